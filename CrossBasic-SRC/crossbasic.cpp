@@ -32,8 +32,12 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <set>
+#include <filesystem>
 #include <variant>
 #include <memory>
 #include <cstdlib>
@@ -48,31 +52,64 @@
 #include <cstring>
 #include <typeinfo>
 #include <cstdint>
+#include <climits>
 #include <streambuf>
 #include <unordered_set>
 #include <mutex> 
 #include <queue>
+#include <deque>
 #include <thread>
+#include <atomic>
 
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <dlfcn.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #include <ffi.h>
 
 // ============================================================================  
 // Debugging and Time globals  
+// CROSSBASIC_TRACE selects how much tracing is compiled in:
+//   0 – none; --d true has no effect
+//   1 – DEBUG_LOG messages (loader, plugins, compiler) and the --trace ring
+//   2 – also VM_TRACE, the per-instruction VM trace (default)
+// Both macros test the level and DEBUG_MODE before the message expression is
+// evaluated, so no strings are built while debugging is off.
 // ============================================================================
+#ifndef CROSSBASIC_TRACE
+#define CROSSBASIC_TRACE 2
+#endif
+
 bool DEBUG_MODE = false; // set to true for debug logging
+int OPT_LEVEL = 1;        // bytecode optimization level, -O0 to -O2
+bool TAIL_CALLS = true;   // compile Return f(...) to OP_TAIL_CALL; off for --no-tail-calls and --d
+int JIT_THRESHOLD = 0;    // calls and loop back-edges before a function is JIT-compiled; 0 = --jit off
 void debugLog(const std::string& msg) {
     if (DEBUG_MODE)
         std::cout << "[DEBUG] " << msg << std::endl;
 }
+#define DEBUG_LOG(msg) do { if (CROSSBASIC_TRACE >= 1 && DEBUG_MODE) debugLog(msg); } while (0)
+#define VM_TRACE(msg)  do { if (CROSSBASIC_TRACE >= 2 && DEBUG_MODE) debugLog(msg); } while (0)
+void dumpTraceRing();
 std::chrono::steady_clock::time_point startTime;
 
+// CROSSBASIC_COMPUTED_GOTO selects the VM dispatch: 1 uses the GCC/Clang
+// labels-as-values extension (the default there), 0 a portable switch.
+#ifndef CROSSBASIC_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define CROSSBASIC_COMPUTED_GOTO 1
+#else
+#define CROSSBASIC_COMPUTED_GOTO 0
+#endif
+#endif
+
 // ---------------------------------------------------------------------------  
 // Global random engine used by built-in rnd (and random class)
 // Global RNG and mutex.
@@ -95,6 +132,8 @@ struct ObjClass;
 struct ObjInstance;
 struct ObjArray;
 struct ObjBoundMethod;
+struct Shape;
+struct JitCode;
 struct ObjModule;
 
 // ============================================================================  
@@ -123,65 +162,323 @@ using BuiltinFn = std::function<struct Value(const std::vector<struct Value>&)>;
 // ----------------------------------------------------------------------------
 using PropertiesType = std::vector<std::pair<std::string, struct Value>>;
 
+
 // ============================================================================  
-// Dynamic Value type – a wrapper around std::variant
-// Now includes pointer type (void*) for pointer variables.
+// Dynamic Value type – a compact 16-byte tagged value.
+// Integers, doubles, booleans, colors and raw pointers are stored inline.
+// Strings, objects and host functions live in a refcounted heap box that is
+// shared (not copied) when the Value is copied.
+// Values belong to the VM thread, so the box count is a plain int. Boxes of
+// Instances, Arrays and BoundMethods that may be left in a reference cycle
+// are handed to the cycle collector (see "Cycle collection").
 // ============================================================================
-// By Design - Not a duplication mistake: The duplicate "using" declaration 
-// inherits std::variant's constructors so Value can be directly constructed 
-// from any of its alternatives.
-struct Value : public std::variant<
-    std::monostate,
-    int,
-    double,
-    bool,
-    std::string,
-    Color,
-    std::shared_ptr<ObjFunction>,
-    std::shared_ptr<ObjClass>,
-    std::shared_ptr<ObjInstance>,
-    std::shared_ptr<ObjArray>,
-    std::shared_ptr<ObjBoundMethod>,
-    BuiltinFn,
-    PropertiesType,
-    std::vector<std::shared_ptr<ObjFunction>>,
-    std::shared_ptr<ObjModule>,
-    std::shared_ptr<ObjEnum>,
-    void* // Pointer type
-> {
-    using std::variant<
-        std::monostate,
-        int,
-        double,
-        bool,
-        std::string,
-        Color,
-        std::shared_ptr<ObjFunction>,
-        std::shared_ptr<ObjClass>,
-        std::shared_ptr<ObjInstance>,
-        std::shared_ptr<ObjArray>,
-        std::shared_ptr<ObjBoundMethod>,
-        BuiltinFn,
-        PropertiesType,
-        std::vector<std::shared_ptr<ObjFunction>>,
-        std::shared_ptr<ObjModule>,
-        std::shared_ptr<ObjEnum>,
-        void*
-    >::variant;
+struct ValueBox {
+    int refCount = 1;
+    bool buffered = false;   // one of the counts is held by the cycle collector
+    uint8_t gcColor = 0;     // the cycle collector's mark
+    virtual ~ValueBox() = default;
+};
+
+void bufferCycleCandidate(ValueBox* box);
+
+template<typename T>
+struct ValueBoxOf : ValueBox {
+    T value;
+    explicit ValueBoxOf(T v) : value(std::move(v)) { }
+};
+
+// Strings are immutable once shared. A box owns its characters (short ones are
+// kept inline by std::string), or is a slice of another string box's
+// characters, which it keeps alive. left/right/middle/split/trim return
+// slices of longer results instead of copying them. The hash is computed once
+// per box; interned boxes (string constants) are unique per content, so two
+// different interned boxes are never equal. Only appendString() changes a
+// box, and only one that nothing else refers to.
+inline void releaseStringBox(ValueBox* box) {
+    if (box->refCount == 1) delete box;
+    else --box->refCount;
+}
+
+struct StringBox : ValueBox {
+    mutable const char* data;
+    size_t size;
+    mutable size_t hashCode = 0;          // 0 until first hashed
+    bool interned = false;
+    mutable ValueBox* parent = nullptr;   // owner of a slice's characters
+    mutable std::string text;             // owned characters
+
+    explicit StringBox(std::string s) : text(std::move(s)) {
+        data = text.data();
+        size = text.size();
+    }
+    // A slice of owner; slices of slices share the owning box directly.
+    StringBox(const StringBox* owner, size_t pos, size_t n)
+        : data(owner->data + pos), size(n), parent(owner->parent ? owner->parent : const_cast<StringBox*>(owner)) {
+        ++parent->refCount;
+    }
+    ~StringBox() override { if (parent) releaseStringBox(parent); }
+
+    std::string_view view() const { return std::string_view(data, size); }
+    static size_t hashOf(std::string_view s) {
+        size_t h = std::hash<std::string_view>()(s);
+        return h ? h : 1;
+    }
+    size_t hash() const {
+        if (hashCode == 0) hashCode = hashOf(view());
+        return hashCode;
+    }
+    // A slice asked for as a std::string copies its characters once and lets
+    // go of its owner.
+    const std::string& str() const {
+        if (parent) {
+            text.assign(data, size);
+            data = text.data();
+            releaseStringBox(parent);
+            parent = nullptr;
+        }
+        return text;
+    }
+};
+
+struct Value {
+    enum class Type : uint8_t {
+        Nil, Int, Double, Bool, Color, Pointer,
+        // Boxed types – everything from String on holds a ValueBox*.
+        String, Function, Class, Instance, Array, BoundMethod,
+        Builtin, Properties, Overloads, Module, Enum
+    };
+
+    Value() : type(Type::Nil) { as.ptr = nullptr; }
+    Value(std::monostate) : Value() { }
+    Value(int i) : type(Type::Int) { as.ptr = nullptr; as.i = i; }
+    Value(double d) : type(Type::Double) { as.d = d; }
+    Value(bool b) : type(Type::Bool) { as.ptr = nullptr; as.b = b; }
+    Value(Color c) : type(Type::Color) { as.ptr = nullptr; as.color = c; }
+    Value(void* p) : type(Type::Pointer) { as.ptr = p; }
+    Value(std::string s) : type(Type::String) { as.box = new StringBox(std::move(s)); }
+    Value(const char* s) : Value(std::string(s)) { }
+    Value(std::shared_ptr<ObjFunction> f) : type(Type::Function) { as.box = new ValueBoxOf<std::shared_ptr<ObjFunction>>(std::move(f)); }
+    Value(std::shared_ptr<ObjClass> c) : type(Type::Class) { as.box = new ValueBoxOf<std::shared_ptr<ObjClass>>(std::move(c)); }
+    Value(std::shared_ptr<ObjInstance> i) : type(Type::Instance) { as.box = new ValueBoxOf<std::shared_ptr<ObjInstance>>(std::move(i)); }
+    Value(std::shared_ptr<ObjArray> a) : type(Type::Array) { as.box = new ValueBoxOf<std::shared_ptr<ObjArray>>(std::move(a)); }
+    Value(std::shared_ptr<ObjBoundMethod> m) : type(Type::BoundMethod) { as.box = new ValueBoxOf<std::shared_ptr<ObjBoundMethod>>(std::move(m)); }
+    Value(BuiltinFn fn) : type(Type::Builtin) { as.box = new ValueBoxOf<BuiltinFn>(std::move(fn)); }
+    Value(PropertiesType props);
+    Value(std::vector<std::shared_ptr<ObjFunction>> fns) : type(Type::Overloads) { as.box = new ValueBoxOf<std::vector<std::shared_ptr<ObjFunction>>>(std::move(fns)); }
+    Value(std::shared_ptr<ObjModule> m) : type(Type::Module) { as.box = new ValueBoxOf<std::shared_ptr<ObjModule>>(std::move(m)); }
+    Value(std::shared_ptr<ObjEnum> e) : type(Type::Enum) { as.box = new ValueBoxOf<std::shared_ptr<ObjEnum>>(std::move(e)); }
+
+    Value(const Value& other) : type(other.type), as(other.as) { retain(); }
+    Value(Value&& other) noexcept : type(other.type), as(other.as) {
+        other.type = Type::Nil;
+        other.as.ptr = nullptr;
+    }
+    Value& operator=(const Value& other) {
+        if (this != &other) {
+            if (other.isBoxed()) ++other.as.box->refCount;
+            release();
+            type = other.type;
+            as = other.as;
+        }
+        return *this;
+    }
+    Value& operator=(Value&& other) noexcept {
+        if (this != &other) {
+            release();
+            type = other.type;
+            as = other.as;
+            other.type = Type::Nil;
+            other.as.ptr = nullptr;
+        }
+        return *this;
+    }
+    ~Value() { release(); }
+
+    Type getType() const { return type; }
+    bool isBoxed() const { return type >= Type::String; }
+
+    bool isNil() const { return type == Type::Nil; }
+    bool isInt() const { return type == Type::Int; }
+    bool isDouble() const { return type == Type::Double; }
+    bool isBool() const { return type == Type::Bool; }
+    bool isColor() const { return type == Type::Color; }
+    bool isPointer() const { return type == Type::Pointer; }
+    bool isString() const { return type == Type::String; }
+    bool isFunction() const { return type == Type::Function; }
+    bool isClass() const { return type == Type::Class; }
+    bool isInstance() const { return type == Type::Instance; }
+    bool isArray() const { return type == Type::Array; }
+    bool isBoundMethod() const { return type == Type::BoundMethod; }
+    bool isBuiltin() const { return type == Type::Builtin; }
+    bool isProperties() const { return type == Type::Properties; }
+    bool isOverloads() const { return type == Type::Overloads; }
+    bool isModule() const { return type == Type::Module; }
+    bool isEnum() const { return type == Type::Enum; }
+
+    int asInt() const { check(Type::Int); return as.i; }
+    double asDouble() const { check(Type::Double); return as.d; }
+    // For the type-specialized opcodes, whose operand types are proven.
+    int asIntUnchecked() const { return as.i; }
+    double asDoubleUnchecked() const { return as.d; }
+    bool asBool() const { check(Type::Bool); return as.b; }
+    Color asColor() const { check(Type::Color); return as.color; }
+    void* asPointer() const { check(Type::Pointer); return as.ptr; }
+    const std::string& asString() const { check(Type::String); return stringBox().str(); }
+    std::string_view asStringView() const { check(Type::String); return stringBox().view(); }
+    size_t stringHash() const { check(Type::String); return stringBox().hash(); }
+    // Type already tested by the caller.
+    const StringBox& stringBox() const { return *static_cast<const StringBox*>(as.box); }
+    // Takes over the initial reference of a freshly made box.
+    static Value adoptString(StringBox* box) {
+        Value v;
+        v.type = Type::String;
+        v.as.box = box;
+        return v;
+    }
+    const std::shared_ptr<ObjFunction>& asFunction() const { return boxed<std::shared_ptr<ObjFunction>>(Type::Function); }
+    const std::shared_ptr<ObjClass>& asClass() const { return boxed<std::shared_ptr<ObjClass>>(Type::Class); }
+    const std::shared_ptr<ObjInstance>& asInstance() const { return boxed<std::shared_ptr<ObjInstance>>(Type::Instance); }
+    const std::shared_ptr<ObjArray>& asArray() const { return boxed<std::shared_ptr<ObjArray>>(Type::Array); }
+    const std::shared_ptr<ObjBoundMethod>& asBoundMethod() const { return boxed<std::shared_ptr<ObjBoundMethod>>(Type::BoundMethod); }
+    const BuiltinFn& asBuiltin() const { return boxed<BuiltinFn>(Type::Builtin); }
+    const PropertiesType& asProperties() const;
+    const std::vector<std::shared_ptr<ObjFunction>>& asOverloads() const { return boxed<std::vector<std::shared_ptr<ObjFunction>>>(Type::Overloads); }
+    const std::shared_ptr<ObjModule>& asModule() const { return boxed<std::shared_ptr<ObjModule>>(Type::Module); }
+    const std::shared_ptr<ObjEnum>& asEnum() const { return boxed<std::shared_ptr<ObjEnum>>(Type::Enum); }
+
+private:
+    friend struct JitCompiler;   // native code reads and writes the layout directly
+    friend struct Aot;
+    friend struct CycleCollector;
+    Type type;
+    union {
+        int i;
+        double d;
+        bool b;
+        Color color;
+        void* ptr;
+        ValueBox* box;
+    } as;
+
+    void retain() const {
+        if (isBoxed()) ++as.box->refCount;
+    }
+    // A container that survives losing a reference may now be held only by a
+    // cycle; its first such release passes the reference to the collector.
+    void release() {
+        if (!isBoxed()) return;
+        if (as.box->refCount == 1)
+            delete as.box;
+        else if (type >= Type::Instance && type <= Type::BoundMethod && !as.box->buffered)
+            bufferCycleCandidate(as.box);
+        else
+            --as.box->refCount;
+    }
+    void check(Type expected) const {
+        if (type != expected) throw std::bad_variant_access();
+    }
+    template<typename T>
+    const T& boxed(Type expected) const {
+        check(expected);
+        return static_cast<ValueBoxOf<T>*>(as.box)->value;
+    }
 };
 
+// PropertiesType holds Values, so its box can only be built once Value is complete.
+inline Value::Value(PropertiesType props) : type(Type::Properties) {
+    as.box = new ValueBoxOf<PropertiesType>(std::move(props));
+}
+inline const PropertiesType& Value::asProperties() const {
+    return boxed<PropertiesType>(Type::Properties);
+}
+
+static_assert(sizeof(Value) == 16, "Value must stay a 16-byte tag + payload");
+
+// ============================================================================
+// Strings
+// ============================================================================
+// Results up to this length are copied into their own box; longer ones share
+// the source's characters.
+static const size_t SLICE_MIN = 16;
+
+// The characters [pos, pos + len) of string s, clamped to its length.
+static Value substring(const Value& s, size_t pos, size_t len) {
+    const StringBox& box = s.stringBox();
+    if (pos >= box.size) return Value(std::string());
+    len = std::min(len, box.size - pos);
+    if (pos == 0 && len == box.size) return s;
+    if (len < SLICE_MIN) return Value(std::string(box.data + pos, len));
+    return Value::adoptString(new StringBox(&box, pos, len));
+}
+
+static inline bool stringsEqual(const Value& a, const Value& b) {
+    const StringBox& x = a.stringBox();
+    const StringBox& y = b.stringBox();
+    if (&x == &y) return true;
+    if (x.size != y.size || (x.interned && y.interned)) return false;
+    if (x.hashCode && y.hashCode && x.hashCode != y.hashCode) return false;
+    return std::memcmp(x.data, y.data, x.size) == 0;
+}
+
+static Value concatStrings(const Value& a, const Value& b) {
+    std::string_view x = a.asStringView(), y = b.asStringView();
+    std::string out;
+    out.reserve(x.size() + y.size());
+    out.append(x).append(y);
+    return Value(std::move(out));
+}
+
+// lhs = lhs + rhs. A string that nothing else refers to is extended in place,
+// so building a string piece by piece (`s = s + x` and StringBuilder.Append)
+// takes amortized linear time instead of copying the whole text every step.
+static inline void appendString(Value& lhs, const Value& rhs) {
+    StringBox& box = const_cast<StringBox&>(lhs.stringBox());
+    if (box.refCount != 1) {
+        lhs = concatStrings(lhs, rhs);
+        return;
+    }
+    std::string_view piece = rhs.asStringView();
+    std::string& text = const_cast<std::string&>(box.str());
+    text.append(piece.data(), piece.size());
+    box.data = text.data();
+    box.size = text.size();
+    box.hashCode = 0;
+}
+
+// One shared box per distinct string constant. The table lives as long as
+// the process, like the constants themselves.
+static std::unordered_map<std::string_view, Value>& internedStrings = *new std::unordered_map<std::string_view, Value>();
+
+static Value internString(const Value& s) {
+    auto it = internedStrings.find(s.asStringView());
+    if (it != internedStrings.end()) return it->second;
+    Value owned = s.stringBox().parent ? Value(std::string(s.asStringView())) : s;
+    StringBox& box = const_cast<StringBox&>(owned.stringBox());
+    box.interned = true;
+    box.hash();
+    internedStrings.emplace(box.view(), owned);
+    return owned;
+}
+
 
 
 // Forward declaration for invokeScriptCallback:
 void invokeScriptCallback(const Value& funcVal, const char* param);
 
+// The function is referenced, not copied: requests are queued by plugin
+// threads, and only the VM thread may touch a Value's count.
 struct CallbackRequest {
-    Value funcVal;
+    const Value* funcVal;
     std::string param;
 };
 
 std::queue<CallbackRequest> callbackQueue;
 std::mutex callbackQueueMutex;
+// Set (under callbackQueueMutex) whenever a callback is queued, and by the VM
+// when a cycle collection is due, so the VM can test for work with a single
+// atomic load instead of taking the lock.
+std::atomic<bool> safepointPending{ false };
+static bool cycleCollectionDue = false;
 
 std::thread::id mainThreadId;
 
@@ -191,34 +488,43 @@ std::thread::id mainThreadId;
 void processPendingCallbacks()
 {
     for (;;) {
-        CallbackRequest req;
+        std::queue<CallbackRequest> batch;
 
-        // 1) Grab one pending callback under the lock
+        // 1) Take every pending callback in one go under the lock
         {
             std::lock_guard<std::mutex> lk(callbackQueueMutex);
-            if (callbackQueue.empty())
+            if (callbackQueue.empty()) {
+                safepointPending.store(false, std::memory_order_relaxed);
                 break;                // nothing to do
-            req = std::move(callbackQueue.front());
-            callbackQueue.pop();
+            }
+            std::swap(batch, callbackQueue);
         }   // <-- mutex released here
 
         // 2) Now it’s safe to run script code
-        invokeScriptCallback(req.funcVal, req.param.c_str());
+        for (; !batch.empty(); batch.pop())
+            invokeScriptCallback(*batch.front().funcVal, batch.front().param.c_str());
+    }
+}
+
+// ---------------------------------------------------------------------------
+//  callbackSafepoint – called by the VM at backward jumps, calls and returns;
+//  also where reference cycles are collected
+// ---------------------------------------------------------------------------
+void collectCycles();
+
+inline void callbackSafepoint()
+{
+    if (safepointPending.load(std::memory_order_acquire)) {
+        processPendingCallbacks();
+        if (cycleCollectionDue)
+            collectCycles();
     }
 }
 
 
 // ----------------------------------------------------------------------------  
-// Helper templates for type queries and access.
+// Helper template for type names of host values.
 // ----------------------------------------------------------------------------
-template<typename T>
-bool holds(const Value& v) {
-    return std::holds_alternative<T>(v); 
-}
-template<typename T>
-T getVal(const Value& v) {
-    return std::get<T>(v);
-}
 template <typename T>
 std::string getTypeName(const T& var) {
     return typeid(var).name();
@@ -237,26 +543,26 @@ std::string toLower(const std::string& s) {
 // Helper: Return a string naming the underlying type of a Value.
 // ----------------------------------------------------------------------------
 std::string getTypeName(const Value& v) {
-    struct TypeVisitor {
-        std::string operator()(std::monostate) const { return "nil"; }
-        std::string operator()(int) const { return "int"; }
-        std::string operator()(double) const { return "double"; }
-        std::string operator()(bool) const { return "bool"; }
-        std::string operator()(const std::string&) const { return "string"; }
-        std::string operator()(const Color&) const { return "Color"; }
-        std::string operator()(const std::shared_ptr<ObjFunction>&) const { return "ObjFunction"; }
-        std::string operator()(const std::shared_ptr<ObjClass>&) const { return "ObjClass"; }
-        std::string operator()(const std::shared_ptr<ObjInstance>&) const { return "ObjInstance"; }
-        std::string operator()(const std::shared_ptr<ObjArray>&) const { return "ObjArray"; }
-        std::string operator()(const std::shared_ptr<ObjBoundMethod>&) const { return "ObjBoundMethod"; }
-        std::string operator()(const BuiltinFn&) const { return "BuiltinFn"; }
-        std::string operator()(const PropertiesType&) const { return "PropertiesType"; }
-        std::string operator()(const std::vector<std::shared_ptr<ObjFunction>>&) const { return "OverloadedFunctions"; }
-        std::string operator()(const std::shared_ptr<ObjModule>&) const { return "ObjModule"; }
-        std::string operator()(const std::shared_ptr<ObjEnum>&) const { return "ObjEnum"; }
-        std::string operator()(void* ptr) const { return "pointer"; }
-    } visitor;
-    return std::visit(visitor, v);
+    switch (v.getType()) {
+    case Value::Type::Nil:         return "nil";
+    case Value::Type::Int:         return "int";
+    case Value::Type::Double:      return "double";
+    case Value::Type::Bool:        return "bool";
+    case Value::Type::String:      return "string";
+    case Value::Type::Color:       return "Color";
+    case Value::Type::Function:    return "ObjFunction";
+    case Value::Type::Class:       return "ObjClass";
+    case Value::Type::Instance:    return "ObjInstance";
+    case Value::Type::Array:       return "ObjArray";
+    case Value::Type::BoundMethod: return "ObjBoundMethod";
+    case Value::Type::Builtin:     return "BuiltinFn";
+    case Value::Type::Properties:  return "PropertiesType";
+    case Value::Type::Overloads:   return "OverloadedFunctions";
+    case Value::Type::Module:      return "ObjModule";
+    case Value::Type::Enum:        return "ObjEnum";
+    case Value::Type::Pointer:     return "pointer";
+    }
+    return "unknown";
 }
 
 // ============================================================================  
@@ -282,34 +588,489 @@ struct ObjFunction {
     std::string name;
     int arity = 0; // Parameter initialization.
     std::vector<Param> params; // Full parameter list
+    int localCount = 0; // Frame slots: parameters first, then Dim/Var/For locals
+    int selfSlot = -1;  // Frame slot holding Self for class methods
+    // Baseline JIT: calls and loop back-edges counted towards compiling, and
+    // the native code once compiled (see "Baseline JIT").
+    mutable uint32_t hotness = 0;
+    mutable bool jitRejected = false;   // not compilable, or deoptimized
+    mutable const JitCode* jitCode = nullptr;
+    // Inline cache of one OP_GET_PROPERTY/OP_SET_PROPERTY site: up to four
+    // shapes seen there, each with the field slot or method it resolved to.
+    struct PropertyCache {
+        static const int Ways = 4;
+        struct Entry {
+            uint32_t shapeId;
+            int slot;       // field slot, or -1 when `method` holds the method
+            Value method;
+        } entries[Ways];
+        int count = 0;
+
+        const Entry* find(const Shape* shape) const;
+        void add(const Shape* shape, int slot, const Value& method);
+    };
+    // Jump table of one OP_SWITCH site: code offsets of the Case bodies keyed
+    // by an Integer or String selector. Dense Integer keys index `dense`.
+    struct SwitchTable {
+        int low = 0;                          // key of dense[0]
+        std::vector<int> dense;               // -1 where no Case matches
+        std::unordered_map<int, int> sparse;
+        std::unordered_map<std::string, int> strings;
+        // strings ordered by StringBox::hashOf, so a selector's cached hash
+        // finds its Case; built on first use and dropped when targets move.
+        struct StringCase { size_t hash; std::string key; int target; };
+        mutable std::vector<StringCase> byHash;
+
+        int find(const Value& selector) const;
+    };
     struct CodeChunk {
-        std::vector<int> code;
+        std::vector<uint8_t> code;      // see "Bytecode encoding"
         std::vector<Value> constants;
+        mutable std::vector<PropertyCache> caches;
+        std::vector<SwitchTable> switches;
+        // Compile-time index of the scalar and string constants, keyed by
+        // constantKey(); released once the chunk is optimized.
+        std::unordered_map<std::string, int> constantIndex;
+        // The chunk with its type-specialized opcodes undone, built when a
+        // guard first fails (see "Type specialization").
+        mutable std::shared_ptr<CodeChunk> generic;
     } chunk;
 };
 
+// ============================================================================  
+// Shapes (hidden classes)
+// A Shape maps lowercase field names to slots of ObjInstance::slots. A class's
+// declared properties form its root shape; storing an undeclared field moves
+// the instance to a child shape, shared by every instance that adds the same
+// fields in the same order. Shape ids are never reused, so inline caches can
+// key on them.
+// ============================================================================
+struct Shape {
+    uint32_t id;
+    std::vector<std::string> names;
+    std::unordered_map<std::string, int> index;
+    std::unordered_map<std::string, std::unique_ptr<Shape>> transitions;
+
+    Shape() : id(nextId()) { }
+
+    static uint32_t nextId() {
+        static uint32_t counter = 0;
+        return ++counter;
+    }
+    int find(const std::string& key) const {
+        auto it = index.find(key);
+        return it == index.end() ? -1 : it->second;
+    }
+    Shape* withField(const std::string& key) {
+        auto& child = transitions[key];
+        if (!child) {
+            child = std::make_unique<Shape>();
+            child->names = names;
+            child->index = index;
+            child->index[key] = (int)names.size();
+            child->names.push_back(key);
+        }
+        return child.get();
+    }
+};
+
+inline const ObjFunction::PropertyCache::Entry*
+ObjFunction::PropertyCache::find(const Shape* shape) const {
+    if (!shape) return nullptr;
+    for (int i = 0; i < count; i++)
+        if (entries[i].shapeId == shape->id)
+            return &entries[i];
+    return nullptr;
+}
+
+// A site that has seen more than `Ways` shapes is megamorphic; it keeps the
+// entries it has and leaves the rest to the slow path.
+inline void ObjFunction::PropertyCache::add(const Shape* shape, int slot, const Value& method) {
+    if (!shape || count == Ways || find(shape)) return;
+    entries[count++] = { shape->id, slot, method };
+}
+
+// The offset of the Case matching `selector` as OP_EQ compares it, or -1.
+// A Double selector matches an Integer Case of the same value.
+inline int ObjFunction::SwitchTable::find(const Value& selector) const {
+    int key;
+    if (selector.isInt())
+        key = selector.asInt();
+    else if (selector.isDouble()) {
+        double d = selector.asDouble();
+        if (!(d >= INT_MIN && d <= INT_MAX) || d != static_cast<int>(d))
+            return -1;
+        key = static_cast<int>(d);
+    }
+    else if (selector.isString()) {
+        if (byHash.size() != strings.size()) {
+            byHash.clear();
+            for (const auto& entry : strings)
+                byHash.push_back({ StringBox::hashOf(entry.first), entry.first, entry.second });
+            std::sort(byHash.begin(), byHash.end(),
+                      [](const StringCase& a, const StringCase& b) { return a.hash < b.hash; });
+        }
+        size_t hash = selector.stringHash();
+        auto it = std::lower_bound(byHash.begin(), byHash.end(), hash,
+                                   [](const StringCase& c, size_t h) { return c.hash < h; });
+        for (; it != byHash.end() && it->hash == hash; ++it)
+            if (it->key == selector.asStringView())
+                return it->target;
+        return -1;
+    }
+    else
+        return -1;
+    if (!dense.empty()) {
+        long long index = (long long)key - low;
+        return index >= 0 && index < (long long)dense.size() ? dense[index] : -1;
+    }
+    auto it = sparse.find(key);
+    return it == sparse.end() ? -1 : it->second;
+}
+
 struct ObjClass {
     std::string name;
     std::unordered_map<std::string, Value> methods;
     PropertiesType properties;
     bool isPlugin = false;
+    bool isNative = false;   // built into the VM; its BuiltinFn methods take the instance first
     BuiltinFn pluginConstructor;
     std::unordered_map<std::string, std::pair<BuiltinFn, BuiltinFn>> pluginProperties;
+    std::unique_ptr<Shape> shape; // built from `properties` by the first instance
+
+    Shape* instanceShape() {
+        if (!shape) {
+            shape = std::make_unique<Shape>();
+            for (auto& p : properties) {
+                if (shape->index.count(p.first)) continue;
+                shape->index[p.first] = (int)shape->names.size();
+                shape->names.push_back(p.first);
+            }
+        }
+        return shape.get();
+    }
+};
+
+// The cycle collector's mark and trial count, for objects that hold Values
+// and can take part in a reference cycle (see "Cycle collection").
+struct Collectable {
+    int gcCount = 0;
+    uint8_t gcColor = 0;
 };
 
-struct ObjInstance {
+// The contents of a native Dictionary: entries in the order their keys were
+// first added, found through an open-addressing index of entry numbers with
+// linear probing. Removing a key leaves a dead entry, which the index treats
+// as a tombstone, until the next rebuild squeezes it out.
+//
+// Keys compare as `=` does for strings and numbers (1 and 1.0 are one key);
+// objects, arrays, classes and functions compare by identity.
+struct ValueTable {
+    struct Entry {
+        Value key, value;
+        size_t hash;
+        bool live;
+    };
+    std::vector<Entry> entries;
+    std::vector<int32_t> index;    // entry number or EMPTY; size is a power of two
+    size_t count = 0;
+    static constexpr int32_t EMPTY = -1;
+
+    // Whether key can be hashed: see hashOf.
+    static bool validKey(const Value& key) {
+        switch (key.getType()) {
+        case Value::Type::Nil: case Value::Type::Bool: case Value::Type::Int: case Value::Type::Double:
+        case Value::Type::String: case Value::Type::Color: case Value::Type::Pointer:
+            return true;
+        default:
+            return identity(key) != nullptr;
+        }
+    }
+    // The object a key stands for when it compares by identity.
+    static const void* identity(const Value& key) {
+        switch (key.getType()) {
+        case Value::Type::Instance: return key.asInstance().get();
+        case Value::Type::Array:    return key.asArray().get();
+        case Value::Type::Class:    return key.asClass().get();
+        case Value::Type::Function: return key.asFunction().get();
+        case Value::Type::Pointer:  return key.asPointer();
+        default:                    return nullptr;
+        }
+    }
+    static size_t hashOf(const Value& key) {
+        size_t h;
+        switch (key.getType()) {
+        case Value::Type::Nil:    h = 0; break;
+        case Value::Type::Bool:   h = key.asBool() ? 0x51 : 0x50; break;
+        case Value::Type::Int:    h = std::hash<int64_t>()(key.asIntUnchecked()); break;
+        case Value::Type::Double: {
+            double d = key.asDoubleUnchecked();
+            h = d == (double)(int64_t)d ? std::hash<int64_t>()((int64_t)d) : std::hash<double>()(d);
+            break;
+        }
+        case Value::Type::String: h = key.stringHash(); break;
+        case Value::Type::Color:  h = std::hash<unsigned>()(key.asColor().value) ^ 0xC0; break;
+        default:   h = std::hash<const void*>()(identity(key)); break;
+        }
+        // Spread sequential and aligned values over the low bits the index uses.
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+    static bool sameKey(const Value& a, const Value& b) {
+        bool numA = a.isInt() || a.isDouble(), numB = b.isInt() || b.isDouble();
+        if (numA || numB) {
+            if (!numA || !numB) return false;
+            if (a.isInt() && b.isInt()) return a.asIntUnchecked() == b.asIntUnchecked();
+            return (a.isInt() ? a.asIntUnchecked() : a.asDoubleUnchecked())
+                == (b.isInt() ? b.asIntUnchecked() : b.asDoubleUnchecked());
+        }
+        if (a.getType() != b.getType()) return false;
+        switch (a.getType()) {
+        case Value::Type::Nil:    return true;
+        case Value::Type::Bool:   return a.asBool() == b.asBool();
+        case Value::Type::String: return stringsEqual(a, b);
+        case Value::Type::Color:  return a.asColor().value == b.asColor().value;
+        default:                  return identity(a) == identity(b);
+        }
+    }
+
+    // The entry number of key, or -1.
+    int find(const Value& key) const {
+        if (count == 0) return -1;
+        size_t hash = hashOf(key), mask = index.size() - 1;
+        for (size_t i = hash & mask; index[i] != EMPTY; i = (i + 1) & mask) {
+            const Entry& e = entries[index[i]];
+            if (e.live && e.hash == hash && sameKey(e.key, key))
+                return index[i];
+        }
+        return -1;
+    }
+    void set(const Value& key, const Value& value) {
+        int at = find(key);
+        if (at >= 0) {
+            entries[at].value = value;
+            return;
+        }
+        // Keep the index at most 3/4 full, counting dead entries.
+        if ((entries.size() + 1) * 4 > index.size() * 3)
+            rebuild(std::max<size_t>(8, count * 2 + 2));
+        size_t hash = hashOf(key);
+        entries.push_back({ key, value, hash, true });
+        place((int32_t)entries.size() - 1);
+        count++;
+    }
+    bool remove(const Value& key) {
+        int at = find(key);
+        if (at < 0) return false;
+        Entry& e = entries[at];
+        e.live = false;
+        e.key = Value();
+        e.value = Value();
+        count--;
+        if (entries.size() > 16 && count < entries.size() / 2)
+            rebuild(count * 2 + 2);
+        return true;
+    }
+    void clear() {
+        entries.clear();
+        index.clear();
+        count = 0;
+    }
+
+private:
+    void place(int32_t entry) {
+        size_t mask = index.size() - 1;
+        size_t i = entries[entry].hash & mask;
+        while (index[i] != EMPTY) i = (i + 1) & mask;
+        index[i] = entry;
+    }
+    // Drops dead entries and sizes the index for at least `capacity` entries.
+    void rebuild(size_t capacity) {
+        size_t live = 0;
+        for (size_t i = 0; i < entries.size(); i++)
+            if (entries[i].live) {
+                if (live != i) entries[live] = std::move(entries[i]);
+                live++;
+            }
+        entries.resize(live);
+        size_t size = 8;
+        while (size * 3 < std::max(capacity, live + 1) * 4) size *= 2;
+        index.assign(size, EMPTY);
+        for (size_t i = 0; i < entries.size(); i++)
+            place((int32_t)i);
+    }
+};
+
+struct ObjInstance : Collectable {
     std::shared_ptr<ObjClass> klass;
-    std::unordered_map<std::string, Value> fields;
+    Shape* shape = nullptr;    // owned by klass
+    std::vector<Value> slots;
     void* pluginInstance = nullptr;
+    std::unique_ptr<ValueTable> table;   // a native Dictionary's contents
+
+    // Lay out the class's properties with their default values.
+    void initFields() {
+        shape = klass->instanceShape();
+        slots.assign(shape->names.size(), Value(std::monostate{}));
+        for (auto& p : klass->properties)
+            slots[shape->find(p.first)] = p.second;
+    }
+    Value* findField(const std::string& key) {
+        int slot = shape ? shape->find(key) : -1;
+        return slot < 0 ? nullptr : &slots[slot];
+    }
+    void setField(const std::string& key, const Value& value) {
+        if (Value* field = findField(key)) {
+            *field = value;
+            return;
+        }
+        if (!shape) shape = klass->instanceShape();
+        shape = shape->withField(key);
+        slots.resize(shape->names.size());
+        slots[shape->find(key)] = value;
+    }
 };
 
-struct ObjArray {
-    std::vector<Value> elements;
+// Array storage. While all its elements have one type, an array keeps them
+// packed: Integers as int32_t, Doubles as double, Booleans as bytes, and
+// strings as their Values with the type known. Storing a value of another type
+// (or leaving a gap of nils) moves the array to generic Values until it is
+// emptied. An array declared with an element type (`Dim a() As Double`) starts
+// in that kind, and an Integer stored into a Double array becomes a Double, as
+// for Double variables. Only `elements` holds Values the collector sees.
+struct ObjArray : Collectable {
+    enum class Kind : uint8_t { Any, Values, Int, Double, Bool, String };
+    Kind kind = Kind::Any;           // Any: empty, type not settled yet
+    Kind declared = Kind::Any;
+    std::vector<Value> elements;     // Values and String
+    std::vector<int32_t> ints;
+    std::vector<double> doubles;
+    std::vector<uint8_t> bools;
+
+    ObjArray() = default;
+    explicit ObjArray(Kind declared) : kind(declared), declared(declared) { }
+
+    static Kind kindOf(const Value& v) {
+        switch (v.getType()) {
+        case Value::Type::Int:    return Kind::Int;
+        case Value::Type::Double: return Kind::Double;
+        case Value::Type::Bool:   return Kind::Bool;
+        case Value::Type::String: return Kind::String;
+        default:                  return Kind::Values;
+        }
+    }
+
+    size_t size() const {
+        switch (kind) {
+        case Kind::Int:    return ints.size();
+        case Kind::Double: return doubles.size();
+        case Kind::Bool:   return bools.size();
+        default:           return elements.size();
+        }
+    }
+    bool empty() const { return size() == 0; }
+
+    Value get(size_t i) const {
+        switch (kind) {
+        case Kind::Int:    return Value((int)ints[i]);
+        case Kind::Double: return Value(doubles[i]);
+        case Kind::Bool:   return Value(bools[i] != 0);
+        default:           return elements[i];
+        }
+    }
+
+    // Whether v can be stored without leaving packed storage; settles the
+    // kind of an empty array.
+    bool fits(const Value& v) {
+        Kind k = kindOf(v);
+        if (kind == Kind::Any && empty())
+            kind = k;
+        return kind == k || kind == Kind::Values;
+    }
+    Value stored(const Value& v) const {
+        return declared == Kind::Double && v.isInt() ? Value((double)v.asInt()) : v;
+    }
+
+    void set(size_t i, const Value& value) {
+        Value v = stored(value);
+        if (!fits(v)) generalize();
+        switch (kind) {
+        case Kind::Int:    ints[i] = v.asIntUnchecked(); break;
+        case Kind::Double: doubles[i] = v.asDoubleUnchecked(); break;
+        case Kind::Bool:   bools[i] = v.asBool(); break;
+        default:           elements[i] = std::move(v); break;
+        }
+    }
+    void push(const Value& value) {
+        Value v = stored(value);
+        if (!fits(v)) generalize();
+        switch (kind) {
+        case Kind::Int:    ints.push_back(v.asIntUnchecked()); break;
+        case Kind::Double: doubles.push_back(v.asDoubleUnchecked()); break;
+        case Kind::Bool:   bools.push_back(v.asBool()); break;
+        default:           elements.push_back(std::move(v)); break;
+        }
+    }
+    // Grows to n elements, the new ones nil.
+    void growTo(size_t n) {
+        if (n <= size()) return;
+        generalize();
+        elements.resize(n, Value(std::monostate{}));
+    }
+    void erase(size_t i) {
+        switch (kind) {
+        case Kind::Int:    ints.erase(ints.begin() + i); break;
+        case Kind::Double: doubles.erase(doubles.begin() + i); break;
+        case Kind::Bool:   bools.erase(bools.begin() + i); break;
+        default:           elements.erase(elements.begin() + i); break;
+        }
+    }
+    Value pop() {
+        Value last = get(size() - 1);
+        erase(size() - 1);
+        return last;
+    }
+    void clear() {
+        elements.clear();
+        ints.clear();
+        doubles.clear();
+        bools.clear();
+        kind = declared;
+    }
+    // Replaces the contents, packing them when they allow it.
+    void assign(std::vector<Value> values) {
+        clear();
+        for (const Value& v : values)
+            if (!fits(stored(v))) break;
+        if (kind == Kind::Values || kind == Kind::String) {
+            for (Value& v : values) v = stored(v);
+            elements = std::move(values);
+        }
+        else {
+            for (const Value& v : values) push(v);
+        }
+    }
+    // Moves packed elements into `elements`, for good.
+    void generalize() {
+        if (kind == Kind::Values) return;
+        if (kind != Kind::String) {
+            size_t n = size();
+            elements.reserve(n);
+            for (size_t i = 0; i < n; i++) elements.push_back(get(i));
+            ints = {};
+            doubles = {};
+            bools = {};
+        }
+        kind = Kind::Values;
+    }
 };
 
-struct ObjBoundMethod {
+struct ObjBoundMethod : Collectable {
     Value receiver;
     std::string name;
+    Value method;   // resolved target for instance methods, when known
 };
 
 struct ObjModule {
@@ -317,50 +1078,289 @@ struct ObjModule {
     std::unordered_map<std::string, Value> publicMembers;
 };
 
+// ============================================================================
+// Cycle collection
+// Counting frees everything except rings of Instances, Arrays and
+// BoundMethods that refer to each other. A container box that loses a
+// reference and survives is buffered as a candidate, the buffer keeping that
+// reference. Once enough candidates have gathered, the next safepoint runs
+// trial deletion over the containers they reach: every reference from inside
+// that graph is subtracted from the counts, and what is neither referenced
+// from outside nor reachable from something that is, is garbage. The counts
+// are put back, the collector empties the garbage containers and counting
+// frees them.
+// The graph alternates between boxes, counted by Values, and the objects they
+// share, counted by shared_ptrs, so a shared_ptr held by native code is an
+// outside reference like any other. Classes, modules and functions are not
+// traced; a reference from one of them is an outside reference too.
+// ============================================================================
+static const size_t CYCLE_BUFFER_MIN = 10000;
+// Never destroyed: Values in other statics may still be released at exit.
+static std::vector<ValueBox*>& cycleCandidates = *new std::vector<ValueBox*>();
+static size_t cycleThreshold = CYCLE_BUFFER_MIN;
+
+void bufferCycleCandidate(ValueBox* box) {
+    box->buffered = true;
+    cycleCandidates.push_back(box);
+    if (cycleCandidates.size() >= cycleThreshold && !cycleCollectionDue) {
+        cycleCollectionDue = true;
+        safepointPending.store(true, std::memory_order_release);
+    }
+}
+
+struct CycleCollector {
+    enum Kind : uint8_t { INSTANCE_BOX, ARRAY_BOX, BOUND_METHOD_BOX, INSTANCE, ARRAY, BOUND_METHOD };
+    enum Color : uint8_t { BLACK, GRAY, WHITE };
+    // A box, or the object it holds.
+    struct Ref {
+        void* ptr;
+        Kind kind;
+        bool isBox() const { return kind <= BOUND_METHOD_BOX; }
+        ValueBox* box() const { return static_cast<ValueBox*>(ptr); }
+        Collectable* object() const {
+            switch (kind) {
+            case INSTANCE: return static_cast<ObjInstance*>(ptr);
+            case ARRAY: return static_cast<ObjArray*>(ptr);
+            default: return static_cast<ObjBoundMethod*>(ptr);
+            }
+        }
+        uint8_t& color() const { return isBox() ? box()->gcColor : object()->gcColor; }
+        // A box's count is changed in place and restored afterwards; an
+        // object's shared_ptr count is copied into gcCount first.
+        int& count() const { return isBox() ? box()->refCount : object()->gcCount; }
+    };
+    std::vector<Ref> visited;
+
+    static bool boxRef(const Value& v, Ref& ref) {
+        switch (v.type) {
+        case Value::Type::Instance: ref = { v.as.box, INSTANCE_BOX }; return true;
+        case Value::Type::Array: ref = { v.as.box, ARRAY_BOX }; return true;
+        case Value::Type::BoundMethod: ref = { v.as.box, BOUND_METHOD_BOX }; return true;
+        default: return false;
+        }
+    }
+    template<typename T>
+    static const std::shared_ptr<T>& held(const Ref& box) {
+        return static_cast<ValueBoxOf<std::shared_ptr<T>>*>(box.box())->value;
+    }
+
+    // Calls visit(child, useCount) for each reference out of `n`; useCount is
+    // the object's shared_ptr count when the child is an object.
+    template<typename F>
+    static void forEachChild(const Ref& n, F visit) {
+        auto value = [&](const Value& v) {
+            Ref child;
+            if (boxRef(v, child)) visit(child, 0);
+        };
+        switch (n.kind) {
+        case INSTANCE_BOX: visit(Ref{ held<ObjInstance>(n).get(), INSTANCE }, (int)held<ObjInstance>(n).use_count()); break;
+        case ARRAY_BOX: visit(Ref{ held<ObjArray>(n).get(), ARRAY }, (int)held<ObjArray>(n).use_count()); break;
+        case BOUND_METHOD_BOX: visit(Ref{ held<ObjBoundMethod>(n).get(), BOUND_METHOD }, (int)held<ObjBoundMethod>(n).use_count()); break;
+        case INSTANCE:
+            for (const Value& v : static_cast<ObjInstance*>(n.ptr)->slots) value(v);
+            if (ValueTable* table = static_cast<ObjInstance*>(n.ptr)->table.get())
+                for (const auto& e : table->entries) {
+                    value(e.key);
+                    value(e.value);
+                }
+            break;
+        case ARRAY:
+            for (const Value& v : static_cast<ObjArray*>(n.ptr)->elements) value(v);
+            break;
+        case BOUND_METHOD:
+            value(static_cast<ObjBoundMethod*>(n.ptr)->receiver);
+            value(static_cast<ObjBoundMethod*>(n.ptr)->method);
+            break;
+        }
+    }
+
+    // Subtract the references held inside the graph reachable from `roots`.
+    void markGray(const std::vector<Ref>& roots) {
+        std::vector<Ref> work;
+        for (const Ref& root : roots)
+            if (root.color() != GRAY) {
+                root.color() = GRAY;
+                visited.push_back(root);
+                work.push_back(root);
+            }
+        while (!work.empty()) {
+            Ref n = work.back();
+            work.pop_back();
+            forEachChild(n, [&](const Ref& child, int useCount) {
+                if (child.color() != GRAY) {
+                    if (!child.isBox()) child.count() = useCount;
+                    child.color() = GRAY;
+                    visited.push_back(child);
+                    work.push_back(child);
+                }
+                child.count()--;
+            });
+        }
+    }
+    // Restore the references out of everything reachable from a live node.
+    static void scanBlack(const Ref& live) {
+        std::vector<Ref> work{ live };
+        live.color() = BLACK;
+        while (!work.empty()) {
+            Ref n = work.back();
+            work.pop_back();
+            forEachChild(n, [&](const Ref& child, int) {
+                child.count()++;
+                if (child.color() != BLACK) {
+                    child.color() = BLACK;
+                    work.push_back(child);
+                }
+            });
+        }
+    }
+    static void scan(const std::vector<Ref>& roots) {
+        std::vector<Ref> work(roots.begin(), roots.end());
+        while (!work.empty()) {
+            Ref n = work.back();
+            work.pop_back();
+            if (n.color() != GRAY) continue;
+            if (n.count() > 0) {
+                scanBlack(n);
+                continue;
+            }
+            n.color() = WHITE;
+            forEachChild(n, [&](const Ref& child, int) { work.push_back(child); });
+        }
+    }
+
+    static Kind rootKind(ValueBox* box) {
+        if (dynamic_cast<ValueBoxOf<std::shared_ptr<ObjInstance>>*>(box)) return INSTANCE_BOX;
+        if (dynamic_cast<ValueBoxOf<std::shared_ptr<ObjArray>>*>(box)) return ARRAY_BOX;
+        return BOUND_METHOD_BOX;
+    }
+
+    // Returns the number of containers found alive.
+    size_t collect(const std::vector<ValueBox*>& candidates) {
+        std::vector<Ref> roots;
+        roots.reserve(candidates.size());
+        for (ValueBox* box : candidates) {
+            box->refCount--;   // the buffer's reference
+            roots.push_back({ box, rootKind(box) });
+        }
+        markGray(roots);
+        scan(roots);
+        for (ValueBox* box : candidates)
+            if (box->gcColor != WHITE) box->buffered = false;
+
+        // Garbage objects give back the references they hold and are
+        // emptied; their contents die with `garbage`. Garbage boxes stay
+        // marked buffered so that freeing them does not buffer them again.
+        std::vector<Value> garbage;
+        size_t freed = 0;
+        for (const Ref& n : visited) {
+            bool white = n.color() == WHITE;
+            n.color() = BLACK;
+            if (!white) continue;
+            if (n.isBox()) {
+                n.box()->buffered = true;
+                continue;
+            }
+            forEachChild(n, [](const Ref& child, int) { child.count()++; });
+            switch (n.kind) {
+            case INSTANCE: {
+                auto& slots = static_cast<ObjInstance*>(n.ptr)->slots;
+                std::move(slots.begin(), slots.end(), std::back_inserter(garbage));
+                slots.clear();
+                if (ValueTable* table = static_cast<ObjInstance*>(n.ptr)->table.get()) {
+                    for (auto& e : table->entries) {
+                        garbage.push_back(std::move(e.key));
+                        garbage.push_back(std::move(e.value));
+                    }
+                    table->clear();
+                }
+                break;
+            }
+            case ARRAY: {
+                auto& elements = static_cast<ObjArray*>(n.ptr)->elements;
+                std::move(elements.begin(), elements.end(), std::back_inserter(garbage));
+                elements.clear();
+                break;
+            }
+            default: {
+                auto* bound = static_cast<ObjBoundMethod*>(n.ptr);
+                garbage.push_back(std::move(bound->receiver));
+                garbage.push_back(std::move(bound->method));
+                break;
+            }
+            }
+            freed++;
+        }
+        size_t live = 0;
+        for (const Ref& n : visited)
+            if (!n.isBox()) live++;
+        live -= freed;
+        // Candidates that only the buffer referred to.
+        for (ValueBox* box : candidates)
+            if (box->refCount == 0) delete box;
+        DEBUG_LOG("Cycle collector: " + std::to_string(candidates.size()) + " candidates, " +
+                  std::to_string(freed) + " of " + std::to_string(freed + live) + " objects freed");
+        garbage.clear();
+        return live;
+    }
+};
+
+// Runs at a safepoint. The next collection waits for at least as many new
+// candidates as this one found alive, so large live graphs are not rescanned
+// over and over.
+void collectCycles() {
+    cycleCollectionDue = false;
+    std::vector<ValueBox*> candidates;
+    candidates.swap(cycleCandidates);
+    CycleCollector collector;
+    size_t live = collector.collect(candidates);
+    cycleThreshold = std::max(CYCLE_BUFFER_MIN, live);
+}
+
 // ============================================================================  
-// valueToString – visitor for Value conversion (with trailing zero trimming)
+// valueToString – Value conversion by type tag (with trailing zero trimming)
 // ============================================================================
 // valueToString converts a Value to a string
 std::string valueToString(const Value& val) {
-    struct Visitor {
-        std::string operator()(std::monostate) const { return "nil"; }
-        std::string operator()(int i) const { return std::to_string(i); }
-        std::string operator()(double d) const {
-            std::string s = std::to_string(d);
-            size_t pos = s.find('.');
-            if (pos != std::string::npos) {
-                while (!s.empty() && s.back() == '0')
-                    s.pop_back();
-                if (!s.empty() && s.back() == '.')
-                    s.pop_back();
-            }
-            return s;
-        }
-        std::string operator()(bool b) const { return b ? "true" : "false"; }
-        std::string operator()(const std::string& s) const { return s; }
-        std::string operator()(const Color& col) const {
-            char buf[10];
-            std::snprintf(buf, sizeof(buf), "&h%06X", col.value & 0xFFFFFF);
-            return std::string(buf);
-        }
-        std::string operator()(const std::shared_ptr<ObjFunction>& fn) const { return "<function " + fn->name + ">"; }
-        std::string operator()(const std::shared_ptr<ObjClass>& cls) const { return "<class " + cls->name + ">"; }
-        std::string operator()(const std::shared_ptr<ObjInstance>& inst) const { return "<instance of " + inst->klass->name + ">"; }
-        std::string operator()(const std::shared_ptr<ObjArray>& arr) const { return "Array(" + std::to_string(arr->elements.size()) + ")"; }
-        std::string operator()(const std::shared_ptr<ObjBoundMethod>& bm) const { return "<bound method " + bm->name + ">"; }
-        std::string operator()(const BuiltinFn&) const { return "<builtin fn>"; }
-        std::string operator()(const PropertiesType&) const { return "<properties>"; }
-        std::string operator()(const std::vector<std::shared_ptr<ObjFunction>>&) const { return "<overloaded functions>"; }
-        std::string operator()(const std::shared_ptr<ObjModule>& mod) const { return "<module " + mod->name + ">"; }
-        std::string operator()(const std::shared_ptr<ObjEnum>& e) const { return "<enum " + e->name + ">"; }
-        std::string operator()(void* ptr) const {
-            if(ptr == nullptr) return "nil";
-            char buf[20];
-            std::snprintf(buf, sizeof(buf), "ptr(%p)", ptr);
-            return std::string(buf);
-        } // Pointer type
-    } visitor;
-    return std::visit(visitor, val);
+    switch (val.getType()) {
+    case Value::Type::Nil: return "nil";
+    case Value::Type::Int: return std::to_string(val.asInt());
+    case Value::Type::Double: {
+        std::string s = std::to_string(val.asDouble());
+        size_t pos = s.find('.');
+        if (pos != std::string::npos) {
+            while (!s.empty() && s.back() == '0')
+                s.pop_back();
+            if (!s.empty() && s.back() == '.')
+                s.pop_back();
+        }
+        return s;
+    }
+    case Value::Type::Bool: return val.asBool() ? "true" : "false";
+    case Value::Type::String: return std::string(val.asStringView());
+    case Value::Type::Color: {
+        char buf[10];
+        std::snprintf(buf, sizeof(buf), "&h%06X", val.asColor().value & 0xFFFFFF);
+        return std::string(buf);
+    }
+    case Value::Type::Function: return "<function " + val.asFunction()->name + ">";
+    case Value::Type::Class: return "<class " + val.asClass()->name + ">";
+    case Value::Type::Instance: return "<instance of " + val.asInstance()->klass->name + ">";
+    case Value::Type::Array: return "Array(" + std::to_string(val.asArray()->size()) + ")";
+    case Value::Type::BoundMethod: return "<bound method " + val.asBoundMethod()->name + ">";
+    case Value::Type::Builtin: return "<builtin fn>";
+    case Value::Type::Properties: return "<properties>";
+    case Value::Type::Overloads: return "<overloaded functions>";
+    case Value::Type::Module: return "<module " + val.asModule()->name + ">";
+    case Value::Type::Enum: return "<enum " + val.asEnum()->name + ">";
+    case Value::Type::Pointer: { // Pointer type
+        void* ptr = val.asPointer();
+        if (ptr == nullptr) return "nil";
+        char buf[20];
+        std::snprintf(buf, sizeof(buf), "ptr(%p)", ptr);
+        return std::string(buf);
+    }
+    }
+    return "nil";
 }
 
 // ============================================================================  
@@ -401,9 +1401,11 @@ struct Token {
 // ============================================================================  
 // Lexer
 // ============================================================================
+// The lexer reads the source through a string_view; the source must outlive
+// scanTokens().
 class Lexer {
 public:
-    Lexer(const std::string& source) : source(source) {}
+    Lexer(std::string_view source) : source(source) {}
     std::vector<Token> scanTokens() {
         while (!isAtEnd()) {
             start = current;
@@ -413,14 +1415,14 @@ public:
         return tokens;
     }
 private:
-    const std::string source;
+    std::string_view source;
     std::vector<Token> tokens;
     int start = 0, current = 0, line = 1;
 
-    bool isAtEnd() { return current >= source.size(); }
+    bool isAtEnd() { return current >= (int)source.size(); }
     char advance() { return source[current++]; }
     void addToken(XTokenType type) {
-        tokens.push_back({ type, source.substr(start, current - start), line });
+        tokens.push_back({ type, std::string(source.substr(start, current - start)), line });
     }
     bool match(char expected) {
         if (isAtEnd() || source[current] != expected) return false;
@@ -428,7 +1430,7 @@ private:
         return true;
     }
     char peek() { return isAtEnd() ? '\0' : source[current]; }
-    char peekNext() { return (current + 1 >= source.size()) ? '\0' : source[current + 1]; }
+    char peekNext() { return (current + 1 >= (int)source.size()) ? '\0' : source[current + 1]; }
     void scanToken() {
         char c = advance();
         switch (c) {
@@ -525,50 +1527,41 @@ private:
         }
         addToken(XTokenType::NUMBER);
     }
+    // Keywords are matched case-insensitively; none is longer than 8 letters.
+    static XTokenType keywordType(std::string_view text) {
+        static const std::unordered_map<std::string_view, XTokenType> keywords = {
+            { "function", XTokenType::FUNCTION }, { "sub", XTokenType::SUB },
+            { "end", XTokenType::END }, { "return", XTokenType::RETURN },
+            { "class", XTokenType::CLASS }, { "new", XTokenType::NEW },
+            { "dim", XTokenType::DIM }, { "var", XTokenType::DIM },
+            { "const", XTokenType::XCONST }, { "as", XTokenType::AS },
+            { "optional", XTokenType::XOPTIONAL }, { "public", XTokenType::PUBLIC },
+            { "private", XTokenType::PRIVATE }, { "print", XTokenType::PRINT },
+            { "if", XTokenType::IF }, { "then", XTokenType::THEN },
+            { "else", XTokenType::ELSE }, { "elseif", XTokenType::ELSEIF },
+            { "for", XTokenType::FOR }, { "to", XTokenType::TO },
+            { "downto", XTokenType::DOWNTO }, { "step", XTokenType::STEP },
+            { "next", XTokenType::NEXT }, { "while", XTokenType::WHILE },
+            { "wend", XTokenType::WEND }, { "not", XTokenType::NOT },
+            { "and", XTokenType::AND }, { "or", XTokenType::OR },
+            { "mod", XTokenType::MOD }, { "true", XTokenType::BOOLEAN_TRUE },
+            { "false", XTokenType::BOOLEAN_FALSE }, { "module", XTokenType::MODULE },
+            { "extends", XTokenType::EXTENDS }, { "declare", XTokenType::DECLARE },
+            { "select", XTokenType::SELECT }, { "case", XTokenType::CASE },
+            { "goto", XTokenType::GOTO }, { "enum", XTokenType::ENUM },
+            { "assigns", XTokenType::ASSIGNS },
+        };
+        char lower[8];
+        if (text.size() > sizeof lower)
+            return XTokenType::IDENTIFIER;
+        for (size_t i = 0; i < text.size(); i++)
+            lower[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(text[i])));
+        auto it = keywords.find(std::string_view(lower, text.size()));
+        return it == keywords.end() ? XTokenType::IDENTIFIER : it->second;
+    }
     void identifier() {
         while (isalnum(peek()) || peek() == '_') advance();
-        std::string text = source.substr(start, current - start);
-        std::string lowerText = toLower(text);
-        XTokenType type = XTokenType::IDENTIFIER;
-        if (lowerText == "function") type = XTokenType::FUNCTION;
-        else if (lowerText == "sub")      type = XTokenType::SUB;
-        else if (lowerText == "end")      type = XTokenType::END;
-        else if (lowerText == "return")   type = XTokenType::RETURN;
-        else if (lowerText == "class")    type = XTokenType::CLASS;
-        else if (lowerText == "new")      type = XTokenType::NEW;
-        else if (lowerText == "dim" || lowerText == "var") type = XTokenType::DIM;
-        else if (lowerText == "const")    type = XTokenType::XCONST;
-        else if (lowerText == "as")       type = XTokenType::AS;
-        else if (lowerText == "optional") type = XTokenType::XOPTIONAL;
-        else if (lowerText == "public")   type = XTokenType::PUBLIC;
-        else if (lowerText == "private")  type = XTokenType::PRIVATE;
-        else if (lowerText == "print")    type = XTokenType::PRINT;
-        else if (lowerText == "if")       type = XTokenType::IF;
-        else if (lowerText == "then")     type = XTokenType::THEN;
-        else if (lowerText == "else")     type = XTokenType::ELSE;
-        else if (lowerText == "elseif")   type = XTokenType::ELSEIF;
-        else if (lowerText == "for")      type = XTokenType::FOR;
-        else if (lowerText == "to")       type = XTokenType::TO;
-        else if (lowerText == "downto")   type = XTokenType::DOWNTO;
-        else if (lowerText == "step")     type = XTokenType::STEP;
-        else if (lowerText == "next")     type = XTokenType::NEXT;
-        else if (lowerText == "while")    type = XTokenType::WHILE;
-        else if (lowerText == "wend")     type = XTokenType::WEND;
-        else if (lowerText == "not")      type = XTokenType::NOT;
-        else if (lowerText == "and")      type = XTokenType::AND;
-        else if (lowerText == "or")       type = XTokenType::OR;
-        else if (lowerText == "mod")      type = XTokenType::MOD;
-        else if (lowerText == "true")     type = XTokenType::BOOLEAN_TRUE;
-        else if (lowerText == "false")    type = XTokenType::BOOLEAN_FALSE;
-        else if (lowerText == "module")   type = XTokenType::MODULE;
-        else if (lowerText == "extends") type = XTokenType::EXTENDS;
-        else if (lowerText == "declare")  type = XTokenType::DECLARE;
-        else if (lowerText == "select")   type = XTokenType::SELECT;
-        else if (lowerText == "case")     type = XTokenType::CASE;
-        else if (lowerText == "goto")     type = XTokenType::GOTO;
-        else if (lowerText == "enum")     type = XTokenType::ENUM;
-        else if (lowerText == "assigns")  type = XTokenType::ASSIGNS;
-        addToken(type);
+        addToken(keywordType(source.substr(start, current - start)));
     }
 };
 
@@ -587,49 +1580,81 @@ std::string rtrim(const std::string& s) {
 struct Environment {
     std::unordered_map<std::string, Value> values;
     std::shared_ptr<Environment> enclosing;
+
+    // The root (global) environment keeps its values in an indexed table
+    // instead of `values`. Names are interned to stable slot indices, so
+    // compiled code can address a global directly once it knows its slot.
+    std::unordered_map<std::string, int> slotIndex;
+    std::vector<Value> slots;
+    std::vector<bool> slotDefined;
+
     Environment(std::shared_ptr<Environment> enclosing = nullptr)
         : enclosing(enclosing) { }
+
+    bool isGlobal() const { return enclosing == nullptr; }
+
+    // Return the slot for a (lowercase) global name, reserving one if needed.
+    int intern(const std::string& key) {
+        auto it = slotIndex.find(key);
+        if (it != slotIndex.end()) return it->second;
+        int slot = (int)slots.size();
+        slotIndex[key] = slot;
+        slots.push_back(Value(std::monostate{}));
+        slotDefined.push_back(false);
+        return slot;
+    }
+    // Value stored in this scope only (or a field of its `self`), else nullptr.
+    Value* lookupHere(const std::string& key) {
+        if (isGlobal()) {
+            auto it = slotIndex.find(key);
+            if (it != slotIndex.end() && slotDefined[it->second])
+                return &slots[it->second];
+            return nullptr;
+        }
+        auto it = values.find(key);
+        if (it != values.end())
+            return &it->second;
+        auto selfIt = values.find("self");
+        if (selfIt != values.end() && selfIt->second.isInstance()) {
+            if (Value* field = selfIt->second.asInstance()->findField(key))
+                return field;
+        }
+        return nullptr;
+    }
+    bool isDefined(const std::string& name) {
+        return lookupHere(toLower(name)) != nullptr;
+    }
     void define(const std::string& name, const Value& value) {
-        values[toLower(name)] = value;
+        std::string key = toLower(name);
+        if (isGlobal()) {
+            int slot = intern(key);
+            slots[slot] = value;
+            slotDefined[slot] = true;
+            return;
+        }
+        values[key] = value;
     }
     Value get(const std::string& name) {
         std::string key = toLower(name);
-        if (values.find(key) != values.end())
-            return values[key];
-        if (values.find("self") != values.end()) {
-            Value selfVal = values["self"];
-            if (holds<std::shared_ptr<ObjInstance>>(selfVal)) {
-                auto instance = getVal<std::shared_ptr<ObjInstance>>(selfVal);
-                if (instance->fields.find(key) != instance->fields.end())
-                    return instance->fields[key];
-            }
+        for (Environment* env = this; env; env = env->enclosing.get()) {
+            if (Value* found = env->lookupHere(key))
+                return *found;
         }
-        if (enclosing) return enclosing->get(name);
         std::cerr << "NilObjectException for variable: " << name << std::endl;
+        dumpTraceRing();
         exit(1);
         return Value(std::monostate{});
     }
     void assign(const std::string& name, const Value& value) {
         std::string key = toLower(name);
-        if (values.find(key) != values.end()) {
-            values[key] = value;
-            return;
-        }
-        if (values.find("self") != values.end()) {
-            Value selfVal = values["self"];
-            if (holds<std::shared_ptr<ObjInstance>>(selfVal)) {
-                auto instance = getVal<std::shared_ptr<ObjInstance>>(selfVal);
-                if (instance->fields.find(key) != instance->fields.end()) {
-                    instance->fields[key] = value;
-                    return;
-                }
+        for (Environment* env = this; env; env = env->enclosing.get()) {
+            if (Value* found = env->lookupHere(key)) {
+                *found = value;
+                return;
             }
         }
-        if (enclosing) {
-            enclosing->assign(name, value);
-            return;
-        }
         std::cerr << "NilObjectException for variable: " << name << std::endl;
+        dumpTraceRing();
         exit(1);
     }
 };
@@ -639,6 +1664,7 @@ struct Environment {
 // ============================================================================
 [[noreturn]] void runtimeError(const std::string& msg) {
     std::cerr << "Runtime Error: " << msg << std::endl;
+    dumpTraceRing();
     exit(1);
 }
 
@@ -718,8 +1744,83 @@ enum OpCode {
     OP_SET_PROPERTY,
     OP_PROPERTIES,
     OP_DUP,
-    OP_CONSTRUCTOR_END
+    OP_CONSTRUCTOR_END,
+    OP_GET_LOCAL,
+    OP_SET_LOCAL,
+    OP_INVOKE,          // obj.Method(args): name, inline cache, argument count
+    OP_COMPARE_JUMP,    // numeric <, <=, >, >= fused with OP_JUMP_IF_FALSE: compare opcode, target
+    OP_FOR_PREP,        // enter a For loop: exit target, flags, counter operands
+    OP_FOR_LOOP,        // step a For loop: loop start, flags, counter operands
+    OP_SWITCH,          // Select Case jump table: table index, default target
+    OP_TAIL_CALL,       // Return f(...): the callee replaces the current frame
+    // Type specialization (see there): guards for declared types, and
+    // opcodes whose operand types are proven.
+    OP_GUARD,           // the value about to be stored: declared type
+    OP_GUARD_LOCAL,     // a parameter: slot, declared type
+    OP_ADD_INT,
+    OP_SUB_INT,
+    OP_MUL_INT,
+    OP_ADD_DOUBLE,
+    OP_SUB_DOUBLE,
+    OP_MUL_DOUBLE,
+    OP_DIV_DOUBLE,
+    OP_ADD_STRING,
+    OP_COMPARE_JUMP_INT,    // OP_COMPARE_JUMP on two Integers
+    OP_COMPARE_JUMP_DOUBLE, // OP_COMPARE_JUMP on two Doubles
+    OP_FOR_LOOP_INT,        // OP_FOR_LOOP with an Integer local counter, end value and step
+    OP_INLINE_GUARD,    // an inlined call: global name, slot, function, target of the call to make instead
+    OP_TYPED_ARRAY,     // an empty array with a declared element type: ObjArray::Kind
+    OP_COUNT
 };
+static_assert(OP_COUNT <= 256, "opcodes are encoded in one byte");
+
+// Flags of OP_FOR_PREP / OP_FOR_LOOP. The counter is a frame slot, or with
+// FOR_GLOBAL a global given by name constant and interned slot.
+enum ForLoopFlags { FOR_GLOBAL = 1, FOR_DOWN = 2 };
+
+// ============================================================================  
+// Bytecode encoding
+// Opcodes take one byte. Operands are unsigned LEB128 varints, so the usual
+// small constant indices, slots and counts take one byte. Jump targets are
+// fixed four-byte little-endian fields so they can be patched once the
+// target is known.
+// ============================================================================
+const int JUMP_TARGET_SIZE = 4;
+
+inline void writeOperand(std::vector<uint8_t>& code, int operand) {
+    unsigned value = static_cast<unsigned>(operand);
+    while (value >= 0x80) {
+        code.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    code.push_back(static_cast<uint8_t>(value));
+}
+
+inline int readOperand(const uint8_t* code, int& ip) {
+    unsigned value = code[ip++];
+    if (value < 0x80)
+        return static_cast<int>(value);
+    value &= 0x7f;
+    for (int shift = 7;; shift += 7) {
+        unsigned byte = code[ip++];
+        value |= (byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return static_cast<int>(value);
+    }
+}
+
+inline void writeJumpTarget(std::vector<uint8_t>& code, size_t at, int target) {
+    for (int i = 0; i < JUMP_TARGET_SIZE; i++)
+        code[at + i] = static_cast<uint8_t>(static_cast<unsigned>(target) >> (8 * i));
+}
+
+inline int readJumpTarget(const uint8_t* code, int& ip) {
+    unsigned target = 0;
+    for (int i = 0; i < JUMP_TARGET_SIZE; i++)
+        target |= static_cast<unsigned>(code[ip + i]) << (8 * i);
+    ip += JUMP_TARGET_SIZE;
+    return static_cast<int>(target);
+}
 
 std::string opcodeToString(int opcode) {
     switch (opcode) {
@@ -759,29 +1860,158 @@ std::string opcodeToString(int opcode) {
     case OP_PROPERTIES:    return "OP_PROPERTIES";
     case OP_DUP:           return "OP_DUP";
     case OP_CONSTRUCTOR_END: return "OP_CONSTRUCTOR_END";
+    case OP_GET_LOCAL:     return "OP_GET_LOCAL";
+    case OP_SET_LOCAL:     return "OP_SET_LOCAL";
+    case OP_INVOKE:        return "OP_INVOKE";
+    case OP_COMPARE_JUMP:  return "OP_COMPARE_JUMP";
+    case OP_FOR_PREP:      return "OP_FOR_PREP";
+    case OP_FOR_LOOP:      return "OP_FOR_LOOP";
+    case OP_SWITCH:        return "OP_SWITCH";
+    case OP_TAIL_CALL:     return "OP_TAIL_CALL";
+    case OP_GUARD:         return "OP_GUARD";
+    case OP_GUARD_LOCAL:   return "OP_GUARD_LOCAL";
+    case OP_ADD_INT:       return "OP_ADD_INT";
+    case OP_SUB_INT:       return "OP_SUB_INT";
+    case OP_MUL_INT:       return "OP_MUL_INT";
+    case OP_ADD_DOUBLE:    return "OP_ADD_DOUBLE";
+    case OP_SUB_DOUBLE:    return "OP_SUB_DOUBLE";
+    case OP_MUL_DOUBLE:    return "OP_MUL_DOUBLE";
+    case OP_DIV_DOUBLE:    return "OP_DIV_DOUBLE";
+    case OP_ADD_STRING:    return "OP_ADD_STRING";
+    case OP_COMPARE_JUMP_INT:    return "OP_COMPARE_JUMP_INT";
+    case OP_COMPARE_JUMP_DOUBLE: return "OP_COMPARE_JUMP_DOUBLE";
+    case OP_FOR_LOOP_INT:  return "OP_FOR_LOOP_INT";
+    case OP_INLINE_GUARD:  return "OP_INLINE_GUARD";
+    case OP_TYPED_ARRAY:   return "OP_TYPED_ARRAY";
     default:               return "UNKNOWN";
     }
 }
 
-// ============================================================================  
-// Virtual Machine
-// ============================================================================
-struct VM {
-    std::vector<Value> stack;
-    std::shared_ptr<Environment> globals;
+// Operand layout of an opcode: one character per operand in encoding order,
+// 'o' for a varint operand and 'J' for a jump target.
+const char* opcodeOperands(int opcode) {
+    switch (opcode) {
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_CALL:
+    case OP_OPTIONAL_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_ARRAY:
+    case OP_TYPED_ARRAY:
+    case OP_PROPERTIES:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GUARD:         return "o";
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GUARD_LOCAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:  return "oo";
+    case OP_INVOKE:        return "ooo";
+    case OP_INLINE_GUARD:  return "oooJ";
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:          return "J";
+    case OP_COMPARE_JUMP:
+    case OP_COMPARE_JUMP_INT:
+    case OP_COMPARE_JUMP_DOUBLE:
+    case OP_SWITCH:        return "oJ";
+    case OP_FOR_PREP:
+    case OP_FOR_LOOP:
+    case OP_FOR_LOOP_INT:  return "Jooo";
+    default:               return "";
+    }
+}
+
+// OP_GUARD / OP_GUARD_LOCAL operand: the declared Value::Type, with this bit
+// set when a value of another type is no reason to leave specialized code.
+const int GUARD_GENERIC = 0x40;
+
+// The opcode a type-specialized opcode stands in for; the same operands.
+inline int genericOpcode(int op) {
+    switch (op) {
+    case OP_ADD_INT: case OP_ADD_DOUBLE: case OP_ADD_STRING: return OP_ADD;
+    case OP_SUB_INT: case OP_SUB_DOUBLE:                     return OP_SUB;
+    case OP_MUL_INT: case OP_MUL_DOUBLE:                     return OP_MUL;
+    case OP_DIV_DOUBLE:                                      return OP_DIV;
+    case OP_COMPARE_JUMP_INT: case OP_COMPARE_JUMP_DOUBLE:   return OP_COMPARE_JUMP;
+    case OP_FOR_LOOP_INT:                                    return OP_FOR_LOOP;
+    default:                                                 return op;
+    }
+}
+
+// ============================================================================  
+// Virtual Machine
+// ============================================================================
+// One activation of a scripted function. Locals live on the value stack
+// starting at `base`; for calls made from bytecode the callee sits at base-1.
+struct CallFrame {
+    const ObjFunction* function;           // nullptr for an entry chunk
+    const ObjFunction::CodeChunk* chunk;
+    int ip;
+    size_t base;
+};
+
+struct VM {
+    std::vector<Value> stack;
+    std::vector<CallFrame> frames;
+    std::shared_ptr<Environment> globals;
     std::shared_ptr<Environment> environment;
     ObjFunction::CodeChunk mainChunk;
     // Module Extends - map[typeName][methodName] → BuiltinFn
     std::unordered_map<std::string,
         std::unordered_map<std::string, Value>> extensionMethods;
+    // Plugin libraries loaded from the libs folder
+    std::vector<std::string> plugins;
+};
+
+// ----------------------------------------------------------------------------
+// Trace ring: the last N executed instructions (enabled with --trace N).
+// Recording stores three words per instruction and formats nothing; the
+// ring is printed when the script stops on a runtime error.
+// ----------------------------------------------------------------------------
+struct TraceEntry {
+    const ObjFunction* function;   // nullptr for an entry chunk
+    int ip;
+    int opcode;
+};
+
+struct TraceRing {
+    std::vector<TraceEntry> entries;
+    size_t next = 0;
+    size_t count = 0;
+
+    bool enabled() const { return !entries.empty(); }
+    void resize(size_t size) { entries.assign(size, TraceEntry{}); next = count = 0; }
+    void record(const ObjFunction* function, int ip, int opcode) {
+        entries[next] = TraceEntry{ function, ip, opcode };
+        next = (next + 1) % entries.size();
+        if (count < entries.size()) count++;
+    }
 };
 
+TraceRing traceRing;
+
+void dumpTraceRing() {
+    if (CROSSBASIC_TRACE < 1 || !traceRing.enabled() || traceRing.count == 0)
+        return;
+    std::cerr << "Last " << traceRing.count << " instruction(s), oldest first:" << std::endl;
+    size_t size = traceRing.entries.size();
+    size_t start = (traceRing.next + size - traceRing.count) % size;
+    for (size_t i = 0; i < traceRing.count; i++) {
+        const TraceEntry& e = traceRing.entries[(start + i) % size];
+        std::cerr << "  " << (e.function ? e.function->name : std::string("<main>"))
+                  << " @" << e.ip << ": " << opcodeToString(e.opcode) << std::endl;
+    }
+}
+
 // ----------------------------------------------------------------------------  
 // Helper: pop from VM stack (with logging)
 // ----------------------------------------------------------------------------
 Value pop(VM& vm) {
     if (vm.stack.empty()) {
-        debugLog("OP_POP: Attempted to pop from an empty stack.");
+        DEBUG_LOG("OP_POP: Attempted to pop from an empty stack.");
         runtimeError("VM: Stack underflow on POP.");
     }
     Value v = vm.stack.back();
@@ -790,8 +2020,26 @@ Value pop(VM& vm) {
 }
 
 
-Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk);
+Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk, size_t base = 0);
 
+// ----------------------------------------------------------------------------
+// Helper: lay out a scripted call frame on the VM stack.
+// Arguments fill the first slots (missing optionals take their defaults) and
+// the remaining Dim/Var/For locals start out as nil. Returns the frame base.
+// ----------------------------------------------------------------------------
+size_t pushFrame(VM& vm, const ObjFunction& fn, const std::vector<Value>& args) {
+    size_t base = vm.stack.size();
+    int slots = std::max<int>(fn.localCount, (int)fn.params.size());
+    for (int i = 0; i < slots; i++) {
+        if (i < (int)args.size())
+            vm.stack.push_back(args[i]);
+        else if (i < (int)fn.params.size())
+            vm.stack.push_back(fn.params[i].defaultValue);
+        else
+            vm.stack.push_back(Value(std::monostate{}));
+    }
+    return base;
+}
 
 
 // ---------------------------------------------------------------------------
@@ -819,9 +2067,9 @@ static Value wrapHandleIfPluginClass(const std::string &raw,
         return Value(raw);
     }
 
-    if (!holds<std::shared_ptr<ObjClass>>(clsVal))
+    if (!clsVal.isClass())
         return Value(raw);
-    auto cls = getVal<std::shared_ptr<ObjClass>>(clsVal);
+    auto cls = clsVal.asClass();
     if (!cls->isPlugin)
         return Value(raw);
 
@@ -829,8 +2077,7 @@ static Value wrapHandleIfPluginClass(const std::string &raw,
     auto inst = std::make_shared<ObjInstance>();
     inst->klass = cls;
     inst->pluginInstance = reinterpret_cast<void *>((intptr_t)std::stol(raw));
-    for (auto &p : cls->properties)
-        inst->fields[p.first] = p.second;
+    inst->initFields();
     return Value(inst);
 }
 
@@ -846,45 +2093,39 @@ void invokeScriptCallback(const Value& funcVal, const char* param) {
 
     // 3) Log entry and build our single-string argument list
     std::string p = param ? param : "";
-    debugLog("invokeScriptCallback: Called with param: " + (p.empty() ? "null" : p));
+    DEBUG_LOG("invokeScriptCallback: Called with param: " + (p.empty() ? "null" : p));
     std::vector<Value> args{ Value(p) };
 
     // 4) Dispatch either a host function or a script function
-    if (holds<BuiltinFn>(funcVal)) {
-        debugLog("invokeScriptCallback: Detected BuiltinFn.");
-        BuiltinFn hostFn = getVal<BuiltinFn>(funcVal);
+    if (funcVal.isBuiltin()) {
+        DEBUG_LOG("invokeScriptCallback: Detected BuiltinFn.");
+        BuiltinFn hostFn = funcVal.asBuiltin();
         hostFn(args);
-        debugLog("invokeScriptCallback: BuiltinFn executed.");
+        DEBUG_LOG("invokeScriptCallback: BuiltinFn executed.");
     }
-    else if (holds<std::shared_ptr<ObjFunction>>(funcVal)) {
-        debugLog("invokeScriptCallback: Detected ObjFunction.");
-        auto fnObj = getVal<std::shared_ptr<ObjFunction>>(funcVal);
+    else if (funcVal.isFunction()) {
+        DEBUG_LOG("invokeScriptCallback: Detected ObjFunction.");
+        auto fnObj = funcVal.asFunction();
 
         // 5) Swap in a fresh environment (child of globals)
         auto previousEnv = globalVM->environment;
         globalVM->environment = std::make_shared<Environment>(globalVM->globals);
 
-        // 6) Define parameters (or default values)
-        for (size_t i = 0; i < fnObj->params.size(); ++i) {
+        // 6) Bind parameters (or default values) to frame slots
+        std::vector<Value> frameArgs;
+        for (size_t i = 0; i < fnObj->params.size() && i < args.size(); ++i) {
             const auto& pd = fnObj->params[i];
-        
-            Value actual;
-            if (i < args.size()) {
-                if (holds<std::string>(args[i]))
-                    actual = wrapHandleIfPluginClass(getVal<std::string>(args[i]),
-                                                     pd.type, *globalVM);
-                else
-                    actual = args[i];
-            } else {
-                actual = pd.defaultValue;
-            }
-            globalVM->environment->define(pd.name, actual);
+            if (args[i].isString())
+                frameArgs.push_back(wrapHandleIfPluginClass(args[i].asString(),
+                                                            pd.type, *globalVM));
+            else
+                frameArgs.push_back(args[i]);
         }
-        
+        size_t base = pushFrame(*globalVM, *fnObj, frameArgs);
 
         // 7) Execute the function body
-        Value result = runVM(*globalVM, fnObj->chunk);
-        debugLog("invokeScriptCallback: Function executed with result: " + valueToString(result));
+        Value result = runVM(*globalVM, fnObj->chunk, base);
+        DEBUG_LOG("invokeScriptCallback: Function executed with result: " + valueToString(result));
 
         // 8) Restore the old environment
         globalVM->environment = previousEnv;
@@ -903,46 +2144,47 @@ void invokeScriptCallback(const Value& funcVal, const char* param) {
 // // This function is called by the ffi closure.
 void scriptCallbackTrampoline(ffi_cif* cif, void* ret, void** args, void* user_data) {
     // Log entry and key pointer values.
-    debugLog("scriptCallbackTrampoline: Entered.");
-    debugLog("  cif pointer: " + std::to_string(reinterpret_cast<uintptr_t>(cif)));
-    debugLog("  ret pointer: " + std::to_string(reinterpret_cast<uintptr_t>(ret)));
-    debugLog("  user_data pointer: " + std::to_string(reinterpret_cast<uintptr_t>(user_data)));
+    DEBUG_LOG("scriptCallbackTrampoline: Entered.");
+    DEBUG_LOG("  cif pointer: " + std::to_string(reinterpret_cast<uintptr_t>(cif)));
+    DEBUG_LOG("  ret pointer: " + std::to_string(reinterpret_cast<uintptr_t>(ret)));
+    DEBUG_LOG("  user_data pointer: " + std::to_string(reinterpret_cast<uintptr_t>(user_data)));
     
     // If available, log the number of arguments from the CIF.
     int nargs = 1;
     #ifdef FFI_CIF_NARGS
       nargs = cif->nargs;
     #endif
-    debugLog("  Number of arguments (nargs): " + std::to_string(nargs));
+    DEBUG_LOG("  Number of arguments (nargs): " + std::to_string(nargs));
 
     if (args == nullptr) {
-         debugLog("scriptCallbackTrampoline: args is null!");
+         DEBUG_LOG("scriptCallbackTrampoline: args is null!");
          return;
     }
-    debugLog("  args pointer: " + std::to_string(reinterpret_cast<uintptr_t>(args)));
+    DEBUG_LOG("  args pointer: " + std::to_string(reinterpret_cast<uintptr_t>(args)));
     
     // Log each argument's pointer value.
     for (int i = 0; i < nargs; i++) {
-         debugLog("  args[" + std::to_string(i) + "] pointer: " + std::to_string(reinterpret_cast<uintptr_t>(args[i])));
+         DEBUG_LOG("  args[" + std::to_string(i) + "] pointer: " + std::to_string(reinterpret_cast<uintptr_t>(args[i])));
     }
     
     // Since we now expect one parameter (a const char*), try to extract it.
     const char* param = *(const char**)args[0];
-    debugLog("scriptCallbackTrampoline: Parameter: " + std::string(param ? param : "null"));
+    DEBUG_LOG("scriptCallbackTrampoline: Parameter: " + std::string(param ? param : "null"));
     
     Value* funcVal = (Value*)user_data;
-    debugLog("scriptCallbackTrampoline: user_data as funcVal pointer: " +
+    DEBUG_LOG("scriptCallbackTrampoline: user_data as funcVal pointer: " +
              std::to_string(reinterpret_cast<uintptr_t>(funcVal)));
     
     // Now, if on the main thread, invoke directly; else, queue the callback.
-    // Queued callbacks immediately handled with processpendingCallbacks() for proper concurrent threading and access.
+    // Queued callbacks are handled by processPendingCallbacks() at the VM's next safepoint.
     if (std::this_thread::get_id() == mainThreadId) {
-         debugLog("scriptCallbackTrampoline: On main thread, invoking callback directly.");
+         DEBUG_LOG("scriptCallbackTrampoline: On main thread, invoking callback directly.");
          invokeScriptCallback(*funcVal, param);
     } else {
-         debugLog("scriptCallbackTrampoline: Not on main thread, queueing callback.");
+         DEBUG_LOG("scriptCallbackTrampoline: Not on main thread, queueing callback.");
          std::lock_guard<std::mutex> lock(callbackQueueMutex);
-         callbackQueue.push(CallbackRequest{ *funcVal, param ? std::string(param) : std::string("") });
+         callbackQueue.push(CallbackRequest{ funcVal, param ? std::string(param) : std::string("") });
+         safepointPending.store(true, std::memory_order_release);
     }
 }
 
@@ -953,12 +2195,12 @@ static std::unordered_set<ffi_closure*> liveClosures;   // <‑‑ keeps them al
 
 BuiltinFn addressOfBuiltin = [](const std::vector<Value>& args) -> Value
 {
-    debugLog("AddressOf: received " + std::to_string(args.size()) + " arg(s)");
+    DEBUG_LOG("AddressOf: received " + std::to_string(args.size()) + " arg(s)");
     if (args.size() != 1)
         runtimeError("AddressOf expects exactly one argument");
 
     // The argument must be either a scripted ObjFunction or another BuiltinFn
-    if (!holds<std::shared_ptr<ObjFunction>>(args[0]) && !holds<BuiltinFn>(args[0]))
+    if (!args[0].isFunction() && !args[0].isBuiltin())
         runtimeError("AddressOf expects a function reference (omit the parentheses)");
 
     //---------------------------------------------------------------------------
@@ -995,7 +2237,7 @@ BuiltinFn addressOfBuiltin = [](const std::vector<Value>& args) -> Value
     // Keep the closure alive until its Deref'd or closed.
     liveClosures.insert(closure);
 
-    debugLog("AddressOf: returning callback pointer " +
+    DEBUG_LOG("AddressOf: returning callback pointer " +
              std::to_string(reinterpret_cast<uintptr_t>(entryPoint)));
     return Value(entryPoint);   // expose the raw code pointer to the script
 };
@@ -1007,18 +2249,18 @@ BuiltinFn addressOfBuiltin = [](const std::vector<Value>& args) -> Value
 // -----------------------------------------------------------------------------
 BuiltinFn addHandlerBuiltin = [](const std::vector<Value>& args) -> Value
 {
-    debugLog("AddHandler: received " + std::to_string(args.size()) + " arg(s)");
+    DEBUG_LOG("AddHandler: received " + std::to_string(args.size()) + " arg(s)");
     if (args.size() != 2)
         runtimeError("AddHandler expects exactly two arguments");
 
     // ------------------------------------------------------------------------
     // Argument 0  – “plugin:HANDLE:EventName”  (string produced by inst.Event)
     // ------------------------------------------------------------------------
-    if (!holds<std::string>(args[0]))
+    if (!args[0].isString())
         runtimeError("AddHandler: first argument must be the event identifier string");
 
-    const std::string target = getVal<std::string>(args[0]);
-    debugLog("AddHandler: target = " + target);
+    const std::string target = args[0].asString();
+    DEBUG_LOG("AddHandler: target = " + target);
 
     const size_t p1 = target.find(':');
     const size_t p2 = target.find(':', p1 + 1);
@@ -1032,11 +2274,11 @@ BuiltinFn addHandlerBuiltin = [](const std::vector<Value>& args) -> Value
     // ------------------------------------------------------------------------
     // Argument 1  – callback code pointer (void*)
     // ------------------------------------------------------------------------
-    if (!holds<void*>(args[1]))
+    if (!args[1].isPointer())
         runtimeError("AddHandler: second argument must be a pointer returned by AddressOf");
-    void* callbackPtr = getVal<void*>(args[1]);
+    void* callbackPtr = args[1].asPointer();
 
-    debugLog("AddHandler: plugin=" + pluginName +
+    DEBUG_LOG("AddHandler: plugin=" + pluginName +
              "  handle=" + std::to_string(handle) +
              "  event="  + eventName +
              "  cbPtr="  + std::to_string(reinterpret_cast<uintptr_t>(callbackPtr)));
@@ -1048,17 +2290,17 @@ BuiltinFn addHandlerBuiltin = [](const std::vector<Value>& args) -> Value
     // ------------------------------------------------------------------------
     const std::string setterKey = pluginName + "_seteventcallback";
     Value setterVal = globalVM->globals->get(setterKey);
-    if (!holds<BuiltinFn>(setterVal))
+    if (!setterVal.isBuiltin())
         runtimeError("AddHandler: could not find " + setterKey);
 
-    BuiltinFn setEventCallback = getVal<BuiltinFn>(setterVal);
+    BuiltinFn setEventCallback = setterVal.asBuiltin();
 
     // Call into the plugin:  Boolean SetEventCallback(Integer handle, String  eventName, Ptr callback)
     Value ok = setEventCallback({ Value(handle),
                                   Value(eventName),
                                   Value(callbackPtr) });
 
-    debugLog("AddHandler: plugin returned " + valueToString(ok));
+    DEBUG_LOG("AddHandler: plugin returned " + valueToString(ok));
     return ok;
 };
 
@@ -1067,99 +2309,127 @@ BuiltinFn addHandlerBuiltin = [](const std::vector<Value>& args) -> Value
 // ============================================================================
 enum class BinaryOp { ADD, SUB, MUL, DIV, LT, LE, GT, GE, NE, EQ, AND, OR, POW, MOD };
 
-struct Expr { virtual ~Expr() = default; };
+// Every node carries its kind, so the compiler dispatches with a switch and
+// nodeAs<T>() tests a node's type without RTTI.
+enum class ExprType { LITERAL, VARIABLE, UNARY, ASSIGNMENT, BINARY, GROUPING, CALL, ARRAY_LITERAL, GET_PROP, SET_PROP, NEW };
+
+struct Expr {
+    const ExprType kind;
+    explicit Expr(ExprType kind) : kind(kind) { }
+    virtual ~Expr() = default;
+};
 
 struct LiteralExpr : Expr { 
+    static const ExprType KIND = ExprType::LITERAL;
     Value value; 
-    LiteralExpr(const Value& value) : value(value) { }
+    LiteralExpr(const Value& value) : Expr(KIND), value(value) { }
 };
 
 struct VariableExpr : Expr {
+    static const ExprType KIND = ExprType::VARIABLE;
     std::string name;
-    VariableExpr(const std::string& name) : name(name) { }
+    VariableExpr(const std::string& name) : Expr(KIND), name(name) { }
 };
 
 struct UnaryExpr : Expr {
+    static const ExprType KIND = ExprType::UNARY;
     std::string op;
     std::shared_ptr<Expr> right;
     UnaryExpr(const std::string& op, std::shared_ptr<Expr> right)
-        : op(op), right(right) { }
+        : Expr(KIND), op(op), right(right) { }
 };
 
 struct AssignmentExpr : Expr {
+    static const ExprType KIND = ExprType::ASSIGNMENT;
     std::string name;
     std::shared_ptr<Expr> value;
     AssignmentExpr(const std::string& name, std::shared_ptr<Expr> value)
-        : name(name), value(value) { }
+        : Expr(KIND), name(name), value(value) { }
 };
 
 struct BinaryExpr : Expr {
+    static const ExprType KIND = ExprType::BINARY;
     std::shared_ptr<Expr> left;
     BinaryOp op;
     std::shared_ptr<Expr> right;
     BinaryExpr(std::shared_ptr<Expr> left, BinaryOp op, std::shared_ptr<Expr> right)
-        : left(left), op(op), right(right) { }
+        : Expr(KIND), left(left), op(op), right(right) { }
 };
 
 struct GroupingExpr : Expr {
+    static const ExprType KIND = ExprType::GROUPING;
     std::shared_ptr<Expr> expression;
     GroupingExpr(std::shared_ptr<Expr> expression)
-        : expression(expression) { }
+        : Expr(KIND), expression(expression) { }
 };
 
 struct CallExpr : Expr {
+    static const ExprType KIND = ExprType::CALL;
     std::shared_ptr<Expr> callee;
     std::vector<std::shared_ptr<Expr>> arguments;
     CallExpr(std::shared_ptr<Expr> callee, const std::vector<std::shared_ptr<Expr>>& arguments)
-        : callee(callee), arguments(arguments) { }
+        : Expr(KIND), callee(callee), arguments(arguments) { }
 };
 
 struct ArrayLiteralExpr : Expr {
+    static const ExprType KIND = ExprType::ARRAY_LITERAL;
     std::vector<std::shared_ptr<Expr>> elements;
-    ArrayLiteralExpr(const std::vector<std::shared_ptr<Expr>>& elements)
-        : elements(elements) { }
+    std::string elementType;    // `Dim a() As Double`: the declared element type
+    ArrayLiteralExpr(const std::vector<std::shared_ptr<Expr>>& elements, const std::string& elementType = "")
+        : Expr(KIND), elements(elements), elementType(elementType) { }
 };
 
 struct GetPropExpr : Expr {
+    static const ExprType KIND = ExprType::GET_PROP;
     std::shared_ptr<Expr> object;
     std::string name;
     GetPropExpr(std::shared_ptr<Expr> object, const std::string& name)
-        : object(object), name(toLower(name)) { }
+        : Expr(KIND), object(object), name(toLower(name)) { }
 };
 
 struct SetPropExpr : Expr {
+    static const ExprType KIND = ExprType::SET_PROP;
     std::shared_ptr<Expr> object;
     std::string name;
     std::shared_ptr<Expr> value;
     SetPropExpr(std::shared_ptr<Expr> object, const std::string& name, std::shared_ptr<Expr> value)
-        : object(object), name(toLower(name)), value(value) { }
+        : Expr(KIND), object(object), name(toLower(name)), value(value) { }
 };
 
 struct NewExpr : Expr {
+    static const ExprType KIND = ExprType::NEW;
     std::string className;
     std::vector<std::shared_ptr<Expr>> arguments;
     NewExpr(const std::string& className, const std::vector<std::shared_ptr<Expr>>& arguments)
-        : className(toLower(className)), arguments(arguments) { }
+        : Expr(KIND), className(toLower(className)), arguments(arguments) { }
 };
 
 // ============================================================================  
 // AST Definitions: Statements
 // ============================================================================
-enum class StmtType { EXPRESSION, FUNCTION, RETURN, CLASS, VAR, IF, WHILE, BLOCK, FOR, MODULE, DECLARE };
+enum class StmtType { EXPRESSION, FUNCTION, RETURN, CLASS, VAR, IF, WHILE, BLOCK, FOR, MODULE, DECLARE,
+                      PROPERTY_ASSIGNMENT, ASSIGNMENT, SELECT, LABEL, GOTO, ENUM };
 
-struct Stmt { virtual ~Stmt() = default; };
+struct Stmt {
+    const StmtType kind;
+    explicit Stmt(StmtType kind) : kind(kind) { }
+    virtual ~Stmt() = default;
+};
 
 struct ExpressionStmt : Stmt {
+    static const StmtType KIND = StmtType::EXPRESSION;
     std::shared_ptr<Expr> expression;
-    ExpressionStmt(std::shared_ptr<Expr> expression) : expression(expression) { }
+    ExpressionStmt(std::shared_ptr<Expr> expression) : Stmt(KIND), expression(expression) { }
 };
 
 struct ReturnStmt : Stmt {
+    static const StmtType KIND = StmtType::RETURN;
     std::shared_ptr<Expr> value;
-    ReturnStmt(std::shared_ptr<Expr> value) : value(value) { }
+    ReturnStmt(std::shared_ptr<Expr> value) : Stmt(KIND), value(value) { }
 };
 
 struct FunctionStmt : Stmt {
+    static const StmtType KIND = StmtType::FUNCTION;
     std::string name;
     std::vector<Param> params;
     std::vector<std::shared_ptr<Stmt>> body;
@@ -1177,7 +2447,7 @@ struct FunctionStmt : Stmt {
                 bool isExt = false,
                 std::string extParam = "",
                 std::string extType  = "")
-    : name(name), 
+    : Stmt(KIND), name(name), 
         params(params), 
         body(body), 
         access(access),
@@ -1188,6 +2458,7 @@ struct FunctionStmt : Stmt {
 };
 
 struct VarStmt : Stmt {
+    static const StmtType KIND = StmtType::VAR;
     std::string name; 
     std::shared_ptr<Expr> initializer;
     std::string varType;
@@ -1195,81 +2466,108 @@ struct VarStmt : Stmt {
     AccessModifier access;
     VarStmt(const std::string& name, std::shared_ptr<Expr> initializer, const std::string& varType = "",
         bool isConstant = false, AccessModifier access = AccessModifier::PUBLIC) 
-        : name(name), initializer(initializer), varType(toLower(varType)), isConstant(isConstant), access(access) { }
+        : Stmt(KIND), name(name), initializer(initializer), varType(toLower(varType)), isConstant(isConstant), access(access) { }
 };
 
 struct PropertyAssignmentStmt : Stmt {
+    static const StmtType KIND = StmtType::PROPERTY_ASSIGNMENT;
     std::shared_ptr<Expr> object;
     std::string property;
     std::shared_ptr<Expr> value;
     PropertyAssignmentStmt(std::shared_ptr<Expr> object, const std::string& property, std::shared_ptr<Expr> value)
-        : object(object), property(property), value(value) { }
+        : Stmt(KIND), object(object), property(property), value(value) { }
 };
 
 struct ClassStmt : Stmt {
+    static const StmtType KIND = StmtType::CLASS;
     std::string name;
     std::vector<std::shared_ptr<FunctionStmt>> methods;
     PropertiesType properties;
     ClassStmt(const std::string& name,
         const std::vector<std::shared_ptr<FunctionStmt>>& methods,
         const PropertiesType& properties)
-        : name(name), methods(methods), properties(properties) { }
+        : Stmt(KIND), name(name), methods(methods), properties(properties) { }
 };
 
 struct IfStmt : Stmt {
+    static const StmtType KIND = StmtType::IF;
     std::shared_ptr<Expr> condition;
     std::vector<std::shared_ptr<Stmt>> thenBranch;
     std::vector<std::shared_ptr<Stmt>> elseBranch;
     IfStmt(std::shared_ptr<Expr> condition,
         const std::vector<std::shared_ptr<Stmt>>& thenBranch,
         const std::vector<std::shared_ptr<Stmt>>& elseBranch)
-        : condition(condition), thenBranch(thenBranch), elseBranch(elseBranch) { }
+        : Stmt(KIND), condition(condition), thenBranch(thenBranch), elseBranch(elseBranch) { }
 };
 
 struct WhileStmt : Stmt {
+    static const StmtType KIND = StmtType::WHILE;
     std::shared_ptr<Expr> condition;
     std::vector<std::shared_ptr<Stmt>> body;
     WhileStmt(std::shared_ptr<Expr> condition, const std::vector<std::shared_ptr<Stmt>>& body)
-        : condition(condition), body(body) { } 
+        : Stmt(KIND), condition(condition), body(body) { } 
 };
 
 struct AssignmentStmt : Stmt {
+    static const StmtType KIND = StmtType::ASSIGNMENT;
     std::string name;
     std::shared_ptr<Expr> value;
     AssignmentStmt(const std::string& name, std::shared_ptr<Expr> value)
-        : name(name), value(value) { }
+        : Stmt(KIND), name(name), value(value) { }
 };
 
 struct BlockStmt : Stmt {
+    static const StmtType KIND = StmtType::BLOCK;
     std::vector<std::shared_ptr<Stmt>> statements;
     BlockStmt(const std::vector<std::shared_ptr<Stmt>>& statements)
-        : statements(statements) { }
+        : Stmt(KIND), statements(statements) { }
 };
 
 struct ForStmt : Stmt {
+    static const StmtType KIND = StmtType::FOR;
     std::string varName;
     std::shared_ptr<Expr> start;
     std::shared_ptr<Expr> end;
     std::shared_ptr<Expr> step;
     std::vector<std::shared_ptr<Stmt>> body;
+    bool isDown;    // DownTo: loop while the counter is >= the end value
     ForStmt(const std::string& varName,
         std::shared_ptr<Expr> start,
         std::shared_ptr<Expr> end,
         std::shared_ptr<Expr> step,
-        const std::vector<std::shared_ptr<Stmt>>& body)
-        : varName(varName), start(start), end(end), step(step), body(body) { }
+        const std::vector<std::shared_ptr<Stmt>>& body,
+        bool isDown = false)
+        : Stmt(KIND), varName(varName), start(start), end(end), step(step), body(body), isDown(isDown) { }
+};
+
+// Select Case: the selector is evaluated once and compared with each Case
+// value in order; the first match runs, otherwise the Case Else body.
+struct SelectStmt : Stmt {
+    static const StmtType KIND = StmtType::SELECT;
+    struct Case {
+        std::shared_ptr<Expr> value;
+        std::vector<std::shared_ptr<Stmt>> body;
+    };
+    std::shared_ptr<Expr> selector;
+    std::vector<Case> cases;
+    std::vector<std::shared_ptr<Stmt>> elseBranch;
+    SelectStmt(std::shared_ptr<Expr> selector, const std::vector<Case>& cases,
+        const std::vector<std::shared_ptr<Stmt>>& elseBranch)
+        : Stmt(KIND), selector(selector), cases(cases), elseBranch(elseBranch) { }
 };
 
 // Module AST node
 struct ModuleStmt : Stmt {
+    static const StmtType KIND = StmtType::MODULE;
      std::string name;
      std::vector<std::shared_ptr<Stmt>> body;
      ModuleStmt(const std::string& name, const std::vector<std::shared_ptr<Stmt>>& body)
-        : name(name), body(body) { }
+        : Stmt(KIND), name(name), body(body) { }
 };
 
 // Declare API statement AST node
 struct DeclareStmt : Stmt {
+    static const StmtType KIND = StmtType::DECLARE;
     bool isFunction; // true if Function, false if Sub
     std::string apiName;
     std::string libraryName;
@@ -1280,28 +2578,83 @@ struct DeclareStmt : Stmt {
     DeclareStmt(bool isFunc, const std::string& name, const std::string& lib,
         const std::string& alias, const std::string& sel,
         const std::vector<Param>& params, const std::string& retType)
-        : isFunction(isFunc), apiName(name), libraryName(lib), aliasName(alias), selector(sel), params(params), returnType(retType) { }
+        : Stmt(KIND), isFunction(isFunc), apiName(name), libraryName(lib), aliasName(alias), selector(sel), params(params), returnType(retType) { }
 };
 
 // Label and Goto AST node
 // AFTER (add just below existing Stmt structs)
 struct LabelStmt : Stmt {
+    static const StmtType KIND = StmtType::LABEL;
     std::string name;
-    explicit LabelStmt(const std::string& n) : name(toLower(n)) {}
+    explicit LabelStmt(const std::string& n) : Stmt(KIND), name(toLower(n)) {}
 };
 
 struct GotoStmt : Stmt {
+    static const StmtType KIND = StmtType::GOTO;
     std::string label;
-    explicit GotoStmt(const std::string& l) : label(toLower(l)) {}
+    explicit GotoStmt(const std::string& l) : Stmt(KIND), label(toLower(l)) {}
 };
 
 
 // Enum AST node
 struct EnumStmt : Stmt {
+    static const StmtType KIND = StmtType::ENUM;
     std::string name;
     std::unordered_map<std::string, int> members;
     EnumStmt(const std::string& name, const std::unordered_map<std::string, int>& members)
-    : name(name), members(members) { }
+    : Stmt(KIND), name(name), members(members) { }
+};
+
+// The node as a T when it is one, else null.
+template <typename T, typename Node>
+std::shared_ptr<T> nodeAs(const std::shared_ptr<Node>& node) {
+    if (!node || node->kind != T::KIND)
+        return nullptr;
+    return std::static_pointer_cast<T>(node);
+}
+
+// ============================================================================
+// AST arena
+// The parser allocates nodes, together with their shared_ptr control blocks,
+// from large blocks that are released all at once. Every node's allocator
+// holds a reference to the arena, so the blocks live until the last node
+// anywhere is gone.
+// ============================================================================
+class AstArena {
+public:
+    void* allocate(size_t size, size_t align) {
+        size_t at = (used + align - 1) & ~(align - 1);
+        if (blocks.empty() || at + size > capacity) {
+            capacity = std::max(BLOCK_SIZE, size);
+            blocks.emplace_back(new char[capacity]);
+            at = 0;
+        }
+        used = at + size;
+        return blocks.back().get() + at;
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t used = 0, capacity = 0;
+};
+
+template <typename T>
+struct AstAllocator {
+    using value_type = T;
+    std::shared_ptr<AstArena> arena;
+
+    explicit AstAllocator(std::shared_ptr<AstArena> arena) : arena(std::move(arena)) { }
+    template <typename U>
+    AstAllocator(const AstAllocator<U>& other) : arena(other.arena) { }
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) { }
+
+    template <typename U>
+    bool operator==(const AstAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const AstAllocator<U>& other) const { return arena != other.arena; }
 };
 
 // ---------------------------------------------------------------------------  
@@ -1313,14 +2666,14 @@ BuiltinFn wrapPluginFunctionForDeclare(const std::vector<Param>& params, const s
 // ============================================================================
 class Parser {
 public:
-    Parser(const std::vector<Token>& tokens) : tokens(tokens), inModule(false) {}
+    Parser(std::vector<Token> tokens) : tokens(std::move(tokens)), inModule(false) {}
     std::vector<std::shared_ptr<Stmt>> parse() {
-       debugLog("Parser: Starting parse. Total tokens: " + std::to_string(tokens.size()));
+       DEBUG_LOG("Parser: Starting parse. Total tokens: " + std::to_string(tokens.size()));
         std::vector<std::shared_ptr<Stmt>> statements;
         while (!isAtEnd()) {
             statements.push_back(declaration());
         }
-        debugLog("Parser: Finished parse.");
+        DEBUG_LOG("Parser: Finished parse.");
         return statements;
     }
     
@@ -1328,25 +2681,31 @@ private:
     std::vector<Token> tokens;
     int current = 0;
     bool inModule; // Flag to indicate module context
+    std::shared_ptr<AstArena> arena = std::make_shared<AstArena>();
+
+    template <typename T, typename... Args>
+    std::shared_ptr<T> node(Args&&... args) {
+        return std::allocate_shared<T>(AstAllocator<T>(arena), std::forward<Args>(args)...);
+    }
 
     bool isAtEnd() { return peek().type == XTokenType::EOF_TOKEN; }
-    Token peek() { return tokens[current]; }
-    Token previous() { return tokens[current - 1]; }
-    Token advance() { if (!isAtEnd()) current++; return previous(); }
+    const Token& peek() { return tokens[current]; }
+    const Token& previous() { return tokens[current - 1]; }
+    const Token& advance() { if (!isAtEnd()) current++; return previous(); }
     bool check(XTokenType type) { return !isAtEnd() && peek().type == type; }
-    bool match(const std::vector<XTokenType>& types) {
+    bool match(std::initializer_list<XTokenType> types) {
         for (auto type : types)
             if (check(type)) { advance(); return true; }
         return false;
     }
 
-    Token consume(XTokenType type, const std::string& msg) {
+    const Token& consume(XTokenType type, const std::string& msg) {
         if (check(type)) return advance();
         std::cerr << "Parse error at line " << peek().line << ": " << msg << std::endl;
         exit(1);
     }
 
-    std::vector<std::shared_ptr<Stmt>> block(const std::vector<XTokenType>& terminators) {
+    std::vector<std::shared_ptr<Stmt>> block(std::initializer_list<XTokenType> terminators) {
         std::vector<std::shared_ptr<Stmt>> statements;
         while (!isAtEnd() && std::find(terminators.begin(), terminators.end(), peek().type) == terminators.end()) {
             statements.push_back(declaration());
@@ -1374,7 +2733,7 @@ private:
     // Goto Label statement - TODO Fix to find even if before.
     std::shared_ptr<Stmt> gotoStatement() {
         Token lbl = consume(XTokenType::IDENTIFIER, "Expect label name after Goto.");
-        return std::make_shared<GotoStmt>(lbl.lexeme);
+        return node<GotoStmt>(lbl.lexeme);
     }
 
 
@@ -1392,7 +2751,7 @@ private:
         }
         consume(XTokenType::END, "Expect 'End' after enum definition.");
         if (check(XTokenType::ENUM)) { advance(); }
-        return std::make_shared<EnumStmt>(name.lexeme, members);
+        return node<EnumStmt>(name.lexeme, members);
     }
 
     // Parse module declaration
@@ -1412,7 +2771,7 @@ private:
         consume(XTokenType::END, "Expect 'End' after module body.");
         consume(XTokenType::MODULE, "Expect 'Module' after End in module declaration.");
         inModule = oldInModule;
-        return std::make_shared<ModuleStmt>(name.lexeme, body);
+        return node<ModuleStmt>(name.lexeme, body);
     }
     // Parse Declare statement
     std::shared_ptr<Stmt> declareStatement() {
@@ -1462,7 +2821,7 @@ private:
                 Value defaultValue = Value(std::monostate{});
                 if (isOptional && match({ XTokenType::EQUAL })) {
                     std::shared_ptr<Expr> defaultExpr = expression();
-                    if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(defaultExpr))
+                    if (auto lit = nodeAs<LiteralExpr>(defaultExpr))
                         defaultValue = lit->value;
                     else
                         runtimeError("Optional parameter default value must be a literal.");
@@ -1477,7 +2836,7 @@ private:
             Token retTok = consume(XTokenType::IDENTIFIER, "Expect return type after 'As' in Declare statement.");
             retType = toLower(retTok.lexeme);
         }
-        return std::make_shared<DeclareStmt>(isFunc, apiName, libraryName, aliasName, selector, params, retType);
+        return node<DeclareStmt>(isFunc, apiName, libraryName, aliasName, selector, params, retType);
     }
 
     // Modified declaration to capture access modifiers in module context.
@@ -1491,7 +2850,7 @@ private:
             && tokens[current + 1].type == XTokenType::COLON) {
             Token labelTok = advance();             // IDENTIFIER
             consume(XTokenType::COLON, "Expect ':' after label.");
-            return std::make_shared<LabelStmt>(labelTok.lexeme);
+            return node<LabelStmt>(labelTok.lexeme);
         }
         if (check(XTokenType::MODULE))
             return (advance(), moduleDeclaration());
@@ -1510,7 +2869,7 @@ private:
             Token prop = consume(XTokenType::IDENTIFIER, "Expect property name in property assignment.");
             consume(XTokenType::EQUAL, "Expect '=' in property assignment.");
             std::shared_ptr<Expr> valueExpr = expression();
-            return std::make_shared<PropertyAssignmentStmt>(std::make_shared<VariableExpr>(obj.lexeme), prop.lexeme, valueExpr);
+            return node<PropertyAssignmentStmt>(node<VariableExpr>(obj.lexeme), prop.lexeme, valueExpr);
         }
         if (match({ XTokenType::FUNCTION, XTokenType::SUB }))
             return functionDeclaration(access);
@@ -1532,7 +2891,7 @@ private:
                 Token id = advance();
                 advance();
                 std::shared_ptr<Expr> value = expression();
-                return std::make_shared<AssignmentStmt>(id.lexeme, value);
+                return node<AssignmentStmt>(id.lexeme, value);
             }
         if (match({ XTokenType::GOTO })) {
             return gotoStatement();
@@ -1591,7 +2950,7 @@ private:
                 Value defaultValue = Value(std::monostate{});
                 if (isOptional && match({ XTokenType::EQUAL })) {
                     std::shared_ptr<Expr> defaultExpr = expression();
-                    if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(defaultExpr))
+                    if (auto lit = nodeAs<LiteralExpr>(defaultExpr))
                         defaultValue = lit->value;
                     else
                         runtimeError("Optional parameter default value must be a literal.");
@@ -1611,8 +2970,8 @@ private:
         int req = 0;
         for (auto& p : parameters)
             if (!p.optional) req++;
-        //return std::make_shared<FunctionStmt>(name.lexeme, parameters, body, access);
-         auto stmt = std::make_shared<FunctionStmt>(
+        //return node<FunctionStmt>(name.lexeme, parameters, body, access);
+         auto stmt = node<FunctionStmt>(
         name.lexeme,
         parameters,
         body,
@@ -1658,6 +3017,7 @@ private:
                 if (!check(XTokenType::RIGHT_PAREN)) {
                     do {
                         bool isOptional = false;
+                        bool isAssigns = match({ XTokenType::ASSIGNS });
                         if (match({ XTokenType::XOPTIONAL })) { isOptional = true; }
                         Token param = consume(XTokenType::IDENTIFIER, "Expect parameter name.");
                         std::string paramType = "";
@@ -1668,12 +3028,12 @@ private:
                         Value defaultValue = Value(std::monostate{});
                         if (isOptional && match({ XTokenType::EQUAL })) {
                             std::shared_ptr<Expr> defaultExpr = expression();
-                            if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(defaultExpr))
+                            if (auto lit = nodeAs<LiteralExpr>(defaultExpr))
                                 defaultValue = lit->value;
                             else
                                 runtimeError("Optional parameter default value must be a literal.");
                         }
-                        parameters.push_back({ param.lexeme, paramType, isOptional, false, defaultValue });
+                        parameters.push_back({ param.lexeme, paramType, isOptional, isAssigns, defaultValue });
                     } while (match({ XTokenType::COMMA }));
                 }
                 consume(XTokenType::RIGHT_PAREN, "Expect ')' after parameters.");
@@ -1682,7 +3042,7 @@ private:
                 std::vector<std::shared_ptr<Stmt>> body = block({ XTokenType::END });
                 consume(XTokenType::END, "Expect 'End' after method body.");
                 match({ XTokenType::FUNCTION, XTokenType::SUB });
-                methods.push_back(std::make_shared<FunctionStmt>(methodName.lexeme, parameters, body));
+                methods.push_back(node<FunctionStmt>(methodName.lexeme, parameters, body));
             }
             else {
                 advance();
@@ -1690,7 +3050,7 @@ private:
         }
         consume(XTokenType::END, "Expect 'End' after class.");
         consume(XTokenType::CLASS, "Expect 'Class' after End.");
-        return std::make_shared<ClassStmt>(name.lexeme, methods, properties);
+        return node<ClassStmt>(name.lexeme, methods, properties);
     }
 
     std::shared_ptr<Stmt> varDeclaration(AccessModifier access, bool isConstant) {
@@ -1707,7 +3067,7 @@ private:
                 advance(); // consume NEW
                 Token typeToken = consume(XTokenType::IDENTIFIER, "Expect class name after 'New' in variable declaration.");
                 typeStr = typeToken.lexeme;
-                initializer = std::make_shared<NewExpr>(typeToken.lexeme, std::vector<std::shared_ptr<Expr>>{});
+                initializer = node<NewExpr>(typeToken.lexeme, std::vector<std::shared_ptr<Expr>>{});
                 if (match({ XTokenType::LEFT_PAREN })) {
                     std::vector<std::shared_ptr<Expr>> args;
                     if (!check(XTokenType::RIGHT_PAREN)) {
@@ -1716,7 +3076,7 @@ private:
                         } while (match({ XTokenType::COMMA }));
                     }
                     consume(XTokenType::RIGHT_PAREN, "Expect ')' after constructor arguments.");
-                    initializer = std::make_shared<NewExpr>(typeToken.lexeme, args);
+                    initializer = node<NewExpr>(typeToken.lexeme, args);
                 }
             }
             else {
@@ -1724,7 +3084,7 @@ private:
                 typeStr = toLower(typeToken.lexeme);
                 if (match({ XTokenType::NEW })) {
                     Token classToken = consume(XTokenType::IDENTIFIER, "Expect class name after 'New'.");
-                    initializer = std::make_shared<NewExpr>(classToken.lexeme, std::vector<std::shared_ptr<Expr>>{});
+                    initializer = node<NewExpr>(classToken.lexeme, std::vector<std::shared_ptr<Expr>>{});
                     if (match({ XTokenType::LEFT_PAREN })) {
                         std::vector<std::shared_ptr<Expr>> args;
                         if (!check(XTokenType::RIGHT_PAREN)) {
@@ -1733,7 +3093,7 @@ private:
                             } while (match({ XTokenType::COMMA }));
                         }
                         consume(XTokenType::RIGHT_PAREN, "Expect ')' after constructor arguments.");
-                        initializer = std::make_shared<NewExpr>(classToken.lexeme, args);
+                        initializer = node<NewExpr>(classToken.lexeme, args);
                     }
                 }
             }
@@ -1741,10 +3101,12 @@ private:
         if (!initializer && match({ XTokenType::EQUAL }))
             initializer = expression();
         else if (isArray)
-            initializer = std::make_shared<ArrayLiteralExpr>(std::vector<std::shared_ptr<Expr>>{});
+            initializer = node<ArrayLiteralExpr>(std::vector<std::shared_ptr<Expr>>{}, toLower(typeStr));
         else if (typeStr == "pointer" || typeStr == "ptr")
-            initializer = std::make_shared<LiteralExpr>(static_cast<void*>(nullptr)); // Initialize pointer to nullptr
-        return std::make_shared<VarStmt>(name.lexeme, initializer, typeStr, isConstant, access);
+            initializer = node<LiteralExpr>(static_cast<void*>(nullptr)); // Initialize pointer to nullptr
+        if (isArray)
+            typeStr = "array";  // the variable holds the array; As names its elements
+        return node<VarStmt>(name.lexeme, initializer, typeStr, isConstant, access);
     }
 
     // ========================================================================
@@ -1762,7 +3124,7 @@ private:
             std::vector<std::shared_ptr<Stmt>> elseBranch;
             if (match({XTokenType::ELSE}) && peek().line == thenLine)
                 elseBranch.push_back(statement());
-            return std::make_shared<IfStmt>(cond, thenBranch, elseBranch);
+            return node<IfStmt>(cond, thenBranch, elseBranch);
         }
 
         // ---------- multi-line ----------
@@ -1773,7 +3135,7 @@ private:
             auto elseifCond  = expression();
             consume(XTokenType::THEN, "expect Then");
             auto elseifBody  = block({XTokenType::ELSEIF, XTokenType::ELSE, XTokenType::END});
-            auto elseifStmt  = std::make_shared<IfStmt>(elseifCond, elseifBody, std::vector<std::shared_ptr<Stmt>>{});
+            auto elseifStmt  = node<IfStmt>(elseifCond, elseifBody, std::vector<std::shared_ptr<Stmt>>{});
             elseBranch = { elseifStmt };
         }
 
@@ -1782,7 +3144,7 @@ private:
 
         consume(XTokenType::END, "expect End If");
         consume(XTokenType::IF,  "expect 'If' after End");
-        return std::make_shared<IfStmt>(cond, thenBranch, elseBranch);
+        return node<IfStmt>(cond, thenBranch, elseBranch);
     }
 
 
@@ -1809,40 +3171,20 @@ private:
             stepExpr = expression();
         } else {
             // Default step: 1 for upward, -1 for downward loops
-            stepExpr = std::make_shared<LiteralExpr>(isDown ? -1 : 1);
+            stepExpr = node<LiteralExpr>(isDown ? -1 : 1);
         }
         std::vector<std::shared_ptr<Stmt>> body = block({ XTokenType::NEXT });
         consume(XTokenType::NEXT, "Expect 'Next' after For loop body.");
         if (check(XTokenType::IDENTIFIER)) advance();
     
-        // Create the initializer for the loop variable
-        std::shared_ptr<Stmt> initializer = std::make_shared<VarStmt>(varName.lexeme, startExpr);
-        std::shared_ptr<Expr> loopVar = std::make_shared<VariableExpr>(varName.lexeme);
-    
-        // Set loop condition: <= for upward, >= for downward
-        std::shared_ptr<Expr> condition;
-        if (isDown) {
-            condition = std::make_shared<BinaryExpr>(loopVar, BinaryOp::GE, endExpr);
-        } else {
-            condition = std::make_shared<BinaryExpr>(loopVar, BinaryOp::LE, endExpr);
-        }
-    
-        // Update the loop variable: always using addition (the step will be negative if downward)
-        std::shared_ptr<Expr> increment = std::make_shared<AssignmentExpr>(
-            varName.lexeme,
-            std::make_shared<BinaryExpr>(loopVar, BinaryOp::ADD, stepExpr)
-        );
-        body.push_back(std::make_shared<ExpressionStmt>(increment));
-    
-        std::vector<std::shared_ptr<Stmt>> forBlock = { initializer, std::make_shared<WhileStmt>(condition, body) };
-        return std::make_shared<BlockStmt>(forBlock);
+        return node<ForStmt>(varName.lexeme, startExpr, endExpr, stepExpr, body, isDown);
     }
     
     std::shared_ptr<Stmt> whileStatement() {
         std::shared_ptr<Expr> condition = expression();
         std::vector<std::shared_ptr<Stmt>> body = block({ XTokenType::WEND });
         consume(XTokenType::WEND, "Expect 'Wend' after while loop.");
-        return std::make_shared<WhileStmt>(condition, body);
+        return node<WhileStmt>(condition, body);
     }
 
     std::shared_ptr<Stmt> statement() {
@@ -1855,9 +3197,9 @@ private:
 
     std::shared_ptr<Stmt> printStatement() {
         std::shared_ptr<Expr> value = expression();
-        return std::make_shared<ExpressionStmt>(
-            std::make_shared<CallExpr>(
-                std::make_shared<LiteralExpr>(std::string("print")),
+        return node<ExpressionStmt>(
+            node<CallExpr>(
+                node<LiteralExpr>(std::string("print")),
                 std::vector<std::shared_ptr<Expr>>{value}
             )
         );
@@ -1865,12 +3207,12 @@ private:
 
     std::shared_ptr<Stmt> returnStatement() {
         std::shared_ptr<Expr> value = expression();
-        return std::make_shared<ReturnStmt>(value);
+        return node<ReturnStmt>(value);
     }
 
     std::shared_ptr<Stmt> expressionStatement() {
         std::shared_ptr<Expr> expr = expression();
-        return std::make_shared<ExpressionStmt>(expr);
+        return node<ExpressionStmt>(expr);
     }
 
     std::shared_ptr<Expr> assignment() 
@@ -1878,14 +3220,14 @@ private:
         std::shared_ptr<Expr> expr = orExpr();
 
         /* --- Assigns-style call: only for *global* routines --------- */
-        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
+        if (auto bin = nodeAs<BinaryExpr>(expr)) {
             if (bin->op == BinaryOp::EQ) {
-                if (auto call = std::dynamic_pointer_cast<CallExpr>(bin->left)) {
+                if (auto call = nodeAs<CallExpr>(bin->left)) {
                     /*  ChangeValue(…) = rhs   →   ChangeValue(…, rhs)   */
-                    if (std::dynamic_pointer_cast<VariableExpr>(call->callee)) {
+                    if (nodeAs<VariableExpr>(call->callee)) {
                         auto args = call->arguments;      // make a copy
                         args.push_back(bin->right);       // append RHS
-                        return std::make_shared<CallExpr>(call->callee, args);
+                        return node<CallExpr>(call->callee, args);
                     }
                     /* callee is *not* a VariableExpr (e.g. obj.Method)
                        → leave it untouched so comparisons like
@@ -1908,7 +3250,7 @@ private:
             std::shared_ptr<Expr> right = assignment();
     
             // must be a simple variable on the left
-            if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr)) {
+            if (auto var = nodeAs<VariableExpr>(expr)) {
                 // pick the correct binary operator
                 BinaryOp binop;
                 switch (op.type) {
@@ -1919,9 +3261,9 @@ private:
                     default:                      binop = BinaryOp::ADD; break; // never happens
                 }
                 // build “var = var <op> right”
-                auto leftVar = std::make_shared<VariableExpr>(var->name);
-                auto binary  = std::make_shared<BinaryExpr>(leftVar, binop, right);
-                return std::make_shared<AssignmentExpr>(var->name, binary);
+                auto leftVar = node<VariableExpr>(var->name);
+                auto binary  = node<BinaryExpr>(leftVar, binop, right);
+                return node<AssignmentExpr>(var->name, binary);
             }
     
             runtimeError("Invalid target for compound assignment.");
@@ -1936,15 +3278,15 @@ private:
                e.g.   ChangeValue(5,4) = 10
                ► translate to a CallExpr with the RHS appended             */
  
-            if (auto call = std::dynamic_pointer_cast<CallExpr>(expr)) {
+            if (auto call = nodeAs<CallExpr>(expr)) {
                 auto args = call->arguments;
                 args.push_back(value);                 // append := parameter
-                return std::make_shared<CallExpr>(call->callee, args);
+                return node<CallExpr>(call->callee, args);
             }
  
             /* existing rules for “x = …” */
-            if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr))
-                return std::make_shared<AssignmentExpr>(var->name, value);
+            if (auto var = nodeAs<VariableExpr>(expr))
+                return node<AssignmentExpr>(var->name, value);
  
             runtimeError("Invalid assignment target.");
 
@@ -1962,7 +3304,7 @@ private:
             Token op = previous();
             BinaryOp binOp = (op.type == XTokenType::EQUAL) ? BinaryOp::EQ : BinaryOp::NE;
             std::shared_ptr<Expr> right = comparison();
-            expr = std::make_shared<BinaryExpr>(expr, binOp, right);
+            expr = node<BinaryExpr>(expr, binOp, right);
         }
         return expr;
     }
@@ -1972,7 +3314,7 @@ private:
         auto expr = andExpr();
         while (match({XTokenType::OR})) {
             auto rhs = andExpr();
-            expr = std::make_shared<BinaryExpr>(expr, BinaryOp::OR, rhs);
+            expr = node<BinaryExpr>(expr, BinaryOp::OR, rhs);
         }
         return expr;
     }
@@ -1981,7 +3323,7 @@ private:
         auto expr = equality();
         while (match({XTokenType::AND})) {
             auto rhs = equality();
-            expr = std::make_shared<BinaryExpr>(expr, BinaryOp::AND, rhs);
+            expr = node<BinaryExpr>(expr, BinaryOp::AND, rhs);
         }
         return expr;
     }
@@ -1999,7 +3341,7 @@ private:
             default: binOp = BinaryOp::EQ; break;
             }
             std::shared_ptr<Expr> right = addition();
-            expr = std::make_shared<BinaryExpr>(expr, binOp, right);
+            expr = node<BinaryExpr>(expr, binOp, right);
         }
         return expr;
     }
@@ -2010,7 +3352,7 @@ private:
             Token op = previous();
             BinaryOp binOp = (op.type == XTokenType::PLUS) ? BinaryOp::ADD : BinaryOp::SUB;
             std::shared_ptr<Expr> right = multiplication();
-            expr = std::make_shared<BinaryExpr>(expr, binOp, right);
+            expr = node<BinaryExpr>(expr, binOp, right);
         }
         return expr;
     }
@@ -2024,7 +3366,7 @@ private:
             else if (op.type == XTokenType::SLASH) binOp = BinaryOp::DIV;
             else if (op.type == XTokenType::MOD) binOp = BinaryOp::MOD;
             std::shared_ptr<Expr> right = exponentiation();
-            expr = std::make_shared<BinaryExpr>(expr, binOp, right);
+            expr = node<BinaryExpr>(expr, binOp, right);
         }
         return expr;
     }
@@ -2033,7 +3375,7 @@ private:
         std::shared_ptr<Expr> expr = unary();
         if (match({ XTokenType::CARET })) {
             std::shared_ptr<Expr> right = exponentiation();
-            expr = std::make_shared<BinaryExpr>(expr, BinaryOp::POW, right);
+            expr = node<BinaryExpr>(expr, BinaryOp::POW, right);
         }
         return expr;
     }
@@ -2047,9 +3389,9 @@ private:
           Token op = previous();
           auto right = unary();
           if (op.type == XTokenType::MINUS)
-            return std::make_shared<UnaryExpr>("-", right);
+            return node<UnaryExpr>("-", right);
           else
-            return std::make_shared<UnaryExpr>("not", right);
+            return node<UnaryExpr>("not", right);
         }
         return call();
       }
@@ -2064,7 +3406,7 @@ private:
             }
             else if (match({ XTokenType::DOT })) {
                 Token prop = consume(XTokenType::IDENTIFIER, "Expect property name after '.'");
-                expr = std::make_shared<GetPropExpr>(expr, prop.lexeme);
+                expr = node<GetPropExpr>(expr, prop.lexeme);
             }
             else {
                 break;
@@ -2081,32 +3423,32 @@ private:
             } while (match({ XTokenType::COMMA }));
         }
         consume(XTokenType::RIGHT_PAREN, "Expect ')' after arguments.");
-        return std::make_shared<CallExpr>(callee, arguments);
+        return node<CallExpr>(callee, arguments);
     }
     
     std::shared_ptr<Expr> primary() {
         if (match({ XTokenType::NUMBER })) {
             std::string lex = previous().lexeme;
             if (lex.find('.') != std::string::npos)
-                return std::make_shared<LiteralExpr>(std::stod(lex));
+                return node<LiteralExpr>(std::stod(lex));
             else
-                return std::make_shared<LiteralExpr>(std::stoi(lex));
+                return node<LiteralExpr>(std::stoi(lex));
         }
         if (match({ XTokenType::STRING })) {
             std::string s = previous().lexeme;
             s = s.substr(1, s.size() - 2);
-            return std::make_shared<LiteralExpr>(s);
+            return node<LiteralExpr>(s);
         }
         if (match({ XTokenType::COLOR })) {
             std::string s = previous().lexeme;
             std::string hex = s.substr(2);
             unsigned int col = std::stoul(hex, nullptr, 16);
-            return std::make_shared<LiteralExpr>(Color{ col });
+            return node<LiteralExpr>(Color{ col });
         }
         if (match({ XTokenType::BOOLEAN_TRUE }))
-            return std::make_shared<LiteralExpr>(true);
+            return node<LiteralExpr>(true);
         if (match({ XTokenType::BOOLEAN_FALSE }))
-            return std::make_shared<LiteralExpr>(false);
+            return node<LiteralExpr>(false);
         if (match({ XTokenType::IDENTIFIER })) {
             Token id = previous();
             if (toLower(id.lexeme) == "array" && match({ XTokenType::LEFT_BRACKET })) {
@@ -2117,14 +3459,14 @@ private:
                     } while (match({ XTokenType::COMMA }));
                 }
                 consume(XTokenType::RIGHT_BRACKET, "Expect ']' after array literal.");
-                return std::make_shared<ArrayLiteralExpr>(elements);
+                return node<ArrayLiteralExpr>(elements);
             }
-            return std::make_shared<VariableExpr>(id.lexeme);
+            return node<VariableExpr>(id.lexeme);
         }
         if (match({ XTokenType::LEFT_PAREN })) {
             std::shared_ptr<Expr> expr = expression();
             consume(XTokenType::RIGHT_PAREN, "Expect ')' after expression.");
-            return std::make_shared<GroupingExpr>(expr);
+            return node<GroupingExpr>(expr);
         }
         std::cerr << "Parse error at line " << peek().line << ": Expected expression." << std::endl;
         exit(1);
@@ -2134,44 +3476,30 @@ private:
     // ***** selectCaseStatement() to support "Select Case" constructs *****
     std::shared_ptr<Stmt> selectCaseStatement() {
         consume(XTokenType::CASE, "Expect 'Case' after 'Select' in Select Case statement.");
-        std::shared_ptr<Expr> switchExpr = expression();
-        struct CaseClause {
-            bool isDefault = false;
-            std::shared_ptr<Expr> expr;
-            std::vector<std::shared_ptr<Stmt>> statements;
-        };
-        std::vector<CaseClause> clauses;
+        std::shared_ptr<Expr> selector = expression();
+        std::vector<SelectStmt::Case> cases;
+        std::vector<std::shared_ptr<Stmt>> elseBranch;
+        bool hasElse = false;
         while (!check(XTokenType::END)) {
             consume(XTokenType::CASE, "Expect 'Case' at start of case clause.");
-            CaseClause clause;
             if (match({ XTokenType::ELSE })) {
-                clause.isDefault = true;
+                auto statements = block({ XTokenType::CASE, XTokenType::END });
+                // Clauses after the first Case Else can never run.
+                if (!hasElse)
+                    elseBranch = statements;
+                hasElse = true;
             }
             else {
-                clause.isDefault = false;
-                clause.expr = expression();
+                SelectStmt::Case clause;
+                clause.value = expression();
+                clause.body = block({ XTokenType::CASE, XTokenType::END });
+                if (!hasElse)
+                    cases.push_back(clause);
             }
-            clause.statements = block({ XTokenType::CASE, XTokenType::END });
-            clauses.push_back(clause);
         }
         consume(XTokenType::END, "Expect 'End' after Select Case statement.");
         consume(XTokenType::SELECT, "Expect 'Select' after 'End' in Select Case statement.");
-        std::vector<std::shared_ptr<Stmt>> currentElse;
-        for (int i = clauses.size() - 1; i >= 0; i--) {
-            if (clauses[i].isDefault) {
-                currentElse = clauses[i].statements;
-            }
-            else {
-                auto condition = std::make_shared<BinaryExpr>(switchExpr, BinaryOp::EQ, clauses[i].expr);
-                auto ifStmt = std::make_shared<IfStmt>(condition, clauses[i].statements, currentElse);
-                currentElse.clear();
-                currentElse.push_back(ifStmt);
-            }
-        }
-        if (currentElse.empty()) {
-            return std::make_shared<BlockStmt>(std::vector<std::shared_ptr<Stmt>>{});
-        }
-        return currentElse[0];
+        return node<SelectStmt>(selector, cases, elseBranch);
     }
     // ***** End of Select Case support *****
 };
@@ -2179,20 +3507,64 @@ private:
 // ============================================================================  
 // Helpers for constant pool management
 // ============================================================================
+// The type tag followed by the bytes of the value, for the scalar and String
+// constants that a chunk stores once. Doubles are keyed by their bits, so 0.0
+// and -0.0 stay apart.
+static bool constantKey(const Value& v, std::string& key) {
+    key.assign(1, static_cast<char>(v.getType()));
+    switch (v.getType()) {
+    case Value::Type::Nil:
+        return true;
+    case Value::Type::Int: {
+        int i = v.asInt();
+        key.append(reinterpret_cast<const char*>(&i), sizeof i);
+        return true;
+    }
+    case Value::Type::Double: {
+        double d = v.asDouble();
+        key.append(reinterpret_cast<const char*>(&d), sizeof d);
+        return true;
+    }
+    case Value::Type::Bool:
+        key.push_back(v.asBool() ? 1 : 0);
+        return true;
+    case Value::Type::Color: {
+        unsigned int c = v.asColor().value;
+        key.append(reinterpret_cast<const char*>(&c), sizeof c);
+        return true;
+    }
+    case Value::Type::String:
+        key.append(v.asStringView());
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int addIndexedConstant(ObjFunction::CodeChunk& chunk, std::string&& key, const Value& v) {
+    auto inserted = chunk.constantIndex.emplace(std::move(key), (int)chunk.constants.size());
+    if (inserted.second)
+        chunk.constants.push_back(v.isString() ? internString(v) : v);
+    return inserted.first->second;
+}
+
+// Scalars and strings are deduplicated per chunk; other values are always
+// appended.
 int addConstant(ObjFunction::CodeChunk& chunk, const Value& v) {
+    std::string key;
+    if (constantKey(v, key))
+        return addIndexedConstant(chunk, std::move(key), v);
     chunk.constants.push_back(v);
     return chunk.constants.size() - 1;
 }
 
 int addConstantString(ObjFunction::CodeChunk& chunk, const std::string& s) {
-    for (int i = 0; i < chunk.constants.size(); i++) {
-        if (holds<std::string>(chunk.constants[i])) {
-            if (getVal<std::string>(chunk.constants[i]) == s)
-                return i;
-        }
-    }
-    chunk.constants.push_back(s);
-    return chunk.constants.size() - 1;
+    std::string key(1, static_cast<char>(Value::Type::String));
+    key += s;
+    auto it = chunk.constantIndex.find(key);
+    if (it != chunk.constantIndex.end())
+        return it->second;
+    return addIndexedConstant(chunk, std::move(key), Value(s));
 }
 
 // ============================================================================  
@@ -2202,37 +3574,41 @@ Value callArrayMethod(std::shared_ptr<ObjArray> array, const std::string& method
     std::string m = toLower(method);
     if (m == "add") {
         if (args.size() != 1) runtimeError("Array.add expects 1 argument.");
-        array->elements.push_back(args[0]);
+        array->push(args[0]);
         return Value(std::monostate{});
     }
     else if (m == "indexof") {
         if (args.size() != 1) runtimeError("Array.indexof expects 1 argument.");
-        for (size_t i = 0; i < array->elements.size(); i++) {
-            if (valueToString(array->elements[i]) == valueToString(args[0]))
+        std::string key = valueToString(args[0]);
+        for (size_t i = 0; i < array->size(); i++) {
+            if (valueToString(array->get(i)) == key)
                 return (int)i;
         }
         return -1;
     }
     else if (m == "lastindex") {
-        return array->elements.empty() ? -1 : (int)(array->elements.size() - 1);
+        return (int)array->size() - 1;
     }
     else if (m == "count") {
-        return (int)array->elements.size();
+        return (int)array->size();
     }
     else if (m == "join") {
     // Array.join(separator As String) As String
     if (args.size() != 1) 
         runtimeError("Array.join expects exactly one argument: the separator string.");
-    if (!holds<std::string>(args[0]))
+    if (!args[0].isString())
         runtimeError("Array.join expects the separator to be a string.");
 
-    const std::string sep = getVal<std::string>(args[0]);
+    std::string_view sep = args[0].asStringView();
     std::string result;
+    // packed numbers and Booleans never pass; strings and Values are checked
+    if (array->kind != ObjArray::Kind::String && array->kind != ObjArray::Kind::Values && !array->empty())
+        runtimeError("Array.join: all elements must be strings.");
     for (size_t i = 0; i < array->elements.size(); ++i) {
         // ensure each element is a string
-        if (!holds<std::string>(array->elements[i]))
+        if (!array->elements[i].isString())
             runtimeError("Array.join: all elements must be strings.");
-        result += getVal<std::string>(array->elements[i]);
+        result += array->elements[i].asStringView();
         if (i + 1 < array->elements.size())
             result += sep;
     }
@@ -2240,24 +3616,22 @@ Value callArrayMethod(std::shared_ptr<ObjArray> array, const std::string& method
     }
 
     else if (m == "pop") {
-        if (array->elements.empty()) runtimeError("Array.pop called on empty array.");
-        Value last = array->elements.back();
-        array->elements.pop_back();
-        return last;
+        if (array->empty()) runtimeError("Array.pop called on empty array.");
+        return array->pop();
     }
     else if (m == "removeat") {
         if (args.size() != 1) runtimeError("Array.removeat expects 1 argument.");
         int index = 0;
-        if (holds<int>(args[0]))
-            index = getVal<int>(args[0]);
+        if (args[0].isInt())
+            index = args[0].asInt();
         else runtimeError("Array.removeat expects an integer index.");
-        if (index < 0 || index >= (int)array->elements.size())
+        if (index < 0 || index >= (int)array->size())
             runtimeError("Array.removeat index out of bounds.");
-        array->elements.erase(array->elements.begin() + index);
+        array->erase(index);
         return Value(std::monostate{});
     }
     else if (m == "removeall") {
-        array->elements.clear();
+        array->clear();
         return Value(std::monostate{});
     }
     else {
@@ -2343,7 +3717,7 @@ BuiltinFn wrapPluginFunction(void *funcPtr,
                              const char **paramTypes,
                              const char *returnTypeStr)
 {
-    debugLog("wrapPluginFunction: building wrapper  funcPtr=" + std::to_string((uintptr_t)funcPtr) + "  arity=" + std::to_string(arity));
+    DEBUG_LOG("wrapPluginFunction: building wrapper  funcPtr=" + std::to_string((uintptr_t)funcPtr) + "  arity=" + std::to_string(arity));
 
     // ----------------------------------------------------------------------
     // 1)  Create and prepare the libffi call interface (CIF)
@@ -2357,7 +3731,7 @@ BuiltinFn wrapPluginFunction(void *funcPtr,
         std::string pType = toLower(pRaw);
         argTypes[i] = mapType(pType);
 
-        debugLog("  param[" + std::to_string(i) + "] = '" + pRaw + "' -> " + (argTypes[i] ? "OK" : "UNKNOWN"));
+        DEBUG_LOG("  param[" + std::to_string(i) + "] = '" + pRaw + "' -> " + (argTypes[i] ? "OK" : "UNKNOWN"));
 
         if (!argTypes[i])
             runtimeError("Unknown plugin parameter type: " + pType);
@@ -2366,7 +3740,7 @@ BuiltinFn wrapPluginFunction(void *funcPtr,
     std::string retTypeString = toLower(returnTypeStr ? returnTypeStr : "variant");
     ffi_type *retType = mapType(retTypeString);
 
-    debugLog("  return type = '" + std::string(returnTypeStr ? returnTypeStr : "") + "'  -> " + (retType ? "built-in" : "custom/plugin"));
+    DEBUG_LOG("  return type = '" + std::string(returnTypeStr ? returnTypeStr : "") + "'  -> " + (retType ? "built-in" : "custom/plugin"));
 
     if (!retType)
         retType = &ffi_type_sint; // treat unknown returns as int
@@ -2388,14 +3762,14 @@ BuiltinFn wrapPluginFunction(void *funcPtr,
         "string", "double", "number", "integer", "int", "boolean", "bool",
         "color", "variant", "pointer", "ptr", "array", "void"};
     bool isCustomClass = (builtinTypes.find(retTypeString) == builtinTypes.end());
-    debugLog("  isCustomClass = " + std::string(isCustomClass ? "true" : "false"));
+    DEBUG_LOG("  isCustomClass = " + std::string(isCustomClass ? "true" : "false"));
 
     // ----------------------------------------------------------------------
     // 4)  Return the VM-visible lambda wrapper
     // ----------------------------------------------------------------------
     return [=](const std::vector<Value> &args) -> Value
     {
-        debugLog("PluginFunction: invoked with " + std::to_string(args.size()) + " args");
+        DEBUG_LOG("PluginFunction: invoked with " + std::to_string(args.size()) + " args");
 
         // --------------------------------------------------------------
         // 4-a)  Argument marshalling
@@ -2424,61 +3798,69 @@ BuiltinFn wrapPluginFunction(void *funcPtr,
             New block: turn an ObjArray into a flat C array (double[])
             ---------------------------------------------------------------- */
             if (pType == "array") {
-                if (holds<std::shared_ptr<ObjArray>>(args[i])) {
-                    auto src = getVal<std::shared_ptr<ObjArray>>(args[i]);
+                if (args[i].isArray()) {
+                    auto src = args[i].asArray();
+
+                    /* a packed Double array already is one: lend its buffer */
+                    if (src->kind == ObjArray::Kind::Double) {
+                        ptrStorage[i] = src->doubles.data();
+                        argValues[i] = &ptrStorage[i];
+                        continue;
+                    }
 
-                    /* build a temporary buffer */
-                    size_t n = src->elements.size();
+                    /* otherwise build a temporary buffer */
+                    size_t n = src->size();
                     double *buf = new double[n];              // ➋ allocate
                     for (size_t k = 0; k < n; ++k) {
-                        const Value &v = src->elements[k];
-                        buf[k] =  holds<double>(v) ? getVal<double>(v)
-                                : holds<int>(v)    ? (double)getVal<int>(v)
+                        Value v = src->get(k);
+                        buf[k] =  v.isDouble() ? v.asDouble()
+                                : v.isInt()    ? (double)v.asInt()
                                 : /* otherwise */    0.0;
                     }
                     heapAlloc.push_back(buf);                 // ➌ remember to free
-                    argValues[i] = buf;
+                    ptrStorage[i] = buf;
+                    argValues[i] = &ptrStorage[i];            // ffi wants the address of the pointer
                     continue;                                 // ➍ done with this arg
                 }
 
                 // /* fall-back for the old pointer/int behaviour */
-                // if (holds<void*>(args[i]))
-                //     argValues[i] = &getVal<void*>(args[i]);
-                // else if (holds<int>(args[i])) {
-                //     intStorage[i] = getVal<int>(args[i]);
+                // if (args[i].isPointer())
+                //     argValues[i] = &args[i].asPointer();
+                // else if (args[i].isInt()) {
+                //     intStorage[i] = args[i].asInt();
                 //     argValues[i] = &intStorage[i];
                 // } else
                 //     runtimeError("Plugin expects an array pointer.");
                 // continue;
             }else if (pType == "string")
             {
-                if (!holds<std::string>(args[i]))
+                if (!args[i].isString())
                     runtimeError("Plugin expects string @" + std::to_string(i));
-                strStorage[i] = strdup(getVal<std::string>(args[i]).c_str());
+                strStorage[i] = strdup(args[i].asString().c_str());
                 argValues[i] = &strStorage[i];
             }
             else if (pType == "double" || pType == "number")
             {
-                dblStorage[i] = holds<double>(args[i]) ? getVal<double>(args[i])
-                                                       : (double)getVal<int>(args[i]);
+                dblStorage[i] = args[i].isDouble() ? args[i].asDouble()
+                                                       : (double)args[i].asInt();
                 argValues[i] = &dblStorage[i];
             }
             else if (pType == "integer" || pType == "int")
             {
-                intStorage[i] = holds<int>(args[i]) ? getVal<int>(args[i])
-                                                    : (int)getVal<double>(args[i]);
+                intStorage[i] = args[i].isInt() ? args[i].asInt()
+                                                    : (int)args[i].asDouble();
                 argValues[i] = &intStorage[i];
             }
             else if (pType == "boolean" || pType == "bool")
             {
-                boolStorage[i] = holds<bool>(args[i]) ? getVal<bool>(args[i]) : false;
+                boolStorage[i] = args[i].isBool() ? args[i].asBool() : false;
                 argValues[i] = &boolStorage[i];
             }
             else if (pType == "color")
             {
-                if (!holds<Color>(args[i]))
+                if (!args[i].isColor())
                     runtimeError("Plugin expects Color @" + std::to_string(i));
-                uintStorage[i] = getVal<Color>(args[i]).value;
+                uintStorage[i] = args[i].asColor().value;
                 argValues[i] = &uintStorage[i];
             }
             else if (pType == "variant")
@@ -2488,11 +3870,11 @@ BuiltinFn wrapPluginFunction(void *funcPtr,
             }
             else if (pType == "pointer" || pType == "ptr") // || pType == "array")
             {
-                if (holds<void *>(args[i]))
-                    ptrStorage[i] = getVal<void *>(args[i]);
-                else if (holds<int>(args[i]))
+                if (args[i].isPointer())
+                    ptrStorage[i] = args[i].asPointer();
+                else if (args[i].isInt())
                     ptrStorage[i] =
-                        reinterpret_cast<void *>((intptr_t)getVal<int>(args[i]));
+                        reinterpret_cast<void *>((intptr_t)args[i].asInt());
                 else
                     runtimeError("Plugin expects pointer/int @" + std::to_string(i));
                 argValues[i] = &ptrStorage[i];
@@ -2500,11 +3882,11 @@ BuiltinFn wrapPluginFunction(void *funcPtr,
             else
             {
                 // treat anything else as an integer handle
-                intStorage[i] = holds<int>(args[i]) ? getVal<int>(args[i]) : 0;
+                intStorage[i] = args[i].isInt() ? args[i].asInt() : 0;
                 argValues[i] = &intStorage[i];
             }
 
-            debugLog("  marshalled arg[" + std::to_string(i) + "] type=" + pType);
+            DEBUG_LOG("  marshalled arg[" + std::to_string(i) + "] type=" + pType);
         }
 
         // --------------------------------------------------------------
@@ -2522,7 +3904,7 @@ BuiltinFn wrapPluginFunction(void *funcPtr,
         } result{};
 
         ffi_call(cif, FFI_FN(funcPtr), &result, argValues);
-        debugLog("  ffi_call complete");
+        DEBUG_LOG("  ffi_call complete");
 
         /* -----------------------------------------
         free any buffers we created for arrays
@@ -2548,22 +3930,20 @@ BuiltinFn wrapPluginFunction(void *funcPtr,
         // --------------------------------------------------------------
         if (isCustomClass)
         {
-            debugLog("  converting return-value as plugin class '" + retTypeString + "'");
+            DEBUG_LOG("  converting return-value as plugin class '" + retTypeString + "'");
             int handle = result.i;
 
             Value clsVal = globalVM->environment->get(toLower(retTypeString));
-            if (!holds<std::shared_ptr<ObjClass>>(clsVal))
+            if (!clsVal.isClass())
                 runtimeError("Plugin class '" + retTypeString + "' not found");
 
-            auto cls = getVal<std::shared_ptr<ObjClass>>(clsVal);
+            auto cls = clsVal.asClass();
             auto inst = std::make_shared<ObjInstance>();
             inst->klass = cls;
             inst->pluginInstance = reinterpret_cast<void *>((intptr_t)handle);
+            inst->initFields();
 
-            for (auto &p : cls->properties)
-                inst->fields[p.first] = p.second;
-
-            debugLog("  returning new instance handle=" + std::to_string(handle));
+            DEBUG_LOG("  returning new instance handle=" + std::to_string(handle));
             return Value(inst);
         }
 
@@ -2613,7 +3993,7 @@ BuiltinFn wrapPluginFunctionForDeclare(const std::vector<Param>& params, const s
 #ifdef _WIN32
     libHandle = LoadLibraryA(libName.c_str());
     if (!libHandle) {
-        debugLog("Error loading library: " + libName);
+        DEBUG_LOG("Error loading library: " + libName);
         exit(1);
     }
     void* funcPtr = reinterpret_cast<void*>(GetProcAddress((HMODULE)libHandle, apiName.c_str()));
@@ -2707,9 +4087,10 @@ std::string getExecutableDir() {
 void processPluginLibrary(const std::string& libPath, VM& vm) {
     LIB_HANDLE libHandle = LOAD_LIBRARY(libPath);
     if (!libHandle) {
-        debugLog("Failed to load library: " + libPath);
+        DEBUG_LOG("Failed to load library: " + libPath);
         return;
     }
+    vm.plugins.push_back(libPath);
 
     // Try to load function-based plugins.
     GetPluginEntriesFunc getEntries = (GetPluginEntriesFunc)GET_PROC_ADDRESS(libHandle, "GetPluginEntries");
@@ -2721,7 +4102,7 @@ void processPluginLibrary(const std::string& libPath, VM& vm) {
             BuiltinFn fn = wrapPluginFunction(entry.funcPtr, entry.arity, entry.paramTypes, entry.returnType);
             std::string funcName = toLower(entry.name);
             vm.environment->define(funcName, fn);
-            debugLog("Loaded plugin function: " + std::string(entry.name) +
+            DEBUG_LOG("Loaded plugin function: " + std::string(entry.name) +
                      " with arity " + std::to_string(entry.arity) + " from " + libPath);
         }
     } else {
@@ -2775,19 +4156,19 @@ void processPluginLibrary(const std::string& libPath, VM& vm) {
             }
             // Define the plugin class in the environment.
             vm.environment->define(toLower(pluginClass->name), Value(pluginClass));
-            debugLog("Loaded plugin class: " + pluginClass->name + " from " + libPath);
+            DEBUG_LOG("Loaded plugin class: " + pluginClass->name + " from " + libPath);
 
             // Also register the event callback registration function.
             std::string setEventCallbackKey = toLower(pluginClass->name) + "_seteventcallback";
             auto methodIt = pluginClass->methods.find(setEventCallbackKey);
             if (methodIt != pluginClass->methods.end()) {
                 vm.environment->define(setEventCallbackKey, methodIt->second);
-                debugLog("Registered event callback setter as global: " + setEventCallbackKey);
+                DEBUG_LOG("Registered event callback setter as global: " + setEventCallbackKey);
             } else {
-                debugLog("Warning: Event callback setter " + setEventCallbackKey + " not found in class methods.");
+                DEBUG_LOG("Warning: Event callback setter " + setEventCallbackKey + " not found in class methods.");
             }
         } else {
-            debugLog("Library " + libPath + " does not export GetPluginEntries or GetClassDefinition.");
+            DEBUG_LOG("Library " + libPath + " does not export GetPluginEntries or GetClassDefinition.");
         }
     }
 }
@@ -2809,12 +4190,12 @@ void loadPlugins(VM& vm) {
         } while (FindNextFileA(hFind, &findData));
         FindClose(hFind);
     } else {
-        debugLog("No plugins found in " + libsDir);
+        DEBUG_LOG("No plugins found in " + libsDir);
     }
 #else
     DIR* dir = opendir(libsDir.c_str());
     if (!dir) {
-        debugLog("Failed to open libs directory: " + libsDir);
+        DEBUG_LOG("Failed to open libs directory: " + libsDir);
         return;
     }
     struct dirent* entry;
@@ -2835,6 +4216,69 @@ void loadPlugins(VM& vm) {
 }
 
 
+void optimizeBytecode(VM& vm, ObjFunction::CodeChunk& chunk, int selfSlot,
+                      const std::unordered_set<std::string>& userNames);
+void specializeTypes(ObjFunction& fn);
+bool inlineCalls(VM& vm, ObjFunction& caller);
+
+// ----------------------------------------------------------------------------
+// Helper: the VM.extensionMethods entry of an extension method. Calls insert
+// the receiver as the first argument.
+// ----------------------------------------------------------------------------
+BuiltinFn makeExtensionMethod(const Value& fnVal) {
+    return [fnVal](const std::vector<Value>& args) -> Value {
+        /* args[0] is the receiver, args[1…] are the regular parameters */
+
+        // dispatching host built-ins is unchanged
+        if (fnVal.isBuiltin())
+            return fnVal.asBuiltin()(args);
+
+        /* scripted function */
+        auto fn = fnVal.asFunction();
+
+        size_t total    = fn->params.size();
+        size_t required = fn->arity;
+
+        if (args.size() - 1 < required || args.size() - 1 > total)
+            runtimeError("Extension " + fn->name + " expects between " +
+                        std::to_string(required) + " and " + std::to_string(total) +
+                        " argument(s) after the receiver.");
+
+        VM temp;
+        temp.globals     = globalVM ? globalVM->globals : std::make_shared<Environment>();
+        temp.environment = temp.globals;
+
+        /* 1. bind the declared parameters to their frame slots */
+        std::vector<Value> params(args.begin() + 1, args.end());
+        size_t base = pushFrame(temp, *fn, params);
+
+        /* 2. bind the receiver (“a” in the user’s code); the compiler
+              gives it the slot right after the parameters */
+        temp.stack[base + fn->params.size()] = args[0];
+
+        return runVM(temp, fn->chunk, base);
+    };
+}
+
+// What compiling a program leaves outside its bytecode: the global names it
+// defined while compiling (functions, modules, declares), the Declare
+// statements behind API functions and the extension methods. Bytecode
+// images replay these.
+struct CompileRecord {
+    struct Declare {
+        std::shared_ptr<DeclareStmt> stmt;
+        Value function;
+    };
+    struct Extension {
+        std::string type;
+        std::string name;
+        Value function;
+    };
+    std::vector<std::string> globals;
+    std::vector<Declare> declares;
+    std::vector<Extension> extensions;
+};
+
 // ============================================================================  
 // Compiler
 // ============================================================================
@@ -2842,20 +4286,39 @@ class Compiler {
 public:
     Compiler(VM& virtualMachine) : vm(virtualMachine), compilingModule(false) {}
     void compile(const std::vector<std::shared_ptr<Stmt>>& stmts) {
+        noteLabelDepths(stmts, 0);
+        noteAssignsMethods(stmts);
         for (auto stmt : stmts) {
             compileStmt(stmt, vm.mainChunk);
-            debugLog("Compiler: Compiled a statement. Main chunk now has " +
-                std::to_string(vm.mainChunk.code.size()) + " instructions.");
+            DEBUG_LOG("Compiler: Compiled a statement. Main chunk now has " +
+                std::to_string(vm.mainChunk.code.size()) + " bytes of code.");
         }
+        // Every chunk ends in OP_RETURN, so the VM never bounds-checks ip.
+        emit(vm.mainChunk, OP_NIL);
+        emit(vm.mainChunk, OP_RETURN);
         // patch unresolved gotos in main chunk
         for (auto& f : gotoFixups) {
             if (labelTable.find(f.label) == labelTable.end())
                 runtimeError("Undefined label: " + f.label);
-            vm.mainChunk.code[f.patchIndex] = labelTable[f.label];
+            writeJumpTarget(vm.mainChunk.code, f.patchIndex, labelTable[f.label]);
         }
         labelTable.clear();
         gotoFixups.clear();
+        labelForDepth.clear();
+        // Optimize once the whole program is known, so pure built-ins are
+        // only folded when no script code redefines their names.
+        if (OPT_LEVEL > 0) {
+            for (auto& function : compiledFunctions)
+                optimizeBytecode(vm, function->chunk, function->selfSlot, userNames);
+            for (auto& function : compiledFunctions)
+                if (inlineCalls(vm, *function))
+                    optimizeBytecode(vm, function->chunk, function->selfSlot, userNames);
+            for (auto& function : compiledFunctions)
+                specializeTypes(*function);
+            optimizeBytecode(vm, vm.mainChunk, -1, userNames);
+        }
     }
+    const CompileRecord& compileRecord() const { return record; }
 private:
     VM& vm;
     bool compilingModule; // Flag indicating if compiling a module
@@ -2866,19 +4329,331 @@ private:
     struct Fixup { std::string label; int patchIndex; };
     std::unordered_map<std::string,int> labelTable;
     std::vector<Fixup> gotoFixups;
+    // For loops around the statement being compiled, and around each label
+    // of the current chunk; a Goto drops the end values and steps of the
+    // loops it leaves.
+    int forDepth = 0;
+    std::unordered_map<std::string,int> labelForDepth;
+    int selectDepth = 0;   // compare-chain Selects around the statement (see compileSelect)
     //
 
-    void emit(ObjFunction::CodeChunk& chunk, int byte) {
-        chunk.code.push_back(byte);
+    void noteLabelDepths(const std::vector<std::shared_ptr<Stmt>>& body, int depth) {
+        for (auto& stmt : body) {
+            switch (stmt->kind) {
+            case StmtType::LABEL:
+                labelForDepth[std::static_pointer_cast<LabelStmt>(stmt)->name] = depth;
+                break;
+            case StmtType::IF:
+                noteLabelDepths(std::static_pointer_cast<IfStmt>(stmt)->thenBranch, depth);
+                noteLabelDepths(std::static_pointer_cast<IfStmt>(stmt)->elseBranch, depth);
+                break;
+            case StmtType::WHILE:
+                noteLabelDepths(std::static_pointer_cast<WhileStmt>(stmt)->body, depth);
+                break;
+            case StmtType::BLOCK:
+                noteLabelDepths(std::static_pointer_cast<BlockStmt>(stmt)->statements, depth);
+                break;
+            case StmtType::FOR:
+                noteLabelDepths(std::static_pointer_cast<ForStmt>(stmt)->body, depth + 1);
+                break;
+            case StmtType::SELECT: {
+                auto select = std::static_pointer_cast<SelectStmt>(stmt);
+                for (auto& c : select->cases)
+                    noteLabelDepths(c.body, depth);
+                noteLabelDepths(select->elseBranch, depth);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    // Methods whose last parameter is declared Assigns, by lowercase name, and
+    // the built-in Dictionary.Value. As a statement, obj.Method(args) = x on one
+    // of these calls obj.Method(args, x); on any other method it compares.
+    std::unordered_set<std::string> assignsMethods{ "value" };
+
+    void noteAssignsMethods(const std::vector<std::shared_ptr<Stmt>>& body) {
+        auto note = [this](const FunctionStmt& function) {
+            if (!function.params.empty() && function.params.back().isAssigns)
+                assignsMethods.insert(toLower(function.name));
+        };
+        for (auto& stmt : body) {
+            switch (stmt->kind) {
+            case StmtType::FUNCTION:
+                note(*std::static_pointer_cast<FunctionStmt>(stmt));
+                break;
+            case StmtType::CLASS:
+                for (auto& method : std::static_pointer_cast<ClassStmt>(stmt)->methods)
+                    note(*method);
+                break;
+            case StmtType::MODULE:
+                noteAssignsMethods(std::static_pointer_cast<ModuleStmt>(stmt)->body);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // Frame slots of the function being compiled (parameters, then Dim/Var/For
+    // locals in declaration order). Not active for top-level or module code.
+    bool compilingFunction = false;
+    std::unordered_map<std::string, int> currentLocals;
+    // Value::Type of the frame slots declared As Integer, Double, Boolean or
+    // String, which stores into them are guarded with.
+    std::unordered_map<int, int> currentLocalTypes;
+    // Declared properties of the class whose methods are being compiled.
+    std::unordered_set<std::string> currentClassProperties;
+    // Globals declared `As String`.
+    std::unordered_set<std::string> stringGlobals;
+
+    // Every function compiled so far, and every name the script declares or
+    // assigns (variables, functions, classes, properties, declares, ...).
+    std::vector<std::shared_ptr<ObjFunction>> compiledFunctions;
+    std::unordered_set<std::string> userNames;
+    CompileRecord record;
+
+    void noteUserName(const std::string& name) {
+        userNames.insert(toLower(name));
+    }
+
+    // Define a name while compiling; definitions in the global scope are
+    // recorded for bytecode images.
+    void defineNow(const std::string& name, const Value& value) {
+        vm.environment->define(name, value);
+        std::string key = toLower(name);
+        if (vm.environment == vm.globals &&
+            std::find(record.globals.begin(), record.globals.end(), key) == record.globals.end())
+            record.globals.push_back(key);
+    }
+
+    int resolveLocal(const std::string& name) {
+        if (!compilingFunction) return -1;
+        auto it = currentLocals.find(toLower(name));
+        return it == currentLocals.end() ? -1 : it->second;
+    }
+
+    int declareLocal(const std::string& name) {
+        std::string key = toLower(name);
+        auto it = currentLocals.find(key);
+        if (it != currentLocals.end()) return it->second;
+        int slot = (int)currentLocals.size();
+        currentLocals[key] = slot;
+        return slot;
+    }
+
+    // The Value::Type an `As` clause pins a local to, or -1 where the VM
+    // checks nothing (Variant, classes, arrays, ...).
+    static int declaredType(const std::string& type) {
+        if (type == "integer") return (int)Value::Type::Int;
+        if (type == "double") return (int)Value::Type::Double;
+        if (type == "boolean") return (int)Value::Type::Bool;
+        if (type == "string") return (int)Value::Type::String;
+        return -1;
+    }
+
+    // The packed storage for an array whose elements are declared `As type`.
+    static ObjArray::Kind arrayKind(const std::string& type) {
+        if (type == "integer") return ObjArray::Kind::Int;
+        if (type == "double") return ObjArray::Kind::Double;
+        if (type == "boolean") return ObjArray::Kind::Bool;
+        if (type == "string") return ObjArray::Kind::String;
+        return ObjArray::Kind::Any;
+    }
+
+    // Whether evaluating expr could read or assign the variable `key`. With
+    // viaCalls, anything that may run script code (calls, properties, New)
+    // counts as well, for globals that script code elsewhere can see.
+    static bool mayTouch(const std::shared_ptr<Expr>& expr, const std::string& key, bool viaCalls) {
+        if (!expr) return false;
+        switch (expr->kind) {
+        case ExprType::LITERAL:
+            return false;
+        case ExprType::VARIABLE:
+            return toLower(std::static_pointer_cast<VariableExpr>(expr)->name) == key;
+        case ExprType::UNARY:
+            return mayTouch(std::static_pointer_cast<UnaryExpr>(expr)->right, key, viaCalls);
+        case ExprType::ASSIGNMENT: {
+            auto assign = std::static_pointer_cast<AssignmentExpr>(expr);
+            return toLower(assign->name) == key || mayTouch(assign->value, key, viaCalls);
+        }
+        case ExprType::BINARY: {
+            auto bin = std::static_pointer_cast<BinaryExpr>(expr);
+            return mayTouch(bin->left, key, viaCalls) || mayTouch(bin->right, key, viaCalls);
+        }
+        case ExprType::GROUPING:
+            return mayTouch(std::static_pointer_cast<GroupingExpr>(expr)->expression, key, viaCalls);
+        case ExprType::ARRAY_LITERAL:
+            for (auto& element : std::static_pointer_cast<ArrayLiteralExpr>(expr)->elements)
+                if (mayTouch(element, key, viaCalls)) return true;
+            return false;
+        case ExprType::CALL: {
+            if (viaCalls) return true;
+            auto call = std::static_pointer_cast<CallExpr>(expr);
+            if (mayTouch(call->callee, key, viaCalls)) return true;
+            for (auto& arg : call->arguments)
+                if (mayTouch(arg, key, viaCalls)) return true;
+            return false;
+        }
+        case ExprType::GET_PROP:
+            return viaCalls || mayTouch(std::static_pointer_cast<GetPropExpr>(expr)->object, key, viaCalls);
+        case ExprType::SET_PROP: {
+            auto set = std::static_pointer_cast<SetPropExpr>(expr);
+            return viaCalls || mayTouch(set->object, key, viaCalls) || mayTouch(set->value, key, viaCalls);
+        }
+        case ExprType::NEW: {
+            if (viaCalls) return true;
+            for (auto& arg : std::static_pointer_cast<NewExpr>(expr)->arguments)
+                if (mayTouch(arg, key, viaCalls)) return true;
+            return false;
+        }
+        }
+        return true;
+    }
+
+    // `x = x + a + b ...` building a string: the outermost addition of the
+    // chain whose leftmost operand is x, or nullptr. Such an assignment takes
+    // x's value out of the variable before adding to it, so the string is
+    // referred to only from the stack and appendString() extends it in place
+    // (see compileSelfAppend). Nothing on the right may read x, and for a
+    // global (slot < 0) nothing there may run script code, which could.
+    std::shared_ptr<BinaryExpr> selfAppend(const std::string& name, const std::shared_ptr<Expr>& value, int slot) {
+        std::string key = toLower(name);
+        auto add = nodeAs<BinaryExpr>(value);
+        if (!add || add->op != BinaryOp::ADD) return nullptr;
+        bool stringPiece = false;
+        std::shared_ptr<BinaryExpr> link = add;
+        for (;;) {
+            if (mayTouch(link->right, key, slot < 0)) return nullptr;
+            if (auto lit = nodeAs<LiteralExpr>(link->right))
+                stringPiece = stringPiece || lit->value.isString();
+            auto left = nodeAs<BinaryExpr>(link->left);
+            if (!left || left->op != BinaryOp::ADD) break;
+            link = left;
+        }
+        auto first = nodeAs<VariableExpr>(link->left);
+        if (!first || toLower(first->name) != key) return nullptr;
+        // Only where the result is a string, so numeric updates keep their
+        // plain instructions.
+        if (slot >= 0) {
+            auto declared = currentLocalTypes.find(slot);
+            if (declared != currentLocalTypes.end())
+                return declared->second == (int)Value::Type::String ? add : nullptr;
+            return stringPiece ? add : nullptr;
+        }
+        return stringPiece || stringGlobals.count(key) ? add : nullptr;
+    }
+
+    // The chain of additions, with `take` emitted right after x is read.
+    template <typename Take>
+    void compileSelfAppend(const std::shared_ptr<BinaryExpr>& add, ObjFunction::CodeChunk& chunk, Take take) {
+        if (auto left = nodeAs<BinaryExpr>(add->left); left && left->op == BinaryOp::ADD)
+            compileSelfAppend(left, chunk, take);
+        else {
+            compileExpr(add->left, chunk);
+            take();
+        }
+        compileExpr(add->right, chunk);
+        emit(chunk, OP_ADD);
+    }
+
+    // SET_LOCAL of the value on the stack, guarded when the slot has a
+    // declared type. The guard turns an Integer stored in a Double into a
+    // Double; the type specializer relies on it for the rest.
+    void emitSetLocal(ObjFunction::CodeChunk& chunk, int slot) {
+        auto declared = currentLocalTypes.find(slot);
+        if (declared != currentLocalTypes.end())
+            emitWithOperand(chunk, OP_GUARD, declared->second | GUARD_GENERIC);
+        emitWithOperand(chunk, OP_SET_LOCAL, slot);
+    }
+
+    void emit(ObjFunction::CodeChunk& chunk, int opcode) {
+        chunk.code.push_back(static_cast<uint8_t>(opcode));
+    }
+
+    void emitOperand(ObjFunction::CodeChunk& chunk, int operand) {
+        writeOperand(chunk.code, operand);
     }
 
     void emitWithOperand(ObjFunction::CodeChunk& chunk, int opcode, int operand) {
         emit(chunk, opcode);
-        emit(chunk, operand);
+        emitOperand(chunk, operand);
+    }
+
+    // Reserve a jump target field and return its position for patchJump.
+    int emitJumpTarget(ObjFunction::CodeChunk& chunk) {
+        int at = (int)chunk.code.size();
+        chunk.code.resize(at + JUMP_TARGET_SIZE);
+        return at;
+    }
+
+    int emitJump(ObjFunction::CodeChunk& chunk, int opcode) {
+        emit(chunk, opcode);
+        return emitJumpTarget(chunk);
+    }
+
+    void patchJump(ObjFunction::CodeChunk& chunk, int at, int target) {
+        writeJumpTarget(chunk.code, at, target);
+    }
+
+    // OP_GET_GLOBAL / OP_SET_GLOBAL carry the name (for scoped lookups and
+    // errors) and the interned slot of the global table.
+    void emitGlobal(ObjFunction::CodeChunk& chunk, int opcode, const std::string& name) {
+        std::string key = toLower(name);
+        emitWithOperand(chunk, opcode, addConstantString(chunk, key));
+        emitOperand(chunk, vm.globals->intern(key));
+    }
+
+    // OP_GET_PROPERTY / OP_SET_PROPERTY carry the property name and the index
+    // of the site's inline cache.
+    void emitProperty(ObjFunction::CodeChunk& chunk, int opcode, const std::string& name) {
+        emitWithOperand(chunk, opcode, addConstantString(chunk, toLower(name)));
+        emitOperand(chunk, (int)chunk.caches.size());
+        chunk.caches.emplace_back();
+    }
+
+    // Compile a branch condition followed by a jump taken when it is false and
+    // return the index of the jump target to patch. Ordering comparisons use
+    // the fused OP_COMPARE_JUMP.
+    int emitConditionJump(std::shared_ptr<Expr> condition, ObjFunction::CodeChunk& chunk) {
+        auto bin = nodeAs<BinaryExpr>(condition);
+        int compareOp = -1;
+        if (bin) {
+            switch (bin->op) {
+            case BinaryOp::LT: compareOp = OP_LT; break;
+            case BinaryOp::LE: compareOp = OP_LE; break;
+            case BinaryOp::GT: compareOp = OP_GT; break;
+            case BinaryOp::GE: compareOp = OP_GE; break;
+            default: break;
+            }
+        }
+        if (compareOp < 0) {
+            compileExpr(condition, chunk);
+            return emitJump(chunk, OP_JUMP_IF_FALSE);
+        }
+        compileExpr(bin->left, chunk);
+        compileExpr(bin->right, chunk);
+        emitWithOperand(chunk, OP_COMPARE_JUMP, compareOp);
+        return emitJumpTarget(chunk);
+    }
+
+    // Frame slot of Self when `name` is a declared property of the class whose
+    // method is being compiled and no local shadows it, otherwise -1. Such
+    // names read and write Self's fields through cached property accesses.
+    int resolveSelfProperty(const std::string& name) {
+        if (!compilingFunction || currentClassProperties.empty() || resolveLocal(name) >= 0)
+            return -1;
+        if (!currentClassProperties.count(toLower(name)))
+            return -1;
+        return resolveLocal("self");
     }
 
-    void compileStmt(std::shared_ptr<Stmt> stmt, ObjFunction::CodeChunk& chunk) {
-        if (auto modStmt = std::dynamic_pointer_cast<ModuleStmt>(stmt)) {
+    void compileStmt(const std::shared_ptr<Stmt>& stmt, ObjFunction::CodeChunk& chunk) {
+        switch (stmt->kind) {
+        case StmtType::MODULE: {
+            auto modStmt = std::static_pointer_cast<ModuleStmt>(stmt);
             auto previousEnv = vm.environment;
             auto moduleEnv = std::make_shared<Environment>(previousEnv);
             vm.environment = moduleEnv;
@@ -2886,6 +4661,7 @@ private:
             compilingModule = true;
             currentModuleName = toLower(modStmt->name);
             currentModulePublicMembers.clear();
+            noteUserName(modStmt->name);
             for (auto s : modStmt->body)
                 compileStmt(s, chunk);
             auto moduleObj = std::make_shared<ObjModule>();
@@ -2893,25 +4669,38 @@ private:
             moduleObj->publicMembers = currentModulePublicMembers;
             vm.environment = previousEnv;
             compilingModule = oldCompilingModule;
-            vm.environment->define(toLower(currentModuleName), Value(moduleObj));
+            defineNow(toLower(currentModuleName), Value(moduleObj));
             for (auto& entry : currentModulePublicMembers) {
-                vm.environment->define(entry.first, entry.second);
+                defineNow(entry.first, entry.second);
             }
             return;
         }
-        // AFTER – add inside compileStmt switch chain
-        else if (auto label = std::dynamic_pointer_cast<LabelStmt>(stmt)) {
+        case StmtType::LABEL: {
+            auto label = std::static_pointer_cast<LabelStmt>(stmt);
             labelTable[label->name] = chunk.code.size();
+            break;
         }
-        else if (auto gs = std::dynamic_pointer_cast<GotoStmt>(stmt)) {
-            int pos = chunk.code.size();
-            emitWithOperand(chunk, OP_JUMP, 0);           // placeholder
-            gotoFixups.push_back({ gs->label, pos + 1 }); // operand cell to patch
+        case StmtType::GOTO: {
+            auto gs = std::static_pointer_cast<GotoStmt>(stmt);
+            auto depth = labelForDepth.find(gs->label);
+            if (depth != labelForDepth.end())
+                for (int i = depth->second; i < forDepth; i++) {
+                    emit(chunk, OP_POP);   // step
+                    emit(chunk, OP_POP);   // end value
+                }
+            int pos = emitJump(chunk, OP_JUMP);           // placeholder
+            gotoFixups.push_back({ gs->label, pos });     // target field to patch
+            break;
         }
-        else if (auto declStmt = std::dynamic_pointer_cast<DeclareStmt>(stmt)) {
+        case StmtType::DECLARE: {
+            auto declStmt = std::static_pointer_cast<DeclareStmt>(stmt);
+            noteUserName(declStmt->apiName);
             compileDeclare(declStmt, chunk);
+            break;
         }
-        else if (auto enumStmt = std::dynamic_pointer_cast<EnumStmt>(stmt)) {
+        case StmtType::ENUM: {
+            auto enumStmt = std::static_pointer_cast<EnumStmt>(stmt);
+            noteUserName(enumStmt->name);
             auto enumObj = std::make_shared<ObjEnum>();
             enumObj->name = toLower(enumStmt->name);
             enumObj->members = enumStmt->members;
@@ -2923,22 +4712,48 @@ private:
             }
             else {
                 currentModulePublicMembers[toLower(enumStmt->name)] = Value(enumObj);
-                vm.environment->define(toLower(enumStmt->name), Value(enumObj));
+                defineNow(toLower(enumStmt->name), Value(enumObj));
             }
+            break;
         }
-        else if (auto exprStmt = std::dynamic_pointer_cast<ExpressionStmt>(stmt)) {
-            compileExpr(exprStmt->expression, chunk);
+        case StmtType::EXPRESSION: {
+            auto exprStmt = std::static_pointer_cast<ExpressionStmt>(stmt);
+            std::shared_ptr<Expr> expr = exprStmt->expression;
+            // obj.Method(args) = x  ->  obj.Method(args, x), as Xojo's Assigns
+            if (auto bin = nodeAs<BinaryExpr>(expr); bin && bin->op == BinaryOp::EQ) {
+                auto call = nodeAs<CallExpr>(bin->left);
+                auto method = call ? nodeAs<GetPropExpr>(call->callee) : nullptr;
+                if (method && assignsMethods.count(method->name)) {
+                    auto args = call->arguments;
+                    args.push_back(bin->right);
+                    expr = std::make_shared<CallExpr>(call->callee, args);
+                }
+            }
+            compileExpr(expr, chunk);
             emit(chunk, OP_POP);
+            break;
         }
-        else if (auto retStmt = std::dynamic_pointer_cast<ReturnStmt>(stmt)) {
-            if (retStmt->value)
+        case StmtType::RETURN: {
+            auto retStmt = std::static_pointer_cast<ReturnStmt>(stmt);
+            auto call = nodeAs<CallExpr>(retStmt->value);
+            if (call && compilingFunction && TAIL_CALLS && !DEBUG_MODE &&
+                !nodeAs<GetPropExpr>(call->callee)) {
+                // The callee reuses this frame when it is a scripted function;
+                // otherwise OP_TAIL_CALL calls normally and OP_RETURN follows.
+                compileExpr(call->callee, chunk);
+                for (auto& arg : call->arguments)
+                    compileExpr(arg, chunk);
+                emitWithOperand(chunk, OP_TAIL_CALL, (int)call->arguments.size());
+            }
+            else if (retStmt->value)
                 compileExpr(retStmt->value, chunk);
             else
                 emit(chunk, OP_NIL);
             emit(chunk, OP_RETURN);
+            break;
         }
-
-        else if (auto funcStmt = std::dynamic_pointer_cast<FunctionStmt>(stmt)) {
+        case StmtType::FUNCTION: {
+            auto funcStmt = std::static_pointer_cast<FunctionStmt>(stmt);
             //
             // ─── 1) Extension-method registration ───────────────────────────────
             //
@@ -2956,7 +4771,7 @@ private:
                 placeholder->params = funcStmt->params;
 
                 // ② register the placeholder (define, *not* assign)
-                vm.environment->define(
+                defineNow(
                     toLower(funcStmt->name),
                     Value(placeholder)
                 );
@@ -2972,56 +4787,13 @@ private:
 
                 // (b) Grab the compiled function Value
                 Value fnVal = vm.environment->get(toLower(funcStmt->name));
-                // (c) Wrap it so that calls insert the receiver as the first argument
-                std::string extName = funcStmt->name;              // <-- capture the name
-
-                BuiltinFn extWrapper =
-                        [fnVal,
-                        receiverName = funcStmt->extendedParam]   // capture “a” in Extends a As …
-                        (const std::vector<Value>& args) -> Value
-                    {
-                        /* args[0] is the receiver, args[1…] are the regular parameters */
-
-                        // dispatching host built-ins is unchanged
-                        if (holds<BuiltinFn>(fnVal))
-                            return getVal<BuiltinFn>(fnVal)(args);
-
-                        /* scripted function */
-                        auto fn = getVal<std::shared_ptr<ObjFunction>>(fnVal);
-
-                        size_t total    = fn->params.size();
-                        size_t required = fn->arity;
-
-                        if (args.size() - 1 < required || args.size() - 1 > total)
-                            runtimeError("Extension " + fn->name + " expects between " +
-                                        std::to_string(required) + " and " + std::to_string(total) +
-                                        " argument(s) after the receiver.");
-
-                        VM temp;
-                        temp.globals     = std::make_shared<Environment>();
-                        temp.environment = temp.globals;
-
-                        /* 1. bind the receiver (“a” in the user’s code) */
-                        temp.environment->define(receiverName, args[0]);
-
-                        /* 2. bind the declared parameters */
-                        for (size_t i = 0; i < fn->params.size(); ++i) {
-                            Value actual = (i + 1 < args.size())
-                                        ? args[i + 1]
-                                        : fn->params[i].defaultValue;
-                            temp.environment->define(fn->params[i].name, actual);
-                        }
-
-                        return runVM(temp, fn->chunk);
-                    };
-
-
-
-                // (d) Store in VM.registry[type][method]
+                // (c) Store in VM.registry[type][method] a wrapper that
+                //     passes the receiver as the first argument
                 vm.extensionMethods
                 [ funcStmt->extendedType ]              // e.g. "string"
                 [ toLower(funcStmt->name) ]             // e.g. "contains"
-                = Value(extWrapper);
+                = Value(makeExtensionMethod(fnVal));
+                record.extensions.push_back({ funcStmt->extendedType, toLower(funcStmt->name), fnVal });
 
                 // ── NEW: export public extension methods out of the module ──────────
                 if (compilingModule && funcStmt->access == AccessModifier::PUBLIC) {
@@ -3043,7 +4815,7 @@ private:
                 if (!p.optional) req++;
             placeholder->arity  = req;
             placeholder->params = funcStmt->params;
-            vm.environment->define(
+            defineNow(
                 toLower(funcStmt->name),
                 Value(placeholder)
             );
@@ -3071,10 +4843,11 @@ private:
                     = vm.environment->get(toLower(funcStmt->name));
                 }
             }
+            break;
         }
-
-        
-        else if (auto varStmt = std::dynamic_pointer_cast<VarStmt>(stmt)) {
+        case StmtType::VAR: {
+            auto varStmt = std::static_pointer_cast<VarStmt>(stmt);
+            noteUserName(varStmt->name);
             if (varStmt->initializer)
                 compileExpr(varStmt->initializer, chunk);
             else {
@@ -3096,89 +4869,285 @@ private:
                 else
                     compileExpr(std::make_shared<LiteralExpr>(std::monostate{}), chunk);
             }
-            if (!compilingModule) {
+            if (compilingFunction) {
+                int slot = declareLocal(varStmt->name);
+                int type = declaredType(varStmt->varType);
+                if (type >= 0)
+                    currentLocalTypes[slot] = type;
+                emitSetLocal(chunk, slot);
+            }
+            else if (!compilingModule) {
                 int nameConst = addConstantString(chunk, toLower(varStmt->name));
                 emitWithOperand(chunk, OP_DEFINE_GLOBAL, nameConst);
+                if (varStmt->varType == "string")
+                    stringGlobals.insert(toLower(varStmt->name));
             }
             else {
-                if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(varStmt->initializer)) {
+                if (auto lit = nodeAs<LiteralExpr>(varStmt->initializer)) {
                     if (varStmt->access == AccessModifier::PUBLIC) {
                         currentModulePublicMembers[toLower(varStmt->name)] = lit->value;
                     }
-                    vm.environment->define(toLower(varStmt->name), lit->value);
+                    defineNow(toLower(varStmt->name), lit->value);
                 }
             }
+            break;
         }
-        else if (auto classStmt = std::dynamic_pointer_cast<ClassStmt>(stmt)) {
+        case StmtType::CLASS: {
+            auto classStmt = std::static_pointer_cast<ClassStmt>(stmt);
+            noteUserName(classStmt->name);
             int nameConst = addConstantString(chunk, toLower(classStmt->name));
             emitWithOperand(chunk, OP_CLASS, nameConst);
+            auto oldClassProperties = std::move(currentClassProperties);
+            currentClassProperties.clear();
+            for (auto& p : classStmt->properties) {
+                noteUserName(p.first);
+                currentClassProperties.insert(toLower(p.first));
+            }
             for (auto method : classStmt->methods) {
-                compileFunction(method);
+                compileFunction(method, true);
                 int fnConst = addConstant(chunk, Value(lastFunction));
                 emitWithOperand(chunk, OP_CONSTANT, fnConst);
                 int methodNameConst = addConstantString(chunk, toLower(method->name));
                 emitWithOperand(chunk, OP_METHOD, methodNameConst);
             }
+            currentClassProperties = std::move(oldClassProperties);
             if (!classStmt->properties.empty()) {
                 int propConst = addConstant(chunk, Value(classStmt->properties));
                 emitWithOperand(chunk, OP_PROPERTIES, propConst);
             }
             int classNameConst = addConstantString(chunk, toLower(classStmt->name));
             emitWithOperand(chunk, OP_DEFINE_GLOBAL, classNameConst);
+            break;
         }
-        else if (auto propAssign = std::dynamic_pointer_cast<PropertyAssignmentStmt>(stmt)) {
+        case StmtType::PROPERTY_ASSIGNMENT: {
+            auto propAssign = std::static_pointer_cast<PropertyAssignmentStmt>(stmt);
+            noteUserName(propAssign->property);
             compileExpr(propAssign->object, chunk);
             compileExpr(propAssign->value, chunk);
-            int propConst = addConstantString(chunk, toLower(propAssign->property));
-            emitWithOperand(chunk, OP_SET_PROPERTY, propConst);
+            emitProperty(chunk, OP_SET_PROPERTY, propAssign->property);
             emit(chunk, OP_POP);
+            break;
         }
-        else if (auto assignStmt = std::dynamic_pointer_cast<AssignmentStmt>(stmt)) {
-            compileExpr(std::make_shared<VariableExpr>(assignStmt->name), chunk);
+        case StmtType::ASSIGNMENT: {
+            auto assignStmt = std::static_pointer_cast<AssignmentStmt>(stmt);
+            noteUserName(assignStmt->name);
+            int slot = resolveLocal(assignStmt->name);
+            if (slot >= 0) {
+                if (auto add = selfAppend(assignStmt->name, assignStmt->value, slot))
+                    compileSelfAppend(add, chunk, [&] {
+                        emit(chunk, OP_NIL);
+                        emitWithOperand(chunk, OP_SET_LOCAL, slot);
+                    });
+                else
+                    compileExpr(assignStmt->value, chunk);
+                emitSetLocal(chunk, slot);
+                return;
+            }
+            int selfSlot = resolveSelfProperty(assignStmt->name);
+            if (selfSlot >= 0) {
+                emitWithOperand(chunk, OP_GET_LOCAL, selfSlot);
+                compileExpr(assignStmt->value, chunk);
+                emitProperty(chunk, OP_SET_PROPERTY, assignStmt->name);
+                emit(chunk, OP_POP);
+                return;
+            }
+            if (auto add = selfAppend(assignStmt->name, assignStmt->value, -1)) {
+                compileSelfAppend(add, chunk, [&] {
+                    emit(chunk, OP_NIL);
+                    emitGlobal(chunk, OP_SET_GLOBAL, assignStmt->name);
+                });
+                emitGlobal(chunk, OP_SET_GLOBAL, assignStmt->name);
+                break;
+            }
+            // -O0 keeps the historical read of the old value, which is only
+            // popped again.
+            if (OPT_LEVEL == 0)
+                compileExpr(std::make_shared<VariableExpr>(assignStmt->name), chunk);
             compileExpr(assignStmt->value, chunk);
-            int nameConst = addConstantString(chunk, toLower(assignStmt->name));
-            emitWithOperand(chunk, OP_SET_GLOBAL, nameConst);
-            emit(chunk, OP_POP);   // <— pop the old LHS value off the stack
-        }
-        else if (auto setProp = std::dynamic_pointer_cast<SetPropExpr>(stmt)) {
-            compileExpr(setProp->object, chunk);
-            compileExpr(setProp->value, chunk);
-            int propConst = addConstantString(chunk, toLower(setProp->name));
-            emitWithOperand(chunk, OP_SET_PROPERTY, propConst);
-            emit(chunk, OP_POP);
+            emitGlobal(chunk, OP_SET_GLOBAL, assignStmt->name);
+            if (OPT_LEVEL == 0)
+                emit(chunk, OP_POP);   // <— pop the old LHS value off the stack
+            break;
         }
-        else if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt)) {
-            compileExpr(ifStmt->condition, chunk);
-            int jumpIfFalsePos = chunk.code.size();
-            emitWithOperand(chunk, OP_JUMP_IF_FALSE, 0);
+        case StmtType::IF: {
+            auto ifStmt = std::static_pointer_cast<IfStmt>(stmt);
+            int elseJump = emitConditionJump(ifStmt->condition, chunk);
             for (auto thenStmt : ifStmt->thenBranch)
                 compileStmt(thenStmt, chunk);
-            int jumpPos = chunk.code.size();
-            emitWithOperand(chunk, OP_JUMP, 0);
+            int jumpPos = emitJump(chunk, OP_JUMP);
             int elseStart = chunk.code.size();
-            chunk.code[jumpIfFalsePos + 1] = elseStart;
+            patchJump(chunk, elseJump, elseStart);
             for (auto elseStmt : ifStmt->elseBranch)
                 compileStmt(elseStmt, chunk);
             int endIf = chunk.code.size();
-            chunk.code[jumpPos + 1] = endIf;
+            patchJump(chunk, jumpPos, endIf);
+            break;
         }
-        else if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt)) {
+        case StmtType::WHILE: {
+            auto whileStmt = std::static_pointer_cast<WhileStmt>(stmt);
             int loopStart = chunk.code.size();
-            compileExpr(whileStmt->condition, chunk);
-            int exitJumpPos = chunk.code.size();
-            emitWithOperand(chunk, OP_JUMP_IF_FALSE, 0);
+            int exitJump = emitConditionJump(whileStmt->condition, chunk);
             for (auto bodyStmt : whileStmt->body)
                 compileStmt(bodyStmt, chunk);
-            emitWithOperand(chunk, OP_JUMP, loopStart);
+            patchJump(chunk, emitJump(chunk, OP_JUMP), loopStart);
             int loopEnd = chunk.code.size();
-            chunk.code[exitJumpPos + 1] = loopEnd;
+            patchJump(chunk, exitJump, loopEnd);
+            break;
+        }
+        case StmtType::FOR: {
+            auto forStmt = std::static_pointer_cast<ForStmt>(stmt);
+            // The counter is declared like a Dim. The end value and step are
+            // evaluated once and stay on the stack while the loop runs (a Goto
+            // out of the loop pops them).
+            compileStmt(std::make_shared<VarStmt>(forStmt->varName, forStmt->start), chunk);
+            int flags = forStmt->isDown ? FOR_DOWN : 0;
+            int counter = resolveLocal(forStmt->varName);
+            int counterSlot = 0;
+            if (counter < 0) {
+                std::string key = toLower(forStmt->varName);
+                flags |= FOR_GLOBAL;
+                counter = addConstantString(chunk, key);
+                counterSlot = vm.globals->intern(key);
+            }
+            compileExpr(forStmt->end, chunk);
+            compileExpr(forStmt->step, chunk);
+            int exitJump = emitJump(chunk, OP_FOR_PREP);
+            emitOperand(chunk, flags);
+            emitOperand(chunk, counter);
+            emitOperand(chunk, counterSlot);
+            int loopStart = chunk.code.size();
+            forDepth++;
+            for (auto bodyStmt : forStmt->body)
+                compileStmt(bodyStmt, chunk);
+            forDepth--;
+            patchJump(chunk, emitJump(chunk, OP_FOR_LOOP), loopStart);
+            emitOperand(chunk, flags);
+            emitOperand(chunk, counter);
+            emitOperand(chunk, counterSlot);
+            patchJump(chunk, exitJump, chunk.code.size());
+            emit(chunk, OP_POP);   // step
+            emit(chunk, OP_POP);   // end value
+            break;
         }
-        else if (auto blockStmt = std::dynamic_pointer_cast<BlockStmt>(stmt)) {
+        case StmtType::SELECT: {
+            auto selectStmt = std::static_pointer_cast<SelectStmt>(stmt);
+            compileSelect(selectStmt, chunk);
+            break;
+        }
+        case StmtType::BLOCK: {
+            auto blockStmt = std::static_pointer_cast<BlockStmt>(stmt);
             for (auto s : blockStmt->statements)
                 compileStmt(s, chunk);
+            break;
+        }
         }
     }
 
+    // The key of a Case value usable in a jump table: an Integer or String
+    // literal, or a negated Integer literal.
+    static bool caseKey(std::shared_ptr<Expr> value, Value& key) {
+        bool negate = false;
+        if (auto un = nodeAs<UnaryExpr>(value)) {
+            if (un->op != "-")
+                return false;
+            negate = true;
+            value = un->right;
+        }
+        auto lit = nodeAs<LiteralExpr>(value);
+        if (!lit)
+            return false;
+        if (lit->value.isInt() && !(negate && lit->value.asInt() == INT_MIN))
+            key = negate ? Value(-lit->value.asInt()) : lit->value;
+        else if (lit->value.isString() && !negate)
+            key = lit->value;
+        else
+            return false;
+        return true;
+    }
+
+    // Select Case evaluates its selector once. When every Case value is an
+    // Integer literal, or every one a String literal, OP_SWITCH pops the
+    // selector and jumps through a table of the chunk. Otherwise the selector
+    // is stored in a hidden variable and each Case compares it with OP_EQ.
+    void compileSelect(std::shared_ptr<SelectStmt> select, ObjFunction::CodeChunk& chunk) {
+        std::vector<Value> keys;
+        bool ints = true, strings = true;
+        for (auto& c : select->cases) {
+            Value key;
+            if (!caseKey(c.value, key)) {
+                ints = strings = false;
+                break;
+            }
+            ints = ints && key.isInt();
+            strings = strings && key.isString();
+            keys.push_back(key);
+        }
+        std::vector<int> endJumps;
+        if (!select->cases.empty() && (ints || strings)) {
+            compileExpr(select->selector, chunk);
+            int tableIndex = (int)chunk.switches.size();
+            chunk.switches.emplace_back();
+            emitWithOperand(chunk, OP_SWITCH, tableIndex);
+            int defaultJump = emitJumpTarget(chunk);
+            std::vector<int> starts;
+            for (auto& c : select->cases) {
+                starts.push_back((int)chunk.code.size());
+                for (auto bodyStmt : c.body)
+                    compileStmt(bodyStmt, chunk);
+                endJumps.push_back(emitJump(chunk, OP_JUMP));
+            }
+            patchJump(chunk, defaultJump, (int)chunk.code.size());
+
+            // The first Case with a given value wins, as in the compare chain.
+            ObjFunction::SwitchTable table;
+            if (strings) {
+                for (size_t i = 0; i < keys.size(); i++)
+                    table.strings.emplace(keys[i].asString(), starts[i]);
+            }
+            else {
+                long long low = INT_MAX, high = INT_MIN;
+                for (auto& key : keys) {
+                    low = std::min<long long>(low, key.asInt());
+                    high = std::max<long long>(high, key.asInt());
+                }
+                // Index a vector when at least about half of the range is used.
+                if (high - low < 2 * (long long)keys.size() + 8) {
+                    table.low = (int)low;
+                    table.dense.assign(high - low + 1, -1);
+                    for (size_t i = keys.size(); i-- > 0;)
+                        table.dense[keys[i].asInt() - low] = starts[i];
+                }
+                else {
+                    for (size_t i = 0; i < keys.size(); i++)
+                        table.sparse.emplace(keys[i].asInt(), starts[i]);
+                }
+            }
+            chunk.switches[tableIndex] = std::move(table);
+        }
+        else {
+            // The selector goes to a hidden variable (a local in a function),
+            // so nothing stays on the stack while the Cases run.
+            auto selector = std::make_shared<VariableExpr>(" select" + std::to_string(selectDepth));
+            compileStmt(std::make_shared<VarStmt>(selector->name, select->selector), chunk);
+            selectDepth++;
+            for (auto& c : select->cases) {
+                compileExpr(selector, chunk);
+                compileExpr(c.value, chunk);
+                emit(chunk, OP_EQ);
+                int nextCase = emitJump(chunk, OP_JUMP_IF_FALSE);
+                for (auto bodyStmt : c.body)
+                    compileStmt(bodyStmt, chunk);
+                endJumps.push_back(emitJump(chunk, OP_JUMP));
+                patchJump(chunk, nextCase, (int)chunk.code.size());
+            }
+            selectDepth--;
+        }
+        for (auto elseStmt : select->elseBranch)
+            compileStmt(elseStmt, chunk);
+        for (int jump : endJumps)
+            patchJump(chunk, jump, (int)chunk.code.size());
+    }
+
     // compileDeclare for API declarations using libffi
     void compileDeclare(std::shared_ptr<DeclareStmt> declStmt, ObjFunction::CodeChunk& chunk) {
         BuiltinFn apiFunc = wrapPluginFunctionForDeclare(
@@ -3187,7 +5156,9 @@ private:
             declStmt->apiName,
             declStmt->libraryName
         );
-        vm.environment->define(toLower(declStmt->apiName), Value(apiFunc));
+        Value apiValue(apiFunc);
+        record.declares.push_back({ declStmt, apiValue });
+        defineNow(toLower(declStmt->apiName), apiValue);
         if (!compilingModule) {
             int fnConst = addConstant(chunk, vm.environment->get(toLower(declStmt->apiName)));
             emitWithOperand(chunk, OP_CONSTANT, fnConst);
@@ -3199,34 +5170,69 @@ private:
         }
     }
 
-    void compileExpr(std::shared_ptr<Expr> expr, ObjFunction::CodeChunk& chunk) {
-        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr)) {
+    void compileExpr(const std::shared_ptr<Expr>& expr, ObjFunction::CodeChunk& chunk) {
+        switch (expr->kind) {
+        case ExprType::LITERAL: {
+            auto lit = std::static_pointer_cast<LiteralExpr>(expr);
             int constIndex = addConstant(chunk, lit->value);
             emitWithOperand(chunk, OP_CONSTANT, constIndex);
+            break;
         }
-        else if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr)) {
-            int nameConst = addConstantString(chunk, toLower(var->name));
-            emitWithOperand(chunk, OP_GET_GLOBAL, nameConst);
+        case ExprType::VARIABLE: {
+            auto var = std::static_pointer_cast<VariableExpr>(expr);
+            int slot = resolveLocal(var->name);
+            if (slot >= 0) {
+                emitWithOperand(chunk, OP_GET_LOCAL, slot);
+                return;
+            }
+            int selfSlot = resolveSelfProperty(var->name);
+            if (selfSlot >= 0) {
+                emitWithOperand(chunk, OP_GET_LOCAL, selfSlot);
+                emitProperty(chunk, OP_GET_PROPERTY, var->name);
+                return;
+            }
+            emitGlobal(chunk, OP_GET_GLOBAL, var->name);
+            break;
         }
-        else if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr)) {
+        case ExprType::UNARY: {
+            auto un = std::static_pointer_cast<UnaryExpr>(expr);
             compileExpr(un->right, chunk);
             if (un->op == "-")
                 emit(chunk, OP_NEGATE);
+            break;
         }
-        else if (auto assignExpr = std::dynamic_pointer_cast<AssignmentExpr>(expr)) {
+        case ExprType::ASSIGNMENT: {
+            auto assignExpr = std::static_pointer_cast<AssignmentExpr>(expr);
+            noteUserName(assignExpr->name);
             compileExpr(std::make_shared<VariableExpr>(assignExpr->name), chunk);
+            int selfSlot = resolveSelfProperty(assignExpr->name);
+            if (selfSlot >= 0) {
+                emitWithOperand(chunk, OP_GET_LOCAL, selfSlot);
+                compileExpr(assignExpr->value, chunk);
+                emitProperty(chunk, OP_SET_PROPERTY, assignExpr->name);
+                emit(chunk, OP_POP);
+                return;
+            }
             compileExpr(assignExpr->value, chunk);
-            int nameConst = addConstantString(chunk, toLower(assignExpr->name));
-            emitWithOperand(chunk, OP_SET_GLOBAL, nameConst);
+            int slot = resolveLocal(assignExpr->name);
+            if (slot >= 0) {
+                emitSetLocal(chunk, slot);
+                return;
+            }
+            emitGlobal(chunk, OP_SET_GLOBAL, assignExpr->name);
+            break;
         }
-        else if (auto setProp = std::dynamic_pointer_cast<SetPropExpr>(expr)) {
+        case ExprType::SET_PROP: {
+            auto setProp = std::static_pointer_cast<SetPropExpr>(expr);
+            noteUserName(setProp->name);
             compileExpr(setProp->object, chunk);
             compileExpr(setProp->value, chunk);
-            int propConst = addConstantString(chunk, toLower(setProp->name));
-            emitWithOperand(chunk, OP_SET_PROPERTY, propConst);
+            emitProperty(chunk, OP_SET_PROPERTY, setProp->name);
             emit(chunk, OP_POP);   // <— drop the instance that SET_PROPERTY pushed back
+            break;
         }
-        else if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
+        case ExprType::BINARY: {
+            auto bin = std::static_pointer_cast<BinaryExpr>(expr);
             compileExpr(bin->left, chunk);
             compileExpr(bin->right, chunk);
             switch (bin->op) {
@@ -3246,35 +5252,56 @@ private:
             case BinaryOp::MOD: emit(chunk, OP_MOD); break;
             default: break;
             }
+            break;
         }
-        else if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr)) {
+        case ExprType::GROUPING: {
+            auto group = std::static_pointer_cast<GroupingExpr>(expr);
             compileExpr(group->expression, chunk);
+            break;
         }
-        else if (auto call = std::dynamic_pointer_cast<CallExpr>(expr)) {
+        case ExprType::CALL: {
+            auto call = std::static_pointer_cast<CallExpr>(expr);
+            if (auto method = nodeAs<GetPropExpr>(call->callee)) {
+                // Method calls look the method up and call it in one step.
+                compileExpr(method->object, chunk);
+                for (auto arg : call->arguments)
+                    compileExpr(arg, chunk);
+                emitProperty(chunk, OP_INVOKE, method->name);
+                emitOperand(chunk, (int)call->arguments.size());
+                return;
+            }
             compileExpr(call->callee, chunk);
             for (auto arg : call->arguments)
                 compileExpr(arg, chunk);
             emitWithOperand(chunk, OP_CALL, call->arguments.size());
+            break;
         }
-        else if (auto arrLit = std::dynamic_pointer_cast<ArrayLiteralExpr>(expr)) {
+        case ExprType::ARRAY_LITERAL: {
+            auto arrLit = std::static_pointer_cast<ArrayLiteralExpr>(expr);
+            ObjArray::Kind kind = arrayKind(arrLit->elementType);
+            if (arrLit->elements.empty() && kind != ObjArray::Kind::Any) {
+                emitWithOperand(chunk, OP_TYPED_ARRAY, (int)kind);
+                break;
+            }
             for (auto& elem : arrLit->elements)
                 compileExpr(elem, chunk);
             emitWithOperand(chunk, OP_ARRAY, arrLit->elements.size());
+            break;
         }
-        else if (auto getProp = std::dynamic_pointer_cast<GetPropExpr>(expr)) {
+        case ExprType::GET_PROP: {
+            auto getProp = std::static_pointer_cast<GetPropExpr>(expr);
             compileExpr(getProp->object, chunk);
-            int propConst = addConstantString(chunk, toLower(getProp->name));
-            emitWithOperand(chunk, OP_GET_PROPERTY, propConst);
+            emitProperty(chunk, OP_GET_PROPERTY, getProp->name);
+            break;
         }
-        else if (auto newExpr = std::dynamic_pointer_cast<NewExpr>(expr)) {
-            int classConst = addConstantString(chunk, toLower(newExpr->className));
-            emitWithOperand(chunk, OP_GET_GLOBAL, classConst);
+        case ExprType::NEW: {
+            auto newExpr = std::static_pointer_cast<NewExpr>(expr);
+            emitGlobal(chunk, OP_GET_GLOBAL, newExpr->className);
             emit(chunk, OP_NEW);
         
             /* -------- constructor dispatch -------- */
             emit(chunk, OP_DUP);                       // instance
-            int consName = addConstantString(chunk, "constructor");
-            emitWithOperand(chunk, OP_GET_PROPERTY, consName);   // push constructor (or nil)
+            emitProperty(chunk, OP_GET_PROPERTY, "constructor");   // push constructor (or nil)
         
             /* NEW: push each argument */
             for (auto &arg : newExpr->arguments)
@@ -3282,226 +5309,4176 @@ private:
         
             emitWithOperand(chunk, OP_OPTIONAL_CALL, (int)newExpr->arguments.size());
             emit(chunk, OP_CONSTRUCTOR_END);
+            break;
+        }
         }
-        
     }
 
     std::shared_ptr<ObjFunction> lastFunction;
 
-    void compileFunction(std::shared_ptr<FunctionStmt> funcStmt) {
+    void compileFunction(std::shared_ptr<FunctionStmt> funcStmt, bool isMethod = false) {
         auto function = std::make_shared<ObjFunction>();
         function->name = funcStmt->name;
+        noteUserName(funcStmt->name);
+        for (auto& p : funcStmt->params)
+            noteUserName(p.name);
         int req = 0;
         for (auto& p : funcStmt->params)
             if (!p.optional) req++;
         function->arity = req;
         function->params = funcStmt->params;
         ObjFunction::CodeChunk fnChunk;
+        // Labels are per chunk: those of the code around the function wait.
+        auto oldLabelTable = std::move(labelTable);
+        auto oldGotoFixups = std::move(gotoFixups);
         labelTable.clear();
         gotoFixups.clear();
+        int oldForDepth = forDepth, oldSelectDepth = selectDepth;
+        auto oldLabelForDepth = std::move(labelForDepth);
+        forDepth = selectDepth = 0;
+        labelForDepth.clear();
+        noteLabelDepths(funcStmt->body, 0);
+
+        // Parameters take the first frame slots; an extension receiver or the
+        // Self of a class method follows them.
+        bool oldCompilingFunction = compilingFunction;
+        auto oldLocals = std::move(currentLocals);
+        auto oldLocalTypes = std::move(currentLocalTypes);
+        compilingFunction = true;
+        currentLocals.clear();
+        currentLocalTypes.clear();
+        // Typed parameters are guarded on entry, except Optional ones whose
+        // default is of another type.
+        for (auto& p : funcStmt->params) {
+            int slot = declareLocal(p.name);
+            int type = declaredType(p.type);
+            Value::Type given = p.defaultValue.getType();
+            if (type < 0 || (p.optional && (int)given != type &&
+                             !(type == (int)Value::Type::Double && given == Value::Type::Int)))
+                continue;
+            currentLocalTypes[slot] = type;
+            emit(fnChunk, OP_GUARD_LOCAL);
+            emitOperand(fnChunk, slot);
+            emitOperand(fnChunk, type | GUARD_GENERIC);
+        }
+        if (funcStmt->isExtension)
+            declareLocal(funcStmt->extendedParam);
+        if (isMethod)
+            function->selfSlot = declareLocal("self");
+
         for (auto stmt : funcStmt->body){
             compileStmt(stmt, fnChunk);
         }
+        function->localCount = (int)currentLocals.size();
+        currentLocals = std::move(oldLocals);
+        currentLocalTypes = std::move(oldLocalTypes);
+        compilingFunction = oldCompilingFunction;
+        forDepth = oldForDepth;
+        selectDepth = oldSelectDepth;
+        labelForDepth = std::move(oldLabelForDepth);
         for (auto& f : gotoFixups) {
             if (labelTable.find(f.label) == labelTable.end())
                 runtimeError("Undefined label: " + f.label + " in function " + function->name);
-            fnChunk.code[f.patchIndex] = labelTable[f.label];
+            writeJumpTarget(fnChunk.code, f.patchIndex, labelTable[f.label]);
         }
+        labelTable = std::move(oldLabelTable);
+        gotoFixups = std::move(oldGotoFixups);
         
         emit(fnChunk, OP_NIL);
         emit(fnChunk, OP_RETURN);
         function->chunk = fnChunk;
         lastFunction = function;
-        debugLog("Compiler: Compiled function: " + function->name + " with required arity " + std::to_string(function->arity));
+        compiledFunctions.push_back(function);
+        DEBUG_LOG("Compiler: Compiled function: " + function->name + " with required arity " + std::to_string(function->arity));
+    }
+};
+
+// ----------------------------------------------------------------------------
+// Helper: resolve a compiled global reference.
+// Fields of the running method's Self and any scopes between the current
+// environment and the globals still shadow by name; once those are
+// exhausted the interned slot is read directly.
+// ----------------------------------------------------------------------------
+static Value* findGlobal(VM& vm, const ObjFunction::CodeChunk& chunk, int nameIndex, int slot,
+                         const Value* self) {
+    if (self && self->isInstance()) {
+        const std::string& name = chunk.constants[nameIndex].asString();
+        if (Value* field = self->asInstance()->findField(name))
+            return field;
+    }
+    Environment* env = vm.environment.get();
+    if (env != vm.globals.get()) {
+        const std::string& name = chunk.constants[nameIndex].asString();
+        for (; env && !env->isGlobal(); env = env->enclosing.get()) {
+            if (Value* found = env->lookupHere(name))
+                return found;
+        }
+        if (env != vm.globals.get())
+            return env ? env->lookupHere(name) : nullptr;
+    }
+    if (slot < (int)vm.globals->slots.size() && vm.globals->slotDefined[slot])
+        return &vm.globals->slots[slot];
+    return nullptr;
+}
+
+// ----------------------------------------------------------------------------
+// Helper: whether the global an OP_INLINE_GUARD names still holds the
+// function inlined at that call site.
+// ----------------------------------------------------------------------------
+static bool inlinedCallee(VM& vm, const ObjFunction::CodeChunk& chunk, int nameIndex, int slot,
+                          int functionIndex, const Value* self) {
+    const Value* callee = findGlobal(vm, chunk, nameIndex, slot, self);
+    return callee && callee->isFunction() &&
+           callee->asFunction() == chunk.constants[functionIndex].asFunction();
+}
+
+// ----------------------------------------------------------------------------
+// Helper: the value of `object.propName` as OP_GET_PROPERTY sees it on a
+// cache miss. Fields and methods of scripted instances are recorded in
+// `cache`; methods and extensions come back as bound methods.
+// ----------------------------------------------------------------------------
+static Value getProperty(VM& vm, const Value& object, const std::string& propName,
+                         ObjFunction::PropertyCache& cache) {
+    if (object.isInstance()) {
+        auto instance = object.asInstance();
+        std::string key = toLower(propName);
+        // FIRST, check instance fields
+        if (Value* field = instance->findField(key)) {
+            if (!instance->klass->isPlugin)
+                cache.add(instance->shape, instance->shape->find(key), Value());
+            return *field;
+        }
+        else if (instance->klass->isPlugin) {
+            // For plugin instances, now check pluginProperties
+            auto it = instance->klass->pluginProperties.find(key);
+            if (it != instance->klass->pluginProperties.end()) {
+                int handle = static_cast<int>(reinterpret_cast<intptr_t>(instance->pluginInstance));
+                BuiltinFn getter = it->second.first;
+                Value result = getter({ Value(handle) });
+                return result;
+            } 
+            // Next, check if the plugin class defines a method with this name
+            else if (instance->klass->methods.find(key) != instance->klass->methods.end()) {
+                auto bound = std::make_shared<ObjBoundMethod>();
+                bound->receiver = object;
+                bound->name = key;
+                return Value(bound);
+            }
+            else {
+                if (key == "constructor") {                // <– NEW guard
+                    return Value(std::monostate{});     // acts like “no ctor”
+                } else {
+                    int handle = static_cast<int>(reinterpret_cast<intptr_t>(instance->pluginInstance));
+                    std::string target = instance->klass->name + ":" +
+                                         std::to_string(handle) + ":" + key;
+                    return Value(target);
+                }
+            }
+            
+        }
+        else {
+            // Non-plugin instance branch
+            auto method = instance->klass->methods.find(key);
+            if (method != instance->klass->methods.end()) {
+                if (!instance->shape)
+                    instance->initFields();
+                cache.add(instance->shape, -1, method->second);
+                auto bound = std::make_shared<ObjBoundMethod>();
+                bound->receiver = object;
+                bound->name = key;
+                bound->method = method->second;
+                return Value(bound);
+            } else if (key == "tostring") {
+                return Value(valueToString(object));
+            } else {
+                if (key == "constructor") {
+                    return Value(std::monostate{});
+                } else {
+                    runtimeError("VM: NilObjectException for property: " + propName);
+                }
+            }
+        }
+    
+    //Module Extends lookups
+    } else if (object.isArray()) {
+        // ─── NEW: module extension lookup ───────────────────
+        auto &exts = vm.extensionMethods["array"];
+        auto it   = exts.find(propName);
+        if (it != exts.end()) {
+            auto bound = std::make_shared<ObjBoundMethod>();
+            bound->receiver = object;
+            bound->name     = propName;
+            return Value(bound);
+        }
+        auto array = object.asArray();
+        auto bound = std::make_shared<ObjBoundMethod>();
+        bound->receiver = object;
+        bound->name = propName;
+        return Value(bound);
+    } else if (object.isInt()) {
+        // ─── NEW: module extension lookup ───────────────────
+        auto &exts = vm.extensionMethods["integer"];
+        auto it   = exts.find(propName);
+        if (it != exts.end()) {
+            auto bound = std::make_shared<ObjBoundMethod>();
+            bound->receiver = object;
+            bound->name     = propName;
+            return Value(bound);
+        }
+        if (propName == "tostring")
+            return Value(valueToString(object));
+        else
+            runtimeError("VM: Unknown property for integer: " + propName);
+    } else if (object.isDouble()) {
+        // ─── NEW: module extension lookup ───────────────────
+        auto &exts = vm.extensionMethods["double"];
+        auto it   = exts.find(propName);
+        if (it != exts.end()) {
+            auto bound = std::make_shared<ObjBoundMethod>();
+            bound->receiver = object;
+            bound->name     = propName;
+            return Value(bound);
+        }
+        if (propName == "tostring")
+            return Value(valueToString(object));
+        else
+            runtimeError("VM: Unknown property for double: " + propName);
+    } 
+    
+    else if (object.isString()) {
+        // ─── NEW: module extension lookup ───────────────────
+        auto &exts = vm.extensionMethods["string"];
+        auto it   = exts.find(propName);
+        if (it != exts.end()) {
+            auto bound = std::make_shared<ObjBoundMethod>();
+            bound->receiver = object;
+            bound->name     = propName;
+            return Value(bound);
+        }
+        if (propName == "tostring")
+            return object;
+        else
+            runtimeError("VM: Unknown property for string: " + propName);
+    } else if (object.isModule()) {
+        auto module = object.asModule();
+        std::string key = toLower(propName);
+        if (module->publicMembers.find(key) != module->publicMembers.end())
+            return module->publicMembers[key];
+        else
+            runtimeError("VM: NilObjectException module property: " + propName);
+    } else if (object.isEnum()) {
+        auto en = object.asEnum();
+        std::string key = toLower(propName);
+        if (en->members.find(key) != en->members.end())
+            return en->members[key];
+        else
+            runtimeError("VM: NilObjectException enum member: " + propName);
+    } else {
+        runtimeError("VM: Property access on unsupported type.");
+    }
+    return Value(std::monostate{});
+}
+
+// ----------------------------------------------------------------------------
+// Helper: the scripted function an OP_CALL/OP_OPTIONAL_CALL callee runs in a
+// new call frame, or nullptr when the callee is a built-in, array, extension
+// or other host value. Sets `self` for instance methods. Method calls through
+// OP_CALL are not arity-checked: missing arguments take their defaults and
+// extra ones are dropped.
+// ----------------------------------------------------------------------------
+static ObjFunction* scriptedCallTarget(const Value& callee, int argCount, Value& self,
+                                       bool checkMethodArity) {
+    Value target = callee;
+    if (callee.isBoundMethod()) {
+        auto bound = callee.asBoundMethod();
+        if (!bound->receiver.isInstance())
+            return nullptr;
+        auto instance = bound->receiver.asInstance();
+        if (!bound->method.isNil())
+            target = bound->method;
+        else
+            target = instance->klass->methods[toLower(bound->name)];
+        if (instance->klass->isPlugin)
+            self = Value(static_cast<int>(reinterpret_cast<intptr_t>(instance->pluginInstance)));
+        else
+            self = bound->receiver;
+        if (target.isOverloads()) {
+            for (auto& f : target.asOverloads()) {
+                if (argCount >= f->arity && argCount <= (int)f->params.size())
+                    return f.get();
+            }
+            runtimeError("VM: No matching method found for " + bound->name);
+        }
+        if (!target.isFunction())
+            return nullptr;
+        if (!checkMethodArity)
+            return target.asFunction().get();
+    }
+    else if (callee.isOverloads()) {
+        for (auto& f : callee.asOverloads()) {
+            if (argCount >= f->arity && argCount <= (int)f->params.size())
+                return f.get();
+        }
+        runtimeError("VM: No matching overload found for function call with " +
+                     std::to_string(argCount) + " arguments.");
+    }
+    else if (!callee.isFunction()) {
+        return nullptr;
+    }
+    ObjFunction* fn = target.asFunction().get();
+    if (argCount < fn->arity || argCount > (int)fn->params.size()) {
+        runtimeError("VM: Expected between " + std::to_string(fn->arity) + " and " +
+                     std::to_string(fn->params.size()) + " arguments for function " + fn->name);
+    }
+    return fn;
+}
+
+// ----------------------------------------------------------------------------
+// Helper: numeric ordering as OP_LT, OP_LE, OP_GT and OP_GE compute it.
+// ----------------------------------------------------------------------------
+template <typename T>
+static bool compareNumbers(int op, T a, T b) {
+    switch (op) {
+    case OP_LT: return a < b;
+    case OP_LE: return a <= b;
+    case OP_GT: return a > b;
+    default:    return a >= b;
+    }
+}
+
+static bool compareValues(int op, const Value& a, const Value& b) {
+    if (a.isInt() && b.isInt())
+        return compareNumbers(op, a.asInt(), b.asInt());
+    double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+    double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
+    return compareNumbers(op, ad, bd);
+}
+
+// ============================================================================
+// Bytecode optimizer
+// A chunk is decoded into a list of instructions whose jumps refer to
+// instruction indices, rewritten by local passes until nothing changes, and
+// encoded again. -O1 folds constant arithmetic and branches, threads jumps,
+// drops unreachable code and fuses store/load pairs; -O2 also folds pure
+// built-ins and built-in constants and turns stores to never-read locals into
+// pops. Every rewrite keeps the value the VM would compute at run time.
+// ============================================================================
+struct Instruction {
+    int op;
+    int operands[3];
+    int operandCount = 0;
+    int target = -1;        // instruction index of the jump target
+    bool isTarget = false;  // some jump lands here
+    bool dead = false;
+};
+
+// Built-ins without side effects and the arguments -O2 folds them for:
+// 'n' is an Integer or Double literal, 's' a String literal.
+static const std::unordered_map<std::string, std::string> pureBuiltins = {
+    { "abs", "n" }, { "acos", "n" }, { "asin", "n" }, { "atan", "n" },
+    { "atan2", "nn" }, { "ceiling", "n" }, { "cos", "n" }, { "exp", "n" },
+    { "floor", "n" }, { "log", "n" }, { "max", "nn" }, { "min", "nn" },
+    { "pow", "nn" }, { "round", "n" }, { "sign", "n" }, { "sin", "n" },
+    { "sqrt", "n" }, { "tan", "n" },
+    { "len", "s" }, { "lowercase", "s" }, { "uppercase", "s" }, { "trim", "s" }
+};
+static const std::unordered_set<std::string> builtinConstants = { "pi", "endofline", "eol" };
+
+static bool isNumber(const Value& v) { return v.isInt() || v.isDouble(); }
+static double toDouble(const Value& v) { return v.isDouble() ? v.asDouble() : static_cast<double>(v.asInt()); }
+
+// Integer results that overflow are left to the VM.
+static bool foldInt(long long result, Value& out) {
+    if (result < INT_MIN || result > INT_MAX)
+        return false;
+    out = Value(static_cast<int>(result));
+    return true;
+}
+
+static bool foldBinary(int op, const Value& a, const Value& b, Value& out) {
+    bool ints = a.isInt() && b.isInt();
+    bool numbers = isNumber(a) && isNumber(b);
+    switch (op) {
+    case OP_ADD:
+        if (ints) return foldInt((long long)a.asInt() + b.asInt(), out);
+        if (numbers) { out = Value(toDouble(a) + toDouble(b)); return true; }
+        if (a.isString() && b.isString()) { out = concatStrings(a, b); return true; }
+        return false;
+    case OP_SUB:
+        if (ints) return foldInt((long long)a.asInt() - b.asInt(), out);
+        if (numbers) { out = Value(toDouble(a) - toDouble(b)); return true; }
+        return false;
+    case OP_MUL:
+        if (ints) return foldInt((long long)a.asInt() * b.asInt(), out);
+        if (numbers) { out = Value(toDouble(a) * toDouble(b)); return true; }
+        return false;
+    case OP_DIV:
+        if (numbers) { out = Value(toDouble(a) / toDouble(b)); return true; }
+        return false;
+    case OP_MOD:
+        if (ints) {
+            if (b.asInt() == 0 || b.asInt() == -1) return false;
+            out = Value(a.asInt() % b.asInt());
+            return true;
+        }
+        if (numbers) { out = Value(std::fmod(toDouble(a), toDouble(b))); return true; }
+        return false;
+    case OP_POW:
+        if (numbers) { out = Value(std::pow(toDouble(a), toDouble(b))); return true; }
+        return false;
+    case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+        if (numbers) { out = Value(compareValues(op, a, b)); return true; }
+        return false;
+    case OP_EQ: case OP_NE: {
+        bool equal;
+        if (ints) equal = a.asInt() == b.asInt();
+        else if (numbers) equal = toDouble(a) == toDouble(b);
+        else if (a.isBool() && b.isBool()) equal = a.asBool() == b.asBool();
+        else if (a.isString() && b.isString()) equal = stringsEqual(a, b);
+        else return false;
+        out = Value(op == OP_EQ ? equal : !equal);
+        return true;
+    }
+    case OP_AND: case OP_OR: {
+        if (!(a.isBool() || a.isInt()) || !(b.isBool() || b.isInt()))
+            return false;
+        bool ab = a.isBool() ? a.asBool() : a.asInt() != 0;
+        bool bb = b.isBool() ? b.asBool() : b.asInt() != 0;
+        out = Value(op == OP_AND ? (ab && bb) : (ab || bb));
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// The truth value OP_JUMP_IF_FALSE gives a constant.
+static bool constantTruth(const Value& v) {
+    if (v.isBool()) return v.asBool();
+    if (v.isInt()) return v.asInt() != 0;
+    if (v.isString()) return v.stringBox().size != 0;
+    return false;
+}
+
+static int operandSize(int operand) {
+    int size = 1;
+    for (unsigned value = static_cast<unsigned>(operand); value >= 0x80; value >>= 7)
+        size++;
+    return size;
+}
+
+static bool hasJumpTarget(int op) { return std::strchr(opcodeOperands(op), 'J') != nullptr; }
+
+// Visit the Case targets of one OP_SWITCH table of `chunk`, or of all its
+// tables when `table` is -1. They are code offsets in an encoded chunk and
+// instruction indices while the chunk is decoded.
+template <typename F>
+static void forEachSwitchTarget(ObjFunction::CodeChunk& chunk, int table, F visit) {
+    for (int t = 0; t < (int)chunk.switches.size(); t++) {
+        if (table >= 0 && t != table)
+            continue;
+        auto& sw = chunk.switches[t];
+        for (int& target : sw.dense)
+            if (target >= 0)
+                visit(target);
+        for (auto& entry : sw.sparse)
+            visit(entry.second);
+        for (auto& entry : sw.strings)
+            visit(entry.second);
+        sw.byHash.clear();
+    }
+}
+
+// Decode a chunk into instructions whose jump and switch targets are
+// instruction indices. Returns false, leaving the chunk alone, for code
+// whose targets do not land on instructions.
+static bool decodeChunk(ObjFunction::CodeChunk& chunk, std::vector<Instruction>& code) {
+    const uint8_t* bytes = chunk.code.data();
+    int size = (int)chunk.code.size();
+    std::vector<int> indexAt(size + 1, -1);
+    code.clear();
+    for (int ip = 0; ip < size;) {
+        indexAt[ip] = (int)code.size();
+        Instruction in;
+        in.op = bytes[ip++];
+        for (const char* f = opcodeOperands(in.op); *f; f++) {
+            if (*f == 'J')
+                in.target = readJumpTarget(bytes, ip);
+            else
+                in.operands[in.operandCount++] = readOperand(bytes, ip);
+        }
+        code.push_back(in);
+    }
+    auto valid = [&](int target) { return target >= 0 && target < size && indexAt[target] >= 0; };
+    bool ok = !code.empty();
+    for (auto& in : code)
+        if (hasJumpTarget(in.op) && !valid(in.target))
+            ok = false;
+    forEachSwitchTarget(chunk, -1, [&](int& target) { if (!valid(target)) ok = false; });
+    if (!ok)
+        return false;
+    for (auto& in : code)
+        if (hasJumpTarget(in.op))
+            in.target = indexAt[in.target];
+    forEachSwitchTarget(chunk, -1, [&](int& target) { target = indexAt[target]; });
+    return true;
+}
+
+// Encode decoded instructions back into `chunk`, turning targets into offsets.
+static void encodeChunk(ObjFunction::CodeChunk& chunk, const std::vector<Instruction>& code) {
+    std::vector<int> position(code.size());
+    int at = 0;
+    for (size_t i = 0; i < code.size(); i++) {
+        position[i] = at;
+        at += 1;
+        for (int k = 0; k < code[i].operandCount; k++)
+            at += operandSize(code[i].operands[k]);
+        if (hasJumpTarget(code[i].op))
+            at += JUMP_TARGET_SIZE;
+    }
+    forEachSwitchTarget(chunk, -1, [&](int& target) { target = position[target]; });
+    std::vector<uint8_t> bytes;
+    bytes.reserve(at);
+    for (auto& in : code) {
+        bytes.push_back(static_cast<uint8_t>(in.op));
+        int k = 0;
+        for (const char* f = opcodeOperands(in.op); *f; f++) {
+            if (*f == 'J') {
+                size_t field = bytes.size();
+                bytes.resize(field + JUMP_TARGET_SIZE);
+                writeJumpTarget(bytes, field, position[in.target]);
+            }
+            else
+                writeOperand(bytes, in.operands[k++]);
+        }
+    }
+    chunk.code = std::move(bytes);
+}
+
+class BytecodeOptimizer {
+public:
+    BytecodeOptimizer(VM& vm, ObjFunction::CodeChunk& chunk, int selfSlot,
+                      const std::unordered_set<std::string>& userNames)
+        : vm(vm), chunk(chunk), selfSlot(selfSlot), userNames(userNames) {}
+
+    void run() {
+        if (!decodeChunk(chunk, code))
+            return;
+        for (int round = 0; round < 16; round++) {
+            bool changed = false;
+            changed |= pass(&BytecodeOptimizer::foldConstants);
+            changed |= pass(&BytecodeOptimizer::threadJumps);
+            changed |= pass(&BytecodeOptimizer::peephole);
+            if (OPT_LEVEL >= 2)
+                changed |= pass(&BytecodeOptimizer::removeDeadStores);
+            changed |= pass(&BytecodeOptimizer::removeUnreachable);
+            if (!changed)
+                break;
+        }
+        size_t before = chunk.code.size();
+        encodeChunk(chunk, code);
+        DEBUG_LOG("Optimizer: chunk of " + std::to_string(before) + " bytes reduced to " +
+                  std::to_string(chunk.code.size()) + " bytes.");
+    }
+
+private:
+    VM& vm;
+    ObjFunction::CodeChunk& chunk;
+    int selfSlot;
+    const std::unordered_set<std::string>& userNames;
+    std::vector<Instruction> code;
+
+    // Run one pass over the live instructions, then drop the instructions it
+    // killed and recompute which instructions are jump targets.
+    bool pass(bool (BytecodeOptimizer::*fn)()) {
+        for (auto& in : code)
+            in.isTarget = false;
+        for (auto& in : code)
+            if (hasJumpTarget(in.op))
+                code[in.target].isTarget = true;
+        forEachSwitchTarget(chunk, -1, [&](int& target) { code[target].isTarget = true; });
+        if (!(this->*fn)())
+            return false;
+        std::vector<int> newIndex(code.size() + 1);
+        int live = 0;
+        for (size_t i = 0; i < code.size(); i++) {
+            newIndex[i] = live;
+            if (!code[i].dead)
+                live++;
+        }
+        newIndex[code.size()] = live;
+        forEachSwitchTarget(chunk, -1, [&](int& target) { target = newIndex[target]; });
+        std::vector<Instruction> kept;
+        kept.reserve(live);
+        for (auto& in : code) {
+            if (in.dead)
+                continue;
+            if (hasJumpTarget(in.op))
+                in.target = newIndex[in.target];
+            kept.push_back(in);
+        }
+        code = std::move(kept);
+        return true;
+    }
+
+    void setConstant(Instruction& in, const Value& v) {
+        in.op = OP_CONSTANT;
+        in.operands[0] = addConstant(chunk, v);
+        in.operandCount = 1;
+        in.target = -1;
+    }
+
+    void setJump(Instruction& in, int target) {
+        in.op = OP_JUMP;
+        in.operandCount = 0;
+        in.target = target;
+    }
+
+    // True when instructions (i, i + count] exist and no jump lands inside
+    // the run, so it always executes as a unit from i.
+    bool straightLine(size_t i, size_t count) const {
+        if (i + count >= code.size())
+            return false;
+        for (size_t k = i + 1; k <= i + count; k++)
+            if (code[k].isTarget)
+                return false;
+        return true;
+    }
+
+    const Value& constantOf(const Instruction& in) const { return chunk.constants[in.operands[0]]; }
+
+    // The built-in a global read names, or nullptr when the script may have
+    // replaced it.
+    const Value* builtinGlobal(const Instruction& in) const {
+        const std::string& name = chunk.constants[in.operands[0]].asString();
+        if (userNames.count(name))
+            return nullptr;
+        return vm.globals->lookupHere(name);
+    }
+
+    bool foldConstants() {
+        bool changed = false;
+        for (size_t i = 0; i < code.size(); i++) {
+            Instruction& in = code[i];
+            if (in.op == OP_GET_GLOBAL && OPT_LEVEL >= 2) {
+                if (foldBuiltinCall(i)) { changed = true; continue; }
+                const std::string& name = chunk.constants[in.operands[0]].asString();
+                const Value* v = builtinConstants.count(name) ? builtinGlobal(in) : nullptr;
+                if (v && (v->isDouble() || v->isString())) {
+                    setConstant(in, *v);
+                    changed = true;
+                }
+                continue;
+            }
+            if (in.op != OP_CONSTANT || !straightLine(i, 1))
+                continue;
+            Instruction& next = code[i + 1];
+            const Value a = constantOf(in);
+            Value result;
+            if (next.op == OP_NEGATE && (a.isInt() || a.isDouble())) {
+                if (a.isInt() && a.asInt() == INT_MIN)
+                    continue;
+                setConstant(in, a.isInt() ? Value(-a.asInt()) : Value(-a.asDouble()));
+                next.dead = true;
+            }
+            else if (next.op == OP_JUMP_IF_FALSE) {
+                if (constantTruth(a))
+                    in.dead = true;
+                else
+                    setJump(in, next.target);
+                next.dead = true;
+            }
+            else if (next.op == OP_SWITCH) {
+                int target = chunk.switches[next.operands[0]].find(a);
+                setJump(in, target >= 0 ? target : next.target);
+                next.dead = true;
+            }
+            else if (next.op == OP_CONSTANT && straightLine(i, 2)) {
+                Instruction& op = code[i + 2];
+                const Value& b = constantOf(next);
+                if (op.op == OP_COMPARE_JUMP && isNumber(a) && isNumber(b)) {
+                    if (compareValues(op.operands[0], a, b))
+                        in.dead = true;
+                    else
+                        setJump(in, op.target);
+                }
+                else if (foldBinary(op.op, a, b, result))
+                    setConstant(in, result);
+                else
+                    continue;
+                next.dead = op.dead = true;
+                i += 2;
+                changed = true;
+                continue;
+            }
+            else
+                continue;
+            i += 1;
+            changed = true;
+        }
+        return changed;
+    }
+
+    // GET_GLOBAL f; CONSTANT x...; CALL n of a pure built-in on literals.
+    bool foldBuiltinCall(size_t i) {
+        const std::string& name = chunk.constants[code[i].operands[0]].asString();
+        auto pure = pureBuiltins.find(name);
+        if (pure == pureBuiltins.end())
+            return false;
+        size_t argc = pure->second.size();
+        if (!straightLine(i, argc + 1))
+            return false;
+        const Instruction& call = code[i + argc + 1];
+        if ((call.op != OP_CALL && call.op != OP_TAIL_CALL) || call.operands[0] != (int)argc)
+            return false;
+        std::vector<Value> args;
+        for (size_t k = 0; k < argc; k++) {
+            const Instruction& arg = code[i + 1 + k];
+            if (arg.op != OP_CONSTANT)
+                return false;
+            const Value& v = constantOf(arg);
+            if (pure->second[k] == 'n' ? !isNumber(v) : !v.isString())
+                return false;
+            args.push_back(v);
+        }
+        const Value* fn = builtinGlobal(code[i]);
+        if (!fn || !fn->isBuiltin())
+            return false;
+        setConstant(code[i], fn->asBuiltin()(args));
+        for (size_t k = 1; k <= argc + 1; k++)
+            code[i + k].dead = true;
+        return true;
+    }
+
+    // Retarget jumps that land on an OP_JUMP and drop jumps to the next
+    // instruction. Backward OP_JUMPs are the loop safepoints, so a jump only
+    // skips one when it becomes a backward OP_JUMP itself.
+    bool threadJumps() {
+        bool changed = false;
+        for (size_t i = 0; i < code.size(); i++) {
+            Instruction& in = code[i];
+            if (in.op != OP_JUMP && in.op != OP_JUMP_IF_FALSE && in.op != OP_COMPARE_JUMP)
+                continue;
+            for (int hops = 0; hops < 8 && code[in.target].op == OP_JUMP; hops++) {
+                int t = in.target, next = code[t].target;
+                if (next == t)
+                    break;
+                if (next < t && !(in.op == OP_JUMP && next <= (int)i))
+                    break;
+                in.target = next;
+                changed = true;
+            }
+            if (in.op == OP_JUMP && in.target == (int)i + 1) {
+                in.dead = true;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool peephole() {
+        bool changed = false;
+        for (size_t i = 0; i + 1 < code.size(); i++) {
+            Instruction& in = code[i];
+            Instruction& next = code[i + 1];
+            if (next.isTarget)
+                continue;
+            // A value pushed only to be popped.
+            if (next.op == OP_POP &&
+                (in.op == OP_CONSTANT || in.op == OP_GET_LOCAL || in.op == OP_NIL || in.op == OP_DUP)) {
+                in.dead = next.dead = true;
+            }
+            // SET x; GET x  ->  DUP; SET x
+            else if ((in.op == OP_SET_GLOBAL && next.op == OP_GET_GLOBAL && in.operands[1] == next.operands[1]) ||
+                     (in.op == OP_SET_LOCAL && next.op == OP_GET_LOCAL && in.operands[0] == next.operands[0])) {
+                next = in;
+                in.op = OP_DUP;
+                in.operandCount = 0;
+            }
+            else
+                continue;
+            i++;
+            changed = true;
+        }
+        return changed;
+    }
+
+    // Stores to frame slots that nothing reads become pops.
+    bool removeDeadStores() {
+        std::unordered_set<int> read;
+        for (auto& in : code) {
+            if (in.op == OP_GET_LOCAL)
+                read.insert(in.operands[0]);
+            else if ((in.op == OP_FOR_PREP || in.op == OP_FOR_LOOP) && !(in.operands[0] & FOR_GLOBAL))
+                read.insert(in.operands[1]);
+        }
+        bool changed = false;
+        for (auto& in : code) {
+            if (in.op == OP_SET_LOCAL && in.operands[0] != selfSlot && !read.count(in.operands[0])) {
+                in.op = OP_POP;
+                in.operandCount = 0;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool removeUnreachable() {
+        std::vector<bool> reached(code.size(), false);
+        std::vector<int> work = { 0 };
+        while (!work.empty()) {
+            int i = work.back();
+            work.pop_back();
+            if (i >= (int)code.size() || reached[i])
+                continue;
+            reached[i] = true;
+            const Instruction& in = code[i];
+            if (hasJumpTarget(in.op))
+                work.push_back(in.target);
+            if (in.op == OP_SWITCH)
+                forEachSwitchTarget(chunk, in.operands[0], [&](int& target) { work.push_back(target); });
+            if (in.op != OP_JUMP && in.op != OP_RETURN && in.op != OP_SWITCH)
+                work.push_back(i + 1);
+        }
+        bool changed = false;
+        for (size_t i = 0; i < code.size(); i++) {
+            if (!reached[i]) {
+                code[i].dead = true;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+};
+
+void optimizeBytecode(VM& vm, ObjFunction::CodeChunk& chunk, int selfSlot,
+                      const std::unordered_set<std::string>& userNames) {
+    BytecodeOptimizer(vm, chunk, selfSlot, userNames).run();
+    std::unordered_map<std::string, int>().swap(chunk.constantIndex);
+}
+
+// ============================================================================
+// Type specialization
+// Stores into locals declared As Integer, Double, Boolean or String, and
+// typed parameters on entry, go through OP_GUARD / OP_GUARD_LOCAL. From -O1
+// on, a pass follows the types of locals and stack values through each
+// function. Arithmetic, comparisons and For loops whose operand types it
+// proves become opcodes that skip the type tests. Guards on values of
+// unknown type (Variants, globals, calls, plugins) then leave the
+// specialized code when they fail: the frame carries on at the same offset
+// in a generic copy of the chunk, and later calls start there. Guards whose
+// values are already known disappear.
+// ============================================================================
+
+// The shape of a scripted function's frame: slot i is vm.stack[base + i],
+// locals first and then the operand stack, whose depth at every instruction
+// must be known before native code runs.
+struct FrameLayout {
+    const ObjFunction& fn;
+    const uint8_t* code;
+    int codeSize;
+    std::vector<int> depth;   // operand stack depth per bytecode offset, -1 if unreachable
+    int frameSlots;
+    int maxDepth = 0;
+
+    explicit FrameLayout(const ObjFunction& f)
+        : fn(f), code(f.chunk.code.data()), codeSize((int)f.chunk.code.size()),
+          depth(f.chunk.code.size(), -1),
+          frameSlots(std::max<int>(f.localCount, (int)f.params.size())) { }
+
+    // Net operand stack change of one instruction, or INT_MIN when unknown.
+    static int stackEffect(int op, const int* operands) {
+        switch (op) {
+        case OP_CONSTANT: case OP_NIL: case OP_DUP: case OP_GET_LOCAL:
+        case OP_GET_GLOBAL: case OP_CLASS: case OP_TYPED_ARRAY:
+            return 1;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW: case OP_MOD:
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_NE: case OP_EQ:
+        case OP_AND: case OP_OR: case OP_PRINT: case OP_POP: case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL: case OP_SET_LOCAL: case OP_JUMP_IF_FALSE: case OP_SET_PROPERTY:
+        case OP_SWITCH: case OP_CONSTRUCTOR_END: case OP_METHOD:
+            return -1;
+        case OP_NEGATE: case OP_NEW: case OP_GET_PROPERTY: case OP_PROPERTIES:
+        case OP_JUMP: case OP_FOR_PREP: case OP_FOR_LOOP: case OP_RETURN:
+        case OP_GUARD: case OP_GUARD_LOCAL: case OP_INLINE_GUARD:
+            return 0;
+        case OP_CALL: case OP_OPTIONAL_CALL: case OP_TAIL_CALL:
+            return -operands[0];
+        case OP_INVOKE:
+            return -operands[2];
+        case OP_ARRAY:
+            return 1 - operands[0];
+        case OP_COMPARE_JUMP:
+            return -2;
+        default:
+            return INT_MIN;
+        }
+    }
+
+    // Decodes the instruction at `ip`: operands, jump target (or -1) and the
+    // offset of the next instruction. Type-specialized opcodes read as their
+    // generic ones.
+    int decode(int ip, int& op, int* operands, int& target) const {
+        op = genericOpcode(code[ip++]);
+        target = -1;
+        int n = 0;
+        for (const char* layout = opcodeOperands(op); *layout; layout++) {
+            if (*layout == 'J')
+                target = readJumpTarget(code, ip);
+            else
+                operands[n++] = readOperand(code, ip);
+        }
+        return ip;
+    }
+
+    // Records the operand stack depth at every reachable instruction; false
+    // if some instruction is reached with two different depths.
+    bool analyze() {
+        std::vector<int> work{ 0 };
+        depth[0] = 0;
+        auto reach = [&](int at, int d) {
+            if (at < 0 || at >= codeSize || d < 0) return false;
+            if (depth[at] < 0) { depth[at] = d; work.push_back(at); return true; }
+            return depth[at] == d;
+        };
+        while (!work.empty()) {
+            int ip = work.back();
+            work.pop_back();
+            int op, operands[4], target;
+            int next = decode(ip, op, operands, target);
+            if (op == OP_GET_LOCAL || op == OP_SET_LOCAL) {
+                if (operands[0] >= frameSlots) return false;
+            }
+            if ((op == OP_FOR_PREP || op == OP_FOR_LOOP) && !(operands[0] & FOR_GLOBAL) &&
+                operands[1] >= frameSlots)
+                return false;
+            int effect = stackEffect(op, operands);
+            if (effect == INT_MIN) return false;
+            int d = depth[ip] + effect;
+            maxDepth = std::max(maxDepth, std::max(depth[ip], d));
+            if (op == OP_RETURN) continue;
+            if (target >= 0 && !reach(target, d)) return false;
+            if (op == OP_SWITCH) {
+                const ObjFunction::SwitchTable& table = fn.chunk.switches[operands[0]];
+                for (int t : table.dense)
+                    if (t >= 0 && !reach(t, d)) return false;
+                for (const auto& entry : table.sparse)
+                    if (!reach(entry.second, d)) return false;
+                for (const auto& entry : table.strings)
+                    if (!reach(entry.second, d)) return false;
+            }
+            if (op != OP_JUMP && op != OP_SWITCH && !reach(next, d)) return false;
+        }
+        return true;
+    }
+};
+
+// Types the specializer tracks: a Value::Type, or unknown.
+const int8_t TYPE_UNKNOWN = -1;
+
+class TypeSpecializer {
+public:
+    explicit TypeSpecializer(ObjFunction& f)
+        : chunk(f.chunk), frameSlots(std::max<int>(f.localCount, (int)f.params.size())) { }
+    TypeSpecializer(ObjFunction::CodeChunk& c, int slots) : chunk(c), frameSlots(slots) { }
+
+    void run() {
+        if (!decodeChunk(chunk, code))
+            return;
+        if (analyze())
+            rewrite();
+        encodeChunk(chunk, code);
+    }
+
+    // Types at the start of an instruction: the frame's locals, then its
+    // operand stack.
+    struct State {
+        bool reached = false;
+        std::vector<int8_t> locals;
+        std::vector<int8_t> stack;
+    };
+
+    // For a chunk that run() has specialized already: the types before and
+    // after each instruction, by instruction index, with every guard taken to
+    // hold. Leaves the chunk decoded.
+    bool flow(std::vector<State>& before, std::vector<State>& after) {
+        if (!decodeChunk(chunk, code))
+            return false;
+        for (auto& in : code)
+            in.op = genericOpcode(in.op);
+        if (!analyze())
+            return false;
+        before = states;
+        after = states;
+        for (size_t i = 0; i < code.size(); i++)
+            if (states[i].reached && !step(code[i], after[i]))
+                return false;
+        return true;
+    }
+
+private:
+
+    ObjFunction::CodeChunk& chunk;
+    int frameSlots;
+    std::vector<Instruction> code;
+    std::vector<State> states;
+
+    static int8_t guardedType(int declared) { return (int8_t)(declared & ~GUARD_GENERIC); }
+
+    // The type a guard leaves. A value of unknown type is assumed to pass,
+    // which holds once rewrite() makes the guard leave specialized code
+    // otherwise; other values pass a generic guard untouched.
+    static int8_t guarded(int8_t type, int declared) {
+        int8_t want = guardedType(declared);
+        if (want == (int8_t)Value::Type::Double && type == (int8_t)Value::Type::Int)
+            return want;
+        return type == TYPE_UNKNOWN ? want : type;
+    }
+
+    static bool isNumeric(int8_t t) { return t == (int8_t)Value::Type::Int || t == (int8_t)Value::Type::Double; }
+
+    // Result of OP_ADD, OP_SUB and OP_MUL (and a For step), as the VM computes it.
+    static int8_t arithmeticType(int op, int8_t a, int8_t b) {
+        if (a == (int8_t)Value::Type::Int && b == (int8_t)Value::Type::Int)
+            return a;
+        if (isNumeric(a) && isNumeric(b))
+            return (int8_t)Value::Type::Double;
+        if (op == OP_ADD && a == (int8_t)Value::Type::String && b == (int8_t)Value::Type::String)
+            return a;
+        return TYPE_UNKNOWN;
+    }
+
+    // Applies one instruction to `s`; false when its effect is not known.
+    bool step(const Instruction& in, State& s) const {
+        std::vector<int8_t>& stack = s.stack;
+        auto pops = [&](size_t n) {
+            if (stack.size() < n) return false;
+            stack.resize(stack.size() - n);
+            return true;
+        };
+        auto local = [&](int slot) { return slot >= 0 && slot < frameSlots; };
+        const int8_t boolean = (int8_t)Value::Type::Bool;
+        switch (in.op) {
+        case OP_CONSTANT:
+            stack.push_back((int8_t)chunk.constants[in.operands[0]].getType());
+            return true;
+        case OP_NIL:
+            stack.push_back((int8_t)Value::Type::Nil);
+            return true;
+        case OP_GET_GLOBAL: case OP_CLASS:
+            stack.push_back(TYPE_UNKNOWN);
+            return true;
+        case OP_GET_LOCAL:
+            if (!local(in.operands[0])) return false;
+            stack.push_back(s.locals[in.operands[0]]);
+            return true;
+        case OP_SET_LOCAL:
+            if (!local(in.operands[0]) || stack.empty()) return false;
+            s.locals[in.operands[0]] = stack.back();
+            return pops(1);
+        case OP_DUP:
+            if (stack.empty()) return false;
+            stack.push_back(stack.back());
+            return true;
+        case OP_GUARD:
+            if (stack.empty()) return false;
+            stack.back() = guarded(stack.back(), in.operands[0]);
+            return true;
+        case OP_GUARD_LOCAL:
+            if (!local(in.operands[0])) return false;
+            s.locals[in.operands[0]] = guarded(s.locals[in.operands[0]], in.operands[1]);
+            return true;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: {
+            if (stack.size() < 2) return false;
+            int8_t b = stack.back(), a = stack[stack.size() - 2];
+            pops(2);
+            stack.push_back(in.op == OP_MOD && !(isNumeric(a) && isNumeric(b)) ? TYPE_UNKNOWN
+                                                                                : arithmeticType(in.op, a, b));
+            return true;
+        }
+        case OP_DIV: case OP_POW:
+            if (!pops(2)) return false;
+            stack.push_back((int8_t)Value::Type::Double);
+            return true;
+        case OP_NEGATE:
+            if (stack.empty()) return false;
+            if (!isNumeric(stack.back())) stack.back() = TYPE_UNKNOWN;
+            return true;
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE:
+        case OP_AND: case OP_OR:
+            if (!pops(2)) return false;
+            stack.push_back(boolean);
+            return true;
+        case OP_COMPARE_JUMP:
+            return pops(2);
+        case OP_POP: case OP_PRINT: case OP_DEFINE_GLOBAL: case OP_SET_GLOBAL:
+        case OP_JUMP_IF_FALSE: case OP_SWITCH:
+            return pops(1);
+        case OP_JUMP: case OP_RETURN: case OP_FOR_PREP: case OP_INLINE_GUARD:
+            return true;
+        case OP_FOR_LOOP:
+            if (stack.size() < 2) return false;
+            if (!(in.operands[0] & FOR_GLOBAL)) {
+                if (!local(in.operands[1])) return false;
+                int8_t& counter = s.locals[in.operands[1]];
+                counter = arithmeticType(OP_ADD, counter, stack.back());
+                if (counter == (int8_t)Value::Type::String) counter = TYPE_UNKNOWN;
+            }
+            return true;
+        default: {
+            // Calls, properties, arrays: what they leave is unknown.
+            int effect = FrameLayout::stackEffect(in.op, in.operands);
+            if (effect == INT_MIN) return false;
+            int inputs = in.op == OP_CALL || in.op == OP_OPTIONAL_CALL || in.op == OP_TAIL_CALL ? in.operands[0] + 1
+                       : in.op == OP_INVOKE ? in.operands[2] + 1
+                       : in.op == OP_ARRAY ? in.operands[0]
+                       : in.op == OP_TYPED_ARRAY ? 0
+                       : in.op == OP_GET_PROPERTY || in.op == OP_NEW ? 1
+                       : (int)stack.size();
+            int kept = (int)stack.size() - inputs;
+            if (kept < 0 || (int)stack.size() + effect < kept) return false;
+            stack.resize(stack.size() + effect);
+            std::fill(stack.begin() + kept, stack.end(), TYPE_UNKNOWN);
+            return true;
+        }
+        }
+    }
+
+    // Joins `s` into the state at instruction `at`; false when the operand
+    // stack depths differ.
+    bool merge(int at, const State& s, std::vector<int>& work) {
+        if (at < 0 || at >= (int)code.size())
+            return false;
+        State& into = states[at];
+        if (!into.reached) {
+            into = s;
+            work.push_back(at);
+            return true;
+        }
+        if (into.stack.size() != s.stack.size())
+            return false;
+        bool changed = false;
+        auto join = [&](std::vector<int8_t>& to, const std::vector<int8_t>& from) {
+            for (size_t k = 0; k < to.size(); k++) {
+                if (to[k] != from[k] && to[k] != TYPE_UNKNOWN) {
+                    to[k] = TYPE_UNKNOWN;
+                    changed = true;
+                }
+            }
+        };
+        join(into.locals, s.locals);
+        join(into.stack, s.stack);
+        if (changed)
+            work.push_back(at);
+        return true;
+    }
+
+    bool analyze() {
+        states.assign(code.size(), State());
+        State entry;
+        entry.reached = true;
+        entry.locals.assign(frameSlots, TYPE_UNKNOWN);
+        std::vector<int> work;
+        merge(0, entry, work);
+        while (!work.empty()) {
+            int i = work.back();
+            work.pop_back();
+            const Instruction& in = code[i];
+            State s = states[i];
+            if (!step(in, s))
+                return false;
+            if (in.op == OP_RETURN)
+                continue;
+            if (hasJumpTarget(in.op) && !merge(in.target, s, work))
+                return false;
+            bool ok = true;
+            if (in.op == OP_SWITCH)
+                forEachSwitchTarget(chunk, in.operands[0], [&](int& target) { ok = ok && merge(target, s, work); });
+            if (!ok || (in.op != OP_JUMP && in.op != OP_SWITCH && !merge(i + 1, s, work)))
+                return false;
+        }
+        return true;
+    }
+
+    // The specialized form of an instruction at `i`, or its own opcode.
+    int specialized(size_t i) const {
+        const Instruction& in = code[i];
+        const State& s = states[i];
+        size_t depth = s.stack.size();
+        int8_t a = depth >= 2 ? s.stack[depth - 2] : TYPE_UNKNOWN;
+        int8_t b = depth >= 1 ? s.stack[depth - 1] : TYPE_UNKNOWN;
+        const int8_t integer = (int8_t)Value::Type::Int, real = (int8_t)Value::Type::Double;
+        bool ints = a == integer && b == integer, doubles = a == real && b == real;
+        switch (in.op) {
+        case OP_ADD:
+            if (a == (int8_t)Value::Type::String && b == a) return OP_ADD_STRING;
+            return ints ? OP_ADD_INT : doubles ? OP_ADD_DOUBLE : in.op;
+        case OP_SUB: return ints ? OP_SUB_INT : doubles ? OP_SUB_DOUBLE : in.op;
+        case OP_MUL: return ints ? OP_MUL_INT : doubles ? OP_MUL_DOUBLE : in.op;
+        case OP_DIV: return doubles ? OP_DIV_DOUBLE : in.op;
+        case OP_COMPARE_JUMP: return ints ? OP_COMPARE_JUMP_INT : doubles ? OP_COMPARE_JUMP_DOUBLE : in.op;
+        case OP_FOR_LOOP:
+            if (!(in.operands[0] & FOR_GLOBAL) && ints && s.locals[in.operands[1]] == integer)
+                return OP_FOR_LOOP_INT;
+            return in.op;
+        default:
+            return in.op;
+        }
+    }
+
+    void rewrite() {
+        std::vector<bool> isTarget(code.size(), false);
+        for (auto& in : code)
+            if (hasJumpTarget(in.op))
+                isTarget[in.target] = true;
+        forEachSwitchTarget(chunk, -1, [&](int& target) { isTarget[target] = true; });
+
+        int rewritten = 0;
+        for (size_t i = 0; i < code.size(); i++) {
+            if (!states[i].reached)
+                continue;
+            int op = specialized(i);
+            if (op != code[i].op) {
+                code[i].op = op;
+                rewritten++;
+            }
+        }
+        // Guards on values of known type go; with something specialized,
+        // guards on values of unknown type protect it.
+        for (size_t i = 0; i < code.size(); i++) {
+            Instruction& in = code[i];
+            if (!states[i].reached || (in.op != OP_GUARD && in.op != OP_GUARD_LOCAL))
+                continue;
+            const State& s = states[i];
+            int& declared = in.operands[in.op == OP_GUARD ? 0 : 1];
+            int8_t type = in.op == OP_GUARD ? s.stack.back() : s.locals[in.operands[0]];
+            int8_t want = guardedType(declared);
+            if (type == want)
+                in.dead = true;
+            else if (type == TYPE_UNKNOWN) {
+                if (rewritten)
+                    declared = want;
+            }
+            else if (in.op == OP_GUARD && type == (int8_t)Value::Type::Int && want == (int8_t)Value::Type::Double &&
+                     i > 0 && code[i - 1].op == OP_CONSTANT && !isTarget[i]) {
+                // Dim x As Double = 1
+                Instruction& constant = code[i - 1];
+                constant.operands[0] = addConstant(chunk, Value((double)chunk.constants[constant.operands[0]].asInt()));
+                in.dead = true;
+            }
+        }
+        removeDead();
+        DEBUG_LOG("Type specializer: " + std::to_string(rewritten) + " instructions specialized.");
+    }
+
+    void removeDead() {
+        std::vector<int> newIndex(code.size() + 1);
+        int live = 0;
+        for (size_t i = 0; i < code.size(); i++) {
+            newIndex[i] = live;
+            if (!code[i].dead)
+                live++;
+        }
+        newIndex[code.size()] = live;
+        forEachSwitchTarget(chunk, -1, [&](int& target) { target = newIndex[target]; });
+        std::vector<Instruction> kept;
+        kept.reserve(live);
+        for (auto& in : code) {
+            if (in.dead)
+                continue;
+            if (hasJumpTarget(in.op))
+                in.target = newIndex[in.target];
+            kept.push_back(in);
+        }
+        code = std::move(kept);
+    }
+};
+
+void specializeTypes(ObjFunction& fn) {
+    TypeSpecializer(fn).run();
+    std::unordered_map<std::string, int>().swap(fn.chunk.constantIndex);
+}
+
+// Whether `v` passes a guard for the `declared` type; an Integer passing as
+// a Double is converted. Only a specialized guard fails.
+static inline bool passGuard(Value& v, int declared) {
+    Value::Type want = (Value::Type)(declared & ~GUARD_GENERIC);
+    if (v.getType() == want)
+        return true;
+    if (want == Value::Type::Double && v.isInt()) {
+        v = Value(static_cast<double>(v.asInt()));
+        return true;
+    }
+    return (declared & GUARD_GENERIC) != 0;
+}
+
+// The chunk with its specialized opcodes put back to generic ones and every
+// guard generic, built once per chunk. Offsets are the same in both.
+static const ObjFunction::CodeChunk& genericChunk(const ObjFunction::CodeChunk& chunk) {
+    if (!chunk.generic) {
+        auto generic = std::make_shared<ObjFunction::CodeChunk>(chunk);
+        uint8_t* code = generic->code.data();
+        int size = (int)generic->code.size();
+        for (int ip = 0; ip < size;) {
+            int op = code[ip];
+            code[ip++] = (uint8_t)genericOpcode(op);
+            for (const char* f = opcodeOperands(op); *f; f++) {
+                if (*f == 'J') {
+                    ip += JUMP_TARGET_SIZE;
+                    continue;
+                }
+                int at = ip;
+                readOperand(code, ip);
+                // The type operand comes last and always fits in one byte.
+                if ((op == OP_GUARD || op == OP_GUARD_LOCAL) && f[1] == '\0')
+                    code[at] |= GUARD_GENERIC;
+            }
+        }
+        chunk.generic = generic;
+    }
+    return *chunk.generic;
+}
+
+// ============================================================================
+// Inlining
+// From -O1 on, a call in a function to a small global function the compiler
+// knows (GET_GLOBAL f; arguments; CALL n) is replaced by a copy of the
+// callee's body, which keeps its parameters and locals in spare frame slots
+// of the caller and jumps to the end of the copy where it returned. The
+// copy starts with OP_INLINE_GUARD, which checks that the global still
+// holds that function; a script that has redefined it takes the original
+// call, kept after the copy. Recursive functions, methods (their target
+// depends on the receiver) and code at the top level are left alone.
+// ============================================================================
+const int INLINE_MAX_INSTRUCTIONS = 40;   // size of a callee worth inlining
+const int INLINE_MAX_GROWTH = 2000;       // instructions added to one caller
+
+// Operand stack depth before each decoded instruction, -1 where it is not
+// reached; false when some instruction is reached with two depths.
+static bool stackDepths(ObjFunction::CodeChunk& chunk, const std::vector<Instruction>& code,
+                        std::vector<int>& depth) {
+    depth.assign(code.size(), -1);
+    std::vector<int> work{ 0 };
+    depth[0] = 0;
+    auto reach = [&](int at, int d) {
+        if (at < 0 || at >= (int)code.size() || d < 0) return false;
+        if (depth[at] < 0) { depth[at] = d; work.push_back(at); return true; }
+        return depth[at] == d;
+    };
+    while (!work.empty()) {
+        int i = work.back();
+        work.pop_back();
+        const Instruction& in = code[i];
+        int effect = FrameLayout::stackEffect(genericOpcode(in.op), in.operands);
+        if (effect == INT_MIN)
+            return false;
+        int d = depth[i] + effect;
+        if (in.op == OP_RETURN)
+            continue;
+        if (hasJumpTarget(in.op) && !reach(in.target, d))
+            return false;
+        bool ok = true;
+        if (in.op == OP_SWITCH)
+            forEachSwitchTarget(chunk, in.operands[0], [&](int& target) { ok = ok && reach(target, d); });
+        if (!ok || (in.op != OP_JUMP && in.op != OP_SWITCH && !reach(i + 1, d)))
+            return false;
+    }
+    return true;
+}
+
+class CallInliner {
+public:
+    CallInliner(VM& vm, ObjFunction& caller) : vm(vm), caller(caller), chunk(caller.chunk) { }
+
+    // True when some call was inlined.
+    bool run() {
+        if (!decodeChunk(chunk, code))
+            return false;
+        std::vector<int> depth;
+        bool inlined = stackDepths(chunk, code, depth) && rewrite(depth);
+        encodeChunk(chunk, code);
+        return inlined;
+    }
+
+private:
+    // A callee's body, decoded.
+    struct Body {
+        ObjFunction::CodeChunk chunk;
+        std::vector<Instruction> code;
+        int frameSlots = 0;
+    };
+
+    VM& vm;
+    ObjFunction& caller;
+    ObjFunction::CodeChunk& chunk;
+    std::vector<Instruction> code;
+    std::unordered_map<const ObjFunction*, std::unique_ptr<Body>> bodies;
+
+    // The body of `callee` when it is small and simple enough to inline,
+    // else nullptr.
+    const Body* inlinable(const std::shared_ptr<ObjFunction>& callee) {
+        auto known = bodies.find(callee.get());
+        if (known != bodies.end())
+            return known->second.get();
+        std::unique_ptr<Body>& body = bodies[callee.get()];
+        const ObjFunction& fn = *callee;
+        if (&fn == &caller || fn.selfSlot >= 0 || fn.chunk.generic ||
+            fn.chunk.code.size() > (size_t)INLINE_MAX_INSTRUCTIONS * 6)
+            return nullptr;
+        auto candidate = std::make_unique<Body>();
+        candidate->chunk = fn.chunk;
+        candidate->frameSlots = std::max<int>(fn.localCount, (int)fn.params.size());
+        std::vector<Instruction>& calleeCode = candidate->code;
+        std::vector<int> depth;
+        if (!decodeChunk(candidate->chunk, calleeCode) || calleeCode.size() > (size_t)INLINE_MAX_INSTRUCTIONS ||
+            !stackDepths(candidate->chunk, calleeCode, depth))
+            return nullptr;
+        // Global names resolve through the Self of a method, so a callee
+        // reading globals is not copied into one.
+        bool intoMethod = caller.selfSlot >= 0;
+        for (size_t i = 0; i < calleeCode.size(); i++) {
+            const Instruction& in = calleeCode[i];
+            switch (in.op) {
+            case OP_CONSTANT: case OP_NIL: case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_DUP: case OP_POP:
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW: case OP_MOD: case OP_NEGATE:
+            case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE: case OP_AND: case OP_OR:
+            case OP_PRINT: case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_COMPARE_JUMP:
+            case OP_GUARD: case OP_GUARD_LOCAL: case OP_ARRAY: case OP_TYPED_ARRAY: case OP_CALL:
+                break;
+            case OP_GET_GLOBAL: case OP_SET_GLOBAL: {
+                if (intoMethod)
+                    return nullptr;
+                // A callee that calls itself stays a call.
+                const Value& name = candidate->chunk.constants[in.operands[0]];
+                if (name.isString() && name.asString() == toLower(fn.name))
+                    return nullptr;
+                break;
+            }
+            case OP_FOR_PREP: case OP_FOR_LOOP:
+                if (in.operands[0] & FOR_GLOBAL)
+                    return nullptr;
+                break;
+            case OP_RETURN:
+                // A Return inside a For loop leaves its end value and step behind.
+                if (depth[i] > 1)
+                    return nullptr;
+                break;
+            default:
+                return nullptr;
+            }
+        }
+        body = std::move(candidate);
+        return body.get();
+    }
+
+    // The end of the call whose callee GET_GLOBAL is at `i`: the CALL taking
+    // that callee, reached through straight-line argument code. -1 if none.
+    int callAt(size_t i, const std::vector<int>& depth, const std::vector<bool>& isTarget) const {
+        if (depth[i] < 0)
+            return -1;
+        for (size_t j = i + 1; j < code.size(); j++) {
+            const Instruction& in = code[j];
+            if (isTarget[j] || depth[j] <= depth[i])
+                return -1;
+            if ((in.op == OP_CALL || in.op == OP_TAIL_CALL) && depth[j] - in.operands[0] - 1 == depth[i])
+                return (int)j;
+            if (hasJumpTarget(in.op) || in.op == OP_RETURN || in.op == OP_SWITCH)
+                return -1;
+        }
+        return -1;
+    }
+
+    bool rewrite(const std::vector<int>& depth) {
+        std::vector<bool> isTarget(code.size() + 1, false);
+        for (auto& in : code)
+            if (hasJumpTarget(in.op))
+                isTarget[in.target] = true;
+        forEachSwitchTarget(chunk, -1, [&](int& target) { isTarget[target] = true; });
+
+        const int spare = std::max<int>(caller.localCount, (int)caller.params.size());
+        int localCount = caller.localCount;
+        std::vector<Instruction> out;
+        std::vector<int> newIndex(code.size() + 1);
+        std::vector<bool> oldTarget;   // per out instruction: target still an old index
+        auto push = [&](const Instruction& in, bool old) { out.push_back(in); oldTarget.push_back(old); };
+        auto simple = [&](int op, int operand) {
+            Instruction in;
+            in.op = op;
+            in.operands[0] = operand;
+            in.operandCount = operand >= 0 ? 1 : 0;
+            push(in, false);
+        };
+        int sites = 0;
+        for (size_t i = 0; i < code.size(); i++) {
+            newIndex[i] = (int)out.size();
+            const Instruction& in = code[i];
+            int j = -1;
+            const Body* body = nullptr;
+            std::shared_ptr<ObjFunction> callee;
+            if (in.op == OP_GET_GLOBAL && (int)out.size() < (int)code.size() + INLINE_MAX_GROWTH &&
+                (j = callAt(i, depth, isTarget)) >= 0) {
+                const Value* global = vm.globals->lookupHere(chunk.constants[in.operands[0]].asString());
+                int argCount = code[j].operands[0];
+                if (global && global->isFunction()) {
+                    callee = global->asFunction();
+                    if (argCount >= callee->arity && argCount <= (int)callee->params.size())
+                        body = inlinable(callee);
+                }
+            }
+            if (!body) {
+                push(in, true);
+                continue;
+            }
+            const ObjFunction& fn = *callee;
+            int argCount = code[j].operands[0];
+            Instruction guard = in;
+            guard.op = OP_INLINE_GUARD;
+            guard.operands[2] = addConstant(chunk, Value(callee));
+            guard.operandCount = 3;
+            size_t guardAt = out.size();
+            push(guard, false);
+            for (int k = (int)i + 1; k < j; k++)
+                push(code[k], false);
+            // Arguments, left out Optional parameters, then the callee's
+            // other locals, which a call would start as Nil.
+            for (int p = argCount - 1; p >= 0; p--)
+                simple(OP_SET_LOCAL, spare + p);
+            for (int p = argCount; p < (int)fn.params.size(); p++) {
+                simple(OP_CONSTANT, addConstant(chunk, fn.params[p].defaultValue));
+                simple(OP_SET_LOCAL, spare + p);
+            }
+            for (int slot = (int)fn.params.size(); slot < body->frameSlots; slot++) {
+                simple(OP_NIL, -1);
+                simple(OP_SET_LOCAL, spare + slot);
+            }
+            int start = (int)out.size();
+            std::vector<size_t> returns;
+            for (const Instruction& from : body->code) {
+                Instruction copy = from;
+                switch (copy.op) {
+                case OP_CONSTANT: case OP_GET_GLOBAL: case OP_SET_GLOBAL:
+                    copy.operands[0] = addConstant(chunk, body->chunk.constants[from.operands[0]]);
+                    break;
+                case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_GUARD_LOCAL:
+                    copy.operands[0] += spare;
+                    break;
+                case OP_FOR_PREP: case OP_FOR_LOOP:
+                    copy.operands[1] += spare;
+                    break;
+                case OP_RETURN:
+                    copy.op = OP_JUMP;
+                    copy.operandCount = 0;
+                    returns.push_back(out.size());
+                    break;
+                }
+                if (hasJumpTarget(from.op))
+                    copy.target = start + from.target;
+                push(copy, false);
+            }
+            // The call itself, for a redefined callee.
+            out[guardAt].target = (int)out.size();
+            for (int k = (int)i; k <= j; k++)
+                push(code[k], false);
+            for (size_t r : returns)
+                out[r].target = (int)out.size();
+            for (int k = (int)i + 1; k <= j; k++)
+                newIndex[k] = (int)out.size();
+            localCount = std::max(localCount, spare + body->frameSlots);
+            i = j;
+            sites++;
+        }
+        if (!sites)
+            return false;
+        newIndex[code.size()] = (int)out.size();
+        for (size_t k = 0; k < out.size(); k++)
+            if (oldTarget[k] && hasJumpTarget(out[k].op))
+                out[k].target = newIndex[out[k].target];
+        forEachSwitchTarget(chunk, -1, [&](int& target) { target = newIndex[target]; });
+        code = std::move(out);
+        caller.localCount = localCount;
+        DEBUG_LOG("Inliner: " + std::to_string(sites) + " calls inlined into " + caller.name + ".");
+        return true;
+    }
+};
+
+bool inlineCalls(VM& vm, ObjFunction& caller) {
+    bool inlined = CallInliner(vm, caller).run();
+    std::unordered_map<std::string, int>().swap(caller.chunk.constantIndex);
+    return inlined;
+}
+
+// ============================================================================
+// Bytecode images (.xbc)
+// `--compile-only -o app.xbc` stores a compiled program; running the image
+// maps it and links it without lexing, parsing or compiling. An image holds
+//   header     "XBC" 0, format version, opcode count
+//   declares   Declare statements, re-bound to their libraries on load
+//   functions  every ObjFunction with its parameters and chunk
+//   globals    names the compiler defined, with their values
+//   extensions extension methods by type and name
+//   main       the main chunk
+// Integers are LEB128 varints as in the bytecode, strings are length-prefixed.
+// Globals, plugin functions and plugin classes are referenced by name; the
+// interned slots in GET_GLOBAL / SET_GLOBAL / For operands are re-linked
+// against the loading VM. Before anything runs, every operand is checked
+// against its chunk, frame and the function table, and every instruction
+// against the operand stack depth it is reached with; a damaged image is
+// refused as "Invalid bytecode image".
+// ============================================================================
+const char XBC_MAGIC[4] = { 'X', 'B', 'C', '\0' };
+const int XBC_VERSION = 1;
+
+class ImageWriter {
+public:
+    ImageWriter(const CompileRecord& record) : record(record) {}
+
+    // Returns false, with the reason in `error`, when the program holds a
+    // value an image cannot store.
+    bool write(VM& vm, std::vector<uint8_t>& image, std::string& error) {
+        // Functions are numbered as they are first referenced, so the
+        // sections referencing them are written before the function table.
+        std::vector<uint8_t> rest;
+        out = &rest;
+        writeInt((int)record.globals.size());
+        for (auto& name : record.globals) {
+            writeString(name);
+            Value* value = vm.globals->lookupHere(name);
+            writeValue(value ? *value : Value());
+        }
+        writeInt((int)record.extensions.size());
+        for (auto& ext : record.extensions) {
+            writeString(ext.type);
+            writeString(ext.name);
+            writeValue(ext.function);
+        }
+        writeChunk(vm.mainChunk);
+
+        std::vector<uint8_t> functionTable;
+        out = &functionTable;
+        for (size_t i = 0; i < functions.size(); i++)
+            writeFunction(*functions[i]);
+
+        image.assign(XBC_MAGIC, XBC_MAGIC + 4);
+        out = &image;
+        writeInt(XBC_VERSION);
+        writeInt(OP_COUNT);
+        writeInt((int)record.declares.size());
+        for (auto& decl : record.declares) {
+            writeString(decl.stmt->apiName);
+            writeString(decl.stmt->libraryName);
+            writeString(decl.stmt->returnType);
+            writeParams(decl.stmt->params);
+        }
+        writeInt((int)functions.size());
+        image.insert(image.end(), functionTable.begin(), functionTable.end());
+        image.insert(image.end(), rest.begin(), rest.end());
+        error = this->error;
+        return error.empty();
+    }
+
+private:
+    const CompileRecord& record;
+    std::vector<uint8_t>* out = nullptr;
+    std::vector<std::shared_ptr<ObjFunction>> functions;
+    std::unordered_map<const ObjFunction*, int> functionIds;
+    std::string error;
+
+    void unsupported(const std::string& what) {
+        if (error.empty())
+            error = "cannot store " + what + " in a bytecode image";
+    }
+
+    void writeInt(int v) { writeOperand(*out, v); }
+    void writeString(const std::string& s) {
+        writeInt((int)s.size());
+        out->insert(out->end(), s.begin(), s.end());
+    }
+
+    int functionId(const std::shared_ptr<ObjFunction>& fn) {
+        auto it = functionIds.find(fn.get());
+        if (it != functionIds.end())
+            return it->second;
+        int id = (int)functions.size();
+        functionIds[fn.get()] = id;
+        functions.push_back(fn);
+        return id;
+    }
+
+    void writeValue(const Value& v) {
+        out->push_back(static_cast<uint8_t>(v.getType()));
+        switch (v.getType()) {
+        case Value::Type::Nil:
+            break;
+        case Value::Type::Int:
+            writeInt(v.asInt());
+            break;
+        case Value::Type::Double: {
+            uint64_t bits;
+            double d = v.asDouble();
+            std::memcpy(&bits, &d, sizeof bits);
+            for (int i = 0; i < 8; i++)
+                out->push_back(static_cast<uint8_t>(bits >> (8 * i)));
+            break;
+        }
+        case Value::Type::Bool:
+            out->push_back(v.asBool() ? 1 : 0);
+            break;
+        case Value::Type::Color:
+            writeInt(static_cast<int>(v.asColor().value));
+            break;
+        case Value::Type::Pointer:
+            if (v.asPointer())
+                unsupported("a non-null Pointer constant");
+            break;
+        case Value::Type::String:
+            writeString(v.asString());
+            break;
+        case Value::Type::Function:
+            writeInt(functionId(v.asFunction()));
+            break;
+        case Value::Type::Array:
+            writeInt((int)v.asArray()->size());
+            for (size_t i = 0; i < v.asArray()->size(); i++)
+                writeValue(v.asArray()->get(i));
+            break;
+        case Value::Type::Builtin: {
+            int index = -1;
+            for (size_t i = 0; i < record.declares.size(); i++)
+                if (&record.declares[i].function.asBuiltin() == &v.asBuiltin())
+                    index = (int)i;
+            if (index < 0)
+                unsupported("a built-in function value");
+            writeInt(index);
+            break;
+        }
+        case Value::Type::Properties:
+            writeInt((int)v.asProperties().size());
+            for (auto& prop : v.asProperties()) {
+                writeString(prop.first);
+                writeValue(prop.second);
+            }
+            break;
+        case Value::Type::Overloads:
+            writeInt((int)v.asOverloads().size());
+            for (auto& fn : v.asOverloads())
+                writeInt(functionId(fn));
+            break;
+        case Value::Type::Module: {
+            auto& module = v.asModule();
+            writeString(module->name);
+            std::map<std::string, Value> members(module->publicMembers.begin(), module->publicMembers.end());
+            writeInt((int)members.size());
+            for (auto& member : members) {
+                writeString(member.first);
+                writeValue(member.second);
+            }
+            break;
+        }
+        case Value::Type::Enum: {
+            auto& enumObj = v.asEnum();
+            writeString(enumObj->name);
+            std::map<std::string, int> members(enumObj->members.begin(), enumObj->members.end());
+            writeInt((int)members.size());
+            for (auto& member : members) {
+                writeString(member.first);
+                writeInt(member.second);
+            }
+            break;
+        }
+        default:
+            unsupported("a " + getTypeName(v) + " value");
+        }
+    }
+
+    void writeParams(const std::vector<Param>& params) {
+        writeInt((int)params.size());
+        for (auto& p : params) {
+            writeString(p.name);
+            writeString(p.type);
+            out->push_back(p.optional ? 1 : 0);
+            out->push_back(p.isAssigns ? 1 : 0);
+            writeValue(p.defaultValue);
+        }
+    }
+
+    void writeChunk(const ObjFunction::CodeChunk& chunk) {
+        writeInt((int)chunk.code.size());
+        out->insert(out->end(), chunk.code.begin(), chunk.code.end());
+        writeInt((int)chunk.constants.size());
+        for (auto& constant : chunk.constants)
+            writeValue(constant);
+        writeInt((int)chunk.caches.size());
+        writeInt((int)chunk.switches.size());
+        for (auto& sw : chunk.switches) {
+            writeInt(sw.low);
+            writeInt((int)sw.dense.size());
+            for (int target : sw.dense)
+                writeInt(target);
+            std::map<int, int> sparse(sw.sparse.begin(), sw.sparse.end());
+            writeInt((int)sparse.size());
+            for (auto& entry : sparse) {
+                writeInt(entry.first);
+                writeInt(entry.second);
+            }
+            std::map<std::string, int> strings(sw.strings.begin(), sw.strings.end());
+            writeInt((int)strings.size());
+            for (auto& entry : strings) {
+                writeString(entry.first);
+                writeInt(entry.second);
+            }
+        }
+    }
+
+    void writeFunction(const ObjFunction& fn) {
+        writeString(fn.name);
+        writeInt(fn.arity);
+        writeInt(fn.localCount);
+        writeInt(fn.selfSlot);
+        writeParams(fn.params);
+        writeChunk(fn.chunk);
+    }
+};
+
+class ImageReader {
+public:
+    ImageReader(VM& vm, const uint8_t* data, size_t size) : vm(vm), p(data), end(data + size) {}
+
+    void read() {
+        p += sizeof XBC_MAGIC;
+        if (readInt() != XBC_VERSION || readInt() != OP_COUNT)
+            fail("built by a different version of CrossBasic");
+        int declareCount = readInt();
+        for (int i = 0; i < declareCount; i++) {
+            std::string apiName = readString();
+            std::string libraryName = readString();
+            std::string returnType = readString();
+            std::vector<Param> params = readParams();
+            declares.push_back(Value(wrapPluginFunctionForDeclare(params, returnType, apiName, libraryName)));
+        }
+        // Create every function first; constants may refer to any of them.
+        int functionCount = readCount();
+        for (int i = 0; i < functionCount; i++)
+            functions.push_back(std::make_shared<ObjFunction>());
+        for (auto& fn : functions) {
+            fn->name = readString();
+            fn->arity = readInt();
+            fn->localCount = readInt();
+            fn->selfSlot = readInt();
+            fn->params = readParams();
+            if (fn->arity < 0 || fn->arity > (int)fn->params.size() || fn->localCount < 0 ||
+                fn->selfSlot < -1 || fn->selfSlot >= frameSlots(*fn))
+                fail("bad function");
+            readChunk(fn->chunk);
+        }
+        int globalCount = readInt();
+        for (int i = 0; i < globalCount; i++) {
+            std::string name = readString();
+            vm.globals->define(name, readValue());
+        }
+        int extensionCount = readInt();
+        for (int i = 0; i < extensionCount; i++) {
+            std::string type = readString();
+            std::string name = readString();
+            vm.extensionMethods[type][name] = Value(makeExtensionMethod(readValue()));
+        }
+        readChunk(vm.mainChunk);
+        if (p != end)
+            fail("trailing data");
+        for (auto& fn : functions)
+            linkChunk(fn->chunk, frameSlots(*fn));
+        linkChunk(vm.mainChunk, 0);
+    }
+
+    const std::vector<std::shared_ptr<ObjFunction>>& loadedFunctions() const { return functions; }
+
+private:
+    VM& vm;
+    const uint8_t* p;
+    const uint8_t* end;
+    std::vector<Value> declares;
+    std::vector<std::shared_ptr<ObjFunction>> functions;
+
+    [[noreturn]] void fail(const std::string& why) {
+        runtimeError("Invalid bytecode image: " + why + ".");
+    }
+
+    static int frameSlots(const ObjFunction& fn) { return std::max<int>(fn.localCount, (int)fn.params.size()); }
+
+    void need(size_t n) {
+        if ((size_t)(end - p) < n)
+            fail("unexpected end of data");
+    }
+
+    uint8_t readByte() {
+        need(1);
+        return *p++;
+    }
+
+    int readInt() {
+        unsigned value = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            uint8_t byte = readByte();
+            value |= static_cast<unsigned>(byte & 0x7f) << shift;
+            if (byte < 0x80)
+                return static_cast<int>(value);
+        }
+        fail("bad integer");
+    }
+
+    int readCount() {
+        int n = readInt();
+        if (n < 0 || (size_t)n > (size_t)(end - p))
+            fail("bad count");
+        return n;
+    }
+
+    std::string readString() {
+        int n = readCount();
+        std::string s(reinterpret_cast<const char*>(p), n);
+        p += n;
+        return s;
+    }
+
+    std::shared_ptr<ObjFunction> readFunction() {
+        int id = readInt();
+        if (id < 0 || id >= (int)functions.size())
+            fail("bad function reference");
+        return functions[id];
+    }
+
+    Value readValue() {
+        auto type = static_cast<Value::Type>(readByte());
+        switch (type) {
+        case Value::Type::Nil:
+            return Value();
+        case Value::Type::Int:
+            return Value(readInt());
+        case Value::Type::Double: {
+            need(8);
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++)
+                bits |= static_cast<uint64_t>(*p++) << (8 * i);
+            double d;
+            std::memcpy(&d, &bits, sizeof d);
+            return Value(d);
+        }
+        case Value::Type::Bool:
+            return Value(readByte() != 0);
+        case Value::Type::Color:
+            return Value(Color{ static_cast<unsigned int>(readInt()) });
+        case Value::Type::Pointer:
+            return Value(static_cast<void*>(nullptr));
+        case Value::Type::String:
+            return internString(Value(readString()));
+        case Value::Type::Function:
+            return Value(readFunction());
+        case Value::Type::Array: {
+            auto array = std::make_shared<ObjArray>();
+            int n = readCount();
+            for (int i = 0; i < n; i++)
+                array->push(readValue());
+            return Value(array);
+        }
+        case Value::Type::Builtin: {
+            int index = readInt();
+            if (index < 0 || index >= (int)declares.size())
+                fail("bad Declare reference");
+            return declares[index];
+        }
+        case Value::Type::Properties: {
+            PropertiesType props;
+            int n = readCount();
+            for (int i = 0; i < n; i++) {
+                std::string name = readString();
+                props.emplace_back(name, readValue());
+            }
+            return Value(props);
+        }
+        case Value::Type::Overloads: {
+            std::vector<std::shared_ptr<ObjFunction>> overloads;
+            int n = readCount();
+            for (int i = 0; i < n; i++)
+                overloads.push_back(readFunction());
+            return Value(overloads);
+        }
+        case Value::Type::Module: {
+            auto module = std::make_shared<ObjModule>();
+            module->name = readString();
+            int n = readCount();
+            for (int i = 0; i < n; i++) {
+                std::string name = readString();
+                module->publicMembers[name] = readValue();
+            }
+            return Value(module);
+        }
+        case Value::Type::Enum: {
+            auto enumObj = std::make_shared<ObjEnum>();
+            enumObj->name = readString();
+            int n = readCount();
+            for (int i = 0; i < n; i++) {
+                std::string name = readString();
+                enumObj->members[name] = readInt();
+            }
+            return Value(enumObj);
+        }
+        default:
+            fail("bad value tag");
+        }
+    }
+
+    std::vector<Param> readParams() {
+        std::vector<Param> params(readCount());
+        for (auto& param : params) {
+            param.name = readString();
+            param.type = readString();
+            param.optional = readByte() != 0;
+            param.isAssigns = readByte() != 0;
+            param.defaultValue = readValue();
+        }
+        return params;
+    }
+
+    void readChunk(ObjFunction::CodeChunk& chunk) {
+        int codeSize = readCount();
+        chunk.code.assign(p, p + codeSize);
+        p += codeSize;
+        int constantCount = readCount();
+        chunk.constants.clear();
+        for (int i = 0; i < constantCount; i++)
+            chunk.constants.push_back(readValue());
+        int cacheCount = readInt();
+        if (cacheCount < 0 || cacheCount > (int)chunk.code.size())
+            fail("bad cache count");
+        chunk.caches.assign(cacheCount, ObjFunction::PropertyCache());
+        chunk.switches.resize(readCount());
+        for (auto& sw : chunk.switches) {
+            sw.low = readInt();
+            sw.dense.resize(readCount());
+            for (int& target : sw.dense)
+                target = readInt();
+            int sparse = readCount();
+            for (int i = 0; i < sparse; i++) {
+                int key = readInt();
+                sw.sparse[key] = readInt();
+            }
+            int strings = readCount();
+            for (int i = 0; i < strings; i++) {
+                std::string key = readString();
+                sw.strings[key] = readInt();
+            }
+        }
+    }
+
+    // Whether every instruction of the chunk and its operands lie within the
+    // code.
+    static bool fitsChunk(const ObjFunction::CodeChunk& chunk) {
+        const uint8_t* bytes = chunk.code.data();
+        int size = (int)chunk.code.size();
+        for (int ip = 0; ip < size;) {
+            int op = bytes[ip++];
+            if (op >= OP_COUNT)
+                return false;
+            for (const char* f = opcodeOperands(op); *f; f++) {
+                if (*f == 'J') {
+                    if (size - ip < JUMP_TARGET_SIZE)
+                        return false;
+                    ip += JUMP_TARGET_SIZE;
+                    continue;
+                }
+                int length = 0;
+                do {
+                    if (ip + length == size || length == 5)
+                        return false;
+                } while (bytes[ip + length++] >= 0x80);
+                ip += length;
+            }
+        }
+        return true;
+    }
+
+    // Values an instruction reads off the operand stack.
+    static int stackInputs(const Instruction& in) {
+        switch (genericOpcode(in.op)) {
+        case OP_CALL: case OP_OPTIONAL_CALL: case OP_TAIL_CALL:
+            return in.operands[0] + 1;
+        case OP_INVOKE:
+            return in.operands[2] + 1;
+        case OP_ARRAY:
+            return in.operands[0];
+        case OP_CONSTANT: case OP_NIL: case OP_GET_LOCAL: case OP_GET_GLOBAL: case OP_CLASS:
+        case OP_TYPED_ARRAY: case OP_JUMP: case OP_GUARD_LOCAL: case OP_INLINE_GUARD:
+            return 0;
+        case OP_NEGATE: case OP_PRINT: case OP_POP: case OP_DEFINE_GLOBAL: case OP_SET_GLOBAL:
+        case OP_SET_LOCAL: case OP_JUMP_IF_FALSE: case OP_SWITCH: case OP_GUARD: case OP_RETURN:
+        case OP_NEW: case OP_GET_PROPERTY: case OP_PROPERTIES: case OP_DUP:
+            return 1;
+        default:
+            return 2;
+        }
+    }
+
+    // Reject operands the VM would use unchecked: constant indices, frame
+    // slots, property caches, switch tables and value counts.
+    void checkOperands(const ObjFunction::CodeChunk& chunk, const Instruction& in, int slots) {
+        auto constant = [&](int k) -> const Value& {
+            if (in.operands[k] < 0 || in.operands[k] >= (int)chunk.constants.size())
+                fail("bad constant index");
+            return chunk.constants[in.operands[k]];
+        };
+        auto name = [&](int k) {
+            if (!constant(k).isString())
+                fail("bad name");
+        };
+        auto local = [&](int k) {
+            if (in.operands[k] < 0 || in.operands[k] >= slots)
+                fail("bad local slot");
+        };
+        auto cache = [&](int k) {
+            if (in.operands[k] < 0 || in.operands[k] >= (int)chunk.caches.size())
+                fail("bad cache index");
+        };
+        // Each value counted comes from at least one instruction byte.
+        auto count = [&](int k) {
+            if (in.operands[k] < 0 || in.operands[k] > (int)chunk.code.size())
+                fail("bad count");
+        };
+        switch (in.op) {
+        case OP_CONSTANT:
+        case OP_PROPERTIES:
+            constant(0);
+            break;
+        case OP_DEFINE_GLOBAL: case OP_CLASS: case OP_METHOD:
+        case OP_GET_GLOBAL: case OP_SET_GLOBAL:
+            name(0);
+            break;
+        case OP_GET_PROPERTY: case OP_SET_PROPERTY:
+            name(0);
+            cache(1);
+            break;
+        case OP_INVOKE:
+            name(0);
+            cache(1);
+            count(2);
+            break;
+        case OP_CALL: case OP_OPTIONAL_CALL: case OP_TAIL_CALL: case OP_ARRAY:
+            count(0);
+            break;
+        case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_GUARD_LOCAL:
+            local(0);
+            break;
+        case OP_INLINE_GUARD:
+            name(0);
+            if (!constant(2).isFunction())
+                fail("bad function reference");
+            break;
+        case OP_SWITCH:
+            if (in.operands[0] < 0 || in.operands[0] >= (int)chunk.switches.size())
+                fail("bad switch table");
+            break;
+        case OP_FOR_PREP: case OP_FOR_LOOP: case OP_FOR_LOOP_INT:
+            if (in.operands[0] & FOR_GLOBAL)
+                name(1);
+            else
+                local(1);
+            break;
+        }
+    }
+
+    // Check the chunk's operands and operand stack, and point its
+    // interned-slot operands at this VM's global slots. The chunk is only
+    // re-encoded when some slot differs, or to turn the decoded switch
+    // targets back into offsets.
+    void linkChunk(ObjFunction::CodeChunk& chunk, int slots) {
+        std::vector<Instruction> code;
+        if (!fitsChunk(chunk) || !decodeChunk(chunk, code))
+            fail("bad code");
+        for (auto& in : code)
+            checkOperands(chunk, in, slots);
+        // Every instruction must be reached with one stack depth, holding
+        // what it reads; the last one cannot fall off the end of the code.
+        std::vector<int> depth;
+        if (!stackDepths(chunk, code, depth))
+            fail("bad stack depth");
+        for (size_t i = 0; i < code.size(); i++)
+            if (depth[i] >= 0 && depth[i] < stackInputs(code[i]))
+                fail("bad stack depth");
+        bool relinked = false;
+        for (auto& in : code) {
+            int nameOperand, slotOperand;
+            if (in.op == OP_GET_GLOBAL || in.op == OP_SET_GLOBAL || in.op == OP_INLINE_GUARD)
+                nameOperand = 0, slotOperand = 1;
+            else if ((in.op == OP_FOR_PREP || in.op == OP_FOR_LOOP) && (in.operands[0] & FOR_GLOBAL))
+                nameOperand = 1, slotOperand = 2;
+            else
+                continue;
+            int slot = vm.globals->intern(chunk.constants[in.operands[nameOperand]].asString());
+            if (in.operands[slotOperand] != slot) {
+                in.operands[slotOperand] = slot;
+                relinked = true;
+            }
+        }
+        if (relinked || !chunk.switches.empty())
+            encodeChunk(chunk, code);
+    }
+};
+
+bool isBytecodeImage(const uint8_t* data, size_t size) {
+    return size >= sizeof XBC_MAGIC && std::memcmp(data, XBC_MAGIC, sizeof XBC_MAGIC) == 0;
+}
+
+bool buildBytecodeImage(VM& vm, const CompileRecord& record, std::vector<uint8_t>& image, std::string& error) {
+    return ImageWriter(record).write(vm, image, error);
+}
+
+bool writeBytecodeImage(VM& vm, const CompileRecord& record, const std::string& path, std::string& error) {
+    std::vector<uint8_t> image;
+    if (!buildBytecodeImage(vm, record, image, error))
+        return false;
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(image.data()), image.size());
+    if (!file.good()) {
+        error = "unable to write " + path;
+        return false;
+    }
+    return true;
+}
+
+// `functions`, if given, receives the image's functions in image order.
+void loadBytecodeImage(VM& vm, const uint8_t* data, size_t size,
+                       std::vector<std::shared_ptr<ObjFunction>>* functions = nullptr) {
+    ImageReader reader(vm, data, size);
+    reader.read();
+    if (functions)
+        *functions = reader.loadedFunctions();
+}
+
+// A read-only view of a whole file: memory-mapped where the platform allows,
+// read into memory otherwise.
+struct MappedFile {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+            return;
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = reinterpret_cast<const uint8_t*>(buffer.data());
+        size = buffer.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = static_cast<const uint8_t*>(mapped);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data)
+            munmap(const_cast<uint8_t*>(data), size);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+#ifdef _WIN32
+private:
+    std::string buffer;
+#endif
+};
+
+// ============================================================================
+// Compilation cache
+// Scripts run with --s are compiled once and then started from a bytecode
+// image kept in a per-user cache directory: $CROSSBASIC_CACHE_DIR (empty
+// disables the cache), else %LOCALAPPDATA%\CrossBasic\Cache on Windows and
+// $XDG_CACHE_HOME/crossbasic or ~/.cache/crossbasic elsewhere. Each script has
+// one entry, named after a hash of its absolute path, holding
+//   key        hash of the source, the interpreter build, the optimization
+//              level and the loaded plugins
+//   size       byte count of the image that follows
+//   checksum   FNV-1a hash of the image
+//   image      see "Bytecode images"
+// An entry whose key differs is stale and is replaced by the next compile; one
+// whose image does not match its checksum is deleted and the script compiled.
+// Entries are touched when used, and the least recently used ones are evicted
+// once the directory grows past COMPILE_CACHE_LIMIT bytes.
+// ============================================================================
+namespace fs = std::filesystem;
+
+const uintmax_t COMPILE_CACHE_LIMIT = 64u << 20;
+const size_t COMPILE_CACHE_HEADER = 24;
+
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t fnv1a(const std::string& s, uint64_t hash) { return fnv1a(s.data(), s.size(), hash); }
+
+// Mix in the path, size and modification time of a file.
+static uint64_t hashFileStamp(const std::string& path, uint64_t hash) {
+    std::error_code ec;
+    uintmax_t size = fs::file_size(path, ec);
+    int64_t time = fs::last_write_time(path, ec).time_since_epoch().count();
+    hash = fnv1a(path, hash);
+    hash = fnv1a(&size, sizeof size, hash);
+    return fnv1a(&time, sizeof time, hash);
+}
+
+static void storeUint64(uint8_t* at, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        at[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+static uint64_t loadUint64(const uint8_t* at) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v |= static_cast<uint64_t>(at[i]) << (8 * i);
+    return v;
+}
+
+static std::string compileCacheDir() {
+    if (const char* dir = std::getenv("CROSSBASIC_CACHE_DIR"))
+        return dir;
+#ifdef _WIN32
+    if (const char* local = std::getenv("LOCALAPPDATA"))
+        return std::string(local) + "\\CrossBasic\\Cache";
+#else
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
+        return std::string(xdg) + "/crossbasic";
+    if (const char* home = std::getenv("HOME"))
+        return std::string(home) + "/.cache/crossbasic";
+#endif
+    return "";
+}
+
+class CompileCache {
+public:
+    CompileCache(const VM& vm, const std::string& exePath, const std::string& script, const std::string& source) {
+        std::string dir = compileCacheDir();
+        std::error_code ec;
+        fs::path absolute = fs::absolute(script, ec);
+        if (dir.empty() || ec)
+            return;
+        char name[24];
+        snprintf(name, sizeof name, "%016llx.xbc", (unsigned long long)fnv1a(absolute.string(), 14695981039346656037ull));
+        entry = (fs::path(dir) / name).string();
+
+        key = fnv1a(source, 14695981039346656037ull);
+        key = fnv1a(std::string(__DATE__ " " __TIME__), key);
+        int build[] = { XBC_VERSION, OP_COUNT, OPT_LEVEL, TAIL_CALLS };
+        key = fnv1a(build, sizeof build, key);
+        key = hashFileStamp(exePath, key);
+        for (auto& plugin : vm.plugins)
+            key = hashFileStamp(plugin, key);
+    }
+
+    bool enabled() const { return !entry.empty(); }
+
+    // The cached image of the script, or false when there is no current one.
+    bool lookup(const uint8_t*& image, size_t& size) {
+        mapped.reset(new MappedFile(entry));
+        if (mapped->size < COMPILE_CACHE_HEADER ||
+            loadUint64(mapped->data) != key ||
+            loadUint64(mapped->data + 8) != mapped->size - COMPILE_CACHE_HEADER) {
+            mapped.reset();
+            return false;
+        }
+        std::error_code ec;
+        const uint8_t* body = mapped->data + COMPILE_CACHE_HEADER;
+        size_t bodySize = mapped->size - COMPILE_CACHE_HEADER;
+        if (loadUint64(mapped->data + 16) != fnv1a(body, bodySize) || !isBytecodeImage(body, bodySize)) {
+            mapped.reset();
+            fs::remove(entry, ec);
+            DEBUG_LOG("Discarding corrupt cached bytecode " + entry);
+            return false;
+        }
+        image = body;
+        size = bodySize;
+        fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+        DEBUG_LOG("Using cached bytecode " + entry);
+        return true;
+    }
+
+    // Store the freshly compiled program. Failures only cost the next run a
+    // compile, so they are logged and otherwise ignored.
+    void store(VM& vm, const CompileRecord& record) {
+        std::vector<uint8_t> image(COMPILE_CACHE_HEADER);
+        std::vector<uint8_t> body;
+        std::string error;
+        if (!buildBytecodeImage(vm, record, body, error)) {
+            DEBUG_LOG("Not caching bytecode: " + error);
+            return;
+        }
+        storeUint64(image.data(), key);
+        storeUint64(image.data() + 8, body.size());
+        storeUint64(image.data() + 16, fnv1a(body.data(), body.size()));
+        image.insert(image.end(), body.begin(), body.end());
+
+        // Write a private file and rename it over the entry, so concurrent
+        // runs of the same script never see a partial entry.
+        std::error_code ec;
+        fs::create_directories(fs::path(entry).parent_path(), ec);
+        std::string temp = entry + "." + std::to_string(std::random_device{}()) + ".tmp";
+        {
+            std::ofstream file(temp, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(image.data()), image.size());
+            if (!file.good()) {
+                file.close();
+                fs::remove(temp, ec);
+                DEBUG_LOG("Unable to write cached bytecode " + entry);
+                return;
+            }
+        }
+        fs::rename(temp, entry, ec);
+        if (ec) {
+            fs::remove(temp, ec);
+            return;
+        }
+        evict();
+    }
+
+private:
+    std::string entry;
+    uint64_t key = 0;
+    std::unique_ptr<MappedFile> mapped;
+
+    void evict() {
+        struct Entry { fs::file_time_type used; uintmax_t size; fs::path path; };
+        std::vector<Entry> entries;
+        uintmax_t total = 0;
+        std::error_code ec;
+        for (fs::directory_iterator it(fs::path(entry).parent_path(), ec), end; !ec && it != end; it.increment(ec)) {
+            if (it->path().extension() != ".xbc")
+                continue;
+            std::error_code statError;
+            Entry e{ fs::last_write_time(it->path(), statError), fs::file_size(it->path(), statError), it->path() };
+            if (statError)
+                continue;
+            total += e.size;
+            entries.push_back(e);
+        }
+        if (total <= COMPILE_CACHE_LIMIT)
+            return;
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+        for (size_t i = 0; i + 1 < entries.size() && total > COMPILE_CACHE_LIMIT; i++) {
+            if (fs::remove(entries[i].path, ec))
+                total -= entries[i].size;
+        }
+    }
+};
+
+// ============================================================================
+// Baseline JIT (x86-64)
+// With --jit, a scripted function that has been called or looped often
+// enough is translated into native code, one machine-code template per
+// bytecode instruction. The templates work on the frame's Value slots in
+// place: slot i of a frame is vm.stack[base + i], locals first and then the
+// operand stack, whose depth at every instruction is known at compile time.
+// Numbers, booleans and nil are handled natively behind type guards, and
+// globals and Select Case through small helpers. A failed guard, and every
+// instruction without a template (calls, returns, properties, strings),
+// leaves native code at the start of that instruction and the interpreter
+// carries on from there with the stack cut back to that instruction's depth.
+// The interpreter re-enters native code at calls, returns and loop
+// back-edges, so a call in a loop costs one round trip. Since templates
+// never retain or release, a value they cannot see into (anything boxed)
+// always ends in a guard exit, and slots above the operand stack only ever
+// hold unboxed values. A function whose guards keep failing is dropped back
+// to the interpreter for good.
+// ============================================================================
+#ifndef CROSSBASIC_JIT
+#if defined(__x86_64__) || defined(_M_X64)
+#define CROSSBASIC_JIT 1
+#else
+#define CROSSBASIC_JIT 0
+#endif
+#endif
+
+const int JIT_DEFAULT_THRESHOLD = 1000;
+// An exit code with this bit set comes from a failed guard.
+const uint32_t JIT_GUARD_EXIT = 0x80000000u;
+
+// An OP_GET_GLOBAL / OP_SET_GLOBAL site in native code, which hands the
+// lookup to a helper.
+struct JitGlobalSite {
+    VM* vm;
+    const ObjFunction* fn;
+    int nameIndex;
+    int slot;
+    int top;   // frame slot the value is pushed to or popped from
+};
+
+// An OP_INLINE_GUARD site in native code, checked by a helper.
+struct JitInlineSite {
+    VM* vm;
+    const ObjFunction* fn;
+    int nameIndex;
+    int slot;
+    int functionIndex;
+};
+
+// An OP_SWITCH site in native code; a helper finds the Case and returns
+// its native address.
+struct JitSwitchSite {
+    const ObjFunction::SwitchTable* table;
+    int defaultTarget;
+    int top;   // frame slot of the selector
+    const JitCode* jit;
+};
+
+struct JitCode {
+    // Runs from `at` with `slots` pointing at the frame's first slot and
+    // returns the bytecode offset to resume at, tagged with JIT_GUARD_EXIT.
+    using Entry = uint32_t (*)(Value* slots, const uint8_t* at);
+    Entry entry = nullptr;
+    // The same contract for a function compiled ahead of time, which starts
+    // at a bytecode offset (see "Ahead-of-time compilation").
+    using Native = uint32_t (*)(VM& vm, const ObjFunction& fn, Value* slots, int ip);
+    Native native = nullptr;
+    uint8_t* memory = nullptr;
+    size_t size = 0;
+    std::vector<int> offsets;   // native offset per bytecode offset, -1 if none
+    std::vector<int> depth;     // operand stack depth per bytecode offset
+    int frameSlots = 0;
+    int maxDepth = 0;
+    std::deque<JitGlobalSite> globals;   // stable addresses, baked into the code
+    std::deque<JitSwitchSite> switches;
+    std::deque<JitInlineSite> inlines;
+    uint32_t entries = 0;
+    uint32_t bailouts = 0;
+
+    JitCode() = default;
+    JitCode(const JitCode&) = delete;
+    JitCode& operator=(const JitCode&) = delete;
+    ~JitCode() {
+        if (!memory) return;
+#ifdef _WIN32
+        VirtualFree(memory, 0, MEM_RELEASE);
+#else
+        munmap(memory, size);
+#endif
+    }
+};
+
+// Compiled code lives as long as the process; functions only point at it.
+std::vector<std::unique_ptr<JitCode>> jitCodes;
+
+#if CROSSBASIC_JIT
+static double jitPow(double a, double b) { return std::pow(a, b); }
+static double jitFmod(double a, double b) { return std::fmod(a, b); }
+
+// Global reads and writes from native code. They return 0, changing
+// nothing, when the name does not resolve, which leaves the error (or the
+// built-in Microseconds and Ticks) to the interpreter.
+static uint32_t jitGetGlobal(Value* slots, const JitGlobalSite* site) {
+    const Value* self = site->fn->selfSlot >= 0 ? &slots[site->fn->selfSlot] : nullptr;
+    Value* found = findGlobal(*site->vm, site->fn->chunk, site->nameIndex, site->slot, self);
+    if (!found)
+        return 0;
+    slots[site->top] = *found;
+    return 1;
+}
+
+static uint32_t jitSetGlobal(Value* slots, const JitGlobalSite* site) {
+    const Value* self = site->fn->selfSlot >= 0 ? &slots[site->fn->selfSlot] : nullptr;
+    Value* found = findGlobal(*site->vm, site->fn->chunk, site->nameIndex, site->slot, self);
+    if (!found)
+        return 0;
+    *found = std::move(slots[site->top]);
+    return 1;
+}
+
+static uint32_t jitInlineGuard(Value* slots, const JitInlineSite* site) {
+    const Value* self = site->fn->selfSlot >= 0 ? &slots[site->fn->selfSlot] : nullptr;
+    return inlinedCallee(*site->vm, site->fn->chunk, site->nameIndex, site->slot, site->functionIndex, self);
+}
+
+static const uint8_t* jitSwitch(Value* slots, const JitSwitchSite* site) {
+    int target = site->table->find(slots[site->top]);
+    slots[site->top] = Value();   // the selector may be a String
+    if (target < 0)
+        target = site->defaultTarget;
+    return site->jit->memory + site->jit->offsets[target];
+}
+
+struct JitCompiler : FrameLayout {
+    // Register numbers as encoded in ModRM; xmm registers use the same.
+    enum { EAX = 0, ECX = 1, EDX = 2 };
+    // Condition codes (the low nibble of Jcc/SETcc).
+    enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+           CC_P = 0xA, CC_NP = 0xB, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+    static_assert(offsetof(Value, type) == 0 && offsetof(Value, as) == 8,
+                  "templates store the tag as the first qword, the payload as the second");
+    static const uint8_t T_NIL = (uint8_t)Value::Type::Nil;
+    static const uint8_t T_INT = (uint8_t)Value::Type::Int;
+    static const uint8_t T_DOUBLE = (uint8_t)Value::Type::Double;
+    static const uint8_t T_BOOL = (uint8_t)Value::Type::Bool;
+    static const uint8_t T_BOXED = (uint8_t)Value::Type::String;
+
+    // A rel32 field to patch once the destination is known: another
+    // instruction, or an exit stub for one.
+    enum FixupKind { TO_INSTRUCTION, TO_EXIT, TO_GUARD_EXIT };
+    struct Fixup { size_t end; FixupKind kind; int ip; };
+
+    VM& vm;
+    JitCode* jit = nullptr;
+    std::vector<uint8_t> out;
+    std::vector<Fixup> fixups;
+    int nextIp = 0;   // offset of the instruction after the one being emitted
+
+    JitCompiler(VM& v, const ObjFunction& f) : FrameLayout(f), vm(v) { }
+
+    // ---- encoding --------------------------------------------------------
+    void emit(std::initializer_list<uint8_t> bytes) { out.insert(out.end(), bytes); }
+    void imm32(uint32_t v) { for (int i = 0; i < 4; i++) out.push_back((uint8_t)(v >> (8 * i))); }
+    void imm64(uint64_t v) { for (int i = 0; i < 8; i++) out.push_back((uint8_t)(v >> (8 * i))); }
+    // `opcode` with a ModRM operand [rbx + disp32]; rbx holds the slot base.
+    void mem(std::initializer_list<uint8_t> opcode, int reg, int32_t disp) {
+        emit(opcode);
+        out.push_back((uint8_t)(0x80 | (reg << 3) | 3));
+        imm32((uint32_t)disp);
+    }
+    static int32_t typeAt(int slot) { return slot * (int32_t)sizeof(Value) + (int32_t)offsetof(Value, type); }
+    static int32_t payloadAt(int slot) { return slot * (int32_t)sizeof(Value) + (int32_t)offsetof(Value, as); }
+
+    size_t jcc(int cc) { emit({ 0x0F, (uint8_t)(0x80 | cc) }); imm32(0); return out.size(); }
+    size_t jmp() { emit({ 0xE9 }); imm32(0); return out.size(); }
+    void patch(size_t end, size_t target) {
+        uint32_t rel = (uint32_t)((int64_t)target - (int64_t)end);
+        for (int i = 0; i < 4; i++) out[end - 4 + i] = (uint8_t)(rel >> (8 * i));
+    }
+    void bind(size_t end) { patch(end, out.size()); }
+    void jccTo(int cc, FixupKind kind, int ip) { fixups.push_back({ jcc(cc), kind, ip }); }
+    void jmpTo(FixupKind kind, int ip) { fixups.push_back({ jmp(), kind, ip }); }
+    void guard(int cc, int ip) { jccTo(cc, TO_GUARD_EXIT, ip); }
+
+    // cmp byte [slot type], t
+    void cmpType(int slot, uint8_t t) { mem({ 0x80 }, 7, typeAt(slot)); out.push_back(t); }
+    // mov qword [slot type], t -- the whole word, so the qword loads of
+    // copySlot() can be forwarded from this store
+    void setType(int slot, uint8_t t) { mem({ 0x48, 0xC7 }, 0, typeAt(slot)); imm32(t); }
+    void guardUnboxed(int slot, int ip) { cmpType(slot, T_BOXED); guard(CC_AE, ip); }
+    // mov r32, [slot payload]
+    void loadInt(int reg, int slot) { mem({ 0x8B }, reg, payloadAt(slot)); }
+    // mov [slot payload], rax -- a 32-bit result in eax has a zero upper half
+    void storeRax(int slot) { mem({ 0x48, 0x89 }, EAX, payloadAt(slot)); }
+    void storeInt(int slot) { storeRax(slot); setType(slot, T_INT); }
+    // movzx eax, al; then store as a Boolean
+    void storeBool(int slot) { emit({ 0x0F, 0xB6, 0xC0 }); storeRax(slot); setType(slot, T_BOOL); }
+    void storeDouble(int slot) { mem({ 0xF2, 0x0F, 0x11 }, 0, payloadAt(slot)); setType(slot, T_DOUBLE); }
+    void setcc(int cc, int reg) { emit({ 0x0F, (uint8_t)(0x90 | cc), (uint8_t)(0xC0 | reg) }); }
+    // Copies a Value as two qwords, the widths the templates store with.
+    void copySlot(int from, int to) {
+        mem({ 0x48, 0x8B }, EAX, typeAt(from));
+        mem({ 0x48, 0x8B }, ECX, payloadAt(from));
+        mem({ 0x48, 0x89 }, EAX, typeAt(to));
+        mem({ 0x48, 0x89 }, ECX, payloadAt(to));
+    }
+    // An Integer or Double slot as a double in xmm`reg`; anything else exits.
+    void loadNumber(int reg, int slot, int ip) {
+        cmpType(slot, T_DOUBLE);
+        size_t notDouble = jcc(CC_NE);
+        mem({ 0xF2, 0x0F, 0x10 }, reg, payloadAt(slot));
+        size_t done = jmp();
+        bind(notDouble);
+        cmpType(slot, T_INT);
+        guard(CC_NE, ip);
+        mem({ 0xF2, 0x0F, 0x2A }, reg, payloadAt(slot));
+        bind(done);
+    }
+    // Calls a C++ helper whose arguments are already in place. rbx is
+    // callee-saved; the shadow space Win64 wants also keeps rsp aligned.
+    void callHelper(const void* helper) {
+        emit({ 0x48, 0x83, 0xEC, 0x20 });
+        emit({ 0x48, 0xB8 }); imm64((uint64_t)(uintptr_t)helper);
+        emit({ 0xFF, 0xD0 });
+        emit({ 0x48, 0x83, 0xC4, 0x20 });
+    }
+    // helper(slots, site) for a helper taking the slots and its site record.
+    void callSiteHelper(const void* helper, const void* site) {
+#ifdef _WIN32
+        emit({ 0x48, 0x89, 0xD9, 0x48, 0xBA });   // mov rcx, rbx; mov rdx, imm64
+#else
+        emit({ 0x48, 0x89, 0xDF, 0x48, 0xBE });   // mov rdi, rbx; mov rsi, imm64
+#endif
+        imm64((uint64_t)(uintptr_t)site);
+        callHelper(helper);
+    }
+    // A global access, leaving for the interpreter at `ip` if the helper
+    // returns 0.
+    void globalAccess(uint32_t (*helper)(Value*, const JitGlobalSite*), int nameIndex, int slot,
+                      int top, int ip) {
+        jit->globals.push_back(JitGlobalSite{ &vm, &fn, nameIndex, slot, top });
+        callSiteHelper((const void*)helper, &jit->globals.back());
+        emit({ 0x85, 0xC0 });                     // test eax, eax
+        jccTo(CC_E, TO_EXIT, ip);
+    }
+    // Leaves for the interpreter at `ip` when a plugin callback is queued or cycles are due.
+    void safepoint(int ip) {
+        emit({ 0x48, 0xB8 }); imm64((uint64_t)(uintptr_t)&safepointPending);
+        emit({ 0x80, 0x38, 0x00 });
+        jccTo(CC_NE, TO_EXIT, ip);
+    }
+    void exitAt(int ip, uint32_t tag) {
+        emit({ 0xB8 }); imm32((uint32_t)ip | tag);
+        emit({ 0x5B, 0xC3 });   // pop rbx; ret
+    }
+
+    // ---- templates -------------------------------------------------------
+    // Integer and Double arithmetic; Integer op Integer stays an Integer.
+    void arithmetic(int op, int a, int b, int ip) {
+        static const uint8_t intOps[][3] = { { 0x01, 0xC8, 0 }, { 0x29, 0xC8, 0 }, { 0x0F, 0xAF, 0xC1 } };
+        static const uint8_t sdOps[] = { 0x58, 0x5C, 0x59, 0x5E };
+        int index = op == OP_ADD ? 0 : op == OP_SUB ? 1 : op == OP_MUL ? 2 : 3;
+        size_t done = 0;
+        if (op != OP_DIV) {
+            cmpType(a, T_INT);
+            size_t notInt1 = jcc(CC_NE);
+            cmpType(b, T_INT);
+            size_t notInt2 = jcc(CC_NE);
+            loadInt(EAX, a);
+            loadInt(ECX, b);
+            if (intOps[index][2]) emit({ intOps[index][0], intOps[index][1], intOps[index][2] });
+            else emit({ intOps[index][0], intOps[index][1] });
+            storeRax(a);
+            done = jmp();
+            bind(notInt1);
+            bind(notInt2);
+        }
+        loadNumber(0, a, ip);
+        loadNumber(1, b, ip);
+        emit({ 0xF2, 0x0F, sdOps[index], 0xC1 });
+        storeDouble(a);
+        if (done) bind(done);
+    }
+
+    // OP_GUARD / OP_GUARD_LOCAL as passGuard() runs them; a failed
+    // specialized guard leaves for the interpreter, which deoptimizes.
+    void typeGuard(int slot, int declared, int ip) {
+        uint8_t want = (uint8_t)(declared & ~GUARD_GENERIC);
+        bool generic = (declared & GUARD_GENERIC) != 0;
+        cmpType(slot, want);
+        size_t done = jcc(CC_E);
+        if (want == T_DOUBLE) {
+            cmpType(slot, T_INT);
+            size_t notInt = jcc(CC_NE);
+            mem({ 0xF2, 0x0F, 0x2A }, 0, payloadAt(slot));   // cvtsi2sd xmm0, dword [payload]
+            storeDouble(slot);
+            size_t converted = jmp();
+            bind(notInt);
+            if (!generic) jmpTo(TO_GUARD_EXIT, ip);
+            bind(converted);
+        }
+        else if (!generic)
+            jmpTo(TO_GUARD_EXIT, ip);
+        bind(done);
+    }
+
+    // Integer % Integer, or fmod when either side is a Double.
+    void modulo(int a, int b, int ip) {
+        cmpType(a, T_INT);
+        size_t notInt1 = jcc(CC_NE);
+        cmpType(b, T_INT);
+        size_t notInt2 = jcc(CC_NE);
+        loadInt(EAX, a);
+        loadInt(ECX, b);
+        emit({ 0x85, 0xC9 });             // test ecx, ecx
+        guard(CC_E, ip);
+        emit({ 0x83, 0xF9, 0xFF });       // cmp ecx, -1
+        guard(CC_E, ip);
+        emit({ 0x99, 0xF7, 0xF9 });       // cdq; idiv ecx
+        emit({ 0x89, 0xD0 });             // mov eax, edx
+        storeRax(a);
+        size_t done = jmp();
+        bind(notInt1);
+        bind(notInt2);
+        loadNumber(0, a, ip);
+        loadNumber(1, b, ip);
+        callHelper((const void*)jitFmod);
+        storeDouble(a);
+        bind(done);
+    }
+
+    // Compares slots a and b as compareValues() does. Emits the Integer case
+    // and then the Double case, each ending in flags for `intCc`/`doubleCc`;
+    // `onResult` is called after each with the condition that holds.
+    template<typename OnResult>
+    void ordered(int op, int a, int b, int ip, OnResult onResult) {
+        int intCc = op == OP_LT ? CC_L : op == OP_LE ? CC_LE : op == OP_GT ? CC_G : CC_GE;
+        cmpType(a, T_INT);
+        size_t notInt1 = jcc(CC_NE);
+        cmpType(b, T_INT);
+        size_t notInt2 = jcc(CC_NE);
+        loadInt(EAX, a);
+        mem({ 0x3B }, EAX, payloadAt(b));                 // cmp eax, [b]
+        onResult(intCc);
+        bind(notInt1);
+        bind(notInt2);
+        loadNumber(0, a, ip);
+        loadNumber(1, b, ip);
+        // Unordered (NaN) sets CF, so "above" tests are false for NaN.
+        if (op == OP_LT || op == OP_LE) emit({ 0x66, 0x0F, 0x2E, 0xC8 });  // ucomisd xmm1, xmm0
+        else emit({ 0x66, 0x0F, 0x2E, 0xC1 });                             // ucomisd xmm0, xmm1
+        onResult((op == OP_LT || op == OP_GT) ? CC_A : CC_AE);
+    }
+
+    void comparison(int op, int a, int b, int ip) {
+        std::vector<size_t> done;
+        ordered(op, a, b, ip, [&](int cc) { setcc(cc, EAX); done.push_back(jmp()); });
+        for (size_t d : done) bind(d);
+        storeBool(a);
+    }
+
+    // OP_EQ / OP_NE on numbers and Booleans; other operands exit.
+    void equality(int op, int a, int b, int ip) {
+        int cc = op == OP_EQ ? CC_E : CC_NE;
+        std::vector<size_t> done;
+        cmpType(a, T_INT);
+        size_t notInt1 = jcc(CC_NE);
+        cmpType(b, T_INT);
+        size_t notInt2 = jcc(CC_NE);
+        loadInt(EAX, a);
+        mem({ 0x3B }, EAX, payloadAt(b));
+        setcc(cc, EAX);
+        done.push_back(jmp());
+        bind(notInt1);
+        bind(notInt2);
+        cmpType(a, T_DOUBLE);
+        size_t number1 = jcc(CC_E);
+        cmpType(b, T_DOUBLE);
+        size_t number2 = jcc(CC_E);
+        cmpType(a, T_BOOL);
+        guard(CC_NE, ip);
+        cmpType(b, T_BOOL);
+        guard(CC_NE, ip);
+        loadInt(EAX, a);
+        mem({ 0x3B }, EAX, payloadAt(b));
+        setcc(cc, EAX);
+        done.push_back(jmp());
+        bind(number1);
+        bind(number2);
+        loadNumber(0, a, ip);
+        loadNumber(1, b, ip);
+        emit({ 0x66, 0x0F, 0x2E, 0xC1 });                 // ucomisd xmm0, xmm1
+        if (op == OP_EQ) { setcc(CC_E, EAX); setcc(CC_NP, ECX); emit({ 0x20, 0xC8 }); }  // and al, cl
+        else { setcc(CC_NE, EAX); setcc(CC_P, ECX); emit({ 0x08, 0xC8 }); }              // or al, cl
+        for (size_t d : done) bind(d);
+        storeBool(a);
+    }
+
+    // The truth of a Boolean or Integer slot in `reg` (al or cl).
+    void truth(int reg, int slot, int ip) {
+        cmpType(slot, T_BOOL);
+        size_t notBool = jcc(CC_NE);
+        mem({ 0x0F, 0xB6 }, reg, payloadAt(slot));       // movzx reg, byte [payload]
+        size_t done = jmp();
+        bind(notBool);
+        cmpType(slot, T_INT);
+        guard(CC_NE, ip);
+        mem({ 0x83 }, 7, payloadAt(slot)); out.push_back(0);  // cmp dword [payload], 0
+        setcc(CC_NE, reg);
+        bind(done);
+    }
+
+    void forLoop(int op, int target, int flags, int counter, int end, int step, int ip) {
+        // Check the end value first: the counter may not change before a guard.
+        cmpType(end, T_INT);
+        size_t endOk = jcc(CC_E);
+        cmpType(end, T_DOUBLE);
+        guard(CC_NE, ip);
+        bind(endOk);
+        if (op == OP_FOR_LOOP) {
+            cmpType(counter, T_INT);
+            size_t notInt1 = jcc(CC_NE);
+            cmpType(step, T_INT);
+            size_t notInt2 = jcc(CC_NE);
+            loadInt(EAX, counter);
+            mem({ 0x03 }, EAX, payloadAt(step));         // add eax, [step]
+            storeRax(counter);
+            size_t added = jmp();
+            bind(notInt1);
+            bind(notInt2);
+            loadNumber(0, counter, ip);
+            loadNumber(1, step, ip);
+            emit({ 0xF2, 0x0F, 0x58, 0xC1 });
+            storeDouble(counter);
+            bind(added);
+        }
+        // FOR_PREP skips the loop once the counter is past the end value;
+        // FOR_LOOP jumps back while it is not.
+        int compare = (flags & FOR_DOWN) ? OP_GE : OP_LE;
+        if (op == OP_FOR_PREP) {
+            ordered(compare, counter, end, ip, [&](int cc) {
+                jccTo(cc ^ 1, TO_INSTRUCTION, target);
+                jmpTo(TO_INSTRUCTION, nextIp);
+            });
+            return;
+        }
+        std::vector<size_t> more;
+        ordered(compare, counter, end, ip, [&](int cc) {
+            more.push_back(jcc(cc));
+            jmpTo(TO_INSTRUCTION, nextIp);
+        });
+        for (size_t m : more) bind(m);
+        safepoint(target);
+        jmpTo(TO_INSTRUCTION, target);
+    }
+
+    bool instruction(int ip, int op, const int* operands, int target) {
+        int d = depth[ip];
+        int top = frameSlots + d;   // first free slot
+        switch (op) {
+        case OP_CONSTANT: {
+            const Value& c = fn.chunk.constants[operands[0]];
+            if (c.isBoxed()) return false;
+            emit({ 0x48, 0xB8 });
+            uint64_t bits = 0;
+            std::memcpy(&bits, &c.as, sizeof(bits));
+            imm64(bits);
+            storeRax(top);
+            setType(top, (uint8_t)c.type);
+            return true;
+        }
+        case OP_NIL:
+            emit({ 0x31, 0xC0 });   // xor eax, eax
+            storeRax(top);
+            setType(top, T_NIL);
+            return true;
+        case OP_GET_LOCAL:
+            guardUnboxed(operands[0], ip);
+            copySlot(operands[0], top);
+            return true;
+        case OP_SET_LOCAL:
+            guardUnboxed(top - 1, ip);
+            guardUnboxed(operands[0], ip);
+            copySlot(top - 1, operands[0]);
+            return true;
+        case OP_GET_GLOBAL:
+            globalAccess(jitGetGlobal, operands[0], operands[1], top, ip);
+            return true;
+        case OP_SET_GLOBAL:
+            globalAccess(jitSetGlobal, operands[0], operands[1], top - 1, ip);
+            return true;
+        case OP_INLINE_GUARD:
+            jit->inlines.push_back(JitInlineSite{ &vm, &fn, operands[0], operands[1], operands[2] });
+            callSiteHelper((const void*)jitInlineGuard, &jit->inlines.back());
+            emit({ 0x85, 0xC0 });                     // test eax, eax
+            jccTo(CC_E, TO_INSTRUCTION, target);
+            return true;
+        case OP_SWITCH:
+            jit->switches.push_back(JitSwitchSite{ &fn.chunk.switches[operands[0]], target, top - 1, jit });
+            callSiteHelper((const void*)jitSwitch, &jit->switches.back());
+            emit({ 0xFF, 0xE0 });                     // jmp rax
+            return true;
+        case OP_DUP:
+            guardUnboxed(top - 1, ip);
+            copySlot(top - 1, top);
+            return true;
+        case OP_POP:
+            guardUnboxed(top - 1, ip);
+            return true;
+        case OP_GUARD: case OP_GUARD_LOCAL:
+            typeGuard(op == OP_GUARD ? top - 1 : operands[0], operands[op == OP_GUARD ? 0 : 1], ip);
+            return true;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+            arithmetic(op, top - 2, top - 1, ip);
+            return true;
+        case OP_MOD:
+            modulo(top - 2, top - 1, ip);
+            return true;
+        case OP_POW:
+            loadNumber(0, top - 2, ip);
+            loadNumber(1, top - 1, ip);
+            callHelper((const void*)jitPow);
+            storeDouble(top - 2);
+            return true;
+        case OP_NEGATE: {
+            cmpType(top - 1, T_INT);
+            size_t notInt = jcc(CC_NE);
+            mem({ 0xF7 }, 3, payloadAt(top - 1));         // neg dword [payload]
+            size_t done = jmp();
+            bind(notInt);
+            cmpType(top - 1, T_DOUBLE);
+            guard(CC_NE, ip);
+            mem({ 0x48, 0x0F, 0xBA }, 7, payloadAt(top - 1)); out.push_back(63);  // btc qword, 63
+            bind(done);
+            return true;
+        }
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+            comparison(op, top - 2, top - 1, ip);
+            return true;
+        case OP_EQ: case OP_NE:
+            equality(op, top - 2, top - 1, ip);
+            return true;
+        case OP_AND: case OP_OR:
+            truth(EAX, top - 2, ip);
+            truth(ECX, top - 1, ip);
+            emit({ (uint8_t)(op == OP_AND ? 0x20 : 0x08), 0xC8 });
+            storeBool(top - 2);
+            return true;
+        case OP_JUMP:
+            if (target <= ip)
+                safepoint(target);
+            jmpTo(TO_INSTRUCTION, target);
+            return true;
+        case OP_JUMP_IF_FALSE: {
+            // Booleans and Integers test their value, strings exit and other
+            // unboxed values count as False.
+            int cond = top - 1;
+            cmpType(cond, T_BOOL);
+            size_t notBool = jcc(CC_NE);
+            mem({ 0x80 }, 7, payloadAt(cond)); out.push_back(0);
+            jccTo(CC_E, TO_INSTRUCTION, target);
+            size_t done1 = jmp();
+            bind(notBool);
+            cmpType(cond, T_INT);
+            size_t notInt = jcc(CC_NE);
+            mem({ 0x83 }, 7, payloadAt(cond)); out.push_back(0);
+            jccTo(CC_E, TO_INSTRUCTION, target);
+            size_t done2 = jmp();
+            bind(notInt);
+            guardUnboxed(cond, ip);
+            jmpTo(TO_INSTRUCTION, target);
+            bind(done1);
+            bind(done2);
+            return true;
+        }
+        case OP_COMPARE_JUMP:
+            ordered(operands[0], top - 2, top - 1, ip, [&](int cc) {
+                jccTo(cc ^ 1, TO_INSTRUCTION, target);
+                jmpTo(TO_INSTRUCTION, nextIp);
+            });
+            return true;
+        case OP_FOR_PREP: case OP_FOR_LOOP:
+            if (operands[0] & FOR_GLOBAL) return false;
+            forLoop(op, target, operands[0], operands[1], top - 2, top - 1, ip);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    JitCode* compile() {
+        if (codeSize == 0 || !analyze())
+            return nullptr;
+        auto owned = std::make_unique<JitCode>();
+        jit = owned.get();
+        jit->offsets.assign(codeSize, -1);
+        // Prologue: keep rbx, point it at the slots and jump to the entry.
+#ifdef _WIN32
+        emit({ 0x53, 0x48, 0x89, 0xCB, 0xFF, 0xE2 });   // push rbx; mov rbx, rcx; jmp rdx
+#else
+        emit({ 0x53, 0x48, 0x89, 0xFB, 0xFF, 0xE6 });   // push rbx; mov rbx, rdi; jmp rsi
+#endif
+        for (int ip = 0; ip < codeSize;) {
+            int op, operands[4], target;
+            nextIp = decode(ip, op, operands, target);
+            if (depth[ip] >= 0) {
+                jit->offsets[ip] = (int)out.size();
+                if (!instruction(ip, op, operands, target))
+                    exitAt(ip, 0);
+            }
+            ip = nextIp;
+        }
+        // Exit stubs, one per instruction and kind, after the main code.
+        std::map<std::pair<int, int>, size_t> stubs;
+        for (const Fixup& f : fixups) {
+            if (f.kind == TO_INSTRUCTION) {
+                patch(f.end, jit->offsets[f.ip]);
+                continue;
+            }
+            auto key = std::make_pair((int)f.kind, f.ip);
+            auto it = stubs.find(key);
+            if (it == stubs.end()) {
+                it = stubs.emplace(key, out.size()).first;
+                exitAt(f.ip, f.kind == TO_GUARD_EXIT ? JIT_GUARD_EXIT : 0);
+            }
+            patch(f.end, it->second);
+        }
+
+        size_t size = out.size();
+#ifdef _WIN32
+        void* memory = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!memory) return nullptr;
+        std::memcpy(memory, out.data(), size);
+        DWORD oldProtect;
+        if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &oldProtect)) {
+            VirtualFree(memory, 0, MEM_RELEASE);
+            return nullptr;
+        }
+        FlushInstructionCache(GetCurrentProcess(), memory, size);
+#else
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return nullptr;
+        std::memcpy(memory, out.data(), size);
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, size);
+            return nullptr;
+        }
+#endif
+        jit->memory = static_cast<uint8_t*>(memory);
+        jit->size = size;
+        jit->entry = reinterpret_cast<JitCode::Entry>(memory);
+        jit->depth = std::move(depth);
+        jit->frameSlots = frameSlots;
+        jit->maxDepth = maxDepth;
+        jitCodes.push_back(std::move(owned));
+        return jit;
+    }
+};
+#endif
+
+// Native code for `fn`, or nullptr when it cannot be compiled.
+static const JitCode* compileJit(VM& vm, const ObjFunction& fn) {
+#if CROSSBASIC_JIT
+    const JitCode* jit = JitCompiler(vm, fn).compile();
+    DEBUG_LOG("JIT: " + fn.name + (jit ? " compiled to " + std::to_string(jit->size) + " bytes" : " not compiled"));
+    return jit;
+#else
+    (void)vm;
+    (void)fn;
+    return nullptr;
+#endif
+}
+
+// Runs `fn`'s native code for the frame at `base` from bytecode offset `ip`
+// and returns the offset the interpreter resumes at.
+static int runJit(VM& vm, const ObjFunction& fn, size_t base, int ip) {
+    JitCode& jit = const_cast<JitCode&>(*fn.jitCode);
+    if (jit.offsets[ip] < 0 || vm.stack.size() != base + jit.frameSlots + jit.depth[ip])
+        return ip;
+    vm.stack.resize(base + jit.frameSlots + jit.maxDepth);
+    uint32_t exit = jit.native ? jit.native(vm, fn, vm.stack.data() + base, ip)
+                               : jit.entry(vm.stack.data() + base, jit.memory + jit.offsets[ip]);
+    int resume = (int)(exit & ~JIT_GUARD_EXIT);
+    vm.stack.resize(base + jit.frameSlots + jit.depth[resume]);
+    jit.entries++;
+    // A function whose guards keep failing runs better interpreted.
+    if ((exit & JIT_GUARD_EXIT) && ++jit.bailouts > 64 && jit.bailouts > jit.entries / 8) {
+        DEBUG_LOG("JIT: " + fn.name + " deoptimized");
+        fn.jitCode = nullptr;
+        fn.jitRejected = true;
+    }
+    callbackSafepoint();
+    return resume;
+}
+
+// ============================================================================
+// Ahead-of-time compilation (C++)
+// `--emit-cpp app.cpp` translates a program into C++ that XCompile builds,
+// together with this source, into a standalone executable (`xcompile -AOT`).
+// The file defines CROSSBASIC_AOT, includes crossbasic.cpp, embeds the
+// program's bytecode image, encrypted like the code xcompile appends to an
+// executable, and adds one C++ function per scripted function.
+// These follow the baseline JIT's rules: they reach each instruction
+// through a switch on its bytecode offset, handle numbers and booleans
+// inline behind type tests the C++ compiler can fold, look up globals and
+// Select Case through the interpreter's own helpers, and return the offset
+// the interpreter carries on from for everything else. Slots that the type
+// specializer proves Integer or Double, from declared `As` types and
+// OP_GUARD, are kept unboxed in C++ locals rather than in the frame. Functions are matched to the loaded image by position
+// and checked against a hash of their bytecode, so one that links
+// differently stays interpreted.
+// ============================================================================
+#ifndef CROSSBASIC_AOT
+#define CROSSBASIC_AOT 0
+#endif
+
+static uint32_t aotCodeHash(const ObjFunction& fn) {
+    return (uint32_t)fnv1a(fn.chunk.code.data(), fn.chunk.code.size());
+}
+
+// Writes the C++ function for one scripted function. Where the type
+// specializer's analysis knows a slot (a local or an operand) to hold an
+// Integer or a Double, the slot lives in a C++ int or double instead of the
+// frame: i3 or d3 for slot 3. Such values are written back to the frame
+// wherever the interpreter takes over, and loaded, after a type test, where
+// it hands a frame back. Guards leave for the interpreter when a value does
+// not have the type that code after them keeps unboxed.
+class CppEmitter : FrameLayout {
+public:
+    explicit CppEmitter(const ObjFunction& f) : FrameLayout(f) { }
+
+    // False when the function's frame has no fixed layout; it is then left
+    // to the interpreter.
+    bool emit(std::ostream& out, const std::string& name) {
+        if (codeSize == 0 || !analyze())
+            return false;
+        analyzeTypes();
+        out << "// " << fn.name << "\n"
+            << "static uint32_t " << name << "(VM& vm, const ObjFunction& fn, Value* s, int ip) {\n"
+            << "    (void)vm; (void)fn;\n";
+        std::set<std::string> variables;
+        for (const auto* types : { &before, &after })
+            for (const auto& t : *types)
+                for (int k = 0; k < (int)t.size(); k++)
+                    if (char kind = unboxed(t, k))
+                        variables.insert((kind == 'i' ? "int " : "double ") + var(kind, k));
+        for (const auto& v : variables)
+            out << "    " << v << " = 0;\n";
+        out << "    switch (ip) {\n";
+        for (int ip = 0; ip < codeSize; ip = next(ip))
+            if (depth[ip] >= 0)
+                out << "    case " << ip << ": " << enter(ip) << "goto L" << ip << ";\n";
+        out << "    default: return " << ip(0) << ";\n"
+            << "    }\n";
+        for (int ip = 0; ip < codeSize;) {
+            int op, operands[4], target;
+            int nextIp = decode(ip, op, operands, target);
+            if (depth[ip] >= 0) {
+                typesIn = reading = &before[ip];
+                typesOut = &after[ip];
+                body.str("");
+                if (!instruction(ip, op, operands, target, nextIp))
+                    body << "    " << leave(ip) << "\n";
+                else if (op != OP_JUMP && op != OP_SWITCH)
+                    body << spillFor(nextIp);
+                out << "L" << ip << ": // " << opcodeToString(op) << "\n" << body.str();
+            }
+            ip = nextIp;
+        }
+        out << "}\n\n";
+        return true;
+    }
+
+private:
+    std::ostringstream body;
+    // Slot types before and after each instruction, by offset; empty where
+    // nothing is known.
+    std::vector<std::vector<int8_t>> before, after;
+    // The types of the instruction being written, and those its operands
+    // are read with.
+    const std::vector<int8_t>* typesIn = nullptr;
+    const std::vector<int8_t>* typesOut = nullptr;
+    const std::vector<int8_t>* reading = nullptr;
+
+    int next(int ip) const {
+        int op, operands[4], target;
+        return decode(ip, op, operands, target);
+    }
+
+    void analyzeTypes() {
+        before.assign(codeSize, {});
+        after.assign(codeSize, {});
+        ObjFunction::CodeChunk chunk = fn.chunk;
+        std::vector<TypeSpecializer::State> in, out;
+        if (!TypeSpecializer(chunk, frameSlots).flow(in, out))
+            return;
+        size_t i = 0;
+        for (int ip = 0; ip < codeSize; ip = next(ip), i++) {
+            if (i >= in.size() || depth[ip] < 0 || !in[i].reached)
+                continue;
+            if ((int)in[i].stack.size() != depth[ip]) {
+                before.assign(codeSize, {});
+                after.assign(codeSize, {});
+                return;
+            }
+            before[ip] = in[i].locals;
+            before[ip].insert(before[ip].end(), in[i].stack.begin(), in[i].stack.end());
+            after[ip] = out[i].locals;
+            after[ip].insert(after[ip].end(), out[i].stack.begin(), out[i].stack.end());
+        }
+    }
+
+    static std::string ip(int at) { return std::to_string(at) + "u"; }
+    static std::string slot(int i) { return "s[" + std::to_string(i) + "]"; }
+    static std::string goTo(int target) { return "goto L" + std::to_string(target) + ";"; }
+    static std::string var(char kind, int k) { return kind + std::to_string(k); }
+
+    // 'i' or 'd' when slot k lives in a C++ int or double, 0 in the frame.
+    static char unboxed(const std::vector<int8_t>& types, int k) {
+        if (k < 0 || k >= (int)types.size()) return 0;
+        if (types[k] == (int8_t)Value::Type::Int) return 'i';
+        if (types[k] == (int8_t)Value::Type::Double) return 'd';
+        return 0;
+    }
+
+    // Copies slot k to the frame if it is unboxed.
+    static std::string store(const std::vector<int8_t>& types, int k) {
+        char kind = unboxed(types, k);
+        if (!kind) return "";
+        return std::string(kind == 'i' ? "Aot::setInt(" : "Aot::setDouble(") + slot(k) + ", " + var(kind, k) + "); ";
+    }
+
+    static std::string spill(const std::vector<int8_t>& types) {
+        std::string code;
+        for (int k = 0; k < (int)types.size(); k++)
+            code += store(types, k);
+        return code;
+    }
+
+    // The switch case entering at `at`: unboxed slots are loaded once their
+    // types check out.
+    std::string enter(int at) const {
+        std::string test, load;
+        const auto& t = before[at];
+        for (int k = 0; k < (int)t.size(); k++) {
+            if (char kind = unboxed(t, k)) {
+                test += std::string(test.empty() ? "" : " || ") + (kind == 'i' ? "!Aot::isInt(" : "!Aot::isDouble(") +
+                        slot(k) + ")";
+                load += var(kind, k) + (kind == 'i' ? " = Aot::i(" : " = Aot::d(") + slot(k) + "); ";
+            }
+        }
+        return test.empty() ? "" : "if (" + test + ") return " + ip(at) + "; " + load;
+    }
+
+    // Leaving for the interpreter at the start of the instruction at `at`,
+    // or after it to resume at `target`.
+    std::string leave(int at) const { return "{ " + spill(*typesIn) + "return " + ip(at) + "; }"; }
+    std::string leaveTo(int target) const { return "{ " + spill(*typesOut) + "return " + ip(target) + "; }"; }
+    std::string guardExit(int at) const {
+        return "{ " + spill(*typesIn) + "return " + std::to_string((uint32_t)at | JIT_GUARD_EXIT) + "u; }";
+    }
+
+    // Moves to the frame what is unboxed after this instruction but not at `to`.
+    std::string spillFor(int to) const {
+        std::string code;
+        for (int k = 0; k < (int)typesOut->size(); k++)
+            if (!unboxed(before[to], k))
+                code += store(*typesOut, k);
+        return code.empty() ? "" : "    " + code + "\n";
+    }
+    std::string jump(int target) const {
+        std::string code;
+        for (int k = 0; k < (int)typesOut->size(); k++)
+            if (!unboxed(before[target], k))
+                code += store(*typesOut, k);
+        return code.empty() ? goTo(target) : "{ " + code + goTo(target) + " }";
+    }
+
+    // Operands, as C++ expressions: type tests are constants for unboxed slots.
+    std::string isInt(int k) const {
+        char kind = unboxed(*reading, k);
+        return kind ? (kind == 'i' ? "true" : "false") : "Aot::isInt(" + slot(k) + ")";
+    }
+    std::string isDouble(int k) const {
+        char kind = unboxed(*reading, k);
+        return kind ? (kind == 'd' ? "true" : "false") : "Aot::isDouble(" + slot(k) + ")";
+    }
+    std::string isBool(int k) const { return unboxed(*reading, k) ? "false" : "Aot::isBool(" + slot(k) + ")"; }
+    std::string boxed(int k) const { return unboxed(*reading, k) ? "false" : "Aot::boxed(" + slot(k) + ")"; }
+    std::string intOf(int k) const {
+        return unboxed(*reading, k) == 'i' ? var('i', k) : "Aot::i(" + slot(k) + ")";
+    }
+    std::string doubleOf(int k) const {
+        return unboxed(*reading, k) == 'd' ? var('d', k) : "Aot::d(" + slot(k) + ")";
+    }
+    // Sets `x` to an Integer or Double operand and is true, or is false.
+    std::string number(int k, const char* x) const {
+        char kind = unboxed(*reading, k);
+        if (kind) return std::string("(") + x + " = " + var(kind, k) + ", true)";
+        return "Aot::number(" + slot(k) + ", " + x + ")";
+    }
+    // An unboxed operand as a double.
+    std::string numberOf(int k) const {
+        return unboxed(*reading, k) == 'i' ? "(double)" + var('i', k) : var('d', k);
+    }
+    bool ints(int x, int y) const { return unboxed(*reading, x) == 'i' && unboxed(*reading, y) == 'i'; }
+    bool numbers(int x, int y) const { return unboxed(*reading, x) && unboxed(*reading, y); }
+    std::string truth(int k, const char* x) const {
+        char kind = unboxed(*reading, k);
+        if (kind == 'i') return std::string("(") + x + " = " + var(kind, k) + " != 0, true)";
+        if (kind) return "false";
+        return "Aot::truth(" + slot(k) + ", " + x + ")";
+    }
+
+    // Results, which go where the slot lives after the instruction.
+    std::string setInt(int k, const std::string& x) const {
+        if (unboxed(*typesOut, k) == 'i') return var('i', k) + " = " + x + ";";
+        return "Aot::setInt(" + slot(k) + ", " + x + ");";
+    }
+    std::string setDouble(int k, const std::string& x) const {
+        if (unboxed(*typesOut, k) == 'd') return var('d', k) + " = " + x + ";";
+        return "Aot::setDouble(" + slot(k) + ", " + x + ");";
+    }
+    std::string copy(int to, int from) const {
+        char kind = unboxed(*reading, from);
+        if (kind == 'i') return setInt(to, var(kind, from));
+        if (kind == 'd') return setDouble(to, var(kind, from));
+        return "Aot::copy(" + slot(to) + ", " + slot(from) + ");";
+    }
+    static std::string either(const std::string& x, const std::string& y) {
+        return x == "false" ? y : y == "false" ? x : x + " || " + y;
+    }
+    std::string exitIf(const std::string& condition, int at) const {
+        return condition == "false" ? "" : "    if (" + condition + ") " + guardExit(at) + "\n";
+    }
+
+    // Sets `c` to `a op b` for numeric operands, as compareValues() does.
+    void ordered(int op, int a, int b, int at) {
+        const char* cmp = op == OP_LT ? " < " : op == OP_LE ? " <= " : op == OP_GT ? " > " : " >= ";
+        if (numbers(a, b)) {
+            body << "    c = " << (ints(a, b) ? intOf(a) : numberOf(a)) << cmp << (ints(a, b) ? intOf(b) : numberOf(b))
+                 << ";\n";
+            return;
+        }
+        body << "    if (" << isInt(a) << " && " << isInt(b) << ") c = " << intOf(a) << cmp << intOf(b) << ";\n"
+             << "    else if (!" << number(a, "x") << " || !" << number(b, "y") << ") " << guardExit(at) << "\n"
+             << "    else c = x" << cmp << "y;\n";
+    }
+
+    bool instruction(int at, int op, const int* operands, int target, int nextIp) {
+        int top = frameSlots + depth[at];   // first free slot
+        int a = top - 2, b = top - 1;
+        switch (op) {
+        case OP_CONSTANT: {
+            const Value& c = fn.chunk.constants[operands[0]];
+            if (c.isInt())
+                body << "    " << setInt(top, std::to_string(c.asInt())) << "\n";
+            else if (c.isDouble()) {
+                uint64_t bits;
+                double d = c.asDouble();
+                std::memcpy(&bits, &d, sizeof bits);
+                body << "    " << setDouble(top, "Aot::fromBits(" + std::to_string(bits) + "ull)") << "\n";
+            }
+            else if (c.isBool())
+                body << "    Aot::setBool(" << slot(top) << ", " << (c.asBool() ? "true" : "false") << ");\n";
+            else if (c.isNil())
+                body << "    Aot::setNil(" << slot(top) << ");\n";
+            else
+                return false;
+            return true;
+        }
+        case OP_NIL:
+            body << "    Aot::setNil(" << slot(top) << ");\n";
+            return true;
+        case OP_GET_LOCAL:
+            body << exitIf(boxed(operands[0]), at)
+                 << "    " << copy(top, operands[0]) << "\n";
+            return true;
+        case OP_SET_LOCAL:
+            body << exitIf(either(boxed(b), boxed(operands[0])), at)
+                 << "    " << copy(operands[0], b) << "\n";
+            return true;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+            // A name that does not resolve is left to the interpreter.
+            char kind = unboxed(*typesIn, b);
+            std::string value = op == OP_SET_GLOBAL && kind ? "Value(" + var(kind, b) + ")" : "std::move(" + slot(b) + ")";
+            body << "    { Value* g = Aot::global(vm, fn, s, " << operands[0] << ", " << operands[1] << ");\n"
+                 << "      if (!g) " << leave(at) << "\n"
+                 << (op == OP_GET_GLOBAL ? "      " + slot(top) + " = *g; }\n" : "      *g = " + value + "; }\n");
+            return true;
+        }
+        case OP_INLINE_GUARD:
+            body << "    if (!Aot::inlined(vm, fn, s, " << operands[0] << ", " << operands[1] << ", " << operands[2]
+                 << ")) " << jump(target) << "\n";
+            return true;
+        case OP_SWITCH: {
+            const ObjFunction::SwitchTable& table = fn.chunk.switches[operands[0]];
+            std::set<int> targets{ target };
+            for (int t : table.dense)
+                if (t >= 0) targets.insert(t);
+            for (const auto& entry : table.sparse) targets.insert(entry.second);
+            for (const auto& entry : table.strings) targets.insert(entry.second);
+            if (std::string selector = store(*typesIn, b); !selector.empty())
+                body << "    " << selector << "\n";
+            body << "    switch (Aot::switchTarget(fn, " << operands[0] << ", " << slot(b) << ", " << target << ")) {\n";
+            for (int t : targets)
+                body << "    case " << t << ": " << jump(t) << "\n";
+            body << "    }\n"
+                 << "    " << leave(at) << "\n";
+            return true;
+        }
+        case OP_DUP:
+            body << exitIf(boxed(b), at)
+                 << "    " << copy(top, b) << "\n";
+            return true;
+        case OP_POP:
+            body << exitIf(boxed(b), at);
+            return true;
+        case OP_GUARD: case OP_GUARD_LOCAL: {
+            // As passGuard(), and a value that does not have the type kept
+            // unboxed after the guard exits even from a generic one.
+            int s = op == OP_GUARD ? b : operands[0];
+            int declared = operands[op == OP_GUARD ? 0 : 1];
+            int want = declared & ~GUARD_GENERIC;
+            bool generic = (declared & GUARD_GENERIC) != 0;
+            char from = unboxed(*typesIn, s), to = unboxed(*typesOut, s);
+            if (to && from == 'i' && to == 'd')
+                body << "    " << var('d', s) << " = " << var('i', s) << ";\n";
+            else if (to == 'i' && !from)
+                body << "    if (!Aot::isInt(" << slot(s) << ")) " << guardExit(at) << "\n"
+                     << "    " << var('i', s) << " = Aot::i(" << slot(s) << ");\n";
+            else if (to == 'd' && !from)
+                body << "    if (Aot::isInt(" << slot(s) << ")) " << var('d', s) << " = Aot::i(" << slot(s) << ");\n"
+                     << "    else if (Aot::isDouble(" << slot(s) << ")) " << var('d', s) << " = Aot::d(" << slot(s)
+                     << ");\n"
+                     << "    else " << guardExit(at) << "\n";
+            else if (!to && !from) {
+                if (want == (int)Value::Type::Double)
+                    body << "    if (Aot::isInt(" << slot(s) << ")) Aot::setDouble(" << slot(s) << ", Aot::i(" << slot(s)
+                         << "));\n";
+                if (!generic)
+                    body << "    if (!Aot::is(" << slot(s) << ", " << want << ")) " << guardExit(at) << "\n";
+            }
+            return true;
+        }
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW: {
+            const char* sym = op == OP_ADD ? " + " : op == OP_SUB ? " - " : op == OP_MUL ? " * " : " / ";
+            bool integer = op != OP_DIV && op != OP_POW;
+            if (integer && ints(a, b)) {
+                body << "    " << setInt(a, "(int)((unsigned)" + intOf(a) + sym + "(unsigned)" + intOf(b) + ")") << "\n";
+                return true;
+            }
+            if (numbers(a, b)) {
+                std::string x = numberOf(a), y = numberOf(b);
+                body << "    " << setDouble(a, op == OP_POW ? "std::pow(" + x + ", " + y + ")" : x + sym + y) << "\n";
+                return true;
+            }
+            body << "    {\n";
+            // Integer op Integer stays an Integer, wrapping as native code does.
+            if (integer)
+                body << "    if (" << isInt(a) << " && " << isInt(b) << ") "
+                     << setInt(a, "(int)((unsigned)" + intOf(a) + sym + "(unsigned)" + intOf(b) + ")") << "\n"
+                     << "    else {\n";
+            else
+                body << "    {\n";
+            body << "    double x, y;\n"
+                 << "    if (!" << number(a, "x") << " || !" << number(b, "y") << ") " << guardExit(at) << "\n"
+                 << "    " << setDouble(a, op == OP_POW ? std::string("std::pow(x, y)") : std::string("x") + sym + "y")
+                 << "\n"
+                 << "    }\n"
+                 << "    }\n";
+            return true;
+        }
+        case OP_MOD:
+            if (numbers(a, b) && !ints(a, b)) {
+                body << "    " << setDouble(a, "std::fmod(" + numberOf(a) + ", " + numberOf(b) + ")") << "\n";
+                return true;
+            }
+            body << "    if (" << isInt(a) << " && " << isInt(b) << ") {\n"
+                 << "        int d = " << intOf(b) << ";\n"
+                 << "        if (d == 0 || d == -1) " << guardExit(at) << "\n"
+                 << "        " << setInt(a, intOf(a) + " % d") << "\n"
+                 << "    } else {\n"
+                 << "        double x, y;\n"
+                 << "        if (!" << number(a, "x") << " || !" << number(b, "y") << ") " << guardExit(at) << "\n"
+                 << "        " << setDouble(a, "std::fmod(x, y)") << "\n"
+                 << "    }\n";
+            return true;
+        case OP_NEGATE:
+            if (unboxed(*reading, b)) {
+                body << "    " << (unboxed(*reading, b) == 'i' ? setInt(b, "(int)(0u - (unsigned)" + intOf(b) + ")")
+                                                            : setDouble(b, "-" + doubleOf(b))) << "\n";
+                return true;
+            }
+            body << "    if (" << isInt(b) << ") " << setInt(b, "(int)(0u - (unsigned)" + intOf(b) + ")") << "\n"
+                 << "    else if (" << isDouble(b) << ") " << setDouble(b, "-" + doubleOf(b)) << "\n"
+                 << "    else " << guardExit(at) << "\n";
+            return true;
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+            body << "    {\n    bool c; double x, y;\n";
+            ordered(op, a, b, at);
+            body << "    Aot::setBool(" << slot(a) << ", c);\n    }\n";
+            return true;
+        case OP_EQ: case OP_NE: {
+            // Numbers and Booleans; other operands are left to the interpreter.
+            const char* eq = op == OP_EQ ? " == " : " != ";
+            if (numbers(a, b)) {
+                body << "    Aot::setBool(" << slot(a) << ", " << (ints(a, b) ? intOf(a) : numberOf(a)) << eq
+                     << (ints(a, b) ? intOf(b) : numberOf(b)) << ");\n";
+                return true;
+            }
+            body << "    {\n    bool c; double x, y;\n"
+                 << "    if (" << isInt(a) << " && " << isInt(b) << ") c = " << intOf(a) << eq << intOf(b) << ";\n"
+                 << "    else if (" << isDouble(a) << " || " << isDouble(b) << ") {\n"
+                 << "        if (!" << number(a, "x") << " || !" << number(b, "y") << ") " << guardExit(at) << "\n"
+                 << "        c = x" << eq << "y;\n"
+                 << "    }\n"
+                 << "    else if (" << isBool(a) << " && " << isBool(b) << ") c = Aot::b(" << slot(a) << ")" << eq
+                 << "Aot::b(" << slot(b) << ");\n"
+                 << "    else " << guardExit(at) << "\n"
+                 << "    Aot::setBool(" << slot(a) << ", c);\n    }\n";
+            return true;
+        }
+        case OP_AND: case OP_OR:
+            body << "    {\n    bool x, y;\n"
+                 << "    if (!" << truth(a, "x") << " || !" << truth(b, "y") << ") " << guardExit(at) << "\n"
+                 << "    Aot::setBool(" << slot(a) << ", x " << (op == OP_AND ? "&&" : "||") << " y);\n    }\n";
+            return true;
+        case OP_JUMP:
+            if (target <= at)
+                body << "    if (safepointPending.load(std::memory_order_relaxed)) " << leaveTo(target) << "\n";
+            body << "    " << jump(target) << "\n";
+            return true;
+        case OP_JUMP_IF_FALSE:
+            // Booleans and Integers test their value, strings exit and other
+            // unboxed values count as False.
+            if (unboxed(*reading, b) == 'i') {
+                body << "    if (!" << intOf(b) << ") " << jump(target) << "\n";
+                return true;
+            }
+            body << "    if (" << isBool(b) << ") { if (!Aot::b(" << slot(b) << ")) " << jump(target) << " }\n"
+                 << "    else if (" << isInt(b) << ") { if (!" << intOf(b) << ") " << jump(target) << " }\n"
+                 << "    else if (" << boxed(b) << ") " << guardExit(at) << "\n"
+                 << "    else " << jump(target) << "\n";
+            return true;
+        case OP_COMPARE_JUMP:
+            body << "    {\n    bool c; double x, y;\n";
+            ordered(operands[0], a, b, at);
+            body << "    if (!c) " << jump(target) << "\n    }\n";
+            return true;
+        case OP_FOR_PREP: case OP_FOR_LOOP: {
+            if (operands[0] & FOR_GLOBAL)
+                return false;
+            int counter = operands[1], end = a, step = b;
+            // Check the end value first: the counter may not change before a guard.
+            body << "    {\n    bool c; double x, y;\n";
+            if (!unboxed(*typesIn, end))
+                body << exitIf("!Aot::isInt(" + slot(end) + ") && !Aot::isDouble(" + slot(end) + ")", at);
+            if (op == OP_FOR_LOOP && numbers(counter, step)) {
+                body << "    " << (ints(counter, step)
+                                   ? setInt(counter, "(int)((unsigned)" + intOf(counter) + " + (unsigned)" + intOf(step) + ")")
+                                   : setDouble(counter, numberOf(counter) + " + " + numberOf(step))) << "\n";
+                reading = typesOut;
+            }
+            else if (op == OP_FOR_LOOP) {
+                body << "    if (" << isInt(counter) << " && " << isInt(step) << ") "
+                     << setInt(counter, "(int)((unsigned)" + intOf(counter) + " + (unsigned)" + intOf(step) + ")")
+                     << "\n"
+                     << "    else if (!" << number(counter, "x") << " || !" << number(step, "y") << ") "
+                     << guardExit(at) << "\n"
+                     << "    else " << setDouble(counter, "x + y") << "\n";
+                // The comparison reads the new counter.
+                reading = typesOut;
+            }
+            ordered((operands[0] & FOR_DOWN) ? OP_GE : OP_LE, counter, end, at);
+            reading = typesIn;
+            // FOR_PREP skips the loop once the counter is past the end value;
+            // FOR_LOOP jumps back while it is not.
+            if (op == OP_FOR_PREP)
+                body << "    if (!c) " << jump(target) << "\n";
+            else
+                body << "    if (c) {\n"
+                     << "        if (safepointPending.load(std::memory_order_relaxed)) " << leaveTo(target) << "\n"
+                     << "        " << jump(target) << "\n"
+                     << "    }\n";
+            body << "    }\n";
+            (void)nextIp;
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+};
+
+void InitializeEnvironment(VM& vm);
+std::string encrypt(const std::string &plaintext, const std::string &keyStr);
+
+// Writes the C++ translation of a compiled program to `path`, with its image
+// encrypted under `key`.
+bool writeAotSource(VM& vm, const CompileRecord& record, const std::string& path, const std::string& key,
+                    std::string& error) {
+    std::vector<uint8_t> image;
+    if (!buildBytecodeImage(vm, record, image, error))
+        return false;
+    // Translate the functions as the executable will load them, with their
+    // globals linked against a fresh environment.
+    VM* running = globalVM;
+    VM linked;
+    InitializeEnvironment(linked);
+    std::vector<std::shared_ptr<ObjFunction>> functions;
+    loadBytecodeImage(linked, image.data(), image.size(), &functions);
+    globalVM = running;
+
+    std::ofstream out(path);
+    out << "// Generated by crossbasic --emit-cpp; build it next to crossbasic.cpp with\n"
+        << "//   g++ -O2 -std=c++17 " << path << " -lffi\n"
+        << "#define CROSSBASIC_AOT 1\n"
+        << "#include \"crossbasic.cpp\"\n\n"
+        << "const uint8_t aotImage[] = {";
+    std::string encrypted = encrypt(std::string(image.begin(), image.end()), key);
+    for (size_t i = 0; i < encrypted.size(); i++)
+        out << (i % 20 ? " " : "\n    ") << (int)(uint8_t)encrypted[i] << ",";
+    out << "\n};\n"
+        << "const size_t aotImageSize = sizeof aotImage;\n\n";
+    std::vector<std::string> names;
+    for (size_t i = 0; i < functions.size(); i++) {
+        std::string name = "aotFunction" + std::to_string(i);
+        names.push_back(CppEmitter(*functions[i]).emit(out, name) ? name : "nullptr");
+    }
+    out << "const AotFunction aotFunctions[] = {\n";
+    for (size_t i = 0; i < functions.size(); i++)
+        out << "    { " << aotCodeHash(*functions[i]) << "u, " << names[i] << " },\n";
+    out << "    { 0, nullptr }\n"
+        << "};\n"
+        << "const int aotFunctionCount = " << functions.size() << ";\n";
+    if (!out.good()) {
+        error = "unable to write " + path;
+        return false;
+    }
+    return true;
+}
+
+#if CROSSBASIC_AOT
+// Slot access for translated code, which works on the Value layout the way
+// the baseline JIT's templates do.
+struct Aot {
+    static bool boxed(const Value& v) { return v.isBoxed(); }
+    static bool isInt(const Value& v) { return v.type == Value::Type::Int; }
+    static bool isDouble(const Value& v) { return v.type == Value::Type::Double; }
+    static bool isBool(const Value& v) { return v.type == Value::Type::Bool; }
+    static bool is(const Value& v, int type) { return (int)v.type == type; }
+    static int i(const Value& v) { return v.as.i; }
+    static double d(const Value& v) { return v.as.d; }
+    static bool b(const Value& v) { return v.as.b; }
+    static double fromBits(uint64_t bits) {
+        double d;
+        std::memcpy(&d, &bits, sizeof d);
+        return d;
+    }
+    // An Integer or Double as a double; false for anything else.
+    static bool number(const Value& v, double& out) {
+        if (v.type == Value::Type::Int) { out = v.as.i; return true; }
+        if (v.type == Value::Type::Double) { out = v.as.d; return true; }
+        return false;
+    }
+    // The truth of a Boolean or Integer; false for anything else.
+    static bool truth(const Value& v, bool& out) {
+        if (v.type == Value::Type::Bool) { out = v.as.b; return true; }
+        if (v.type == Value::Type::Int) { out = v.as.i != 0; return true; }
+        return false;
+    }
+    // The setters and copy() overwrite slots that hold no boxed value. The
+    // payload is built aside and stored as one word, so copy() can load it
+    // straight from that store.
+    static void setInt(Value& v, int x) {
+        decltype(v.as) as;
+        as.ptr = nullptr;
+        as.i = x;
+        v.type = Value::Type::Int;
+        v.as = as;
+    }
+    static void setDouble(Value& v, double x) { v.type = Value::Type::Double; v.as.d = x; }
+    static void setBool(Value& v, bool x) {
+        decltype(v.as) as;
+        as.ptr = nullptr;
+        as.b = x;
+        v.type = Value::Type::Bool;
+        v.as = as;
+    }
+    static void setNil(Value& v) { v.type = Value::Type::Nil; v.as.ptr = nullptr; }
+    static void copy(Value& to, const Value& from) { to.type = from.type; to.as = from.as; }
+
+    static Value* global(VM& vm, const ObjFunction& fn, Value* s, int nameIndex, int slot) {
+        const Value* self = fn.selfSlot >= 0 ? &s[fn.selfSlot] : nullptr;
+        return findGlobal(vm, fn.chunk, nameIndex, slot, self);
+    }
+    static bool inlined(VM& vm, const ObjFunction& fn, Value* s, int nameIndex, int slot, int function) {
+        const Value* self = fn.selfSlot >= 0 ? &s[fn.selfSlot] : nullptr;
+        return inlinedCallee(vm, fn.chunk, nameIndex, slot, function, self);
+    }
+    static int switchTarget(const ObjFunction& fn, int table, Value& selector, int defaultTarget) {
+        int target = fn.chunk.switches[table].find(selector);
+        selector = Value();   // the selector may be a String
+        return target < 0 ? defaultTarget : target;
+    }
+};
+
+struct AotFunction {
+    uint32_t codeHash;
+    JitCode::Native native;
+};
+
+// Defined by the generated source.
+extern const uint8_t aotImage[];
+extern const size_t aotImageSize;
+extern const AotFunction aotFunctions[];
+extern const int aotFunctionCount;
+
+// Gives the functions of the loaded image their translated code.
+static void attachAotCode(const std::vector<std::shared_ptr<ObjFunction>>& functions) {
+    for (size_t i = 0; i < functions.size() && i < (size_t)aotFunctionCount; i++) {
+        const ObjFunction& fn = *functions[i];
+        if (!aotFunctions[i].native || aotFunctions[i].codeHash != aotCodeHash(fn))
+            continue;
+        FrameLayout layout(fn);
+        if (!layout.analyze())
+            continue;
+        auto code = std::make_unique<JitCode>();
+        code->native = aotFunctions[i].native;
+        for (int d : layout.depth)
+            code->offsets.push_back(d >= 0 ? 0 : -1);
+        code->depth = std::move(layout.depth);
+        code->frameSlots = layout.frameSlots;
+        code->maxDepth = layout.maxDepth;
+        fn.jitCode = code.get();
+        jitCodes.push_back(std::move(code));
+    }
+}
+#endif
+
+// Binary opcodes first try numeric operands, combining them in place on the
+// stack instead of popping and re-pushing two Values. Past INT_FAST_PATH, an
+// Integer paired with a Double is widened as the slow paths do.
+#define INT_FAST_PATH(op)                                       \
+    {                                                           \
+        Value& lhs = vm.stack[vm.stack.size() - 2];             \
+        const Value& rhs = vm.stack.back();                     \
+        if (lhs.isInt() && rhs.isInt()) {                       \
+            lhs = Value(lhs.asInt() op rhs.asInt());            \
+            vm.stack.pop_back();                                \
+            DISPATCH();                                         \
+        }                                                       \
+    }
+#define DOUBLE_FAST_PATH(op)                                    \
+    {                                                           \
+        Value& lhs = vm.stack[vm.stack.size() - 2];             \
+        const Value& rhs = vm.stack.back();                     \
+        if (isNumber(lhs) && isNumber(rhs)) {                   \
+            lhs = Value(toDouble(lhs) op toDouble(rhs));        \
+            vm.stack.pop_back();                                \
+            DISPATCH();                                         \
+        }                                                       \
+    }
+// Type-specialized opcodes, whose operand types the compiler proved.
+#define TYPED_BINARY(get, op)                                   \
+    {                                                           \
+        Value& lhs = vm.stack[vm.stack.size() - 2];             \
+        lhs = Value(lhs.get() op vm.stack.back().get());        \
+        vm.stack.pop_back();                                    \
+        DISPATCH();                                             \
     }
-};
-
-// choose the first overload whose required/total arity matches |args|
-static Value resolveOverload(const Value &candidate,
-                             const std::vector<Value> &args)
-{
-    if (!holds<std::vector<std::shared_ptr<ObjFunction>>>(candidate))
-        return candidate; // already a single fn
 
-    const auto &overloads =
-        getVal<std::vector<std::shared_ptr<ObjFunction>>>(candidate);
+// ----------------------------------------------------------------------------
+// Per-instruction debug hooks, kept out of line so the dispatch code stays
+// small. Both compile away unless CROSSBASIC_TRACE enables them.
+// ----------------------------------------------------------------------------
+static void traceInstruction(const ObjFunction* function, int ip, int instruction) {
+    VM_TRACE("VM: IP " + std::to_string(ip) + ": Executing " + opcodeToString(instruction));
+#if CROSSBASIC_TRACE >= 1
+    if (traceRing.enabled())
+        traceRing.record(function, ip, instruction);
+#else
+    (void)function;
+#endif
+}
 
-    for (auto &f : overloads)
-    {
-        int total = f->params.size();
-        int required = f->arity;
-        if ((int)args.size() >= required && (int)args.size() <= total)
-            return Value(f);
+static void traceStack(const VM& vm, size_t base) {
+    if (CROSSBASIC_TRACE >= 2 && DEBUG_MODE) {
+        // Only the running frame's window; deeper frames are unchanged.
+        std::string s = "[";
+        for (size_t i = std::min(base, vm.stack.size()); i < vm.stack.size(); i++)
+            s += valueToString(vm.stack[i]) + ", ";
+        s += "]";
+        VM_TRACE("VM: Stack after execution: " + s);
     }
-    runtimeError("VM: no matching overload for call with " + std::to_string(args.size()) + " argument(s).");
-    return Value(std::monostate{});
 }
 
 // ============================================================================  
 // Virtual Machine Execution
 // ============================================================================
-Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
+Value runVM(VM& vm, const ObjFunction::CodeChunk& entryChunk, size_t entryBase) {
+    // Scripted calls push a CallFrame and keep running in this loop; only the
+    // entry frame returns to the C++ caller.
+    size_t entryDepth = vm.frames.size();
+    vm.frames.push_back(CallFrame{ nullptr, &entryChunk, 0, entryBase });
+    const ObjFunction::CodeChunk* chunk = &entryChunk;
+    const uint8_t* code = entryChunk.code.data();
     int ip = 0;
-    while (ip < chunk.code.size()) {
+    size_t base = entryBase;
+    const ObjFunction* function = nullptr;
+
+    // Debug hooks run only when --d or --trace asked for them; native code
+    // would skip them, so the JIT stays off.
+    const bool tracing = (CROSSBASIC_TRACE >= 2 && DEBUG_MODE) ||
+                         (CROSSBASIC_TRACE >= 1 && traceRing.enabled());
+
+    // Baseline JIT: count a call or loop back-edge of the running function,
+    // compile it once it is hot, and continue in native code when it has some
+    // (compiled here or ahead of time).
+    auto tierUp = [&]() {
+        if (!function || tracing)
+            return;
+        if (!function->jitCode) {
+            if (!JIT_THRESHOLD || function->jitRejected || ++function->hotness < (uint32_t)JIT_THRESHOLD)
+                return;
+            function->jitCode = compileJit(vm, *function);
+            if (!function->jitCode) {
+                function->jitRejected = true;
+                return;
+            }
+        }
+        ip = runJit(vm, *function, base, ip);
+    };
 
-        // Process any pending callbacks from plugin events for any yielded threads.
-        processPendingCallbacks();
+    // Push a frame for `fn` with its arguments already on the stack above the
+    // callee, and continue in it.
+    auto pushCallFrame = [&](ObjFunction* fn, int argCount, const Value& self) {
+        if (argCount > (int)fn->params.size()) {
+            vm.stack.resize(vm.stack.size() - (argCount - fn->params.size()));
+            argCount = (int)fn->params.size();
+        }
+        size_t newBase = vm.stack.size() - argCount;
+        for (int i = argCount; i < (int)fn->params.size(); i++)
+            vm.stack.push_back(fn->params[i].defaultValue);
+        for (int i = (int)fn->params.size(); i < fn->localCount; i++)
+            vm.stack.push_back(Value(std::monostate{}));
+        if (fn->selfSlot >= 0)
+            vm.stack[newBase + fn->selfSlot] = self;
+        // A function that once left its specialized code starts generic.
+        chunk = fn->chunk.generic ? fn->chunk.generic.get() : &fn->chunk;
+        vm.frames.push_back(CallFrame{ fn, chunk, 0, newBase });
+        function = fn;
+        code = chunk->code.data();
+        ip = 0;
+        base = newBase;
+        tierUp();
+    };
+    auto enterFrame = [&](ObjFunction* fn, int argCount, const Value& self) {
+        vm.frames.back().ip = ip;
+        pushCallFrame(fn, argCount, self);
+    };
 
-        int currentIp = ip;
-        int instruction = chunk.code[ip++];
+    // A guard failed: carry on at the same offset in the generic chunk.
+    auto deoptimize = [&]() {
+        VM_TRACE("VM: Type guard failed in " + (function ? function->name : std::string("main")));
+        chunk = &genericChunk(*chunk);
+        code = chunk->code.data();
+        vm.frames.back().chunk = chunk;
+    };
 
-        debugLog("VM: IP " + std::to_string(currentIp) + ": Executing " + opcodeToString(instruction));
+    // With GCC and Clang each handler jumps straight to the next one through
+    // a table of label addresses (computed goto); elsewhere a portable switch
+    // dispatches. Hot handlers finish with DISPATCH(), the rest with break.
+    // A computed goto leaves the handler without running destructors, so
+    // DISPATCH() is only used where no Value or other object is in scope,
+    // not even a moved-from one: such handlers keep their objects in a block
+    // that closes before DISPATCH(), and slow paths end with break.
+    // There is no bounds check on ip: every chunk ends in OP_RETURN.
+#if CROSSBASIC_COMPUTED_GOTO
+    // One entry per OpCode, in enum order.
+    static const void* const dispatchTable[] = {
+        &&L_OP_CONSTANT, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV,
+        &&L_OP_NEGATE, &&L_OP_POW, &&L_OP_MOD, &&L_OP_LT, &&L_OP_LE, &&L_OP_GT,
+        &&L_OP_GE, &&L_OP_NE, &&L_OP_EQ, &&L_OP_AND, &&L_OP_OR, &&L_OP_PRINT,
+        &&L_OP_POP, &&L_OP_DEFINE_GLOBAL, &&L_OP_GET_GLOBAL, &&L_OP_SET_GLOBAL,
+        &&L_OP_NEW, &&L_OP_CALL, &&L_OP_OPTIONAL_CALL, &&L_OP_RETURN, &&L_OP_NIL,
+        &&L_OP_JUMP_IF_FALSE, &&L_OP_JUMP, &&L_OP_CLASS, &&L_OP_METHOD,
+        &&L_OP_ARRAY, &&L_OP_GET_PROPERTY, &&L_OP_SET_PROPERTY, &&L_OP_PROPERTIES,
+        &&L_OP_DUP, &&L_OP_CONSTRUCTOR_END, &&L_OP_GET_LOCAL, &&L_OP_SET_LOCAL,
+        &&L_OP_INVOKE, &&L_OP_COMPARE_JUMP, &&L_OP_FOR_PREP, &&L_OP_FOR_LOOP,
+        &&L_OP_SWITCH, &&L_OP_TAIL_CALL, &&L_OP_GUARD, &&L_OP_GUARD_LOCAL,
+        &&L_OP_ADD_INT, &&L_OP_SUB_INT, &&L_OP_MUL_INT, &&L_OP_ADD_DOUBLE,
+        &&L_OP_SUB_DOUBLE, &&L_OP_MUL_DOUBLE, &&L_OP_DIV_DOUBLE, &&L_OP_ADD_STRING,
+        &&L_OP_COMPARE_JUMP_INT, &&L_OP_COMPARE_JUMP_DOUBLE, &&L_OP_FOR_LOOP_INT,
+        &&L_OP_INLINE_GUARD, &&L_OP_TYPED_ARRAY
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_COUNT,
+                  "dispatchTable must list every opcode");
+#define VM_CASE(op) case op: L_##op
+#define DISPATCH()                                      \
+    do {                                                \
+        if (tracing)                                    \
+            traceStack(vm, base);                       \
+        currentIp = ip;                                 \
+        instruction = code[ip++];                       \
+        if (tracing)                                    \
+            traceInstruction(function, currentIp, instruction); \
+        goto *dispatchTable[instruction];               \
+    } while (0)
+#else
+#define VM_CASE(op) case op
+#define DISPATCH() break
+#endif
 
+    int currentIp = 0;
+    int instruction = 0;
+    for (;;) {
+        currentIp = ip;
+        instruction = code[ip++];
+        if (tracing)
+            traceInstruction(function, currentIp, instruction);
+
+    dispatch:
+#if CROSSBASIC_COMPUTED_GOTO
+        goto *dispatchTable[instruction];
+#endif
         switch (instruction) {
-        case OP_CONSTANT: {
-            int index = chunk.code[ip++];
-            Value constant = chunk.constants[index];
-            vm.stack.push_back(constant);
-            debugLog("VM: Loaded constant: " + valueToString(constant));
-            break;
-        }
-        case OP_ADD: {
+        VM_CASE(OP_CONSTANT): {
+            int index = readOperand(code, ip);
+            vm.stack.push_back(chunk->constants[index]);
+            VM_TRACE("VM: Loaded constant: " + valueToString(vm.stack.back()));
+            DISPATCH();
+        }
+        VM_CASE(OP_ADD): {
+            INT_FAST_PATH(+)
+            DOUBLE_FAST_PATH(+)
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) + getVal<int>(b));
-            else if (holds<double>(a) || holds<double>(b)) {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() + b.asInt());
+            else if (a.isDouble() || b.isDouble()) {
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(ad + bd);
             }
-            else if (holds<std::string>(a) && holds<std::string>(b))
-                vm.stack.push_back(getVal<std::string>(a) + getVal<std::string>(b));
+            else if (a.isString() && b.isString()) {
+                appendString(a, b);
+                vm.stack.push_back(std::move(a));
+            }
             else runtimeError("VM: Operands must be numbers or strings for addition.");
             break;
         }
-        case OP_SUB: {
+        VM_CASE(OP_SUB): {
+            INT_FAST_PATH(-)
+            DOUBLE_FAST_PATH(-)
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) - getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() - b.asInt());
             else {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(ad - bd);
             }
             break;
         }
-        case OP_MUL: {
+        VM_CASE(OP_MUL): {
+            INT_FAST_PATH(*)
+            DOUBLE_FAST_PATH(*)
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) * getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() * b.asInt());
             else {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(ad * bd);
             }
             break;
         }
-        case OP_DIV: {
+        VM_CASE(OP_DIV): {
+            DOUBLE_FAST_PATH(/)
             Value b = pop(vm), a = pop(vm);
-            double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-            double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+            double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+            double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
             vm.stack.push_back(ad / bd);
             break;
         }
-        case OP_NEGATE: {
+        VM_CASE(OP_NEGATE): {
             Value v = pop(vm);
-            if (holds<int>(v))
-                vm.stack.push_back(-getVal<int>(v));
-            else if (holds<double>(v))
-                vm.stack.push_back(-getVal<double>(v));
+            if (v.isInt())
+                vm.stack.push_back(-v.asInt());
+            else if (v.isDouble())
+                vm.stack.push_back(-v.asDouble());
             else runtimeError("VM: Operand must be a number for negation.");
             break;
         }
-        case OP_POW: {
+        VM_CASE(OP_POW): {
             Value b = pop(vm), a = pop(vm);
-            double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-            double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+            double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+            double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
             vm.stack.push_back(std::pow(ad, bd));
             break;
         }
-        case OP_MOD: {
+        VM_CASE(OP_MOD): {
+            INT_FAST_PATH(%)
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) % getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() % b.asInt());
             else {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(std::fmod(ad, bd));
             }
             break;
         }
-        case OP_LT: {
+        VM_CASE(OP_LT): {
+            INT_FAST_PATH(<)
+            DOUBLE_FAST_PATH(<)
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) < getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() < b.asInt());
             else {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(ad < bd);
             }
             break;
         }
-        case OP_LE: {
+        VM_CASE(OP_LE): {
+            INT_FAST_PATH(<=)
+            DOUBLE_FAST_PATH(<=)
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) <= getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() <= b.asInt());
             else {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(ad <= bd);
             }
             break;
         }
-        case OP_GT: {
+        VM_CASE(OP_GT): {
+            INT_FAST_PATH(>)
+            DOUBLE_FAST_PATH(>)
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) > getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() > b.asInt());
             else {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(ad > bd);
             }
             break;
         }
-        case OP_GE: {
+        VM_CASE(OP_GE): {
+            INT_FAST_PATH(>=)
+            DOUBLE_FAST_PATH(>=)
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) >= getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() >= b.asInt());
             else {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(ad >= bd);
             }
             break;
         }
-        case OP_EQ: {
+        VM_CASE(OP_EQ): {
             Value b = pop(vm), a = pop(vm);
         
             /* ──────────  numbers  ────────── */
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) == getVal<int>(b));
-            else if (holds<double>(a) || holds<double>(b)) {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() == b.asInt());
+            else if (a.isDouble() || b.isDouble()) {
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(ad == bd);
             }
             /* ──────────  simple scalars  ────────── */
-            else if (holds<bool>(a)  && holds<bool>(b))
-                vm.stack.push_back(getVal<bool>(a)  == getVal<bool>(b));
-            else if (holds<std::string>(a) && holds<std::string>(b))
-                vm.stack.push_back(getVal<std::string>(a) == getVal<std::string>(b));
+            else if (a.isBool()  && b.isBool())
+                vm.stack.push_back(a.asBool()  == b.asBool());
+            else if (a.isString() && b.isString())
+                vm.stack.push_back(stringsEqual(a, b));
         
             /* ──────────  NEW:  Color literals  ────────── */
-            else if (holds<Color>(a) && holds<Color>(b))
-                vm.stack.push_back(getVal<Color>(a).value == getVal<Color>(b).value);
+            else if (a.isColor() && b.isColor())
+                vm.stack.push_back(a.asColor().value == b.asColor().value);
         
             /* ──────────  NEW:  reference / pointer types  ────────── */
-            else if (holds<std::shared_ptr<ObjInstance>>(a) && holds<std::shared_ptr<ObjInstance>>(b))
-                vm.stack.push_back(getVal<std::shared_ptr<ObjInstance>>(a) == getVal<std::shared_ptr<ObjInstance>>(b));
-            else if (holds<std::shared_ptr<ObjClass>>(a)     && holds<std::shared_ptr<ObjClass>>(b))
-                vm.stack.push_back(getVal<std::shared_ptr<ObjClass>>(a)     == getVal<std::shared_ptr<ObjClass>>(b));
-            else if (holds<void*>(a) && holds<void*>(b))
-                vm.stack.push_back(getVal<void*>(a) == getVal<void*>(b));
+            else if (a.isInstance() && b.isInstance())
+                vm.stack.push_back(a.asInstance() == b.asInstance());
+            else if (a.isClass()     && b.isClass())
+                vm.stack.push_back(a.asClass()     == b.asClass());
+            else if (a.isPointer() && b.isPointer())
+                vm.stack.push_back(a.asPointer() == b.asPointer());
         
             /* ──────────  fallback  ────────── */
             else
@@ -3509,154 +9486,165 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
             break;
         }
         
-        case OP_NE: {
+        VM_CASE(OP_NE): {
             Value b = pop(vm), a = pop(vm);
         
-            if (holds<int>(a) && holds<int>(b))
-                vm.stack.push_back(getVal<int>(a) != getVal<int>(b));
-            else if (holds<double>(a) || holds<double>(b)) {
-                double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+            if (a.isInt() && b.isInt())
+                vm.stack.push_back(a.asInt() != b.asInt());
+            else if (a.isDouble() || b.isDouble()) {
+                double ad = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                double bd = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                 vm.stack.push_back(ad != bd);
             }
-            else if (holds<bool>(a)  && holds<bool>(b))
-                vm.stack.push_back(getVal<bool>(a)  != getVal<bool>(b));
-            else if (holds<std::string>(a) && holds<std::string>(b))
-                vm.stack.push_back(getVal<std::string>(a) != getVal<std::string>(b));
+            else if (a.isBool()  && b.isBool())
+                vm.stack.push_back(a.asBool()  != b.asBool());
+            else if (a.isString() && b.isString())
+                vm.stack.push_back(!stringsEqual(a, b));
         
             /* NEW comparisons mirror OP_EQ */
-            else if (holds<Color>(a) && holds<Color>(b))
-                vm.stack.push_back(getVal<Color>(a).value != getVal<Color>(b).value);
-            else if (holds<std::shared_ptr<ObjInstance>>(a) && holds<std::shared_ptr<ObjInstance>>(b))
-                vm.stack.push_back(getVal<std::shared_ptr<ObjInstance>>(a) != getVal<std::shared_ptr<ObjInstance>>(b));
-            else if (holds<std::shared_ptr<ObjClass>>(a)     && holds<std::shared_ptr<ObjClass>>(b))
-                vm.stack.push_back(getVal<std::shared_ptr<ObjClass>>(a)     != getVal<std::shared_ptr<ObjClass>>(b));
-            else if (holds<void*>(a) && holds<void*>(b))
-                vm.stack.push_back(getVal<void*>(a) != getVal<void*>(b));
+            else if (a.isColor() && b.isColor())
+                vm.stack.push_back(a.asColor().value != b.asColor().value);
+            else if (a.isInstance() && b.isInstance())
+                vm.stack.push_back(a.asInstance() != b.asInstance());
+            else if (a.isClass()     && b.isClass())
+                vm.stack.push_back(a.asClass()     != b.asClass());
+            else if (a.isPointer() && b.isPointer())
+                vm.stack.push_back(a.asPointer() != b.asPointer());
             else
                 runtimeError("VM: Operands are not comparable for '<>'.");
             break;
         }
         
-        case OP_AND: {
+        VM_CASE(OP_AND): {
             Value b = pop(vm), a = pop(vm);
-            bool ab = (holds<bool>(a)) ? getVal<bool>(a) : (holds<int>(a) ? (getVal<int>(a) != 0) : false);
-            bool bb = (holds<bool>(b)) ? getVal<bool>(b) : (holds<int>(b) ? (getVal<int>(b) != 0) : false);
+            bool ab = (a.isBool()) ? a.asBool() : (a.isInt() ? (a.asInt() != 0) : false);
+            bool bb = (b.isBool()) ? b.asBool() : (b.isInt() ? (b.asInt() != 0) : false);
             vm.stack.push_back(ab && bb);
             break;
         }
-        case OP_OR: {
+        VM_CASE(OP_OR): {
             Value b = pop(vm), a = pop(vm);
-            bool ab = (holds<bool>(a)) ? getVal<bool>(a) : (holds<int>(a) ? (getVal<int>(a) != 0) : false);
-            bool bb = (holds<bool>(b)) ? getVal<bool>(b) : (holds<int>(b) ? (getVal<int>(b) != 0) : false);
+            bool ab = (a.isBool()) ? a.asBool() : (a.isInt() ? (a.asInt() != 0) : false);
+            bool bb = (b.isBool()) ? b.asBool() : (b.isInt() ? (b.asInt() != 0) : false);
             vm.stack.push_back(ab || bb);
             break;
         }
-        case OP_PRINT: {
+        VM_CASE(OP_PRINT): {
             Value v = pop(vm);
             std::cout << valueToString(v) << std::endl;
             break;
         }
-        case OP_POP: {
-            debugLog("OP_POP: Attempting to pop a value.");
+        VM_CASE(OP_POP): {
+            VM_TRACE("OP_POP: Attempting to pop a value.");
             if (vm.stack.empty())
                 runtimeError("VM: Stack underflow on POP.");
             vm.stack.pop_back();
-            break;
+            DISPATCH();
         }
-        case OP_DEFINE_GLOBAL: {
-            int nameIndex = chunk.code[ip++];
-            if (nameIndex < 0 || nameIndex >= (int)chunk.constants.size())
+        VM_CASE(OP_DEFINE_GLOBAL): {
+            int nameIndex = readOperand(code, ip);
+            if (nameIndex < 0 || nameIndex >= (int)chunk->constants.size())
                 runtimeError("VM: Invalid constant index for global name.");
-            Value nameVal = chunk.constants[nameIndex];
-            if (!holds<std::string>(nameVal))
+            Value nameVal = chunk->constants[nameIndex];
+            if (!nameVal.isString())
                 runtimeError("VM: Global name must be a string.");
-            std::string name = getVal<std::string>(nameVal);
+            std::string name = nameVal.asString();
             if (vm.stack.empty())
                 runtimeError("VM: Stack underflow on global definition for " + name);
             Value val = pop(vm);
             vm.environment->define(name, val);
-            debugLog("VM: Defined global variable: " + name + " = " + valueToString(val));
+            VM_TRACE("VM: Defined global variable: " + name + " = " + valueToString(val));
             break;
         }
-        case OP_GET_GLOBAL: {
-            int nameIndex = chunk.code[ip++];
-            if (nameIndex < 0 || nameIndex >= (int)chunk.constants.size())
-                runtimeError("VM: Invalid constant index for global name.");
-            Value nameVal = chunk.constants[nameIndex];
-            if (!holds<std::string>(nameVal))
-                runtimeError("VM: Global name must be a string.");
-            std::string name = getVal<std::string>(nameVal);
-            if (toLower(name) == "microseconds") {
+        VM_CASE(OP_GET_GLOBAL): {
+            int nameIndex = readOperand(code, ip);
+            int slot = readOperand(code, ip);
+            const Value* self = function && function->selfSlot >= 0 ? &vm.stack[base + function->selfSlot] : nullptr;
+            Value* found = findGlobal(vm, *chunk, nameIndex, slot, self);
+            if (found) {
+                vm.stack.push_back(*found);
+                DISPATCH();
+            }
+            const std::string& name = chunk->constants[nameIndex].asString();
+            if (name == "microseconds") {
                 auto now = std::chrono::steady_clock::now();
                 double us = std::chrono::duration<double, std::micro>(now - startTime).count();
                 vm.stack.push_back(us);
-                debugLog("VM: Loaded built-in microseconds: " + std::to_string(us));
+                VM_TRACE("VM: Loaded built-in microseconds: " + std::to_string(us));
             }
-            else if (toLower(name) == "ticks") {
+            else if (name == "ticks") {
                 auto now = std::chrono::steady_clock::now();
                 double seconds = std::chrono::duration<double>(now - startTime).count();
                 int ticks = static_cast<int>(seconds * 60);
                 vm.stack.push_back(ticks);
-                debugLog("VM: Loaded built-in ticks: " + std::to_string(ticks));
+                VM_TRACE("VM: Loaded built-in ticks: " + std::to_string(ticks));
             }
             else {
-                Value val = vm.environment->get(name);
-                vm.stack.push_back(val);
-                debugLog("VM: Loaded global variable: " + name + " = " + valueToString(val));
+                std::cerr << "NilObjectException for variable: " << name << std::endl;
+                dumpTraceRing();
+                exit(1);
             }
-            break;
+            DISPATCH();
+        }
+        VM_CASE(OP_SET_GLOBAL): {
+            int nameIndex = readOperand(code, ip);
+            int slot = readOperand(code, ip);
+            const Value* self = function && function->selfSlot >= 0 ? &vm.stack[base + function->selfSlot] : nullptr;
+            Value* found = findGlobal(vm, *chunk, nameIndex, slot, self);
+            if (!found) {
+                std::cerr << "NilObjectException for variable: "
+                          << chunk->constants[nameIndex].asString() << std::endl;
+                dumpTraceRing();
+                exit(1);
+            }
+            *found = std::move(vm.stack.back());
+            vm.stack.pop_back();
+            DISPATCH();
         }
-        case OP_SET_GLOBAL: {
-            int nameIndex = chunk.code[ip++];
-            if (nameIndex < 0 || nameIndex >= (int)chunk.constants.size())
-                runtimeError("VM: Invalid constant index for global name.");
-            Value nameVal = chunk.constants[nameIndex];
-            if (!holds<std::string>(nameVal))
-                runtimeError("VM: Global name must be a string.");
-            std::string name = getVal<std::string>(nameVal);
-            Value newVal = pop(vm);
-            vm.environment->assign(name, newVal);
-            debugLog("VM: Set global variable: " + name + " = " + valueToString(newVal));
-            break;
+        VM_CASE(OP_GET_LOCAL): {
+            int slot = readOperand(code, ip);
+            vm.stack.push_back(vm.stack[base + slot]);
+            DISPATCH();
         }
-        case OP_NEW: {
+        VM_CASE(OP_SET_LOCAL): {
+            int slot = readOperand(code, ip);
+            vm.stack[base + slot] = std::move(vm.stack.back());   // locals lie below the operands
+            vm.stack.pop_back();
+            DISPATCH();
+        }
+        VM_CASE(OP_NEW): {
             Value classVal = pop(vm);
-            if (!holds<std::shared_ptr<ObjClass>>(classVal))
+            if (!classVal.isClass())
                 runtimeError("VM: 'new' applied to non-class.");
-            auto cls = getVal<std::shared_ptr<ObjClass>>(classVal);
+            auto cls = classVal.asClass();
             if (cls->isPlugin) {
                 // For plugin classes, call the pluginConstructor to create a new instance.
                 Value result = cls->pluginConstructor({});
                 auto instance = std::make_shared<ObjInstance>();
                 instance->klass = cls;
                 // If the constructor returned an integer handle, store it by converting to void*
-                if (holds<int>(result)) {
-                    int handle = getVal<int>(result);
+                if (result.isInt()) {
+                    int handle = result.asInt();
                     instance->pluginInstance = reinterpret_cast<void*>(static_cast<intptr_t>(handle));
                 } else {
                     // Otherwise, use the returned pointer as is.
-                    instance->pluginInstance = getVal<void*>(result);
-                }
-                // Copy the plugin class properties into the instance's environment fields
-                for (auto& prop : cls->properties) {
-                    instance->fields[prop.first] = prop.second;
+                    instance->pluginInstance = result.asPointer();
                 }
+                // Lay out the plugin class properties as the instance's fields
+                instance->initFields();
                 vm.stack.push_back(Value(instance));
             } else {
                 // For built-in classes, use the standard instance creation.
                 auto instance = std::make_shared<ObjInstance>();
                 instance->klass = cls;
-                for (auto& p : cls->properties) {
-                    instance->fields[p.first] = p.second;
-                }
+                instance->initFields();
                 vm.stack.push_back(Value(instance));
             }
             break;
         }
         
 
-        case OP_DUP: {
+        VM_CASE(OP_DUP): {
             if (vm.stack.empty())
                 runtimeError("VM: Stack underflow on DUP.");
             vm.stack.push_back(vm.stack.back());
@@ -3664,9 +9652,38 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
         }
 
 
-        case OP_CALL: {
+        VM_CASE(OP_CALL): {
+            callbackSafepoint();
             // Number of arguments to pop
-            int argCount = chunk.code[ip++];
+            int argCount = readOperand(code, ip);
+
+            // Scripted functions and methods run in a new frame of this loop,
+            // taking their arguments in place on the stack.
+            Value self;
+            if (ObjFunction* target = scriptedCallTarget(vm.stack[vm.stack.size() - argCount - 1], argCount, self, false)) {
+                VM_TRACE("VM: Calling function " + target->name + " with " + std::to_string(argCount) + " arguments.");
+                enterFrame(target, argCount, self);
+                break;
+            }
+
+            // a(i) and a(i) = v within the array (or appending), in place on
+            // the stack; everything else takes the general path below.
+            if ((argCount == 1 || argCount == 2) && vm.stack[vm.stack.size() - argCount - 1].isArray()
+                && vm.stack[vm.stack.size() - argCount].isInt()) {
+                ObjArray* array = vm.stack[vm.stack.size() - argCount - 1].asArray().get();
+                int i = vm.stack[vm.stack.size() - argCount].asIntUnchecked();
+                if (i >= 0 && (size_t)i < array->size() + (argCount == 2)) {
+                    if (argCount == 2) {
+                        if ((size_t)i == array->size()) array->push(vm.stack.back());
+                        else array->set(i, vm.stack.back());
+                    }
+                    Value element = array->get(i);
+                    vm.stack.resize(vm.stack.size() - argCount - 1);
+                    vm.stack.push_back(std::move(element));
+                    break;
+                }
+            }
+
             std::vector<Value> args;
             // Pop arguments off the stack
             for (int i = 0; i < argCount; i++) {
@@ -3677,127 +9694,40 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
         
             // Pop the callable
             Value callee = pop(vm);
-            debugLog("VM: Calling function with " + std::to_string(argCount) + " arguments.");
+            VM_TRACE("VM: Calling function with " + std::to_string(argCount) + " arguments.");
         
             // ---------------------------  BUILTIN  -----------------------------------
-            if (holds<BuiltinFn>(callee)) {
-                BuiltinFn fn = getVal<BuiltinFn>(callee);
+            if (callee.isBuiltin()) {
+                BuiltinFn fn = callee.asBuiltin();
                 Value result = fn(args);
                 vm.stack.push_back(result);
             }
         
-            // -------------------------  SCRIPTED FN  ---------------------------------
-            else if (holds<std::shared_ptr<ObjFunction>>(callee)) {
-                auto function = getVal<std::shared_ptr<ObjFunction>>(callee);
-                int total    = function->params.size();
-                int required = function->arity;
-                if ((int)args.size() < required || (int)args.size() > total) {
-                    runtimeError("VM: Expected between " +
-                                 std::to_string(required) +
-                                 " and " +
-                                 std::to_string(total) +
-                                 " arguments for function " +
-                                 function->name);
-                }
-        
-                // Fill in optional parameters
-                for (int i = args.size(); i < total; i++) {
-                    args.push_back(function->params[i].defaultValue);
-                }
-        
-                // Remember stack depth
-                size_t savedDepth = vm.stack.size();
-        
-                // Swap in new environment
-                auto previousEnv = vm.environment;
-                vm.environment = std::make_shared<Environment>(previousEnv);
-        
-                // Bind parameters
-                for (size_t i = 0; i < function->params.size(); i++) {
-                    vm.environment->define(function->params[i].name, args[i]);
-                }
-        
-                // Execute
-                Value result = runVM(vm, function->chunk);
-        
-                // Restore environment
-                vm.environment = previousEnv;
-        
-                // Clear any extra stack values left by the call, then push exactly one result
-                vm.stack.resize(savedDepth);
-                vm.stack.push_back(result);
-        
-                debugLog("VM: Function " + function->name + " returned " + valueToString(result));
-            }
-        
-            // ------------------  SCRIPTED OVERLOAD RESOLUTION  -----------------------
-            else if (holds<std::vector<std::shared_ptr<ObjFunction>>>(callee)) {
-                auto overloads = getVal<std::vector<std::shared_ptr<ObjFunction>>>(callee);
-                std::shared_ptr<ObjFunction> chosen = nullptr;
-                for (auto& f : overloads) {
-                    int total    = f->params.size();
-                    int required = f->arity;
-                    if ((int)args.size() >= required && (int)args.size() <= total) {
-                        chosen = f;
-                        break;
-                    }
-                }
-                if (!chosen) {
-                    runtimeError("VM: No matching overload found for function call with " +
-                                 std::to_string(args.size()) + " arguments.");
-                }
-        
-                // Fill in optional parameters
-                for (int i = args.size(); i < (int)chosen->params.size(); i++) {
-                    args.push_back(chosen->params[i].defaultValue);
-                }
-        
-                size_t savedDepth = vm.stack.size();
-        
-                auto previousEnv = vm.environment;
-                vm.environment = std::make_shared<Environment>(previousEnv);
-                for (size_t i = 0; i < chosen->params.size(); i++) {
-                    vm.environment->define(chosen->params[i].name, args[i]);
-                }
-        
-                Value result = runVM(vm, chosen->chunk);
-        
-                vm.environment = previousEnv;
-                vm.stack.resize(savedDepth);
-                vm.stack.push_back(result);
-        
-                debugLog("VM: Function " + chosen->name + " returned " + valueToString(result));
-            }
-        
             // ----------------------  BOUND METHOD CALL  -------------------------------
-            else if (holds<std::shared_ptr<ObjBoundMethod>>(callee)) {
-                auto bound = getVal<std::shared_ptr<ObjBoundMethod>>(callee);
+            else if (callee.isBoundMethod()) {
+                auto bound = callee.asBoundMethod();
         
                 // NEW: string extension
-                if (holds<std::string>(bound->receiver)) {
+                if (bound->receiver.isString()) {
                     // look up the extension
                     auto &exts = vm.extensionMethods["string"];
                     auto it   = exts.find(bound->name);
                     if (it == exts.end())
                         runtimeError("No string extension: " + bound->name);
                     // invoke it
-                    return getVal<BuiltinFn>(it->second)(
-                        /* prepend the receiver */ 
-                        [&]{
-                            std::vector<Value> x = args;
-                            x.insert(x.begin(), bound->receiver);
-                            return x;
-                        }()
-                    );
+                    std::vector<Value> newArgs = args;
+                    newArgs.insert(newArgs.begin(), bound->receiver);   // prepend receiver
+                    vm.stack.push_back(it->second.asBuiltin()(newArgs));
+                    break;
                 }
                 /* ── NEW: Integer / Double / Boolean extensions ────────────────── */
-                else if (holds<int>(bound->receiver) ||
-                        holds<double>(bound->receiver) ||
-                        holds<bool>(bound->receiver))
+                else if (bound->receiver.isInt() ||
+                        bound->receiver.isDouble() ||
+                        bound->receiver.isBool())
                 {
                     std::string typeKey =
-                        holds<int>(bound->receiver)    ? "integer" :
-                        holds<double>(bound->receiver) ? "double"  : "boolean";
+                        bound->receiver.isInt()    ? "integer" :
+                        bound->receiver.isDouble() ? "double"  : "boolean";
 
                     auto &exts = vm.extensionMethods[typeKey];
                     auto it    = exts.find(bound->name);
@@ -3807,20 +9737,20 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
                     std::vector<Value> newArgs = args;            // the call’s arguments
                     newArgs.insert(newArgs.begin(), bound->receiver);   // prepend receiver
 
-                    Value result = getVal<BuiltinFn>(it->second)(newArgs);
+                    Value result = it->second.asBuiltin()(newArgs);
                     vm.stack.push_back(result);
                     break;
                 }
 
                 // Instance methods
-                if (holds<std::shared_ptr<ObjInstance>>(bound->receiver)) {
-                    auto instance = getVal<std::shared_ptr<ObjInstance>>(bound->receiver);
+                if (bound->receiver.isInstance()) {
+                    auto instance = bound->receiver.asInstance();
                     std::string key = toLower(bound->name);
                     Value methodVal = instance->klass->methods[key];
         
                     // If it's a BuiltinFn on a plugin class, prepend handle
-                    if (holds<BuiltinFn>(methodVal) && instance->klass->isPlugin) {
-                        BuiltinFn fn = getVal<BuiltinFn>(methodVal);
+                    if (methodVal.isBuiltin() && instance->klass->isPlugin) {
+                        BuiltinFn fn = methodVal.asBuiltin();
                         int handle = static_cast<int>(reinterpret_cast<intptr_t>(instance->pluginInstance));
                         std::vector<Value> newArgs;
                         newArgs.push_back(Value(handle));
@@ -3828,71 +9758,24 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
                         Value result = fn(newArgs);
                         vm.stack.push_back(result);
                     }
+                    // A method of a class built into the VM
+                    else if (methodVal.isBuiltin() && instance->klass->isNative) {
+                        args.insert(args.begin(), bound->receiver);
+                        vm.stack.push_back(methodVal.asBuiltin()(args));
+                    }
                     // If it's a simple BuiltinFn
-                    else if (holds<BuiltinFn>(methodVal)) {
-                        BuiltinFn fn = getVal<BuiltinFn>(methodVal);
+                    else if (methodVal.isBuiltin()) {
+                        BuiltinFn fn = methodVal.asBuiltin();
                         Value result = fn(args);
                         vm.stack.push_back(result);
                     }
-                    // Otherwise, it's a scripted ObjFunction or overload set
                     else {
-                        // Resolve to a single ObjFunction
-                        std::shared_ptr<ObjFunction> methodFn = nullptr;
-                        if (holds<std::shared_ptr<ObjFunction>>(methodVal)) {
-                            methodFn = getVal<std::shared_ptr<ObjFunction>>(methodVal);
-                        }
-                        else {
-                            auto overloads = getVal<std::vector<std::shared_ptr<ObjFunction>>>(methodVal);
-                            for (auto& f : overloads) {
-                                int total    = f->params.size();
-                                int required = f->arity;
-                                if ((int)args.size() >= required && (int)args.size() <= total) {
-                                    methodFn = f;
-                                    break;
-                                }
-                            }
-                        }
-                        if (!methodFn) {
-                            runtimeError("VM: No matching method found for " + bound->name);
-                        }
-        
-                        size_t savedDepth = vm.stack.size();
-        
-                        auto previousEnv = vm.environment;
-                        vm.environment = std::make_shared<Environment>(previousEnv);
-        
-                        // Define 'self'
-                        if (instance->klass->isPlugin) {
-                            int handle = static_cast<int>(reinterpret_cast<intptr_t>(instance->pluginInstance));
-                            vm.environment->define("self", Value(handle));
-                        } else {
-                            vm.environment->define("self", bound->receiver);
-                        }
-        
-                        // Bind parameters
-                        for (size_t i = 0; i < methodFn->params.size(); i++) {
-                            if (i < args.size()) {
-                                vm.environment->define(methodFn->params[i].name, args[i]);
-                            } else {
-                                vm.environment->define(
-                                    methodFn->params[i].name,
-                                    methodFn->params[i].defaultValue
-                                );
-                            }
-                        }
-        
-                        Value result = runVM(vm, methodFn->chunk);
-        
-                        vm.environment = previousEnv;
-                        vm.stack.resize(savedDepth);
-                        vm.stack.push_back(result);
-        
-                        debugLog("VM: Method " + methodFn->name + " returned " + valueToString(result));
+                        runtimeError("VM: No method " + bound->name + " on class " + instance->klass->name);
                     }
                 }
                 // Array methods
-                else if (holds<std::shared_ptr<ObjArray>>(bound->receiver)) {
-                    auto array = getVal<std::shared_ptr<ObjArray>>(bound->receiver);
+                else if (bound->receiver.isArray()) {
+                    auto array = bound->receiver.asArray();
                     Value result = callArrayMethod(array, bound->name, args);
                     vm.stack.push_back(result);
                 }
@@ -3902,50 +9785,52 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
             }
         
             // -----------------  ARRAY INDEXING  --------------------------------------
-            // else if (holds<std::shared_ptr<ObjArray>>(callee)) {
-            //     auto array = getVal<std::shared_ptr<ObjArray>>(callee);
+            // else if (callee.isArray()) {
+            //     auto array = callee.asArray();
             //     if (argCount != 1) {
             //         runtimeError("VM: Array call expects exactly 1 argument for indexing.");
             //     }
             //     Value indexVal = args[0];
-            //     if (!holds<int>(indexVal)) {
+            //     if (!indexVal.isInt()) {
             //         runtimeError("VM: Array index must be an integer.");
             //     }
-            //     int index = getVal<int>(indexVal);
+            //     int index = indexVal.asInt();
             //     if (index < 0 || index >= (int)array->elements.size()) {
             //         runtimeError("VM: Array index out of bounds.");
             //     }
             //     vm.stack.push_back(array->elements[index]);
             // }
-            else if (holds<std::shared_ptr<ObjArray>>(callee)) {
-                auto array = getVal<std::shared_ptr<ObjArray>>(callee);
+            else if (callee.isArray()) {
+                auto array = callee.asArray();
 
                 /* ---------------- get item ---------------- */
                 if (argCount == 1) {
                     Value idx = args[0];
-                    if (!holds<int>(idx))
+                    if (!idx.isInt())
                         runtimeError("VM: Array index must be an Integer.");
-                    int i = getVal<int>(idx);
-                    if (i < 0 || i >= (int)array->elements.size())
+                    int i = idx.asInt();
+                    if (i < 0 || i >= (int)array->size())
                         runtimeError("VM: Array index out of bounds.");
-                    vm.stack.push_back(array->elements[i]);
+                    vm.stack.push_back(array->get(i));
                 }
 
                 /* ---------------- set item ---------------- */
                 else if (argCount == 2) {
                     Value idx = args[0];
-                    if (!holds<int>(idx))
+                    if (!idx.isInt())
                         runtimeError("VM: Array index must be an Integer.");
-                    int i = getVal<int>(idx);
+                    int i = idx.asInt();
                     if (i < 0)
                         runtimeError("VM: Array index must be ≥ 0.");
 
-                    /* auto-grow, like Xojo */
-                    if (i >= (int)array->elements.size())
-                        array->elements.resize(i + 1, Value(std::monostate{}));
-
-                    array->elements[i] = args[1];      // assign
-                    vm.stack.push_back(args[1]);       // return the new value
+                    /* auto-grow, like Xojo; appending keeps the array packed */
+                    if (i == (int)array->size())
+                        array->push(args[1]);
+                    else {
+                        array->growTo(i + 1);
+                        array->set(i, args[1]);        // assign
+                    }
+                    vm.stack.push_back(array->get(i)); // return the new value
                 }
 
                 /* anything else is an error */
@@ -3955,8 +9840,8 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
             }
         
             // -----------------  STRING-BASED BUILT-INS  ------------------------------
-            else if (holds<std::string>(callee)) {
-                std::string funcName = toLower(getVal<std::string>(callee));
+            else if (callee.isString()) {
+                std::string funcName = toLower(callee.asString());
                 if (funcName == "print") {
                     if (args.empty()) runtimeError("VM: print expects an argument.");
                     std::cout << valueToString(args[0]) << std::endl;
@@ -3978,8 +9863,8 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
                 }
                 else if (funcName == "val") {
                     if (args.size() != 1) runtimeError("VM: val expects exactly one argument.");
-                    if (!holds<std::string>(args[0])) runtimeError("VM: val expects a string argument.");
-                    double d = std::stod(getVal<std::string>(args[0]));
+                    if (!args[0].isString()) runtimeError("VM: val expects a string argument.");
+                    double d = std::stod(args[0].asString());
                     vm.stack.push_back(d);
                 }
                 else {
@@ -3991,94 +9876,295 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
             else {
                 runtimeError("VM: Can only call functions, methods, arrays, or built-in functions.");
             }
-        
+
+            // Native code left at this call; go back to it for the rest.
+            tierUp();
             break;
         }
         
-        case OP_OPTIONAL_CALL: {
-            int argCount = chunk.code[ip++];
+        VM_CASE(OP_INVOKE): {
+            callbackSafepoint();
+            int nameIndex = readOperand(code, ip);
+            ObjFunction::PropertyCache& cache = chunk->caches[readOperand(code, ip)];
+            int argCountPos = ip;
+            int argCount = readOperand(code, ip);
+            size_t calleePos = vm.stack.size() - argCount - 1;
+            const std::string& name = chunk->constants[nameIndex].asString();
+            Value& receiver = vm.stack[calleePos];
+
+            // Scripted instances: resolve through the inline cache and run a
+            // scripted method in place, with the receiver as its callee slot.
+            if (receiver.isInstance()) {
+                ObjInstance* instance = receiver.asInstance().get();
+                int slot = -1;
+                Value method;
+                if (const ObjFunction::PropertyCache::Entry* hit = cache.find(instance->shape)) {
+                    slot = hit->slot;
+                    method = hit->method;
+                }
+                else if (!instance->klass->isPlugin) {
+                    if (!instance->shape)
+                        instance->initFields();
+                    slot = instance->shape->find(name);
+                    auto it = instance->klass->methods.find(name);
+                    if (slot < 0 && it != instance->klass->methods.end())
+                        method = it->second;
+                    if (slot >= 0 || !method.isNil())
+                        cache.add(instance->shape, slot, method);
+                }
+                if (slot >= 0) {
+                    // A field holding something callable: call its value.
+                    Value field = instance->slots[slot];
+                    receiver = std::move(field);
+                    ip = argCountPos;
+                    instruction = OP_CALL;
+                    goto dispatch;
+                }
+                ObjFunction* target = nullptr;
+                Value self = receiver;
+                if (method.isFunction())
+                    target = method.asFunction().get();
+                else if (method.isOverloads())
+                    target = scriptedCallTarget(method, argCount, self, false);
+                if (target) {
+                    VM_TRACE("VM: Invoking method " + target->name + " with " + std::to_string(argCount) + " arguments.");
+                    enterFrame(target, argCount, self);
+                    break;
+                }
+                if (method.isBuiltin() && instance->klass->isNative) {
+                    std::vector<Value> args(vm.stack.begin() + calleePos, vm.stack.end());
+                    Value result = method.asBuiltin()(args);
+                    vm.stack.resize(calleePos);
+                    vm.stack.push_back(std::move(result));
+                    break;
+                }
+            }
+            // Arrays and extension methods on strings and numbers are called
+            // directly with the receiver in front of the arguments.
+            else if (receiver.isArray() || receiver.isString() || receiver.isInt() || receiver.isDouble()) {
+                std::vector<Value> args(vm.stack.begin() + calleePos + 1, vm.stack.end());
+                Value result;
+                bool handled = true;
+                if (receiver.isArray()) {
+                    result = callArrayMethod(receiver.asArray(), name, args);
+                }
+                else {
+                    const char* typeKey = receiver.isString() ? "string" :
+                                          receiver.isInt()    ? "integer" : "double";
+                    auto& exts = vm.extensionMethods[typeKey];
+                    auto it = exts.find(name);
+                    if (it != exts.end()) {
+                        args.insert(args.begin(), receiver);
+                        result = it->second.asBuiltin()(args);
+                    }
+                    else {
+                        handled = false;
+                    }
+                }
+                if (handled) {
+                    vm.stack.resize(calleePos);
+                    vm.stack.push_back(std::move(result));
+                    break;
+                }
+            }
+
+            // Everything else: fetch the property as OP_GET_PROPERTY would and
+            // call it as OP_CALL, which re-reads the argument count operand.
+            Value object = receiver;
+            vm.stack[calleePos] = getProperty(vm, object, name, cache);
+            ip = argCountPos;
+            instruction = OP_CALL;
+            goto dispatch;
+        }
+        VM_CASE(OP_TAIL_CALL): {
+            // A scripted callee takes over the current frame: it and its
+            // arguments slide down over this frame's callee slot, so calls in
+            // tail position run in constant stack. Entry frames, which have no
+            // callee slot, and every other kind of callee call as OP_CALL.
+            int argCountPos = ip;
+            int argCount = readOperand(code, ip);
+            Value self;
+            ObjFunction* target = nullptr;
+            if (vm.frames.size() - 1 > entryDepth)
+                target = scriptedCallTarget(vm.stack[vm.stack.size() - argCount - 1], argCount, self, false);
+            if (!target) {
+                ip = argCountPos;
+                instruction = OP_CALL;
+                goto dispatch;
+            }
+            callbackSafepoint();
+            VM_TRACE("VM: Tail calling function " + target->name + " with " + std::to_string(argCount) + " arguments.");
+            size_t calleePos = vm.stack.size() - argCount - 1;
+            std::move(vm.stack.begin() + calleePos, vm.stack.end(), vm.stack.begin() + (base - 1));
+            vm.stack.resize(base + argCount);
+            vm.frames.pop_back();
+            pushCallFrame(target, argCount, self);
+            break;
+        }
+        VM_CASE(OP_COMPARE_JUMP): {
+            int compareOp = readOperand(code, ip);
+            int offset = readJumpTarget(code, ip);
+            size_t top = vm.stack.size();
+            bool result = compareValues(compareOp, vm.stack[top - 2], vm.stack[top - 1]);
+            vm.stack.resize(top - 2);
+            if (!result)
+                ip = offset;
+            DISPATCH();
+        }
+        VM_CASE(OP_GUARD): {
+            int declared = readOperand(code, ip);
+            if (!passGuard(vm.stack.back(), declared))
+                deoptimize();
+            DISPATCH();
+        }
+        VM_CASE(OP_GUARD_LOCAL): {
+            int slot = readOperand(code, ip);
+            int declared = readOperand(code, ip);
+            if (!passGuard(vm.stack[base + slot], declared))
+                deoptimize();
+            DISPATCH();
+        }
+        VM_CASE(OP_ADD_INT): TYPED_BINARY(asIntUnchecked, +)
+        VM_CASE(OP_SUB_INT): TYPED_BINARY(asIntUnchecked, -)
+        VM_CASE(OP_MUL_INT): TYPED_BINARY(asIntUnchecked, *)
+        VM_CASE(OP_ADD_DOUBLE): TYPED_BINARY(asDoubleUnchecked, +)
+        VM_CASE(OP_SUB_DOUBLE): TYPED_BINARY(asDoubleUnchecked, -)
+        VM_CASE(OP_MUL_DOUBLE): TYPED_BINARY(asDoubleUnchecked, *)
+        VM_CASE(OP_DIV_DOUBLE): TYPED_BINARY(asDoubleUnchecked, /)
+        VM_CASE(OP_ADD_STRING): {
+            appendString(vm.stack[vm.stack.size() - 2], vm.stack.back());
+            vm.stack.pop_back();
+            DISPATCH();
+        }
+        VM_CASE(OP_COMPARE_JUMP_INT):
+        VM_CASE(OP_COMPARE_JUMP_DOUBLE): {
+            int compareOp = readOperand(code, ip);
+            int offset = readJumpTarget(code, ip);
+            const Value& a = vm.stack[vm.stack.size() - 2];
+            const Value& b = vm.stack.back();
+            bool result = instruction == OP_COMPARE_JUMP_INT
+                ? compareNumbers(compareOp, a.asIntUnchecked(), b.asIntUnchecked())
+                : compareNumbers(compareOp, a.asDoubleUnchecked(), b.asDoubleUnchecked());
+            vm.stack.pop_back();
+            vm.stack.pop_back();
+            if (!result)
+                ip = offset;
+            DISPATCH();
+        }
+        VM_CASE(OP_FOR_LOOP_INT): {
+            int offset = readJumpTarget(code, ip);
+            int flags = readOperand(code, ip);
+            int counterIndex = readOperand(code, ip);
+            readOperand(code, ip);
+            Value& counter = vm.stack[base + counterIndex];
+            int end = vm.stack[vm.stack.size() - 2].asIntUnchecked();
+            int next = counter.asIntUnchecked() + vm.stack.back().asIntUnchecked();
+            counter = Value(next);
+            if ((flags & FOR_DOWN) ? next >= end : next <= end) {
+                callbackSafepoint();
+                ip = offset;
+                tierUp();
+            }
+            DISPATCH();
+        }
+        VM_CASE(OP_INLINE_GUARD): {
+            int nameIndex = readOperand(code, ip);
+            int slot = readOperand(code, ip);
+            int functionIndex = readOperand(code, ip);
+            int offset = readJumpTarget(code, ip);
+            const Value* self = function && function->selfSlot >= 0 ? &vm.stack[base + function->selfSlot] : nullptr;
+            if (!inlinedCallee(vm, *chunk, nameIndex, slot, functionIndex, self))
+                ip = offset;
+            DISPATCH();
+        }
+        VM_CASE(OP_SWITCH): {
+            int tableIndex = readOperand(code, ip);
+            int offset = readJumpTarget(code, ip);
+            int target = chunk->switches[tableIndex].find(vm.stack.back());
+            vm.stack.pop_back();
+            ip = target >= 0 ? target : offset;
+            DISPATCH();
+        }
+        VM_CASE(OP_FOR_PREP):
+        VM_CASE(OP_FOR_LOOP): {
+            int offset = readJumpTarget(code, ip);
+            int flags = readOperand(code, ip);
+            int counterIndex = readOperand(code, ip);
+            int counterSlot = readOperand(code, ip);
+            Value* counter;
+            if (flags & FOR_GLOBAL) {
+                const Value* self = function && function->selfSlot >= 0 ? &vm.stack[base + function->selfSlot] : nullptr;
+                counter = findGlobal(vm, *chunk, counterIndex, counterSlot, self);
+                if (!counter)
+                    runtimeError("VM: NilObjectException for variable: " + chunk->constants[counterIndex].asString());
+            }
+            else {
+                counter = &vm.stack[base + counterIndex];
+            }
+            // [ ..., end value, step ] stay on the stack for the whole loop.
+            const Value& end = vm.stack[vm.stack.size() - 2];
+            const Value& step = vm.stack.back();
+            if (instruction == OP_FOR_LOOP) {
+                if (counter->isInt() && step.isInt())
+                    *counter = Value(counter->asInt() + step.asInt());
+                else if ((counter->isInt() || counter->isDouble()) && (step.isInt() || step.isDouble()))
+                    *counter = Value((counter->isDouble() ? counter->asDouble() : counter->asInt()) +
+                                     (step.isDouble() ? step.asDouble() : step.asInt()));
+                else
+                    runtimeError("VM: For loop counter and step must be numbers.");
+            }
+            bool more = compareValues((flags & FOR_DOWN) ? OP_GE : OP_LE, *counter, end);
+            if (instruction == OP_FOR_PREP) {
+                if (!more)
+                    ip = offset;
+            }
+            else if (more) {
+                callbackSafepoint();
+                ip = offset;
+                tierUp();
+            }
+            DISPATCH();
+        }
+        VM_CASE(OP_OPTIONAL_CALL): {
+            callbackSafepoint();
+            int argCount = readOperand(code, ip);
+            Value self;
+            if (ObjFunction* target = scriptedCallTarget(vm.stack[vm.stack.size() - argCount - 1], argCount, self, true)) {
+                VM_TRACE("OP_OPTIONAL_CALL: Calling constructor " + target->name);
+                enterFrame(target, argCount, self);
+                break;
+            }
+
             std::vector<Value> args;
             for (int i = 0; i < argCount; i++) {
                 args.push_back(pop(vm));
             }
             std::reverse(args.begin(), args.end());
             Value callee = pop(vm);
-            debugLog("OP_OPTIONAL_CALL: callee type: " + getTypeName(callee));
-            if (holds<std::monostate>(callee)) {
-                debugLog("OP_OPTIONAL_CALL: No constructor found; skipping call.");
+            VM_TRACE("OP_OPTIONAL_CALL: callee type: " + getTypeName(callee));
+            if (callee.isNil()) {
+                VM_TRACE("OP_OPTIONAL_CALL: No constructor found; skipping call.");
                 vm.stack.push_back(Value(std::monostate{}));   // so constructor_end sees [instance, nil]
             }
-            else if (holds<std::shared_ptr<ObjFunction>>(callee)) {
-                auto function = getVal<std::shared_ptr<ObjFunction>>(callee);
-                int total = function->params.size();
-                int required = function->arity;
-                if ((int)args.size() < required || (int)args.size() > total)
-                    runtimeError("VM: Expected between " + std::to_string(required) + " and " + std::to_string(total) + " arguments for constructor " + function->name);
-                for (int i = args.size(); i < total; i++) {
-                    args.push_back(function->params[i].defaultValue);
-                }
-                auto previousEnv = vm.environment;
-                vm.environment = std::make_shared<Environment>(previousEnv);
-                for (size_t i = 0; i < function->params.size(); i++) {
-                    vm.environment->define(function->params[i].name, args[i]);
-                }
-
-                Value result = runVM(vm, function->chunk);
-                vm.environment = previousEnv;
-                debugLog("OP_OPTIONAL_CALL: Constructor function "
-                            + function->name + " returned " + valueToString(result));
-                
-                vm.stack.push_back(result);                  //  ← always push, even if “nil”
-                    
-            }
 
            /* ─────────────  NEW: handle bound-methods (scripted or plugin) ───────────── */
-            else if (holds<std::shared_ptr<ObjBoundMethod>>(callee)) {
+            else if (callee.isBoundMethod()) {
 
-                auto bound = getVal<std::shared_ptr<ObjBoundMethod>>(callee);
+                auto bound = callee.asBoundMethod();
                 std::string key = toLower(bound->name);
 
                 /* 1.  Receiver is a *scripted* instance -- fetch the target method */
-                if (holds<std::shared_ptr<ObjInstance>>(bound->receiver)) {
-                    auto instance = getVal<std::shared_ptr<ObjInstance>>(bound->receiver);
+                if (bound->receiver.isInstance()) {
+                    auto instance = bound->receiver.asInstance();
                     Value methodVal = instance->klass->methods[key];
 
-                    /* fall back to existing OP_CALL logic ------------------------- */
-                    // --- scripted function overload set?
-                    if (holds<std::vector<std::shared_ptr<ObjFunction>>>(methodVal))
-                        methodVal = resolveOverload(methodVal, args);   // helper you already have
-
-                    /* scripted ObjFunction */
-                    if (holds<std::shared_ptr<ObjFunction>>(methodVal)) {
-
-                        auto fn = getVal<std::shared_ptr<ObjFunction>>(methodVal);
-
-                        /* arity / default-arg handling (same as OP_CALL) */
-                        int total    = fn->params.size();
-                        int required = fn->arity;
-                        if ((int)args.size() < required || (int)args.size() > total)
-                            runtimeError("VM: Expected between " + std::to_string(required) +
-                                        " and " + std::to_string(total) + " arguments for " + fn->name);
-                        for (int i = args.size(); i < total; ++i)
-                            args.push_back(fn->params[i].defaultValue);
-
-                        auto prevEnv = vm.environment;
-                        vm.environment = std::make_shared<Environment>(prevEnv);
-                        vm.environment->define("self", bound->receiver);          // bind Self
-
-                        for (size_t i = 0; i < fn->params.size(); ++i)
-                            vm.environment->define(fn->params[i].name, args[i]);
-
-                        Value result = runVM(vm, fn->chunk);
-                        vm.environment = prevEnv;
-                        vm.stack.push_back(result);
-                    }
-                    /* builtin for plugin instance (shouldn’t happen for “constructor”, but safe) */
-                    else if (holds<BuiltinFn>(methodVal)) {
-                        BuiltinFn fn = getVal<BuiltinFn>(methodVal);
+                    /* scripted methods were entered as a frame above;
+                       builtin for plugin instance (shouldn’t happen for “constructor”, but safe) */
+                    if (methodVal.isBuiltin()) {
+                        BuiltinFn fn = methodVal.asBuiltin();
                         int handle = static_cast<int>(
                                         reinterpret_cast<intptr_t>(
-                                            getVal<std::shared_ptr<ObjInstance>>(bound->receiver)->pluginInstance));
+                                            bound->receiver.asInstance()->pluginInstance));
                         std::vector<Value> newArgs{ Value(handle) };
                         newArgs.insert(newArgs.end(), args.begin(), args.end());
                         vm.stack.push_back(fn(newArgs));
@@ -4098,59 +10184,80 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
 
             break;
         }
-        case OP_RETURN: {
+        VM_CASE(OP_RETURN): {
+            callbackSafepoint();
             Value ret = vm.stack.empty() ? Value(std::monostate{}) : pop(vm);
-            return ret;
+            vm.frames.pop_back();
+            if (vm.frames.size() == entryDepth)
+                return ret;
+            VM_TRACE("VM: Function " + function->name + " returned " + valueToString(ret));
+            // Drop the callee, its arguments and locals, then push exactly one result
+            vm.stack.resize(base - 1);
+            vm.stack.push_back(std::move(ret));
+            const CallFrame& caller = vm.frames.back();
+            function = caller.function;
+            chunk = caller.chunk;
+            code = chunk->code.data();
+            ip = caller.ip;
+            base = caller.base;
+            tierUp();
+            break;
         }
-        case OP_NIL: {
+        VM_CASE(OP_NIL): {
             vm.stack.push_back(Value(std::monostate{}));
-            break;
+            DISPATCH();
         }
-        case OP_JUMP_IF_FALSE: {
-            int offset = chunk.code[ip++];
-            Value condition = pop(vm);
+        VM_CASE(OP_JUMP_IF_FALSE): {
+            int offset = readJumpTarget(code, ip);
+            const Value& condition = vm.stack.back();
             bool condTruth = false;
-            if (holds<bool>(condition))
-                condTruth = getVal<bool>(condition);
-            else if (holds<int>(condition))
-                condTruth = (getVal<int>(condition) != 0);
-            else if (holds<std::string>(condition))
-                condTruth = !getVal<std::string>(condition).empty();
-            else if (std::holds_alternative<std::monostate>(condition))
+            if (condition.isBool())
+                condTruth = condition.asBool();
+            else if (condition.isInt())
+                condTruth = (condition.asInt() != 0);
+            else if (condition.isString())
+                condTruth = condition.stringBox().size != 0;
+            else if (condition.isNil())
                 condTruth = false;
+            vm.stack.pop_back();
             if (!condTruth) {
                 ip = offset;
             }
-            break;
+            DISPATCH();
         }
-        case OP_JUMP: {
-            int offset = chunk.code[ip++];
+        VM_CASE(OP_JUMP): {
+            int offset = readJumpTarget(code, ip);
+            // Loops are safepoints: deliver plugin callbacks queued by other threads.
             ip = offset;
-            break;
+            if (offset <= currentIp) {
+                callbackSafepoint();
+                tierUp();
+            }
+            DISPATCH();
         }
-        case OP_CLASS: {
-            int nameIndex = chunk.code[ip++];
-            Value nameVal = chunk.constants[nameIndex];
-            if (!holds<std::string>(nameVal))
+        VM_CASE(OP_CLASS): {
+            int nameIndex = readOperand(code, ip);
+            Value nameVal = chunk->constants[nameIndex];
+            if (!nameVal.isString())
                 runtimeError("VM: Class name must be a string.");
             auto klass = std::make_shared<ObjClass>();
-            klass->name = getVal<std::string>(nameVal);
+            klass->name = nameVal.asString();
             vm.stack.push_back(Value(klass));
             break;
         }
-        case OP_METHOD: {
-            int methodNameIndex = chunk.code[ip++];
-            Value methodNameVal = chunk.constants[methodNameIndex];
-            if (!holds<std::string>(methodNameVal))
+        VM_CASE(OP_METHOD): {
+            int methodNameIndex = readOperand(code, ip);
+            Value methodNameVal = chunk->constants[methodNameIndex];
+            if (!methodNameVal.isString())
                 runtimeError("VM: Method name must be a string.");
             Value methodVal = pop(vm);
-            if (!holds<std::shared_ptr<ObjFunction>>(methodVal))
+            if (!methodVal.isFunction())
                 runtimeError("VM: Method must be a function.");
             Value classVal = pop(vm);
-            if (!holds<std::shared_ptr<ObjClass>>(classVal))
+            if (!classVal.isClass())
                 runtimeError("VM: No class found for method.");
-            auto klass = getVal<std::shared_ptr<ObjClass>>(classVal);
-            std::string methodName = toLower(getVal<std::string>(methodNameVal));
+            auto klass = classVal.asClass();
+            std::string methodName = toLower(methodNameVal.asString());
             if (klass->methods.find(methodName) != klass->methods.end()) {
                 // Overload handling omitted.
             }
@@ -4160,195 +10267,98 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
             vm.stack.push_back(Value(klass));
             break;
         }
-        case OP_PROPERTIES: {
-            int propIndex = chunk.code[ip++];
-            Value propVal = chunk.constants[propIndex];
-            if (!holds<PropertiesType>(propVal))
+        VM_CASE(OP_PROPERTIES): {
+            int propIndex = readOperand(code, ip);
+            Value propVal = chunk->constants[propIndex];
+            if (!propVal.isProperties())
                 runtimeError("VM: Properties must be a property map.");
-            auto props = getVal<PropertiesType>(propVal);
+            auto props = propVal.asProperties();
             Value classVal = pop(vm);
-            if (!holds<std::shared_ptr<ObjClass>>(classVal))
+            if (!classVal.isClass())
                 runtimeError("VM: Properties can only be set on a class object.");
-            auto klass = getVal<std::shared_ptr<ObjClass>>(classVal);
+            auto klass = classVal.asClass();
             klass->properties = props;
             vm.stack.push_back(Value(klass));
             break;
         }
-        case OP_ARRAY: {
-            int count = chunk.code[ip++];
+        VM_CASE(OP_ARRAY): {
+            int count = readOperand(code, ip);
             std::vector<Value> elems;
             for (int i = 0; i < count; i++) {
                 elems.push_back(pop(vm));
             }
             std::reverse(elems.begin(), elems.end());
             auto array = std::make_shared<ObjArray>();
-            array->elements = elems;
+            array->assign(std::move(elems));
             vm.stack.push_back(Value(array));
-            debugLog("VM: Created array with " + std::to_string(count) + " elements.");
+            VM_TRACE("VM: Created array with " + std::to_string(count) + " elements.");
             break;
         }
-        case OP_GET_PROPERTY: {
-            int nameIndex = chunk.code[ip++];
-            Value propNameVal = chunk.constants[nameIndex];
-            if (!holds<std::string>(propNameVal))
-                runtimeError("VM: Property name must be a string.");
-            std::string propName = toLower(getVal<std::string>(propNameVal));
-            Value object = pop(vm);
-
-            if (holds<std::shared_ptr<ObjInstance>>(object)) {
-                auto instance = getVal<std::shared_ptr<ObjInstance>>(object);
-                std::string key = toLower(propName);
-                // FIRST, check instance fields
-                if (instance->fields.find(key) != instance->fields.end()) {
-                    vm.stack.push_back(instance->fields[key]);
-                }
-                else if (instance->klass->isPlugin) {
-                    // For plugin instances, now check pluginProperties
-                    auto it = instance->klass->pluginProperties.find(key);
-                    if (it != instance->klass->pluginProperties.end()) {
-                        int handle = static_cast<int>(reinterpret_cast<intptr_t>(instance->pluginInstance));
-                        BuiltinFn getter = it->second.first;
-                        Value result = getter({ Value(handle) });
-                        vm.stack.push_back(result);
-                    } 
-                    // Next, check if the plugin class defines a method with this name
-                    else if (instance->klass->methods.find(key) != instance->klass->methods.end()) {
-                        auto bound = std::make_shared<ObjBoundMethod>();
-                        bound->receiver = object;
-                        bound->name = key;
-                        vm.stack.push_back(Value(bound));
-                    }
-                    else {
-                        if (key == "constructor") {                // <– NEW guard
-                            vm.stack.push_back(Value(std::monostate{}));     // acts like “no ctor”
-                        } else {
-                            int handle = static_cast<int>(reinterpret_cast<intptr_t>(instance->pluginInstance));
-                            std::string target = instance->klass->name + ":" +
-                                                 std::to_string(handle) + ":" + key;
-                            vm.stack.push_back(Value(target));
-                        }
-                    }
-                    
+        VM_CASE(OP_TYPED_ARRAY): {
+            int kind = readOperand(code, ip);
+            if (kind <= (int)ObjArray::Kind::Values || kind > (int)ObjArray::Kind::String)
+                runtimeError("VM: Bad array element type.");
+            vm.stack.push_back(Value(std::make_shared<ObjArray>((ObjArray::Kind)kind)));
+            break;
+        }
+        VM_CASE(OP_GET_PROPERTY): {
+            int nameIndex = readOperand(code, ip);
+            ObjFunction::PropertyCache& cache = chunk->caches[readOperand(code, ip)];
+            if (vm.stack.back().isInstance()) {
+                // Fast path: a shape this site has already resolved.
+                Value& top = vm.stack.back();
+                const ObjFunction::PropertyCache::Entry* hit = cache.find(top.asInstance()->shape);
+                if (hit && hit->slot >= 0) {
+                    // Copied before top lets go of the instance.
+                    top = Value(top.asInstance()->slots[hit->slot]);
+                    DISPATCH();
                 }
-                else {
-                    // Non-plugin instance branch
-                    if (instance->fields.find(key) != instance->fields.end()) {
-                        vm.stack.push_back(instance->fields[key]);
-                    } else if (instance->klass && instance->klass->methods.find(key) != instance->klass->methods.end()) {
+                if (hit) {
+                    {
                         auto bound = std::make_shared<ObjBoundMethod>();
-                        bound->receiver = object;
-                        bound->name = key;
-                        vm.stack.push_back(Value(bound));
-                    } else if (key == "tostring") {
-                        vm.stack.push_back(Value(valueToString(object)));
-                    } else {
-                        if (key == "constructor") {
-                            vm.stack.push_back(Value(std::monostate{}));
-                        } else {
-                            runtimeError("VM: NilObjectException for property: " + propName);
-                        }
+                        bound->receiver = top;
+                        bound->name = chunk->constants[nameIndex].asString();
+                        bound->method = hit->method;
+                        top = Value(std::move(bound));
                     }
+                    DISPATCH();
                 }
-            
-            //Module Extends lookups
-            } else if (holds<std::shared_ptr<ObjArray>>(object)) {
-                // ─── NEW: module extension lookup ───────────────────
-                auto &exts = vm.extensionMethods["array"];
-                auto it   = exts.find(propName);
-                if (it != exts.end()) {
-                    auto bound = std::make_shared<ObjBoundMethod>();
-                    bound->receiver = object;
-                    bound->name     = propName;
-                    vm.stack.push_back(Value(bound));
-                    break;
-                }
-                auto array = getVal<std::shared_ptr<ObjArray>>(object);
-                auto bound = std::make_shared<ObjBoundMethod>();
-                bound->receiver = object;
-                bound->name = propName;
-                vm.stack.push_back(Value(bound));
-            } else if (holds<int>(object)) {
-                // ─── NEW: module extension lookup ───────────────────
-                auto &exts = vm.extensionMethods["integer"];
-                auto it   = exts.find(propName);
-                if (it != exts.end()) {
-                    auto bound = std::make_shared<ObjBoundMethod>();
-                    bound->receiver = object;
-                    bound->name     = propName;
-                    vm.stack.push_back(Value(bound));
-                    break;
-                }
-                if (propName == "tostring")
-                    vm.stack.push_back(Value(valueToString(object)));
-                else
-                    runtimeError("VM: Unknown property for integer: " + propName);
-            } else if (holds<double>(object)) {
-                // ─── NEW: module extension lookup ───────────────────
-                auto &exts = vm.extensionMethods["double"];
-                auto it   = exts.find(propName);
-                if (it != exts.end()) {
-                    auto bound = std::make_shared<ObjBoundMethod>();
-                    bound->receiver = object;
-                    bound->name     = propName;
-                    vm.stack.push_back(Value(bound));
-                    break;
-                }
-                if (propName == "tostring")
-                    vm.stack.push_back(Value(valueToString(object)));
-                else
-                    runtimeError("VM: Unknown property for double: " + propName);
-            } 
-            
-            else if (holds<std::string>(object)) {
-                std::string s = getVal<std::string>(object);
-                // ─── NEW: module extension lookup ───────────────────
-                auto &exts = vm.extensionMethods["string"];
-                auto it   = exts.find(propName);
-                if (it != exts.end()) {
-                    auto bound = std::make_shared<ObjBoundMethod>();
-                    bound->receiver = object;
-                    bound->name     = propName;
-                    vm.stack.push_back(Value(bound));
-                    break;
-                }
-                if (propName == "tostring")
-                    vm.stack.push_back(Value(s));
-                else
-                    runtimeError("VM: Unknown property for string: " + propName);
-            } else if (holds<std::shared_ptr<ObjModule>>(object)) {
-                auto module = getVal<std::shared_ptr<ObjModule>>(object);
-                std::string key = toLower(propName);
-                if (module->publicMembers.find(key) != module->publicMembers.end())
-                    vm.stack.push_back(module->publicMembers[key]);
-                else
-                    runtimeError("VM: NilObjectException module property: " + propName);
-            } else if (holds<std::shared_ptr<ObjEnum>>(object)) {
-                auto en = getVal<std::shared_ptr<ObjEnum>>(object);
-                std::string key = toLower(propName);
-                if (en->members.find(key) != en->members.end())
-                    vm.stack.push_back(en->members[key]);
-                else
-                    runtimeError("VM: NilObjectException enum member: " + propName);
-            } else {
-                runtimeError("VM: Property access on unsupported type.");
             }
+            Value propNameVal = chunk->constants[nameIndex];
+            if (!propNameVal.isString())
+                runtimeError("VM: Property name must be a string.");
+            Value object = pop(vm);
+            vm.stack.push_back(getProperty(vm, object, toLower(propNameVal.asString()), cache));
             break;
         }
 
 
-        case OP_SET_PROPERTY: {
-            int propNameIndex = chunk.code[ip++];
-            Value propNameVal = chunk.constants[propNameIndex];
-            if (!holds<std::string>(propNameVal))
+        VM_CASE(OP_SET_PROPERTY): {
+            int propNameIndex = readOperand(code, ip);
+            ObjFunction::PropertyCache& cache = chunk->caches[readOperand(code, ip)];
+            {
+                // Fast path: store straight into a slot this site has seen.
+                Value& target = vm.stack[vm.stack.size() - 2];
+                if (target.isInstance()) {
+                    const ObjFunction::PropertyCache::Entry* hit = cache.find(target.asInstance()->shape);
+                    if (hit && hit->slot >= 0) {
+                        target.asInstance()->slots[hit->slot] = std::move(vm.stack.back());
+                        vm.stack.pop_back();
+                        DISPATCH();
+                    }
+                }
+            }
+            Value propNameVal = chunk->constants[propNameIndex];
+            if (!propNameVal.isString())
                 runtimeError("VM: Property name must be a string.");
-            std::string propName = toLower(getVal<std::string>(propNameVal));
+            std::string propName = toLower(propNameVal.asString());
             Value value = pop(vm);
             Value object = pop(vm);
-            debugLog("OP_SET_PROPERTY: About to set property '" + propName + "'.");
-            debugLog("OP_SET_PROPERTY: Value = " + valueToString(value));
-            debugLog("OP_SET_PROPERTY: Object type = " + getTypeName(object) + " (" + valueToString(object) + ")");
-            if (holds<std::shared_ptr<ObjInstance>>(object)) {
-                auto instance = getVal<std::shared_ptr<ObjInstance>>(object);
+            VM_TRACE("OP_SET_PROPERTY: About to set property '" + propName + "'.");
+            VM_TRACE("OP_SET_PROPERTY: Value = " + valueToString(value));
+            VM_TRACE("OP_SET_PROPERTY: Object type = " + getTypeName(object) + " (" + valueToString(object) + ")");
+            if (object.isInstance()) {
+                auto instance = object.asInstance();
                 if (instance->klass->isPlugin) {
                     // For plugin instances, look for an explicit setter.
                     auto it = instance->klass->pluginProperties.find(propName);
@@ -4358,12 +10368,13 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
                         setter({ Value(handle), value });
                         vm.stack.push_back(object);
                     } else {
-                        // Fallback: store the value in the instance's field map.
-                        instance->fields[propName] = value;
+                        // Fallback: store the value in the instance's fields.
+                        instance->setField(propName, value);
                         vm.stack.push_back(object);
                     }
                 } else {
-                    instance->fields[propName] = value;
+                    instance->setField(propName, value);
+                    cache.add(instance->shape, instance->shape->find(propName), Value());
                     vm.stack.push_back(object);
                 }
             } else {
@@ -4374,12 +10385,12 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
 
 
 
-        case OP_CONSTRUCTOR_END: {
+        VM_CASE(OP_CONSTRUCTOR_END): {
             if (vm.stack.size() < 2)
                 runtimeError("VM: Not enough values for constructor end.");
             Value constructorResult = pop(vm);
             Value instance = pop(vm);
-            if (holds<std::monostate>(constructorResult))
+            if (constructorResult.isNil())
                 vm.stack.push_back(instance);
             else
                 vm.stack.push_back(constructorResult);
@@ -4388,17 +10399,17 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
         default:
             break;
         }
-        {
-            std::string s = "[";
-            for (auto& v : vm.stack)
-                s += valueToString(v) + ", ";
-            s += "]";
-            debugLog("VM: Stack after execution: " + s);
-        }
+        if (tracing)
+            traceStack(vm, base);
     }
-    return Value(std::monostate{});
+#undef VM_CASE
+#undef DISPATCH
 }
 
+#undef INT_FAST_PATH
+#undef DOUBLE_FAST_PATH
+#undef TYPED_BINARY
+
 const char MARKER[9] = "BYTECODE"; // 8 characters + null terminator = 9
 
 std::string retrieveData(const std::string& exePath) {
@@ -4411,7 +10422,7 @@ std::string retrieveData(const std::string& exePath) {
     exeFile.seekg(0, std::ios::end);
     std::streampos fileSize = exeFile.tellg();
     if (fileSize < 12) { // at least marker (8 bytes) + length (4 bytes)
-        debugLog("No bytecode data found.\n");
+        DEBUG_LOG("No bytecode data found.\n");
         return "";
     }
     // Read the last 12 bytes: marker (8) and text length (4)
@@ -4422,12 +10433,12 @@ std::string retrieveData(const std::string& exePath) {
     exeFile.read(reinterpret_cast<char*>(&textLength), sizeof(textLength));
     // Verify marker
     if (std::strncmp(markerBuffer, MARKER, 8) != 0) {
-        debugLog("Bytecode not found.\n");
+        DEBUG_LOG("Bytecode not found.\n");
         return "";
     }
     // Ensure file contains enough data for the embedded text
     if (fileSize < static_cast<std::streamoff>(12 + textLength)) {
-        debugLog("Invalid bytecode data length.\n");
+        DEBUG_LOG("Invalid bytecode data length.\n");
         return "";
     }
     // Calculate position of text data
@@ -4466,17 +10477,17 @@ void InitializeEnvironment(VM& vm) {
                 runtimeError("sortwith expects exactly 2 arguments.");
         
             // Ensure both arguments are arrays.
-            if (!holds<std::shared_ptr<ObjArray>>(args[0]) || !holds<std::shared_ptr<ObjArray>>(args[1]))
+            if (!args[0].isArray() || !args[1].isArray())
                 runtimeError("sortwith expects both arguments to be arrays.");
         
-            auto arr1 = getVal<std::shared_ptr<ObjArray>>(args[0]);
-            auto arr2 = getVal<std::shared_ptr<ObjArray>>(args[1]);
+            auto arr1 = args[0].asArray();
+            auto arr2 = args[1].asArray();
         
             // They must be of equal length.
-            if (arr1->elements.size() != arr2->elements.size())
+            if (arr1->size() != arr2->size())
                 runtimeError("sortwith: both arrays must have the same number of elements.");
         
-            size_t n = arr1->elements.size();
+            size_t n = arr1->size();
             // Create an index vector [0, 1, 2, ... n-1]
             std::vector<size_t> indices(n);
             for (size_t i = 0; i < n; i++) {
@@ -4485,15 +10496,15 @@ void InitializeEnvironment(VM& vm) {
         
             // Sort the indices based on the values in arr1.
             std::sort(indices.begin(), indices.end(), [arr1](size_t i, size_t j) {
-                const Value &a = arr1->elements[i];
-                const Value &b = arr1->elements[j];
+                Value a = arr1->get(i);
+                Value b = arr1->get(j);
                 // First, if both are int, compare as integers.
-                if (holds<int>(a) && holds<int>(b))
-                    return getVal<int>(a) < getVal<int>(b);
+                if (a.isInt() && b.isInt())
+                    return a.asInt() < b.asInt();
                 // Otherwise, if both are numbers (int or double), compare numerically.
-                else if ((holds<double>(a) || holds<int>(a)) && (holds<double>(b) || holds<int>(b))) {
-                    double da = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
-                    double db = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+                else if ((a.isDouble() || a.isInt()) && (b.isDouble() || b.isInt())) {
+                    double da = a.isDouble() ? a.asDouble() : static_cast<double>(a.asInt());
+                    double db = b.isDouble() ? b.asDouble() : static_cast<double>(b.asInt());
                     return da < db;
                 }
                 // Fallback: use string comparison.
@@ -4503,13 +10514,13 @@ void InitializeEnvironment(VM& vm) {
             // Create new sorted vectors for both arrays.
             std::vector<Value> newArr1(n), newArr2(n);
             for (size_t i = 0; i < n; i++) {
-                newArr1[i] = arr1->elements[indices[i]];
-                newArr2[i] = arr2->elements[indices[i]];
+                newArr1[i] = arr1->get(indices[i]);
+                newArr2[i] = arr2->get(indices[i]);
             }
         
             // Replace the contents of the original arrays with the sorted ones.
-            arr1->elements = newArr1;
-            arr2->elements = newArr2;
+            arr1->assign(std::move(newArr1));
+            arr2->assign(std::move(newArr2));
         
             // sortwith is a procedure so we return nil.
             return Value(std::monostate{});
@@ -4525,11 +10536,11 @@ void InitializeEnvironment(VM& vm) {
             // Evaluate truthiness of the first argument
             const Value& c = args[0];
             bool cond = false;
-            if      (holds<bool>(c))   cond = getVal<bool>(c);
-            else if (holds<int>(c))    cond = getVal<int>(c) != 0;
-            else if (holds<double>(c)) cond = getVal<double>(c) != 0.0;
-            else if (holds<std::string>(c))
-                cond = !getVal<std::string>(c).empty();
+            if      (c.isBool())   cond = c.asBool();
+            else if (c.isInt())    cond = c.asInt() != 0;
+            else if (c.isDouble()) cond = c.asDouble() != 0.0;
+            else if (c.isString())
+                cond = c.stringBox().size != 0;
             // other types are “false”
 
             // Return either the second or third argument
@@ -4545,19 +10556,19 @@ void InitializeEnvironment(VM& vm) {
             if (args.size() != 2) runtimeError("Beep expects 2 arguments: frequency, duration.");
 
             int freq;
-            if (holds<int>(args[0])) {
-                freq = getVal<int>(args[0]);
-            } else if (holds<double>(args[0])) {
-                freq = (int)getVal<double>(args[0]);
+            if (args[0].isInt()) {
+                freq = args[0].asInt();
+            } else if (args[0].isDouble()) {
+                freq = (int)args[0].asDouble();
             } else {
                 runtimeError("Beep: frequency must be a number.");
             }
 
             int dur;
-            if (holds<int>(args[1])) {
-                dur = getVal<int>(args[1]);
-            } else if (holds<double>(args[1])) {
-                dur = (int)getVal<double>(args[1]);
+            if (args[1].isInt()) {
+                dur = args[1].asInt();
+            } else if (args[1].isDouble()) {
+                dur = (int)args[1].asDouble();
             } else {
                 runtimeError("Beep: duration must be a number.");
             }
@@ -4578,10 +10589,10 @@ void InitializeEnvironment(VM& vm) {
             if (args.size() != 1) runtimeError("Sleep expects 1 argument: milliseconds.");
 
             int ms;
-            if (holds<int>(args[0])) {
-                ms = getVal<int>(args[0]);
-            } else if (holds<double>(args[0])) {
-                ms = (int)getVal<double>(args[0]);
+            if (args[0].isInt()) {
+                ms = args[0].asInt();
+            } else if (args[0].isDouble()) {
+                ms = (int)args[0].asDouble();
             } else {
                 runtimeError("Sleep: argument must be a number.");
             }
@@ -4600,10 +10611,10 @@ void InitializeEnvironment(VM& vm) {
             if (args.size() != 1) runtimeError("DoEvents expects 1 argument: milliseconds.");
 
             int ms;
-            if (holds<int>(args[0])) {
-                ms = getVal<int>(args[0]);
-            } else if (holds<double>(args[0])) {
-                ms = (int)getVal<double>(args[0]);
+            if (args[0].isInt()) {
+                ms = args[0].asInt();
+            } else if (args[0].isDouble()) {
+                ms = (int)args[0].asDouble();
             } else {
                 runtimeError("DoEvents: argument must be a number.");
             }
@@ -4622,7 +10633,7 @@ void InitializeEnvironment(VM& vm) {
         #endif
 
             // then sleep
-            auto sleepFn = getVal<BuiltinFn>(vm.environment->get("sleep"));
+            auto sleepFn = vm.environment->get("sleep").asBuiltin();
             sleepFn({ Value(ms) });
             return Value(true);
         }));
@@ -4632,8 +10643,8 @@ void InitializeEnvironment(VM& vm) {
             if (args.size() != 1) runtimeError("IsNumeric expects 1 argument: text.");
 
             std::string s;
-            if (holds<std::string>(args[0])) {
-                s = getVal<std::string>(args[0]);
+            if (args[0].isString()) {
+                s = args[0].asString();
             } else {
                 s = valueToString(args[0]);
             }
@@ -4668,11 +10679,11 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("replace", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 3)
                 runtimeError("replace expects exactly 3 arguments: input, findText, replaceWith.");
-            if (!holds<std::string>(args[0]) || !holds<std::string>(args[1]) || !holds<std::string>(args[2]))
+            if (!args[0].isString() || !args[1].isString() || !args[2].isString())
                 runtimeError("replace expects all arguments to be strings.");
-            std::string input = getVal<std::string>(args[0]);
-            std::string findText = getVal<std::string>(args[1]);
-            std::string replaceWith = getVal<std::string>(args[2]);
+            std::string input = args[0].asString();
+            std::string findText = args[1].asString();
+            std::string replaceWith = args[2].asString();
             size_t pos = input.find(findText);
             if (pos != std::string::npos) {
                 input.replace(pos, findText.length(), replaceWith);
@@ -4685,11 +10696,11 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("replaceall", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 3)
                 runtimeError("replaceall expects exactly 3 arguments: input, findText, replacement.");
-            if (!holds<std::string>(args[0]) || !holds<std::string>(args[1]) || !holds<std::string>(args[2]))
+            if (!args[0].isString() || !args[1].isString() || !args[2].isString())
                 runtimeError("replaceall expects all arguments to be strings.");
-            std::string input = getVal<std::string>(args[0]);
-            std::string findText = getVal<std::string>(args[1]);
-            std::string replacement = getVal<std::string>(args[2]);
+            std::string input = args[0].asString();
+            std::string findText = args[1].asString();
+            std::string replacement = args[2].asString();
             if (findText.empty())
                 runtimeError("replaceall: find text cannot be an empty string.");
             size_t pos = 0;
@@ -4705,14 +10716,13 @@ void InitializeEnvironment(VM& vm) {
             if (args.size() != 1) runtimeError("length expects exactly one argument.");
         
             // string case
-            if (holds<std::string>(args[0])) {
-                const std::string& s = getVal<std::string>(args[0]);
-                return Value((int)s.size());
+            if (args[0].isString()) {
+                return Value((int)args[0].stringBox().size);
             }
             // array case
-            else if (holds<std::shared_ptr<ObjArray>>(args[0])) {
-                auto arr = getVal<std::shared_ptr<ObjArray>>(args[0]);
-                return Value((int)arr->elements.size());
+            else if (args[0].isArray()) {
+                auto arr = args[0].asArray();
+                return Value((int)arr->size());
             }
             else {
                 runtimeError("length expects a string or an array.");
@@ -4726,14 +10736,13 @@ void InitializeEnvironment(VM& vm) {
             if (args.size() != 1) runtimeError("len expects exactly one argument.");
         
             // string case
-            if (holds<std::string>(args[0])) {
-                const std::string& s = getVal<std::string>(args[0]);
-                return Value((int)s.size());
+            if (args[0].isString()) {
+                return Value((int)args[0].stringBox().size);
             }
             // array case
-            else if (holds<std::shared_ptr<ObjArray>>(args[0])) {
-                auto arr = getVal<std::shared_ptr<ObjArray>>(args[0]);
-                return Value((int)arr->elements.size());
+            else if (args[0].isArray()) {
+                auto arr = args[0].asArray();
+                return Value((int)arr->size());
             }
             else {
                 runtimeError("len expects a string or an array.");
@@ -4746,11 +10755,11 @@ void InitializeEnvironment(VM& vm) {
             if (args.size() != 1) runtimeError("space expects exactly one argument.");
             
             int count;
-            if (holds<int>(args[0])) {
-                count = getVal<int>(args[0]);
+            if (args[0].isInt()) {
+                count = args[0].asInt();
             }
-            else if (holds<double>(args[0])) {
-                count = (int)getVal<double>(args[0]);
+            else if (args[0].isDouble()) {
+                count = (int)args[0].asDouble();
             }
             else {
                 runtimeError("space expects a number.");
@@ -4775,13 +10784,13 @@ void InitializeEnvironment(VM& vm) {
             if (args.size() < 1) runtimeError("str expects an argument.");
             return Value(valueToString(args[0]));
         }));
-        vm.environment->define("microseconds", std::string("microseconds"));
-        vm.environment->define("ticks", std::string("ticks"));
+        // Microseconds and Ticks are not stored globals: OP_GET_GLOBAL computes
+        // them when no user definition of the name exists.
         vm.environment->define("val", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("val expects exactly one argument.");
-            if (!holds<std::string>(args[0]))
+            if (!args[0].isString())
                 runtimeError("val expects a string argument.");
-            double d = std::stod(getVal<std::string>(args[0]));
+            double d = std::stod(args[0].asString());
             return d;
         }));
 
@@ -4796,23 +10805,25 @@ void InitializeEnvironment(VM& vm) {
                 runtimeError("join expects exactly two arguments: inputStringArray and separator.");
 
             // args[0] must be an array
-            if (!holds<std::shared_ptr<ObjArray>>(args[0]))
+            if (!args[0].isArray())
                 runtimeError("join expects the first argument to be an array.");
 
             // args[1] must be a string
-            if (!holds<std::string>(args[1]))
+            if (!args[1].isString())
                 runtimeError("join expects the second argument to be a string.");
 
-            auto arr = getVal<std::shared_ptr<ObjArray>>(args[0]);
-            const std::string sep = getVal<std::string>(args[1]);
+            auto arr = args[0].asArray();
+            std::string_view sep = args[1].asStringView();
 
             // Build the result
             std::string result;
+            if (arr->kind != ObjArray::Kind::String && arr->kind != ObjArray::Kind::Values && !arr->empty())
+                runtimeError("join: all array elements must be strings.");
             for (size_t i = 0; i < arr->elements.size(); ++i) {
                 // Each element must be a string (or convertible)
-                if (!holds<std::string>(arr->elements[i]))
+                if (!arr->elements[i].isString())
                     runtimeError("join: all array elements must be strings.");
-                result += getVal<std::string>(arr->elements[i]);
+                result += arr->elements[i].asStringView();
                 if (i + 1 < arr->elements.size())
                     result += sep;
             }
@@ -4823,125 +10834,126 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("split", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 2)
                 runtimeError("split expects exactly two arguments: text and delimiter.");
-            if (!holds<std::string>(args[0]) || !holds<std::string>(args[1]))
+            if (!args[0].isString() || !args[1].isString())
                 runtimeError("split expects both arguments to be strings.");
-            std::string text = getVal<std::string>(args[0]);
-            std::string delimiter = getVal<std::string>(args[1]);
+            // Fields are slices of the text (see "Strings").
+            std::string_view text = args[0].asStringView();
+            std::string_view delimiter = args[1].asStringView();
             auto arr = std::make_shared<ObjArray>();
             if (delimiter.empty()) {
                 for (char c : text) {
-                    arr->elements.push_back(std::string(1, c));
+                    arr->push(Value(std::string(1, c)));
                 }
             } else {
                 size_t start = 0;
                 size_t pos = text.find(delimiter, start);
-                while (pos != std::string::npos) {
-                    arr->elements.push_back(text.substr(start, pos - start));
+                while (pos != std::string_view::npos) {
+                    arr->push(substring(args[0], start, pos - start));
                     start = pos + delimiter.length();
                     pos = text.find(delimiter, start);
                 }
-                arr->elements.push_back(text.substr(start));
+                arr->push(substring(args[0], start, text.size() - start));
             }
             return Value(arr);
         }));
         vm.environment->define("array", BuiltinFn([](const std::vector<Value>& args) -> Value {
             auto arr = std::make_shared<ObjArray>();
-            arr->elements = args;
+            arr->assign(args);
             return Value(arr);
         }));
         vm.environment->define("abs", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Abs expects exactly one argument.");
-            if (holds<int>(args[0]))
-                return std::abs(getVal<int>(args[0]));
-            else if (holds<double>(args[0]))
-                return std::fabs(getVal<double>(args[0]));
+            if (args[0].isInt())
+                return std::abs(args[0].asInt());
+            else if (args[0].isDouble())
+                return std::fabs(args[0].asDouble());
             else
                 runtimeError("Abs expects a number.");
             return Value(std::monostate{});
         }));
         vm.environment->define("acos", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Acos expects exactly one argument.");
-            double x = holds<int>(args[0]) ? getVal<int>(args[0]) : (holds<double>(args[0]) ? getVal<double>(args[0]) : (runtimeError("Acos expects a number."), 0.0));
+            double x = args[0].isInt() ? args[0].asInt() : (args[0].isDouble() ? args[0].asDouble() : (runtimeError("Acos expects a number."), 0.0));
             return std::acos(x);
         }));
         vm.environment->define("asc", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Asc expects exactly one argument.");
-            if (!holds<std::string>(args[0]))
+            if (!args[0].isString())
                 runtimeError("Asc expects a string.");
-            std::string s = getVal<std::string>(args[0]);
+            std::string_view s = args[0].asStringView();
             if (s.empty()) runtimeError("Asc expects a non-empty string.");
             return (int)s[0];
         }));
         vm.environment->define("asin", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Asin expects exactly one argument.");
-            double x = holds<int>(args[0]) ? getVal<int>(args[0]) : (holds<double>(args[0]) ? getVal<double>(args[0]) : (runtimeError("Asin expects a number."), 0.0));
+            double x = args[0].isInt() ? args[0].asInt() : (args[0].isDouble() ? args[0].asDouble() : (runtimeError("Asin expects a number."), 0.0));
             return std::asin(x);
         }));
         vm.environment->define("atan", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Atan expects exactly one argument.");
-            double x = holds<int>(args[0]) ? getVal<int>(args[0]) : (holds<double>(args[0]) ? getVal<double>(args[0]) : (runtimeError("Atan expects a number."), 0.0));
+            double x = args[0].isInt() ? args[0].asInt() : (args[0].isDouble() ? args[0].asDouble() : (runtimeError("Atan expects a number."), 0.0));
             return std::atan(x);
         }));
         vm.environment->define("atan2", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 2) runtimeError("Atan2 expects exactly two arguments.");
-            double y = holds<int>(args[0]) ? getVal<int>(args[0]) : (holds<double>(args[0]) ? getVal<double>(args[0]) : (runtimeError("Atan2 expects numbers."), 0.0));
-            double x = holds<int>(args[1]) ? getVal<int>(args[1]) : (holds<double>(args[1]) ? getVal<double>(args[1]) : (runtimeError("Atan2 expects numbers."), 0.0));
+            double y = args[0].isInt() ? args[0].asInt() : (args[0].isDouble() ? args[0].asDouble() : (runtimeError("Atan2 expects numbers."), 0.0));
+            double x = args[1].isInt() ? args[1].asInt() : (args[1].isDouble() ? args[1].asDouble() : (runtimeError("Atan2 expects numbers."), 0.0));
             return std::atan2(y, x);
         }));
         vm.environment->define("ceiling", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Ceiling expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : (holds<double>(args[0]) ? getVal<double>(args[0]) : (runtimeError("Ceiling expects a number."), 0.0));
+            double v = args[0].isInt() ? args[0].asInt() : (args[0].isDouble() ? args[0].asDouble() : (runtimeError("Ceiling expects a number."), 0.0));
             return std::ceil(v);
         }));
         vm.environment->define("cos", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Cos expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : (holds<double>(args[0]) ? getVal<double>(args[0]) : (runtimeError("Cos expects a number."), 0.0));
+            double v = args[0].isInt() ? args[0].asInt() : (args[0].isDouble() ? args[0].asDouble() : (runtimeError("Cos expects a number."), 0.0));
             return std::cos(v);
         }));
         vm.environment->define("exp", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Exp expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : (holds<double>(args[0]) ? getVal<double>(args[0]) : (runtimeError("Exp expects a number."), 0.0));
+            double v = args[0].isInt() ? args[0].asInt() : (args[0].isDouble() ? args[0].asDouble() : (runtimeError("Exp expects a number."), 0.0));
             return std::exp(v);
         }));
         vm.environment->define("floor", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Floor expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : (holds<double>(args[0]) ? getVal<double>(args[0]) : (runtimeError("Floor expects a number."), 0.0));
+            double v = args[0].isInt() ? args[0].asInt() : (args[0].isDouble() ? args[0].asDouble() : (runtimeError("Floor expects a number."), 0.0));
             return std::floor(v);
         }));
         vm.environment->define("log", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Log expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : (holds<double>(args[0]) ? getVal<double>(args[0]) : (runtimeError("Log expects a number."), 0.0));
+            double v = args[0].isInt() ? args[0].asInt() : (args[0].isDouble() ? args[0].asDouble() : (runtimeError("Log expects a number."), 0.0));
             return std::log(v);
         }));
         vm.environment->define("max", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 2) runtimeError("Max expects exactly two arguments.");
-            if (holds<int>(args[0]) && holds<int>(args[1])) {
-                int a = getVal<int>(args[0]), b = getVal<int>(args[1]);
+            if (args[0].isInt() && args[1].isInt()) {
+                int a = args[0].asInt(), b = args[1].asInt();
                 return a > b ? a : b;
             }
             else {
-                double a = holds<int>(args[0]) ? getVal<int>(args[0]) : getVal<double>(args[0]);
-                double b = holds<int>(args[1]) ? getVal<int>(args[1]) : getVal<double>(args[1]);
+                double a = args[0].isInt() ? args[0].asInt() : args[0].asDouble();
+                double b = args[1].isInt() ? args[1].asInt() : args[1].asDouble();
                 return a > b ? a : b;
             }
         }));
         vm.environment->define("min", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 2) runtimeError("Min expects exactly two arguments.");
-            if (holds<int>(args[0]) && holds<int>(args[1])) {
-                int a = getVal<int>(args[0]), b = getVal<int>(args[1]);
+            if (args[0].isInt() && args[1].isInt()) {
+                int a = args[0].asInt(), b = args[1].asInt();
                 return a < b ? a : b;
             }
             else {
-                double a = holds<int>(args[0]) ? getVal<int>(args[0]) : getVal<double>(args[0]);
-                double b = holds<int>(args[1]) ? getVal<int>(args[1]) : getVal<double>(args[1]);
+                double a = args[0].isInt() ? args[0].asInt() : args[0].asDouble();
+                double b = args[1].isInt() ? args[1].asInt() : args[1].asDouble();
                 return a < b ? a : b;
             }
         }));
         vm.environment->define("oct", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Oct expects exactly one argument.");
             int n = 0;
-            if (holds<int>(args[0])) n = getVal<int>(args[0]);
-            else if (holds<double>(args[0])) n = static_cast<int>(getVal<double>(args[0]));
+            if (args[0].isInt()) n = args[0].asInt();
+            else if (args[0].isDouble()) n = static_cast<int>(args[0].asDouble());
             else runtimeError("Oct expects a number.");
             std::stringstream ss;
             ss << std::oct << n;
@@ -4949,35 +10961,35 @@ void InitializeEnvironment(VM& vm) {
         }));
         vm.environment->define("pow", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 2) runtimeError("Pow expects exactly two arguments.");
-            double a = holds<int>(args[0]) ? getVal<int>(args[0]) : getVal<double>(args[0]);
-            double b = holds<int>(args[1]) ? getVal<int>(args[1]) : getVal<double>(args[1]);
+            double a = args[0].isInt() ? args[0].asInt() : args[0].asDouble();
+            double b = args[1].isInt() ? args[1].asInt() : args[1].asDouble();
             return std::pow(a, b);
         }));
         vm.environment->define("round", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Round expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : getVal<double>(args[0]);
+            double v = args[0].isInt() ? args[0].asInt() : args[0].asDouble();
             return std::round(v);
         }));
         vm.environment->define("sign", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Sign expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : getVal<double>(args[0]);
+            double v = args[0].isInt() ? args[0].asInt() : args[0].asDouble();
             if (v < 0) return -1;
             else if (v == 0) return 0;
             else return 1;
         }));
         vm.environment->define("sin", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Sin expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : getVal<double>(args[0]);
+            double v = args[0].isInt() ? args[0].asInt() : args[0].asDouble();
             return std::sin(v);
         }));
         vm.environment->define("sqrt", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Sqrt expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : getVal<double>(args[0]);
+            double v = args[0].isInt() ? args[0].asInt() : args[0].asDouble();
             return std::sqrt(v);
         }));
         vm.environment->define("tan", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1) runtimeError("Tan expects exactly one argument.");
-            double v = holds<int>(args[0]) ? getVal<int>(args[0]) : getVal<double>(args[0]);
+            double v = args[0].isInt() ? args[0].asInt() : args[0].asDouble();
             return std::tan(v);
         }));
         vm.environment->define("rnd", BuiltinFn([](const std::vector<Value>& args) -> Value {
@@ -4993,14 +11005,14 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("trim", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1)
                 runtimeError("trim expects exactly one argument.");
-            if (!holds<std::string>(args[0]))
+            if (!args[0].isString())
                 runtimeError("trim expects a string argument.");
-            std::string s = getVal<std::string>(args[0]);
+            std::string_view s = args[0].asStringView();
             size_t first = s.find_first_not_of(" \t\r\n");
-            if (first == std::string::npos)
+            if (first == std::string_view::npos)
                 return Value(std::string(""));
             size_t last = s.find_last_not_of(" \t\r\n");
-            return Value(s.substr(first, last - first + 1));
+            return substring(args[0], first, last - first + 1);
         }));
 
         // Built-in function: right(input, count) as String
@@ -5008,17 +11020,16 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("right", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 2)
                 runtimeError("right expects exactly two arguments: input and count.");
-            if (!holds<std::string>(args[0]))
+            if (!args[0].isString())
                 runtimeError("right expects the first argument to be a string.");
-            if (!(holds<int>(args[1]) || holds<double>(args[1])))
+            if (!(args[1].isInt() || args[1].isDouble()))
                 runtimeError("right expects the second argument to be a number.");
-            std::string s = getVal<std::string>(args[0]);
-            int count = holds<int>(args[1]) ? getVal<int>(args[1]) : static_cast<int>(getVal<double>(args[1]));
-            if (count < 0)
+            size_t size = args[0].stringBox().size;
+            int requested = args[1].isInt() ? args[1].asInt() : static_cast<int>(args[1].asDouble());
+            if (requested < 0)
                 runtimeError("right expects a non-negative count.");
-            if (count > s.size())
-                count = s.size();
-            return Value(s.substr(s.size() - count, count));
+            size_t count = std::min(static_cast<size_t>(requested), size);
+            return substring(args[0], size - count, count);
         }));
 
         // Built-in function: left(input, count) as String
@@ -5026,17 +11037,14 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("left", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 2)
                 runtimeError("left expects exactly two arguments: input and count.");
-            if (!holds<std::string>(args[0]))
+            if (!args[0].isString())
                 runtimeError("left expects the first argument to be a string.");
-            if (!(holds<int>(args[1]) || holds<double>(args[1])))
+            if (!(args[1].isInt() || args[1].isDouble()))
                 runtimeError("left expects the second argument to be a number.");
-            std::string s = getVal<std::string>(args[0]);
-            int count = holds<int>(args[1]) ? getVal<int>(args[1]) : static_cast<int>(getVal<double>(args[1]));
+            int count = args[1].isInt() ? args[1].asInt() : static_cast<int>(args[1].asDouble());
             if (count < 0)
                 runtimeError("left expects a non-negative count.");
-            if (count > s.size())
-                count = s.size();
-            return Value(s.substr(0, count));
+            return substring(args[0], 0, count);
         }));
 
         // Built-in function: titlecase(input) as String
@@ -5045,9 +11053,9 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("titlecase", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1)
                 runtimeError("titlecase expects exactly one argument.");
-            if (!holds<std::string>(args[0]))
+            if (!args[0].isString())
                 runtimeError("titlecase expects a string argument.");
-            std::string s = getVal<std::string>(args[0]);
+            std::string s = args[0].asString();
             std::string result = s;
             bool capitalizeNext = true;
             for (size_t i = 0; i < result.length(); i++) {
@@ -5070,9 +11078,9 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("lowercase", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1)
                 runtimeError("lowercase expects exactly one argument.");
-            if (!holds<std::string>(args[0]))
+            if (!args[0].isString())
                 runtimeError("lowercase expects a string argument.");
-            std::string s = getVal<std::string>(args[0]);
+            std::string s = args[0].asString();
             std::transform(s.begin(), s.end(), s.begin(), ::tolower);
             return Value(s);
         }));
@@ -5082,9 +11090,9 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("uppercase", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 1)
                 runtimeError("uppercase expects exactly one argument.");
-            if (!holds<std::string>(args[0]))
+            if (!args[0].isString())
                 runtimeError("uppercase expects a string argument.");
-            std::string s = getVal<std::string>(args[0]);
+            std::string s = args[0].asString();
             std::transform(s.begin(), s.end(), s.begin(), ::toupper);
             return Value(s);
         }));
@@ -5095,31 +11103,142 @@ void InitializeEnvironment(VM& vm) {
         vm.environment->define("middle", BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 3)
                 runtimeError("middle expects exactly three arguments: input, start position, and length.");
-            if (!holds<std::string>(args[0]))
+            if (!args[0].isString())
                 runtimeError("middle expects the first argument to be a string.");
-            if (!(holds<int>(args[1]) || holds<double>(args[1])))
+            if (!(args[1].isInt() || args[1].isDouble()))
                 runtimeError("middle expects the second argument (start position) to be a number.");
-            if (!(holds<int>(args[2]) || holds<double>(args[2])))
+            if (!(args[2].isInt() || args[2].isDouble()))
                 runtimeError("middle expects the third argument (length) to be a number.");
 
-            std::string s = getVal<std::string>(args[0]);
             // Assume 1-based indexing; convert to zero-based.
-            int startPos = holds<int>(args[1]) ? getVal<int>(args[1]) : static_cast<int>(getVal<double>(args[1]));
-            int len = holds<int>(args[2]) ? getVal<int>(args[2]) : static_cast<int>(getVal<double>(args[2]));
+            int startPos = args[1].isInt() ? args[1].asInt() : static_cast<int>(args[1].asDouble());
+            int len = args[2].isInt() ? args[2].asInt() : static_cast<int>(args[2].asDouble());
 
             if (startPos < 1)
                 runtimeError("middle expects a start position of 1 or greater.");
             if (len < 0)
                 runtimeError("middle expects a non-negative length.");
 
-            int zeroBased = startPos - 1;
-            if (zeroBased >= s.size())
-                return Value(std::string("")); // Return empty string if start is past the end.
-            if (zeroBased + len > s.size())
-                len = s.size() - zeroBased; // Adjust length if it goes beyond the end.
-            return Value(s.substr(zeroBased, len));
+            // substring() returns an empty string if start is past the end and
+            // stops at the end.
+            return substring(args[0], startPos - 1, len);
         }));
 
+        // Class StringBuilder: Append(value), ToString() As String and
+        // Length() As Integer. The text lives in a field scripts can't name;
+        // while only the builder refers to it, Append extends it in place (see
+        // appendString), so building a large text is linear.
+        {
+            static const std::string TEXT_FIELD = " text";
+            auto builder = std::make_shared<ObjClass>();
+            builder->name = "stringbuilder";
+            builder->isNative = true;
+            builder->properties.push_back({ TEXT_FIELD, Value(std::string()) });
+            auto text = [](const std::vector<Value>& args, const char* method) -> Value& {
+                if (args.empty() || !args[0].isInstance())
+                    runtimeError(std::string("StringBuilder.") + method + " needs a StringBuilder.");
+                Value* field = args[0].asInstance()->findField(TEXT_FIELD);
+                if (!field || !field->isString())
+                    runtimeError(std::string("StringBuilder.") + method + " needs a StringBuilder.");
+                return *field;
+            };
+            builder->methods["append"] = Value(BuiltinFn([text](const std::vector<Value>& args) -> Value {
+                if (args.size() != 2)
+                    runtimeError("StringBuilder.Append expects exactly one argument.");
+                Value& field = text(args, "Append");
+                if (args[1].isString())
+                    appendString(field, args[1]);
+                else
+                    appendString(field, Value(valueToString(args[1])));
+                return Value();
+            }));
+            builder->methods["tostring"] = Value(BuiltinFn([text](const std::vector<Value>& args) -> Value {
+                if (args.size() != 1)
+                    runtimeError("StringBuilder.ToString expects no arguments.");
+                return text(args, "ToString");
+            }));
+            builder->methods["length"] = Value(BuiltinFn([text](const std::vector<Value>& args) -> Value {
+                if (args.size() != 1)
+                    runtimeError("StringBuilder.Length expects no arguments.");
+                return Value((int)text(args, "Length").stringBox().size);
+            }));
+            vm.environment->define("stringbuilder", Value(builder));
+        }
+
+        // Class Dictionary: Value(key) and Value(key) = value, HasKey(key),
+        // Lookup(key, default), Remove(key), RemoveAll(), Count(), Keys() and
+        // Values(). The entries live in the instance's ValueTable, so a lookup
+        // is one hash probe; Keys and Values list them in the order they were
+        // first added.
+        {
+            auto dictionary = std::make_shared<ObjClass>();
+            dictionary->name = "dictionary";
+            dictionary->isNative = true;
+            // The receiver's table, after checking the argument count.
+            auto table = [](const std::vector<Value>& args, size_t arity, const char* method) -> ValueTable& {
+                if (args.empty() || !args[0].isInstance())
+                    runtimeError(std::string("Dictionary.") + method + " needs a Dictionary.");
+                if (args.size() != arity + 1)
+                    runtimeError(std::string("Dictionary.") + method + " expects " + std::to_string(arity)
+                                 + (arity == 1 ? " argument." : " arguments."));
+                if (arity > 0 && !ValueTable::validKey(args[1]))
+                    runtimeError(std::string("Dictionary.") + method + ": a key must be a string, number, Boolean, color, pointer, object, array, class or function.");
+                auto& instance = args[0].asInstance();
+                if (!instance->table)
+                    instance->table = std::make_unique<ValueTable>();
+                return *instance->table;
+            };
+            dictionary->methods["value"] = Value(BuiltinFn([table](const std::vector<Value>& args) -> Value {
+                // d.Value(key) = value arrives with the value as a second argument.
+                ValueTable& t = table(args, args.size() == 3 ? 2 : 1, "Value");
+                if (args.size() == 3) {
+                    t.set(args[1], args[2]);
+                    return Value();
+                }
+                int at = t.find(args[1]);
+                if (at < 0)
+                    runtimeError("Dictionary.Value: key not found: " + valueToString(args[1]));
+                return t.entries[at].value;
+            }));
+            dictionary->methods["haskey"] = Value(BuiltinFn([table](const std::vector<Value>& args) -> Value {
+                return Value(table(args, 1, "HasKey").find(args[1]) >= 0);
+            }));
+            dictionary->methods["lookup"] = Value(BuiltinFn([table](const std::vector<Value>& args) -> Value {
+                ValueTable& t = table(args, 2, "Lookup");
+                int at = t.find(args[1]);
+                return at < 0 ? args[2] : t.entries[at].value;
+            }));
+            dictionary->methods["remove"] = Value(BuiltinFn([table](const std::vector<Value>& args) -> Value {
+                if (!table(args, 1, "Remove").remove(args[1]))
+                    runtimeError("Dictionary.Remove: key not found: " + valueToString(args[1]));
+                return Value();
+            }));
+            dictionary->methods["removeall"] = Value(BuiltinFn([table](const std::vector<Value>& args) -> Value {
+                table(args, 0, "RemoveAll").clear();
+                return Value();
+            }));
+            dictionary->methods["count"] = Value(BuiltinFn([table](const std::vector<Value>& args) -> Value {
+                return Value((int)table(args, 0, "Count").count);
+            }));
+            auto list = [table](const std::vector<Value>& args, bool keys) -> Value {
+                ValueTable& t = table(args, 0, keys ? "Keys" : "Values");
+                std::vector<Value> items;
+                items.reserve(t.count);
+                for (const auto& e : t.entries)
+                    if (e.live) items.push_back(keys ? e.key : e.value);
+                auto array = std::make_shared<ObjArray>();
+                array->assign(std::move(items));
+                return Value(array);
+            };
+            dictionary->methods["keys"] = Value(BuiltinFn([list](const std::vector<Value>& args) -> Value {
+                return list(args, true);
+            }));
+            dictionary->methods["values"] = Value(BuiltinFn([list](const std::vector<Value>& args) -> Value {
+                return list(args, false);
+            }));
+            vm.environment->define("dictionary", Value(dictionary));
+        }
+
 
         // Register built-in AddressOf and AddHandler functions.
         // AddressOf converts a script function to a C callback pointer.
@@ -5135,16 +11254,16 @@ void InitializeEnvironment(VM& vm) {
             randomClass->methods["inrange"] = BuiltinFn([](const std::vector<Value>& args) -> Value {
                 if (args.size() != 2) runtimeError("Random.InRange expects exactly two arguments.");
                 int minVal = 0, maxVal = 0;
-                if (holds<int>(args[0]))
-                    minVal = getVal<int>(args[0]);
-                else if (holds<double>(args[0]))
-                    minVal = static_cast<int>(getVal<double>(args[0]));
+                if (args[0].isInt())
+                    minVal = args[0].asInt();
+                else if (args[0].isDouble())
+                    minVal = static_cast<int>(args[0].asDouble());
                 else
                     runtimeError("Random.InRange expects a number as first argument.");
-                if (holds<int>(args[1]))
-                    maxVal = getVal<int>(args[1]);
-                else if (holds<double>(args[1]))
-                    maxVal = static_cast<int>(getVal<double>(args[1]));
+                if (args[1].isInt())
+                    maxVal = args[1].asInt();
+                else if (args[1].isDouble())
+                    maxVal = static_cast<int>(args[1].asDouble());
                 else
                     runtimeError("Random.InRange expects a number as second argument.");
                 if (minVal > maxVal) runtimeError("Random.InRange: min is greater than max.");
@@ -5303,12 +11422,56 @@ std::string decrypt(const std::string &cipher, const std::string &keyStr) {
         mainThreadId = std::this_thread::get_id();
         startTime = std::chrono::steady_clock::now();
         std::string filename = "default.xs";
+        bool compileOnly = false;
+        bool useCache = true;
+        std::string imagePath;
+        std::string cppPath;
         // Iterate through arguments, skipping argv[0] (program name)
-        for (int i = 1; i < argc - 1; i++) {
+        for (int i = 1; i < argc; i++) {
             std::string arg = argv[i];
-            if (arg == "--s" && (i + 1 < argc)) {
+            if (arg == "-O0" || arg == "-O1" || arg == "-O2") {
+                OPT_LEVEL = arg[2] - '0';
+            }
+            else if (arg == "--s" && (i + 1 < argc)) {
                 filename = argv[i + 1];
             }
+            else if (arg == "--compile-only") {
+                compileOnly = true;
+            }
+            else if (arg == "-o" && (i + 1 < argc)) {
+                imagePath = argv[i + 1];
+            }
+            else if (arg == "--emit-cpp" && (i + 1 < argc)) {
+                compileOnly = true;
+                cppPath = argv[i + 1];
+            }
+            else if (arg == "--no-cache") {
+                useCache = false;
+            }
+            else if (arg == "--no-tail-calls") {
+                TAIL_CALLS = false;
+            }
+            else if (arg == "--jit" && (i + 1 < argc)) {
+                std::string mode = argv[i + 1];
+                if (mode == "on")
+                    JIT_THRESHOLD = JIT_DEFAULT_THRESHOLD;
+                else if (mode == "off")
+                    JIT_THRESHOLD = 0;
+                else if (mode.rfind("threshold=", 0) == 0 && std::atoi(mode.c_str() + 10) > 0)
+                    JIT_THRESHOLD = std::atoi(mode.c_str() + 10);
+                else {
+                    std::cerr << "Error: Argument for --jit must be 'on', 'off' or 'threshold=N'." << std::endl;
+                    return 1;
+                }
+            }
+            else if (arg == "--trace" && (i + 1 < argc)) {
+                int size = std::atoi(argv[i + 1]);
+                if (size < 0) {
+                    std::cerr << "Error: Argument for --trace must be a non-negative instruction count." << std::endl;
+                    return 1;
+                }
+                traceRing.resize(size);
+            }
             else if (arg == "--d" && (i + 1 < argc)) {
                 std::string debugArg = argv[i + 1];
                 
@@ -5324,7 +11487,7 @@ std::string decrypt(const std::string &cipher, const std::string &keyStr) {
                 }
             }
         }
-        debugLog(std::string("DEBUG_MODE: ") + (DEBUG_MODE ? "ON" : "OFF"));
+        DEBUG_LOG(std::string("DEBUG_MODE: ") + (DEBUG_MODE ? "ON" : "OFF"));
     ///////////////Initialize Envrironment////////////////
             // Create and initialize the VM environment.
             VM vm;
@@ -5349,65 +11512,139 @@ std::string decrypt(const std::string &cipher, const std::string &keyStr) {
 
         std::string retrieved = decrypt(retrieveData(exePath), cipherkey); // retrieve bytecode if exists
         std::string source;
-
+        // A bytecode image is mapped and linked instead of being compiled.
+        std::unique_ptr<MappedFile> mapped;
+        std::unique_ptr<CompileCache> cache;
+        const uint8_t* image = nullptr;
+        size_t imageSize = 0;
+
+#if CROSSBASIC_AOT
+        // A translated program carries its image; see "Ahead-of-time compilation".
+        bool translated = false;
+        if (retrieved.empty()) {
+            retrieved = decrypt(std::string(reinterpret_cast<const char*>(aotImage), aotImageSize), cipherkey);
+            translated = true;
+        }
+#endif
         if (!retrieved.empty()) {
-            source = preprocessSource(retrieved);
+            if (isBytecodeImage(reinterpret_cast<const uint8_t*>(retrieved.data()), retrieved.size())) {
+                image = reinterpret_cast<const uint8_t*>(retrieved.data());
+                imageSize = retrieved.size();
+            }
+            else {
+                source = preprocessSource(retrieved);
+            }
         } else {
-            std::ifstream file(filename);
-            if (!file.is_open()) {
-                std::cerr << "Notice: Unable to find " << filename << std::endl;
-                return EXIT_FAILURE;
+            mapped.reset(new MappedFile(filename));
+            if (!compileOnly && isBytecodeImage(mapped->data, mapped->size)) {
+                image = mapped->data;
+                imageSize = mapped->size;
+            }
+            else {
+                mapped.reset();
+                std::ifstream file(filename);
+                if (!file.is_open()) {
+                    std::cerr << "Notice: Unable to find " << filename << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::stringstream buffer;
+                buffer << file.rdbuf();
+                source = preprocessSource(buffer.str());
+                // The cache is bypassed by debug runs, which trace the compile.
+                if (useCache && !compileOnly && !DEBUG_MODE) {
+                    cache.reset(new CompileCache(vm, exePath, filename, source));
+                    if (!cache->enabled())
+                        cache.reset();
+                    else
+                        cache->lookup(image, imageSize);
+                }
             }
-            std::stringstream buffer;
-            buffer << file.rdbuf();
-            source = preprocessSource(buffer.str());
         }
 
-
-        debugLog("Starting lexing...");
-        Lexer lexer(source);
-        auto tokens = lexer.scanTokens();
-        debugLog("Lexing complete. Tokens count: " + std::to_string(tokens.size()));
-
-        debugLog("Starting parsing...");
-        Parser parser(tokens);
-        std::vector<std::shared_ptr<Stmt>> statements = parser.parse();
-        debugLog("Parsing complete. Statements count: " + std::to_string(statements.size()));
+        if (image) {
+            DEBUG_LOG("Loading bytecode image...");
+            std::vector<std::shared_ptr<ObjFunction>> functions;
+            loadBytecodeImage(vm, image, imageSize, &functions);
+#if CROSSBASIC_AOT
+            if (translated)
+                attachAotCode(functions);
+#endif
+            DEBUG_LOG("Image loaded. Main chunk size in bytes: " + std::to_string(vm.mainChunk.code.size()));
+        }
+        else {
+            DEBUG_LOG("Starting lexing...");
+            Lexer lexer(source);
+            auto tokens = lexer.scanTokens();
+            DEBUG_LOG("Lexing complete. Tokens count: " + std::to_string(tokens.size()));
+
+            DEBUG_LOG("Starting parsing...");
+            Parser parser(std::move(tokens));
+            std::vector<std::shared_ptr<Stmt>> statements = parser.parse();
+            DEBUG_LOG("Parsing complete. Statements count: " + std::to_string(statements.size()));
     ///////////////////////////////////////
 
-        // Compile the CrossBasic program.
-        debugLog("Starting compilation...");
-        Compiler compiler(vm);
-        compiler.compile(statements);
-        debugLog("Compilation complete. Main chunk instructions count: " + std::to_string(vm.mainChunk.code.size()));
+            // Compile the CrossBasic program.
+            DEBUG_LOG("Starting compilation...");
+            Compiler compiler(vm);
+            compiler.compile(statements);
+            DEBUG_LOG("Compilation complete. Main chunk size in bytes: " + std::to_string(vm.mainChunk.code.size()));
+
+            if (compileOnly && !cppPath.empty()) {
+                std::string error;
+                if (!writeAotSource(vm, compiler.compileRecord(), cppPath, cipherkey, error)) {
+                    std::cerr << "Error: " << error << "." << std::endl;
+                    return EXIT_FAILURE;
+                }
+                DEBUG_LOG("C++ translation written to " + cppPath);
+                return 0;
+            }
+            if (compileOnly) {
+                if (imagePath.empty()) {
+                    size_t dot = filename.find_last_of('.');
+                    size_t slash = filename.find_last_of("/\\");
+                    imagePath = (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+                        ? filename : filename.substr(0, dot);
+                    imagePath += ".xbc";
+                }
+                std::string error;
+                if (!writeBytecodeImage(vm, compiler.compileRecord(), imagePath, error)) {
+                    std::cerr << "Error: " << error << "." << std::endl;
+                    return EXIT_FAILURE;
+                }
+                DEBUG_LOG("Bytecode image written to " + imagePath);
+                return 0;
+            }
+            if (cache)
+                cache->store(vm, compiler.compileRecord());
+        }
 
-        if (vm.environment->values.find("main") != vm.environment->values.end() &&
-            (holds<std::shared_ptr<ObjFunction>>(vm.environment->get("main")) ||
-            holds<std::vector<std::shared_ptr<ObjFunction>>>(vm.environment->get("main")))) {
+        if (vm.environment->isDefined("main") &&
+            (vm.environment->get("main").isFunction() ||
+            vm.environment->get("main").isOverloads())) {
             Value mainVal = vm.environment->get("main");
-            if (holds<std::shared_ptr<ObjFunction>>(mainVal)) {
-                auto mainFunction = getVal<std::shared_ptr<ObjFunction>>(mainVal);
-                debugLog("Calling main function...");
+            if (mainVal.isFunction()) {
+                auto mainFunction = mainVal.asFunction();
+                DEBUG_LOG("Calling main function...");
                 // Run the compiled bytecode
-                runVM(vm, mainFunction->chunk);
+                runVM(vm, mainFunction->chunk, pushFrame(vm, *mainFunction, {}));
             }
-            else if (holds<std::vector<std::shared_ptr<ObjFunction>>>(mainVal)) {
-                auto overloads = getVal<std::vector<std::shared_ptr<ObjFunction>>>(mainVal);
+            else if (mainVal.isOverloads()) {
+                auto overloads = mainVal.asOverloads();
                 std::shared_ptr<ObjFunction> mainFunction = nullptr;
                 for (auto f : overloads) {
                     if (f->arity == 0) { mainFunction = f; break; }
                 }
                 if (!mainFunction)
                     runtimeError("No main function with 0 parameters found.");
-                debugLog("Calling main function...");
-                runVM(vm, mainFunction->chunk);
+                DEBUG_LOG("Calling main function...");
+                runVM(vm, mainFunction->chunk, pushFrame(vm, *mainFunction, {}));
             }
         }
         else {
-            debugLog("No main function found. Executing top-level code...");
+            DEBUG_LOG("No main function found. Executing top-level code...");
             runVM(vm, vm.mainChunk);
         }
-        debugLog("Program execution finished.");
+        DEBUG_LOG("Program execution finished.");
         return 0;
     }
 
@@ -5459,29 +11696,29 @@ const char* CompileAndRun(const char* code, bool enableDebug) {
     std::string source = preprocessSource(code);
     Lexer lexer(source);
     auto tokens = lexer.scanTokens();
-    Parser parser(tokens);
+    Parser parser(std::move(tokens));
     std::vector<std::shared_ptr<Stmt>> statements = parser.parse();
     Compiler compiler(vm);
     compiler.compile(statements);
 
     // --- Run the compiled code ---
     // If a 'main' function exists, run it; otherwise run top-level code.
-    if (vm.environment->values.find("main") != vm.environment->values.end() &&
-       (holds<std::shared_ptr<ObjFunction>>(vm.environment->get("main")) ||
-        holds<std::vector<std::shared_ptr<ObjFunction>>>(vm.environment->get("main")))) {
+    if (vm.environment->isDefined("main") &&
+       (vm.environment->get("main").isFunction() ||
+        vm.environment->get("main").isOverloads())) {
         Value mainVal = vm.environment->get("main");
-        if (holds<std::shared_ptr<ObjFunction>>(mainVal)) {
-            auto mainFunction = getVal<std::shared_ptr<ObjFunction>>(mainVal);
-            runVM(vm, mainFunction->chunk);
-        } else if (holds<std::vector<std::shared_ptr<ObjFunction>>>(mainVal)) {
-            auto overloads = getVal<std::vector<std::shared_ptr<ObjFunction>>>(mainVal);
+        if (mainVal.isFunction()) {
+            auto mainFunction = mainVal.asFunction();
+            runVM(vm, mainFunction->chunk, pushFrame(vm, *mainFunction, {}));
+        } else if (mainVal.isOverloads()) {
+            auto overloads = mainVal.asOverloads();
             std::shared_ptr<ObjFunction> mainFunction = nullptr;
             for (auto f : overloads) {
                 if (f->arity == 0) { mainFunction = f; break; }
             }
             if (!mainFunction)
                 runtimeError("No main function with 0 parameters found.");
-            runVM(vm, mainFunction->chunk);
+            runVM(vm, mainFunction->chunk, pushFrame(vm, *mainFunction, {}));
         }
     } else {
         runVM(vm, vm.mainChunk);
@@ -0,0 +1,72 @@
+// -----------------------------------------------------------------------------
+// Test: Goto out of For loops in CrossBasic
+// A For loop keeps its end value and step while it runs. Leaving the loop with
+// Goto must drop them, or the loop around it would pick up the wrong bounds and
+// a long-running script would keep growing. Each line should read "ok".
+// -----------------------------------------------------------------------------
+
+// Goto out of an inner loop to a label inside the outer loop: the outer loop
+// must still run exactly three times.
+Dim outerRuns As Integer = 0
+For i As Integer = 1 To 3
+  For j As Integer = 1 To 100
+    If j = 2 Then
+      Goto NextOuter
+    End If
+  Next j
+NextOuter:
+  outerRuns = outerRuns + 1
+Next i
+If outerRuns = 3 Then
+  Print("ok - Goto to a label in the enclosing loop")
+Else
+  Print("FAILED - outer loop ran " + Str(outerRuns) + " times")
+End If
+
+// The same inside a function, leaving two loops at once many times over.
+Function LeaveLoops(times As Integer) As Integer
+  Dim left As Integer = 0
+Again:
+  For a As Integer = 1 To 10
+    For b As Integer = 1 To 10
+      If b = 3 Then
+        Goto Out
+      End If
+    Next b
+  Next a
+Out:
+  left = left + 1
+  If left < times Then
+    Goto Again
+  End If
+  // A loop after all those exits must see its own bounds.
+  Dim total As Integer = 0
+  For k As Integer = 1 To 4
+    total = total + k
+  Next k
+  Return total * 1000000 + left
+End Function
+
+Dim result As Integer = LeaveLoops(100000)
+If result = 10100000 Then
+  Print("ok - Goto out of nested loops in a function")
+Else
+  Print("FAILED - LeaveLoops returned " + Str(result))
+End If
+
+// Top-level Goto back to a label before the loop.
+Dim rounds As Integer = 0
+Restart:
+For n As Integer = 1 To 5
+  If n = 2 Then
+    rounds = rounds + 1
+    If rounds < 50000 Then
+      Goto Restart
+    End If
+  End If
+Next n
+If rounds = 50000 Then
+  Print("ok - Goto back over a loop")
+Else
+  Print("FAILED - rounds = " + Str(rounds))
+End If
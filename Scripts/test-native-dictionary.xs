@@ -0,0 +1,133 @@
+// -----------------------------------------------------------------------------
+// Test: the built-in Dictionary in CrossBasic
+// Dictionary is a hash table built into the interpreter. This test covers
+// Value(key) and Value(key) = x, HasKey, Lookup with a default, Remove,
+// RemoveAll, Count, and the order of Keys and Values, which list entries in
+// the order they were first added. It also calls a method of a script class
+// in the same obj.Method(args) = x form, which needs an Assigns parameter.
+// Each line should read "ok".
+// -----------------------------------------------------------------------------
+
+Sub Check(what As String, got As String, want As String)
+  If got = want Then
+    Print("ok - " + what)
+  Else
+    Print("FAILED - " + what + ": got " + got + ", expected " + want)
+  End If
+End Sub
+
+Function Joined(items As Variant) As String
+  Dim s As String = ""
+  For i As Integer = 0 To items.Count() - 1
+    If i > 0 Then
+      s = s + ","
+    End If
+    s = s + Str(items(i))
+  Next i
+  Return s
+End Function
+
+Dim d As New Dictionary
+Check("a new Dictionary is empty", Str(d.Count()), "0")
+
+// Value get and set
+d.Value("apple") = 3
+d.Value("pear") = 5
+d.Value(7) = "seven"
+Dim apple As Integer = d.Value("apple")
+Dim seven As String = d.Value(7)
+Check("Value get after set", Str(apple) + " " + seven, "3 seven")
+d.Value("apple") = apple + 10
+apple = d.Value("apple")
+Check("Value set replaces", Str(apple), "13")
+Dim one As String = "one"
+d.Value(one + "two") = 12
+Dim built As Integer = d.Value("onetwo")
+Check("key built at run time", Str(built), "12")
+d.Value(1) = "int"
+d.Value(1.0) = "double"
+Dim numeric As String = d.Value(1)
+Check("1 and 1.0 are one key", numeric, "double")
+Check("Count", Str(d.Count()), "5")
+
+// HasKey and Lookup
+Check("HasKey on a present key", Str(d.HasKey("pear")), "true")
+Check("HasKey on a missing key", Str(d.HasKey("plum")), "false")
+Check("HasKey is case-sensitive", Str(d.HasKey("Pear")), "false")
+Dim pear As Integer = d.Lookup("pear", 0)
+Dim plum As Integer = d.Lookup("plum", -1)
+Check("Lookup with a default", Str(pear) + " " + Str(plum), "5 -1")
+Check("Lookup does not add the key", Str(d.HasKey("plum")), "false")
+
+// Keys and Values keep the order in which entries were first added
+Check("Keys in insertion order", Joined(d.Keys()), "apple,pear,7,onetwo,1")
+Check("Values in insertion order", Joined(d.Values()), "13,5,seven,12,double")
+
+// Remove and RemoveAll
+d.Remove("pear")
+Check("Remove", Str(d.HasKey("pear")) + " " + Str(d.Count()), "false 4")
+d.Value("pear") = 6
+Check("a key added again goes last", Joined(d.Keys()), "apple,7,onetwo,1,pear")
+d.RemoveAll()
+Check("RemoveAll", Str(d.Count()) + " " + Str(d.HasKey("apple")), "0 false")
+d.Value("again") = 1
+Check("usable after RemoveAll", Joined(d.Keys()), "again")
+
+// Many keys, then most of them removed
+Dim squares As New Dictionary
+For i As Integer = 1 To 10000
+  squares.Value(i) = i * i
+Next i
+For i As Integer = 1 To 9990
+  squares.Remove(i)
+Next i
+Dim last As Integer = squares.Value(10000)
+Check("ten thousand keys, most removed", Str(squares.Count()) + " " + Str(last), "10 100000000")
+Check("order kept after removals", Joined(squares.Keys()), "9991,9992,9993,9994,9995,9996,9997,9998,9999,10000")
+
+// Object keys compare by identity
+Class Point
+  Dim x As Integer
+End Class
+
+Dim p As New Point
+Dim q As New Point
+Dim byObject As New Dictionary
+byObject.Value(p) = "p"
+byObject.Value(q) = "q"
+Dim fromP As String = byObject.Value(p)
+Check("object keys by identity", fromP + " " + Str(byObject.Count()), "p 2")
+
+// A script class with an Assigns method, called as obj.Method(args) = x
+Class Grid
+  Dim cells As Dictionary
+  Dim reads As Integer
+
+  Sub Constructor()
+    Dim c As New Dictionary
+    cells = c
+  End Sub
+
+  Sub Cell(row As Integer, column As Integer, Assigns content As String)
+    cells.Value(Str(row) + ":" + Str(column)) = content
+  End Sub
+
+  Function CellAt(row As Integer, column As Integer) As String
+    reads = reads + 1
+    Return cells.Lookup(Str(row) + ":" + Str(column), "")
+  End Function
+End Class
+
+Dim g As New Grid
+g.Cell(1, 2) = "b1"
+g.Cell(3, 4) = "d3"
+g.Cell(1, 2) = "B1"
+Dim cell12 As String = g.CellAt(1, 2)
+Dim cell34 As String = g.CellAt(3, 4)
+Check("Assigns method called as obj.Method(args) = x", cell12 + " " + cell34, "B1 d3")
+
+// Without Assigns, the same statement is a comparison: CellAt runs once
+// with its own two arguments and nothing is stored.
+g.CellAt(5, 5) = "x"
+Dim cell55 As String = g.CellAt(5, 5)
+Check("method without Assigns compares", Str(g.reads) + " [" + cell55 + "]", "4 []")
@@ -0,0 +1,165 @@
+// -----------------------------------------------------------------------------
+// Test: Select Case in CrossBasic
+// Select Case compiles to one of four forms: a dense jump table for Integer
+// Cases close together, a sparse table for Integer Cases far apart, a hashed
+// table for String Cases, and a chain of comparisons for anything else. Each
+// must pick the first matching Case, fall back to Case Else, and evaluate the
+// selector exactly once. Each line should read "ok".
+// -----------------------------------------------------------------------------
+
+Sub Check(what As String, got As String, want As String)
+  If got = want Then
+    Print("ok - " + what)
+  Else
+    Print("FAILED - " + what + ": got " + got + ", expected " + want)
+  End If
+End Sub
+
+// Integer Cases close together: a dense table.
+Function Dense(n As Integer) As String
+  Select Case n
+  Case 1
+    Return "one"
+  Case 2
+    Return "two"
+  Case 3
+    Return "three"
+  Case 5
+    Return "five"
+  Case Else
+    Return "other"
+  End Select
+End Function
+
+Dim dense As String = Dense(1) + " " + Dense(3) + " " + Dense(4) + " " + Dense(5) + " " + Dense(0) + " " + Dense(99)
+Check("dense Integer table", dense, "one three other five other other")
+
+// Integer Cases far apart, one of them negative: a sparse table.
+Function Sparse(n As Integer) As String
+  Select Case n
+  Case -5
+    Return "minus five"
+  Case 1000
+    Return "thousand"
+  Case 1000000
+    Return "million"
+  Case Else
+    Return "other"
+  End Select
+End Function
+
+Dim sparse As String = Sparse(-5) + ", " + Sparse(1000) + ", " + Sparse(1000000) + ", " + Sparse(999)
+Check("sparse Integer table", sparse, "minus five, thousand, million, other")
+
+// String Cases: a hashed table. The selector is built at run time, so it is
+// not the same string object as the Case literal.
+Function Colour(name As String) As Integer
+  Select Case name
+  Case "red"
+    Return 1
+  Case "green"
+    Return 2
+  Case "blue"
+    Return 3
+  Case Else
+    Return 0
+  End Select
+End Function
+
+Dim gr As String = "gr"
+Dim colours As String = Str(Colour("red")) + Str(Colour(gr + "een")) + Str(Colour("blue")) + Str(Colour("purple"))
+Check("String table", colours, "1230")
+
+// The first Case with a given value wins.
+Function FirstWins(n As Integer) As String
+  Select Case n
+  Case 7
+    Return "first"
+  Case 7
+    Return "second"
+  Case Else
+    Return "other"
+  End Select
+End Function
+
+Dim firstWins As String = FirstWins(7)
+Check("first of two equal Cases wins", firstWins, "first")
+
+// Case values that are not literals: a chain of comparisons.
+Function Chain(n As Integer, low As Integer) As String
+  Select Case n
+  Case low
+    Return "low"
+  Case low + 1
+    Return "next"
+  Case Else
+    Return "other"
+  End Select
+End Function
+
+Dim chain As String = Chain(10, 10) + " " + Chain(11, 10) + " " + Chain(12, 10)
+Check("compare chain", chain, "low next other")
+
+// Nested compare chains keep their selectors apart.
+Function Nested(a As Integer, b As Integer, one As Integer) As String
+  Select Case a
+  Case one
+    Select Case b
+    Case one
+      Return "1/1"
+    Case one + 1
+      Return "1/2"
+    Case Else
+      Return "1/?"
+    End Select
+  Case one + 1
+    Return "2"
+  Case Else
+    Return "?"
+  End Select
+End Function
+
+Dim nested As String = Nested(1, 1, 1) + " " + Nested(1, 2, 1) + " " + Nested(1, 3, 1) + " " + Nested(2, 1, 1)
+Check("nested compare chains", nested, "1/1 1/2 1/? 2")
+
+// A selector with a side effect is evaluated once, whichever form is used.
+Dim calls As Integer = 0
+Function NextValue() As Integer
+  calls = calls + 1
+  Return 3
+End Function
+
+Dim three As Integer = 3
+Dim picked As String = ""
+Select Case NextValue()
+Case 1
+  picked = "one"
+Case 2
+  picked = "two"
+Case 3
+  picked = "three"
+End Select
+Select Case NextValue()
+Case three - 2
+  picked = picked + " one"
+Case three - 1
+  picked = picked + " two"
+Case three
+  picked = picked + " three"
+Case Else
+  picked = picked + " other"
+End Select
+Check("selector evaluated once", picked + " after " + Str(calls) + " calls", "three three after 2 calls")
+
+// At the top level the compare chain works the same, and Case Else runs
+// when nothing matches.
+Dim outcome As String = "none"
+Select Case three * 10
+Case three
+  outcome = "three"
+Case three * 2
+  outcome = "six"
+Case Else
+  outcome = "else"
+End Select
+Check("top-level Case Else", outcome, "else")
@@ -0,0 +1,132 @@
+// -----------------------------------------------------------------------------
+// Test: StringBuilder and appending to strings in CrossBasic
+// s = s + x adds to s's text in place when nothing else refers to it, and
+// StringBuilder.Append always does. A string that has been copied to another
+// variable, an argument, an array, a field or a builder's ToString result
+// is shared, and appending to one copy must leave the others as they were.
+// Each line should read "ok".
+// -----------------------------------------------------------------------------
+
+Sub Check(what As String, got As String, want As String)
+  If got = want Then
+    Print("ok - " + what)
+  Else
+    Print("FAILED - " + what + ": got " + got + ", expected " + want)
+  End If
+End Sub
+
+// StringBuilder
+Dim sb As New StringBuilder
+sb.Append("<td>")
+sb.Append(42)
+sb.Append(1.5)
+sb.Append("</td>")
+Check("StringBuilder.Append and ToString", sb.ToString(), "<td>421.5</td>")
+Check("StringBuilder.Length", Str(sb.Length()), "14")
+
+Dim snapshot As String = sb.ToString()
+sb.Append("<td>")
+Check("ToString result kept after Append", snapshot, "<td>421.5</td>")
+Check("builder continues after ToString", sb.ToString(), "<td>421.5</td><td>")
+
+Dim big As New StringBuilder
+For i As Integer = 1 To 100000
+  big.Append("ab")
+Next i
+Check("a hundred thousand Appends", Str(big.Length()), "200000")
+
+Dim empty As New StringBuilder
+Check("empty StringBuilder", "[" + empty.ToString() + "]", "[]")
+
+// An unshared local grows in place.
+Function Repeat(piece As String, n As Integer) As String
+  Dim s As String = ""
+  For i As Integer = 1 To n
+    s = s + piece
+  Next i
+  Return s
+End Function
+
+Dim repeated As String = Repeat("xyz", 50000)
+Check("local appended to in a loop", Str(Len(repeated)) + " " + Right(repeated, 6), "150000 xyzxyz")
+
+// A copy in a second variable is not changed by appending to the first.
+Function AliasLocal() As String
+  Dim a As String = "abc"
+  a = a + "d"
+  Dim b As String = a
+  a = a + "e"
+  a = a + "f" + "g"
+  Return a + " " + b
+End Function
+
+Dim aliasLocal As String = AliasLocal()
+Check("aliased local", aliasLocal, "abcdefg abcd")
+
+Dim ga As String = "top"
+ga = ga + "-"
+Dim gb As String = ga
+ga = ga + "level"
+Check("aliased global", ga + " " + gb, "top-level top-")
+
+// A string literal is shared by every use of it.
+Function Literal() As String
+  Return "lit"
+End Function
+
+Function ExtendLiteral() As String
+  Dim s As String = Literal()
+  s = s + "eral"
+  Return s
+End Function
+
+Dim extended As String = ExtendLiteral()
+Dim literalAgain As String = Literal()
+Check("literal unchanged after appending to a copy", extended + " " + literalAgain, "literal lit")
+
+// An argument is a copy of the caller's string.
+Function Shout(s As String) As String
+  s = s + "!"
+  s = s + "!"
+  Return s
+End Function
+
+Dim word As String = "hey"
+word = word + " you"
+Dim shouted As String = Shout(word)
+Check("argument appended to in the callee", shouted + " / " + word, "hey you!! / hey you")
+
+// Copies held in an array, an object field and a Dictionary.
+Class Holder
+  Dim text As String
+End Class
+
+Dim parts() As String
+Dim h As New Holder
+Dim d As New Dictionary
+Dim grow As String = "p"
+For i As Integer = 1 To 3
+  grow = grow + Str(i)
+  parts.Add(grow)
+Next i
+h.text = grow
+d.Value("k") = grow
+grow = grow + "x"
+Check("array elements kept", parts(0) + " " + parts(1) + " " + parts(2), "p1 p12 p123")
+Check("object field kept", h.text, "p123")
+Dim fromDictionary As String = d.Value("k")
+Check("Dictionary value kept", fromDictionary, "p123")
+Check("appended string", grow, "p123x")
+
+// A substring shares its parent's text, which must survive.
+Dim line As String = "alpha,beta,gamma,delta,epsilon,zeta,eta,theta"
+Dim head As String = Left(line, 30)
+head = head + "!"
+Check("appending to a substring", head, "alpha,beta,gamma,delta,epsilon!")
+Check("substring's parent kept", line, "alpha,beta,gamma,delta,epsilon,zeta,eta,theta")
+
+// Appending a string to itself.
+Dim twice As String = "ab"
+twice = twice + twice
+twice = twice + "-" + twice
+Check("string appended to itself", twice, "abab-abab")
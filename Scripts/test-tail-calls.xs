@@ -0,0 +1,89 @@
+// -----------------------------------------------------------------------------
+// Test: tail calls in CrossBasic
+// Return f(...) inside a function or method hands the caller's frame to the
+// callee, so the recursions below run in constant memory however deep they
+// go. Each line should read "ok".
+//
+// Run it under a memory limit to see the frames being reused:
+//
+//   (ulimit -v 200000; ./crossbasic --s Scripts/test-tail-calls.xs)
+//
+// passes, while the same run with --no-tail-calls keeps all ten million
+// frames of Count, as before tail calls, and runs out of memory. Without the
+// limit both runs print the same lines.
+// -----------------------------------------------------------------------------
+
+Sub Check(what As String, got As String, want As String)
+  If got = want Then
+    Print("ok - " + what)
+  Else
+    Print("FAILED - " + what + ": got " + got + ", expected " + want)
+  End If
+End Sub
+
+// Self recursion, ten million calls deep.
+Function Count(n As Integer, acc As Integer) As Integer
+  If n = 0 Then
+    Return acc
+  End If
+  Return Count(n - 1, acc + 1)
+End Function
+
+Dim counted As Integer = Count(10000000, 0)
+Check("ten million deep self recursion", Str(counted), "10000000")
+
+// Mutual recursion through two functions.
+Function IsEven(n As Integer) As Boolean
+  If n = 0 Then
+    Return True
+  End If
+  Return IsOdd(n - 1)
+End Function
+
+Function IsOdd(n As Integer) As Boolean
+  If n = 0 Then
+    Return False
+  End If
+  Return IsEven(n - 1)
+End Function
+
+Dim even As Boolean = IsEven(1000001)
+Check("a million deep mutual recursion", Str(even), "false")
+
+// A method that tail calls itself keeps its object.
+Class Walker
+  Dim steps As Integer
+  Function Walk(n As Integer) As Integer
+    If n = 0 Then
+      Return steps
+    End If
+    steps = steps + 1
+    Return Self.Walk(n - 1)
+  End Function
+End Class
+
+Dim w As New Walker
+Dim walked As Integer = w.Walk(1000000)
+Check("a million deep method recursion", Str(walked), "1000000")
+
+// A tail call with fewer arguments than parameters fills in the Optional ones.
+Function Pad(s As String, n As Integer, Optional fill As String = "*") As String
+  If Len(s) >= n Then
+    Return s
+  End If
+  Return Pad(s + fill, n)
+End Function
+
+Dim padded As String = Pad("ab", 6)
+Check("tail call with an Optional parameter", padded, "ab****")
+
+// A call whose result is still used is not a tail call and keeps its frame.
+Function Fact(n As Integer) As Integer
+  If n <= 1 Then
+    Return 1
+  End If
+  Return n * Fact(n - 1)
+End Function
+
+Dim fact As Integer = Fact(10)
+Check("recursion that is not a tail call", Str(fact), "3628800")
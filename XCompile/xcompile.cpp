@@ -192,28 +192,92 @@ void injectData(const std::string& exePath, const std::string& textFilePath) {
               << " bytes of encrypted bytecode to " << exePath << ".\n";
 }
 
+// Quotes a path for the shell.
+std::string quote(const std::string& path) {
+    return "\"" + path + "\"";
+}
+
+// Finds crossbasic.cpp: $CROSSBASIC_SRC, or next to xcompile, or in a
+// CrossBasic-SRC directory beside or above it.
+std::string findInterpreterSource(const std::string& baseDir) {
+    std::vector<std::string> candidates;
+    if (const char* env = std::getenv("CROSSBASIC_SRC"))
+        candidates.push_back(std::string(env) + "/");
+    candidates.push_back(baseDir);
+    candidates.push_back(baseDir + "CrossBasic-SRC/");
+    candidates.push_back(baseDir + "../CrossBasic-SRC/");
+    for (const std::string& dir : candidates) {
+        if (std::ifstream(dir + "crossbasic.cpp"))
+            return dir.empty() ? "./" : dir;
+    }
+    return "";
+}
+
+// Ahead-of-time build: the base executable translates the script to C++
+// (--emit-cpp), which is compiled together with the interpreter source into
+// the target executable. The translation embeds the bytecode encrypted with
+// cipherkey, as injectData() does. $CXX picks the compiler, $CXXFLAGS adds
+// options.
+bool compileAhead(const std::string& baseExe, const std::string& baseDir,
+                  const std::string& targetExe, const std::string& textFilePath, bool useGUI) {
+    std::string srcDir = findInterpreterSource(baseDir);
+    if (srcDir.empty()) {
+        std::cerr << "Error: Cannot find crossbasic.cpp; set CROSSBASIC_SRC to its directory.\n";
+        return false;
+    }
+    std::string cppPath = targetExe + ".cpp";
+    std::string translate = quote(baseExe) + " --emit-cpp " + quote(cppPath) + " --s " + quote(textFilePath);
+    if (std::system(translate.c_str()) != 0) {
+        std::cerr << "Error: Translation of " << textFilePath << " to C++ failed.\n";
+        return false;
+    }
+
+    const char* cxx = std::getenv("CXX");
+    const char* flags = std::getenv("CXXFLAGS");
+    std::string build = std::string(cxx ? cxx : "g++") + " -O2 -std=c++17 -I" + quote(srcDir) + " " +
+                        quote(cppPath) + " -o " + quote(targetExe) + " " + (flags ? flags : "") + " -lffi";
+#ifdef _WIN32
+    if (useGUI)
+        build += " -Wl,--subsystem,windows";
+#else
+    (void)useGUI;
+#endif
+    std::cout << "Building " << targetExe << " from " << cppPath << "...\n";
+    if (std::system(build.c_str()) != 0) {
+        std::cerr << "Error: Building " << targetExe << " failed.\n";
+        return false;
+    }
+    std::remove(cppPath.c_str());
+    std::cout << "Compilation complete: Built " << targetExe << " ahead of time.\n";
+    return true;
+}
+
 int main(int argc, char* argv[]) {
-    // Require 2 mandatory arguments, plus optional "-GUI"
-    if (argc < 3 || argc > 4) {
+    // Require 2 mandatory arguments, plus optional "-GUI" and "-AOT"
+    if (argc < 3 || argc > 5) {
         std::cerr << "Usage: " << argv[0]
-                  << " <target_executable> <text_file> [-GUI]\n";
+                  << " <target_executable> <text_file> [-GUI] [-AOT]\n";
         return EXIT_FAILURE;
     }
 
     std::string targetExe   = argv[1];
     std::string textFilePath = argv[2];
     bool useGUI = false;
+    bool aheadOfTime = false;
 
-    // Handle optional GUI flag
-    if (argc == 4) {
-        std::string flag = argv[3];
+    // Handle optional flags
+    for (int i = 3; i < argc; i++) {
+        std::string flag = argv[i];
         if (flag == "-GUI") {
             useGUI = true;
         }
+        else if (flag == "-AOT") {
+            aheadOfTime = true;
+        }
         else {
             std::cerr << "Error: Unknown parameter '" << flag << "'.\n"
                       << "Usage: " << argv[0]
-                      << " <target_executable> <text_file> [-GUI]\n";
+                      << " <target_executable> <text_file> [-GUI] [-AOT]\n";
             return EXIT_FAILURE;
         }
     }
@@ -248,6 +312,17 @@ int main(int argc, char* argv[]) {
     // Build full path to the base executable:
     std::string baseExe = baseDir + baseName;
 
+    if (aheadOfTime) {
+        // The translation always uses the console interpreter.
+#ifdef _WIN32
+        std::string translator = baseDir + "crossbasic.exe";
+#else
+        std::string translator = baseDir + "crossbasic";
+#endif
+        return compileAhead(translator, baseDir, targetExe, textFilePath, useGUI)
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     // Copy the base executable to the user-defined target filename.
     if (!copyFile(baseExe, targetExe)) {
         std::cerr << "Error: Could not copy base executable from "
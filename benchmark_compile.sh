@@ -0,0 +1,47 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Measures front-end throughput: generates a CrossBasic program of about
+# LINES lines (default 100000), in the shape of generated report code, and
+# times compiling it to a bytecode image.
+#
+#   ./benchmark_compile.sh [LINES] [path/to/crossbasic]
+
+LINES="${1:-100000}"
+XOSCRIPT="${2:-./crossbasic}"
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# Each block is 20 lines: a function with locals, arithmetic, string
+# building, an If and a For loop, followed by top-level code calling it.
+awk -v lines="$LINES" 'BEGIN {
+  for (i = 0; i * 20 < lines; i++) {
+    printf "Function Section%d(rows As Integer, title As String) As String\n", i
+    printf "  Dim total As Double = 0\n"
+    printf "  Dim label As String = \"Section %d: \" + title\n", i
+    printf "  For r As Integer = 1 To rows\n"
+    printf "    total = total + r * %d.5 - (r Mod %d)\n", i % 97, i % 13 + 2
+    printf "  Next\n"
+    printf "  If total > %d Then\n", i * 3
+    printf "    label = label + \" (over budget)\"\n"
+    printf "  Else\n"
+    printf "    label = label + \" (within budget)\"\n"
+    printf "  End If\n"
+    printf "  Return label + \" total=\" + Str(total)\n"
+    printf "End Function\n"
+    printf "Dim report%d As String = Section%d(%d, \"Region %d\")\n", i, i, i % 5 + 1, i % 50
+    printf "Dim count%d As Integer = Len(report%d) + %d\n", i, i, i
+    printf "If count%d > 1000000 Then\n", i
+    printf "  Print(\"unexpected %d\")\n", i
+    printf "End If\n"
+    printf "Dim ratio%d As Double = count%d / %d.0\n", i, i, i + 1
+    printf "Dim tag%d As String = \"row-%d-\" + Str(ratio%d > 1)\n", i, i, i
+  }
+  print "Print(\"done\")"
+}' > "$WORK_DIR/generated.xs"
+
+echo "Generated $(wc -l < "$WORK_DIR/generated.xs") lines"
+start=$(date +%s%N)
+"$XOSCRIPT" --compile-only --s "$WORK_DIR/generated.xs" -o "$WORK_DIR/generated.xbc"
+end=$(date +%s%N)
+echo "Compiled in $(( (end - start) / 1000000 )) ms"
@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Loads damaged bytecode images: every truncation of a compiled program must
+# be refused with "Invalid bytecode image", and no single corrupted byte may
+# crash the interpreter.
+#
+#   ./test_bytecode_images.sh [path/to/crossbasic]
+
+XOSCRIPT="${1:-./crossbasic}"
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+cat > "$WORK_DIR/program.xs" <<'EOF'
+Class Counter
+  Var total As Integer
+  Sub Add(n As Integer)
+    total = total + n
+  End Sub
+End Class
+
+Function Name(n As Integer) As String
+  Select Case n
+  Case 1
+    Return "one"
+  Case 2
+    Return "two"
+  Case Else
+    Return "many"
+  End Select
+End Function
+
+Var c As New Counter
+For i As Integer = 1 To 10
+  c.Add(i)
+Next
+Print(Str(c.total) + " " + Name(2))
+EOF
+
+"$XOSCRIPT" --compile-only --s "$WORK_DIR/program.xs" -o "$WORK_DIR/good.xbc"
+if [[ "$("$XOSCRIPT" --s "$WORK_DIR/good.xbc")" != "55 two" ]]; then
+  echo "FAILED - the undamaged image does not run"
+  exit 1
+fi
+
+SIZE=$(wc -c < "$WORK_DIR/good.xbc")
+FAILURES=0
+
+# Files without the four-byte "XBC" magic are read as source.
+for ((n = 4; n < SIZE; n++)); do
+  head -c "$n" "$WORK_DIR/good.xbc" > "$WORK_DIR/bad.xbc"
+  output=$("$XOSCRIPT" --s "$WORK_DIR/bad.xbc" 2>&1 < /dev/null || true)
+  if [[ "$output" != *"Invalid bytecode image"* ]]; then
+    echo "FAILED - image truncated to $n bytes was not refused"
+    FAILURES=$((FAILURES + 1))
+  fi
+done
+
+# Setting the high bit turns an opcode into an unknown one and an operand
+# into a larger or longer one. A damaged program may still run, fail or loop
+# until the timeout; it must not be killed by a signal.
+for ((n = 4; n < SIZE; n++)); do
+  cp "$WORK_DIR/good.xbc" "$WORK_DIR/bad.xbc"
+  byte=$(od -An -tu1 -j "$n" -N1 "$WORK_DIR/good.xbc")
+  printf "\\$(printf %03o $((byte ^ 0x80)))" | dd of="$WORK_DIR/bad.xbc" bs=1 seek="$n" conv=notrunc 2>/dev/null
+  status=0
+  timeout 10 "$XOSCRIPT" --s "$WORK_DIR/bad.xbc" > /dev/null 2>&1 < /dev/null || status=$?
+  if ((status >= 128)); then
+    echo "FAILED - corrupting byte $n ended with status $status"
+    FAILURES=$((FAILURES + 1))
+  fi
+done
+
+if ((FAILURES > 0)); then
+  echo "$FAILURES damaged images were mishandled"
+  exit 1
+fi
+echo "ok - $((SIZE - 4)) truncated and $((SIZE - 4)) corrupted images handled"